@@ -0,0 +1,491 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// Signing agent for NervesKeys
+//
+// The agent owns the ATECCs. Processes that load nerves_key_pkcs11.so with
+// NERVES_KEY_AGENT_SOCKET set send their signing and metadata requests here
+// instead of using the I2C buses. Each chip is opened once and kept open, so
+// nothing is read from it again when clients come and go. All the signing
+// goes through one library instance, so requests from every client share wake
+// cycles and wait in the same priority queue.
+//
+// Usage: nerves_key_agent [socket path]
+//
+// The socket path defaults to NERVES_KEY_AGENT_SOCKET. Anyone who can connect
+// to it can sign, so it's created with the permissions from the umask. The
+// library is loaded from NERVES_KEY_AGENT_LIBRARY or from next to this
+// program. The other NERVES_KEY_* settings apply to the agent like they do to
+// any other user of the library.
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "nerves_key_pkcs11.h"
+#include "nerves_key_agent_client.h"
+
+#define AGENT_SLOTS      32
+#define AGENT_PRIORITIES 3 // Normal, interactive and background
+
+static CK_FUNCTION_LIST_PTR p11;
+static CK_NKCS11_FUNCTION_LIST_PTR nkcs11;
+
+// Slots that have a chip. Each has a session of its own that's never closed
+// so that the library keeps the device open.
+struct agent_slot {
+    CK_BBOOL present;
+    CK_SESSION_HANDLE session;
+    CK_OBJECT_HANDLE private_key;
+    CK_NKCS11_SLOT_SCAN scan;
+};
+
+static struct agent_slot slots[AGENT_SLOTS];
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// A client has one session for each slot and priority that it uses. The
+// library schedules signatures by the session's priority. Each client has a
+// thread. Clients are kept on a list so that they can be stopped before the
+// library is finalized.
+struct agent_client {
+    int fd;
+    CK_SESSION_HANDLE sessions[AGENT_SLOTS][AGENT_PRIORITIES];
+    struct agent_client *prev;
+    struct agent_client *next;
+};
+
+static struct agent_client *clients;
+static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clients_gone = PTHREAD_COND_INITIALIZER;
+
+static CK_RV find_key(CK_SESSION_HANDLE session, CK_OBJECT_CLASS class, CK_OBJECT_HANDLE *key)
+{
+    CK_ATTRIBUTE search = {CKA_CLASS, &class, sizeof(class)};
+    CK_ULONG found = 0;
+    CK_RV rv = p11->C_FindObjectsInit(session, &search, 1);
+    if (rv != CKR_OK)
+        return rv;
+    rv = p11->C_FindObjects(session, key, 1, &found);
+    p11->C_FindObjectsFinal(session);
+    if (rv == CKR_OK && found != 1)
+        rv = CKR_KEY_HANDLE_INVALID;
+    return rv;
+}
+
+// Call with slots_mutex held. Chips that were found before are kept.
+static void rescan(void)
+{
+    CK_NKCS11_SLOT_SCAN scans[AGENT_SLOTS];
+    CK_ULONG count = AGENT_SLOTS;
+    if (nkcs11->C_NKCS11_ScanSlots(scans, &count) != CKR_OK)
+        return;
+
+    for (CK_ULONG i = 0; i < count; i++) {
+        if (scans[i].slotID >= AGENT_SLOTS)
+            continue;
+
+        struct agent_slot *slot = &slots[scans[i].slotID];
+        if (!slot->present) {
+            if (p11->C_OpenSession(scans[i].slotID, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &slot->session) != CKR_OK)
+                continue;
+            if (find_key(slot->session, CKO_PRIVATE_KEY, &slot->private_key) != CKR_OK) {
+                p11->C_CloseSession(slot->session);
+                continue;
+            }
+            slot->present = CK_TRUE;
+            fprintf(stderr, "nerves_key_agent: slot %lu has an %s\n", scans[i].slotID, scans[i].chipName);
+        }
+        slot->scan = scans[i];
+    }
+}
+
+// Call with slots_mutex held. This retries reading a public key that the
+// scan couldn't get.
+static CK_RV read_public_key(struct agent_slot *slot)
+{
+    CK_OBJECT_HANDLE key;
+    CK_RV rv = find_key(slot->session, CKO_PUBLIC_KEY, &key);
+    if (rv != CKR_OK)
+        return rv;
+
+    // The point comes back as a DER OCTET STRING
+    CK_BYTE point[67];
+    CK_ATTRIBUTE attribute = {CKA_EC_POINT, point, sizeof(point)};
+    rv = p11->C_GetAttributeValue(slot->session, key, &attribute, 1);
+    if (rv != CKR_OK)
+        return rv;
+
+    memcpy(slot->scan.publicKey, &point[2], sizeof(slot->scan.publicKey));
+    slot->scan.hasPublicKey = CK_TRUE;
+    return CKR_OK;
+}
+
+static void handle_list(struct nerves_key_agent_reply *reply)
+{
+    pthread_mutex_lock(&slots_mutex);
+    rescan();
+    for (int i = 0; i < AGENT_SLOTS; i++) {
+        if (slots[i].present)
+            reply->slots |= 1U << i;
+    }
+    pthread_mutex_unlock(&slots_mutex);
+    reply->rv = CKR_OK;
+}
+
+static void handle_info(const struct nerves_key_agent_request *request, struct nerves_key_agent_reply *reply)
+{
+    struct agent_slot *slot = &slots[request->slot];
+
+    pthread_mutex_lock(&slots_mutex);
+    if (!slot->present)
+        rescan();
+
+    if (!slot->present) {
+        reply->rv = CKR_TOKEN_NOT_PRESENT;
+    } else {
+        if (!slot->scan.hasPublicKey)
+            read_public_key(slot);
+
+        struct nerves_key_agent_info *info = &reply->info;
+        memcpy(info->serial_number, slot->scan.serialNumber, sizeof(info->serial_number));
+        info->has_public_key = slot->scan.hasPublicKey;
+        memcpy(info->public_key, slot->scan.publicKey, sizeof(info->public_key));
+        memcpy(info->chip_name, slot->scan.chipName, sizeof(info->chip_name));
+        reply->rv = CKR_OK;
+    }
+    pthread_mutex_unlock(&slots_mutex);
+}
+
+static CK_RV client_session(struct agent_client *client, CK_SLOT_ID slot_id, CK_FLAGS priority,
+                            CK_SESSION_HANDLE *session)
+{
+    int index = priority == CKF_NKCS11_PRIORITY_INTERACTIVE ? 1 :
+                priority == CKF_NKCS11_PRIORITY_BACKGROUND ? 2 : 0;
+    CK_SESSION_HANDLE *s = &client->sessions[slot_id][index];
+    if (*s == CK_INVALID_HANDLE) {
+        CK_RV rv = p11->C_OpenSession(slot_id, CKF_SERIAL_SESSION | priority, NULL_PTR, NULL_PTR, s);
+        if (rv != CKR_OK)
+            return rv;
+    }
+    *session = *s;
+    return CKR_OK;
+}
+
+/* One digest is signed with C_Sign so that the library can group it with
+   other clients' digests. Several are signed as a batch. */
+static void handle_sign(struct agent_client *client, const struct nerves_key_agent_request *request,
+                        struct nerves_key_agent_reply *reply)
+{
+    CK_FLAGS priority = request->session_flags & (CKF_NKCS11_PRIORITY_INTERACTIVE | CKF_NKCS11_PRIORITY_BACKGROUND);
+    CK_SESSION_HANDLE session;
+    CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+    CK_RV rv = request->count >= 1 && request->count <= NKCS11_AGENT_MAX_DIGESTS ? CKR_OK : CKR_ARGUMENTS_BAD;
+    if (rv == CKR_OK) {
+        pthread_mutex_lock(&slots_mutex);
+        rv = slots[request->slot].present ? CKR_OK : CKR_TOKEN_NOT_PRESENT;
+        key = slots[request->slot].private_key;
+        pthread_mutex_unlock(&slots_mutex);
+    }
+    if (rv == CKR_OK)
+        rv = client_session(client, request->slot, priority, &session);
+    if (rv != CKR_OK) {
+        reply->rv = rv;
+        return;
+    }
+
+    CK_NKCS11_SIGN_PARAMS params = {request->deadline_ms};
+    CK_MECHANISM mechanism = {CKM_ECDSA, &params, sizeof(params)};
+    CK_RV results[NKCS11_AGENT_MAX_DIGESTS];
+    if (request->count == 1) {
+        CK_ULONG len = sizeof(reply->sign.signatures[0]);
+        results[0] = p11->C_SignInit(session, &mechanism, key);
+        if (results[0] == CKR_OK)
+            results[0] = p11->C_Sign(session, (CK_BYTE_PTR) request->digests[0], 32, reply->sign.signatures[0], &len);
+    } else {
+        // The library fills in every result, even when the whole batch
+        // fails. Never send stack garbage to a client if it doesn't.
+        for (uint32_t i = 0; i < request->count; i++)
+            results[i] = CKR_GENERAL_ERROR;
+        nkcs11->C_NKCS11_SignBatch(session, &mechanism, key, (CK_BYTE_PTR) request->digests,
+                                   request->count, (CK_BYTE_PTR) reply->sign.signatures, results);
+    }
+
+    for (uint32_t i = 0; i < request->count; i++)
+        reply->sign.results[i] = (uint32_t) results[i];
+    reply->count = request->count;
+    reply->rv = CKR_OK;
+}
+
+static void *serve_client(void *arg)
+{
+    struct agent_client *client = arg;
+    struct nerves_key_agent_request request;
+    struct nerves_key_agent_reply reply;
+
+    for (;;) {
+        ssize_t len = recv(client->fd, &request, sizeof(request), 0);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len != (ssize_t) sizeof(request) || request.version != NKCS11_AGENT_VERSION ||
+            request.slot >= AGENT_SLOTS)
+            break;
+
+        memset(&reply, 0, sizeof(reply));
+        switch (request.op) {
+        case NKCS11_AGENT_LIST:
+            handle_list(&reply);
+            break;
+        case NKCS11_AGENT_INFO:
+            handle_info(&request, &reply);
+            break;
+        case NKCS11_AGENT_SIGN:
+            handle_sign(client, &request, &reply);
+            break;
+        default:
+            reply.rv = CKR_FUNCTION_NOT_SUPPORTED;
+            break;
+        }
+
+        if (send(client->fd, &reply, sizeof(reply), MSG_NOSIGNAL) != (ssize_t) sizeof(reply))
+            break;
+    }
+
+    for (int i = 0; i < AGENT_SLOTS; i++) {
+        for (int j = 0; j < AGENT_PRIORITIES; j++) {
+            if (client->sessions[i][j] != CK_INVALID_HANDLE)
+                p11->C_CloseSession(client->sessions[i][j]);
+        }
+    }
+    pthread_mutex_lock(&clients_mutex);
+    if (client->prev)
+        client->prev->next = client->next;
+    else
+        clients = client->next;
+    if (client->next)
+        client->next->prev = client->prev;
+    if (clients == NULL)
+        pthread_cond_broadcast(&clients_gone);
+    pthread_mutex_unlock(&clients_mutex);
+
+    close(client->fd);
+    free(client);
+    return NULL;
+}
+
+static void add_client(int fd, const pthread_attr_t *attr)
+{
+    struct agent_client *client = calloc(1, sizeof(struct agent_client));
+    if (client == NULL) {
+        close(fd);
+        return;
+    }
+    client->fd = fd;
+
+    pthread_mutex_lock(&clients_mutex);
+    client->next = clients;
+    if (clients)
+        clients->prev = client;
+    clients = client;
+
+    pthread_t thread;
+    if (pthread_create(&thread, attr, serve_client, client) != 0) {
+        clients = client->next;
+        if (clients)
+            clients->prev = NULL;
+        close(fd);
+        free(client);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Disconnect every client and wait for the threads to finish what they're doing
+static void stop_clients(void)
+{
+    pthread_mutex_lock(&clients_mutex);
+    for (struct agent_client *client = clients; client; client = client->next)
+        shutdown(client->fd, SHUT_RDWR);
+    while (clients)
+        pthread_cond_wait(&clients_gone, &clients_mutex);
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "nerves_key_agent: socket path is too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Clean up after an agent that didn't exit normally, but don't take the
+    // socket from one that's still running
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        int running = probe >= 0 && connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+        if (probe >= 0)
+            close(probe);
+        if (running) {
+            fprintf(stderr, "nerves_key_agent: another agent is using %s\n", path);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "nerves_key_agent: can't listen on %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *load_library(const char *program)
+{
+    char path[PATH_MAX];
+    const char *library_path = getenv("NERVES_KEY_AGENT_LIBRARY");
+    if (library_path == NULL || *library_path == '\0') {
+        char self[PATH_MAX];
+        ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+        if (len < 0)
+            len = snprintf(self, sizeof(self), "%s", program);
+        self[len] = '\0';
+        snprintf(path, sizeof(path), "%s/nerves_key_pkcs11.so", dirname(self));
+        library_path = path;
+    }
+
+    void *library = dlopen(library_path, RTLD_NOW);
+    if (library == NULL) {
+        fprintf(stderr, "nerves_key_agent: %s\n", dlerror());
+        return NULL;
+    }
+
+    CK_RV (*get_function_list)(CK_FUNCTION_LIST_PTR_PTR) = (CK_RV (*)(CK_FUNCTION_LIST_PTR_PTR)) dlsym(library, "C_GetFunctionList");
+    CK_RV (*get_vendor_function_list)(CK_NKCS11_FUNCTION_LIST_PTR_PTR) =
+        (CK_RV (*)(CK_NKCS11_FUNCTION_LIST_PTR_PTR)) dlsym(library, "C_NKCS11_GetFunctionList");
+    if (get_function_list == NULL || get_vendor_function_list == NULL ||
+        get_function_list(&p11) != CKR_OK || get_vendor_function_list(&nkcs11) != CKR_OK) {
+        fprintf(stderr, "nerves_key_agent: can't get the function lists from %s\n", library_path);
+        return NULL;
+    }
+    return library;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *env_path = getenv("NERVES_KEY_AGENT_SOCKET");
+    if (argc > 2 || (argc < 2 && (env_path == NULL || *env_path == '\0'))) {
+        fprintf(stderr, "Usage: %s [socket path]\n\nThe socket path defaults to $NERVES_KEY_AGENT_SOCKET.\n", argv[0]);
+        return 1;
+    }
+
+    char socket_path[PATH_MAX];
+    snprintf(socket_path, sizeof(socket_path), "%s", argc == 2 ? argv[1] : env_path);
+
+    // The library in this process is the one that uses the chips
+    unsetenv("NERVES_KEY_AGENT_SOCKET");
+    if (load_library(argv[0]) == NULL)
+        return 1;
+
+    // Signals are only taken by the main loop. Threads inherit the mask.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+    CK_C_INITIALIZE_ARGS args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CKF_OS_LOCKING_OK;
+    if (signal_fd < 0 || p11->C_Initialize(&args) != CKR_OK) {
+        fprintf(stderr, "nerves_key_agent: can't initialize the library\n");
+        return 1;
+    }
+
+    // Open everything up front so that the first clients don't wait on it
+    pthread_mutex_lock(&slots_mutex);
+    rescan();
+    pthread_mutex_unlock(&slots_mutex);
+
+    int listen_fd = listen_on(socket_path);
+    if (listen_fd < 0) {
+        p11->C_Finalize(NULL_PTR);
+        return 1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (;;) {
+        struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (fds[0].revents == 0)
+            continue;
+
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd >= 0)
+            add_client(fd, &attr);
+    }
+
+    // Finalizing saves what was learned about the chips. Clients that are
+    // still connected lose their connections and reconnect to the next agent.
+    close(listen_fd);
+    unlink(socket_path);
+    stop_clients();
+    p11->C_Finalize(NULL_PTR);
+    return 0;
+}
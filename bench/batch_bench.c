@@ -0,0 +1,155 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// Benchmark for C_NKCS11_SignBatch against one C_Sign per digest
+//
+// Run with "make bench SIMULATOR=1". This loads the library, signs the same
+// digests both ways on a simulated ATECC and checks that every signature
+// came back. It's run with the default 50 ms keep-awake and with the chip
+// put to sleep after every command.
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nerves_key_pkcs11.h"
+
+#define DIGESTS 32
+
+static CK_FUNCTION_LIST_PTR p11;
+static CK_NKCS11_FUNCTION_LIST_PTR nkcs11;
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int sign_each(CK_SESSION_HANDLE session, CK_BYTE *digests, CK_BYTE *signatures)
+{
+    CK_MECHANISM mechanism = {CKM_ECDSA, NULL_PTR, 0};
+
+    for (int i = 0; i < DIGESTS; i++) {
+        CK_ULONG len = 64;
+        if (p11->C_SignInit(session, &mechanism, 1) != CKR_OK ||
+            p11->C_Sign(session, &digests[i * 32], 32, &signatures[i * 64], &len) != CKR_OK)
+            return -1;
+    }
+    return 0;
+}
+
+static int sign_batch(CK_SESSION_HANDLE session, CK_BYTE *digests, CK_BYTE *signatures)
+{
+    CK_MECHANISM mechanism = {CKM_ECDSA, NULL_PTR, 0};
+    CK_RV results[DIGESTS];
+
+    return nkcs11->C_NKCS11_SignBatch(session, &mechanism, 1, digests, DIGESTS, signatures, results) == CKR_OK ? 0 : -1;
+}
+
+static int run(const char *keep_awake_ms)
+{
+    setenv("NERVES_KEY_KEEP_AWAKE_MS", keep_awake_ms, 1);
+
+    CK_C_INITIALIZE_ARGS args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CKF_OS_LOCKING_OK;
+
+    CK_SESSION_HANDLE session;
+    if (p11->C_Initialize(&args) != CKR_OK ||
+        p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) != CKR_OK) {
+        fprintf(stderr, "Can't open a session\n");
+        return -1;
+    }
+
+    static CK_BYTE digests[DIGESTS * 32];
+    static CK_BYTE signatures[DIGESTS * 64];
+    for (size_t i = 0; i < sizeof(digests); i++)
+        digests[i] = (CK_BYTE) (i * 7);
+
+    // Let the driver learn the chip's timing before measuring anything
+    if (sign_batch(session, digests, signatures) < 0) {
+        fprintf(stderr, "C_NKCS11_SignBatch failed\n");
+        return -1;
+    }
+
+    double start = now_s();
+    if (sign_each(session, digests, signatures) < 0) {
+        fprintf(stderr, "C_Sign failed\n");
+        return -1;
+    }
+    double each = now_s() - start;
+
+    start = now_s();
+    if (sign_batch(session, digests, signatures) < 0) {
+        fprintf(stderr, "C_NKCS11_SignBatch failed\n");
+        return -1;
+    }
+    double batch = now_s() - start;
+
+    printf("keep awake %4s ms: C_Sign %6.1f sig/s  C_NKCS11_SignBatch %6.1f sig/s (%+.1f%%)\n",
+           keep_awake_ms, DIGESTS / each, DIGESTS / batch, (each / batch - 1) * 100);
+
+    p11->C_Finalize(NULL_PTR);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <path to nerves_key_pkcs11.so>\n", argv[0]);
+        return 1;
+    }
+
+    setenv("NERVES_KEY_TRANSPORT", "sim", 0);
+
+    void *library = dlopen(argv[1], RTLD_NOW);
+    if (library == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return 1;
+    }
+
+    CK_RV (*get_function_list)(CK_FUNCTION_LIST_PTR_PTR) = (CK_RV (*)(CK_FUNCTION_LIST_PTR_PTR)) dlsym(library, "C_GetFunctionList");
+    CK_RV (*get_vendor_function_list)(CK_NKCS11_FUNCTION_LIST_PTR_PTR) =
+        (CK_RV (*)(CK_NKCS11_FUNCTION_LIST_PTR_PTR)) dlsym(library, "C_NKCS11_GetFunctionList");
+    if (get_function_list == NULL || get_vendor_function_list == NULL ||
+        get_function_list(&p11) != CKR_OK || get_vendor_function_list(&nkcs11) != CKR_OK) {
+        fprintf(stderr, "Can't get the function lists\n");
+        return 1;
+    }
+
+    if (run("50") < 0 || run("0") < 0)
+        return 1;
+
+    return 0;
+}
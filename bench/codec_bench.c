@@ -0,0 +1,142 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// Microbenchmark for the ATECC command codec
+//
+// Run with "make bench". This checks the table-driven CRC against the
+// bit-by-bit one from the application note and then times both along with
+// framing commands and checking responses.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "atecc508a.h"
+
+#define ITERATIONS 2000000
+
+static uint16_t reference_crc16(const uint8_t *data, size_t length)
+{
+    const uint16_t polynom = 0x8005;
+    uint16_t crc_register = 0;
+
+    for (size_t counter = 0; counter < length; counter++) {
+        for (uint8_t shift_register = 0x01; shift_register > 0x00; shift_register <<= 1) {
+            uint8_t data_bit = (data[counter] & shift_register) ? 1 : 0;
+            uint8_t crc_bit = crc_register >> 15;
+            crc_register <<= 1;
+            if (data_bit != crc_bit)
+                crc_register ^= polynom;
+        }
+    }
+
+    return crc_register;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile uint32_t sink;
+
+static void report(const char *name, double start, size_t bytes)
+{
+    double elapsed = now_s() - start;
+    printf("%-28s %7.1f ns/op", name, elapsed * 1e9 / ITERATIONS);
+    if (bytes)
+        printf(" %8.1f MB/s", (double) bytes * ITERATIONS / elapsed / 1e6);
+    printf("\n");
+}
+
+int main(void)
+{
+    uint8_t buffer[ATECC508A_MAX_RESPONSE];
+    unsigned int seed = 1;
+
+    for (int i = 0; i < 100000; i++) {
+        size_t len = (size_t) rand_r(&seed) % sizeof(buffer);
+        for (size_t j = 0; j < len; j++)
+            buffer[j] = (uint8_t) rand_r(&seed);
+
+        if (atecc508a_crc16(buffer, len) != reference_crc16(buffer, len)) {
+            fprintf(stderr, "CRC mismatch for length %zu\n", len);
+            return 1;
+        }
+    }
+
+    // A Sign response: count, 64 bytes of signature and the CRC
+    uint8_t response[ATECC508A_MAX_RESPONSE];
+    response[0] = sizeof(response);
+    for (size_t j = 1; j < sizeof(response) - 2; j++)
+        response[j] = (uint8_t) rand_r(&seed);
+    atecc508a_append_crc(response, sizeof(response));
+
+    double start = now_s();
+    for (int i = 0; i < ITERATIONS; i++) {
+        response[1] = (uint8_t) i;
+        sink += reference_crc16(response, sizeof(response) - 2);
+    }
+    report("bitwise crc16 (65 bytes)", start, sizeof(response) - 2);
+
+    start = now_s();
+    for (int i = 0; i < ITERATIONS; i++) {
+        response[1] = (uint8_t) i;
+        sink += atecc508a_crc16(response, sizeof(response) - 2);
+    }
+    report("table crc16 (65 bytes)", start, sizeof(response) - 2);
+
+    uint8_t nonce[ATECC508A_MAX_COMMAND_DATA];
+    memset(nonce, 0xa5, sizeof(nonce));
+    uint8_t frame[ATECC508A_MAX_COMMAND];
+    start = now_s();
+    for (int i = 0; i < ITERATIONS; i++) {
+        nonce[0] = (uint8_t) i;
+        sink += (uint32_t) atecc508a_encode_command(frame, 0x16, 0x03, 0, nonce, sizeof(nonce));
+    }
+    report("encode Nonce", start, 0);
+
+    atecc508a_append_crc(response, sizeof(response));
+    if (!atecc508a_crc_ok(response, sizeof(response))) {
+        fprintf(stderr, "Response check failed\n");
+        return 1;
+    }
+
+    start = now_s();
+    for (int i = 0; i < ITERATIONS; i++)
+        sink += (uint32_t) atecc508a_crc_ok(response, sizeof(response));
+    report("check Sign response", start, 0);
+
+    return 0;
+}
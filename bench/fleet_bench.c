@@ -0,0 +1,251 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// Benchmark for using several NervesKeys at once
+//
+// Run with "make bench SIMULATOR=1". This simulates 4 buses with a chip at
+// each address. It times C_NKCS11_ScanSlots against opening one slot after
+// another and then signs on 1, 2 and 4 chips at once with C_NKCS11_SignAsync
+// from this one thread.
+//
+// The first open of a chip reads its public key and learns its timing, so
+// later ones are faster. Each way of scanning is timed cold in a process of
+// its own, with the cache file and shared memory turned off, and then warm.
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+
+#include "nerves_key_pkcs11.h"
+
+#define BUSES "4"
+#define MAX_CHIPS 4
+#define DIGESTS_PER_CHIP 16
+
+static CK_FUNCTION_LIST_PTR p11;
+static CK_NKCS11_FUNCTION_LIST_PTR nkcs11;
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double scan_parallel(void)
+{
+    CK_NKCS11_SLOT_SCAN scans[32];
+    CK_ULONG count = 32;
+
+    double start = now_s();
+    if (nkcs11->C_NKCS11_ScanSlots(scans, &count) != CKR_OK || count == 0) {
+        fprintf(stderr, "C_NKCS11_ScanSlots failed\n");
+        return -1;
+    }
+    return now_s() - start;
+}
+
+static double scan_serial(void)
+{
+    CK_SLOT_ID slots[32];
+    CK_ULONG count = 32;
+
+    double start = now_s();
+    if (p11->C_GetSlotList(CK_TRUE, slots, &count) != CKR_OK || count == 0) {
+        fprintf(stderr, "C_GetSlotList failed\n");
+        return -1;
+    }
+    for (CK_ULONG i = 0; i < count; i++) {
+        CK_SESSION_HANDLE session;
+        if (p11->C_OpenSession(slots[i], CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK)
+            p11->C_CloseSession(session);
+    }
+    return now_s() - start;
+}
+
+static int load(const char *path)
+{
+    void *library = dlopen(path, RTLD_NOW);
+    if (library == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return -1;
+    }
+
+    CK_RV (*get_function_list)(CK_FUNCTION_LIST_PTR_PTR) = (CK_RV (*)(CK_FUNCTION_LIST_PTR_PTR)) dlsym(library, "C_GetFunctionList");
+    CK_RV (*get_vendor_function_list)(CK_NKCS11_FUNCTION_LIST_PTR_PTR) =
+        (CK_RV (*)(CK_NKCS11_FUNCTION_LIST_PTR_PTR)) dlsym(library, "C_NKCS11_GetFunctionList");
+    if (get_function_list == NULL || get_vendor_function_list == NULL ||
+        get_function_list(&p11) != CKR_OK || get_vendor_function_list(&nkcs11) != CKR_OK) {
+        fprintf(stderr, "Can't get the function lists\n");
+        return -1;
+    }
+    return p11->C_Initialize(NULL_PTR) == CKR_OK ? 0 : -1;
+}
+
+// Time a scan in a new process so that nothing is cached yet
+static double cold(const char *path, double (*scan)(void))
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        double elapsed = load(path) < 0 ? -1 : scan();
+        if (write(fds[1], &elapsed, sizeof(elapsed)) != sizeof(elapsed))
+            _exit(1);
+        _exit(0);
+    }
+
+    double elapsed = -1;
+    close(fds[1]);
+    if (pid < 0 || read(fds[0], &elapsed, sizeof(elapsed)) != sizeof(elapsed))
+        elapsed = -1;
+    close(fds[0]);
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+    return elapsed;
+}
+
+static void report(const char *when, double serial, double parallel)
+{
+    printf("scan %s: one at a time %6.1f ms  C_NKCS11_ScanSlots %6.1f ms (%.1fx)\n",
+           when, serial * 1000, parallel * 1000, serial / parallel);
+}
+
+static int scan(const char *path)
+{
+    double serial = cold(path, scan_serial);
+    double parallel = cold(path, scan_parallel);
+    if (serial < 0 || parallel < 0)
+        return -1;
+    report("cold", serial, parallel);
+
+    if (load(path) < 0 || scan_serial() < 0)
+        return -1;
+    serial = scan_serial();
+    parallel = scan_parallel();
+    if (serial < 0 || parallel < 0)
+        return -1;
+    report("warm", serial, parallel);
+    return 0;
+}
+
+static int sign_on(int chips, double *rate)
+{
+    static CK_BYTE digests[MAX_CHIPS * DIGESTS_PER_CHIP][32];
+    static CK_BYTE signatures[MAX_CHIPS * DIGESTS_PER_CHIP][64];
+    static CK_NKCS11_ASYNC_SIGN async[MAX_CHIPS * DIGESTS_PER_CHIP];
+    CK_MECHANISM mechanism = {CKM_ECDSA, NULL_PTR, 0};
+    CK_SESSION_HANDLE sessions[MAX_CHIPS];
+    int count = chips * DIGESTS_PER_CHIP;
+
+    for (int i = 0; i < chips; i++) {
+        if (p11->C_OpenSession(i, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &sessions[i]) != CKR_OK) {
+            fprintf(stderr, "Can't open slot %d\n", i);
+            return -1;
+        }
+    }
+
+    int event_fd = eventfd(0, EFD_CLOEXEC);
+    double start = now_s();
+    for (int i = 0; i < count; i++) {
+        memset(digests[i], i, sizeof(digests[i]));
+        async[i].eventFd = event_fd;
+        async[i].Callback = NULL;
+        async[i].pContext = NULL;
+        if (nkcs11->C_NKCS11_SignAsync(sessions[i % chips], &mechanism, 1, digests[i], signatures[i], &async[i]) != CKR_OK) {
+            fprintf(stderr, "C_NKCS11_SignAsync failed\n");
+            return -1;
+        }
+    }
+
+    uint64_t done = 0;
+    while (done < (uint64_t) count) {
+        uint64_t value;
+        if (read(event_fd, &value, sizeof(value)) == sizeof(value))
+            done += value;
+    }
+    *rate = count / (now_s() - start);
+    close(event_fd);
+
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        if (async[i].rv != CKR_OK)
+            failures++;
+    }
+    for (int i = 0; i < chips; i++)
+        p11->C_CloseSession(sessions[i]);
+
+    if (failures) {
+        fprintf(stderr, "%d signatures failed\n", failures);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <path to nerves_key_pkcs11.so>\n", argv[0]);
+        return 1;
+    }
+
+    setenv("NERVES_KEY_TRANSPORT", "sim", 0);
+    setenv("NERVES_KEY_SIM_BUSES", BUSES, 0);
+
+    // Nothing can carry over from an earlier run
+    unsetenv("NERVES_KEY_CACHE_FILE");
+    unsetenv("NERVES_KEY_SHM");
+    unsetenv("NERVES_KEY_AGENT_SOCKET");
+
+    if (scan(argv[1]) < 0)
+        return 1;
+
+    double one = 0;
+    for (int chips = 1; chips <= MAX_CHIPS; chips *= 2) {
+        double rate;
+        if (sign_on(chips, &rate) < 0)
+            return 1;
+        if (chips == 1)
+            one = rate;
+        printf("sign on %d chips: %6.1f sig/s (%.2fx)\n", chips, rate, rate / one);
+    }
+
+    p11->C_Finalize(NULL_PTR);
+    return 0;
+}
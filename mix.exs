@@ -37,6 +37,7 @@ defmodule NervesKey.PKCS11.MixProject do
   defp package do
     [
       files: [
+        "agent/*.c",
         "CHANGELOG.md",
         "lib",
         "LICENSES/*",
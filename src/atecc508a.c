@@ -32,31 +32,91 @@
  */
 
 #include <errno.h>
-#include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
-#include <unistd.h>
-
-#include <linux/i2c.h>
-#include <linux/i2c-dev.h>
-
-#include <sys/ioctl.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 
 #include "atecc508a.h"
 #include "log.h"
 
 #define ATECC508A_WAKE_DELAY_US 1500
 
+// The watchdog puts the chip to sleep 1.3 seconds (typical) after it's woken
+// up. The datasheet minimum is 0.7 seconds, so only trust that much of it.
+// The maximum is 1.7 seconds.
+#define ATECC508A_WATCHDOG_US 700000
+#define ATECC508A_WATCHDOG_MAX_US 1700000
+
+// ChipMode can select a 10 second watchdog instead. Scale the limits the same way.
+#define ATECC508A_LONG_WATCHDOG_US 5300000
+#define ATECC508A_LONG_WATCHDOG_MAX_US 13100000
+
+// ChipMode bits (ATECC608A Table 2-8)
+#define ATECC508A_CHIP_MODE_LONG_WATCHDOG 0x04
+#define ATECC508A_CHIP_MODE_CLOCK_DIVIDER(mode) ((mode) >> 3)
+
+// Until a few commands have been timed, wait the "typical" time and poll every
+// millisecond. After that, the first read is scheduled at the learned
+// percentile and polling speeds up if the completion times are consistent.
+#define ATECC508A_TIMING_WARMUP 4
+#define ATECC508A_POLL_PERCENTILE 50
+#define ATECC508A_POLL_INTERVAL_US 1000
+#define ATECC508A_MIN_POLL_INTERVAL_US 250
+
+// How many times to try a command before giving up. See atecc508a_request().
+#define ATECC508A_MAX_ATTEMPTS 3
+
+// How often a signature that's run a step at a time checks whether another
+// process is done with the chip
+#define ATECC508A_ARBITER_POLL_US 1000
+
 // The ATECC508A/608A have different times for how long to wait for commands to complete.
 // Unless I'm totally misreading the datasheet (Table 9-4), it really seems like some are too short.
 // See https://github.com/MicrochipTech/cryptoauthlib/blob/master/lib/atca_execution.c#L98 for
 // another opinion on execution times.
 //
-// I'm taking the "typical" time from the datasheet and the "max" time from the longest
-// I see on the 508A/608A in atca_execution.c or the datasheet.
+// Execution times for each variant. Each one is the typical time and then the
+// max time at each clock divider that ChipMode can select (M0, M1 and M2,
+// fastest first). The max times are from atca_execution.c. The typical times
+// are for M0 and get scaled with the max times. Only the 608's have a clock
+// divider, so the 508A's max times are the same for all three.
+#define TIMES_508A_GENKEY   11000, 115000, 115000, 115000
+#define TIMES_508A_NONCE      100,   7000,   7000,   7000
+#define TIMES_508A_READ       100,   1000,   1000,   1000
+#define TIMES_508A_SIGN     42000,  50000,  50000,  50000
+
+#define TIMES_608A_GENKEY   11000, 115000, 215000, 653000
+#define TIMES_608A_NONCE      100,  20000,  20000,  29000
+#define TIMES_608A_READ       100,   5000,   5000,   5000
+#define TIMES_608A_SIGN     38000, 115000, 220000, 665000
+
+#define TIMES_608B_GENKEY    9000, 115000, 215000, 653000
+#define TIMES_608B_NONCE      100,  20000,  20000,  29000
+#define TIMES_608B_READ       100,   5000,   5000,   5000
+#define TIMES_608B_SIGN     30000, 115000, 220000, 665000
+
+// Builds for one part (see CHIP_PROFILE in the Makefile) use that part's times
+// directly. ChipMode isn't read, so they take the max times for the slowest
+// clock divider. That only matters when the chip stops responding since
+// polling starts at the typical time and then learns from there.
+#define TYPICAL_AND_SLOWEST_(typical, m0, m1, m2) typical, m2
+#define TYPICAL_AND_SLOWEST(times) TYPICAL_AND_SLOWEST_(times)
+
+#if defined(NKCS11_CHIP_PROFILE_508A)
+#define ATECC508A_FIXED_VARIANT ATECC508A_VARIANT_508A
+#define PROFILE_TIMES(op) TYPICAL_AND_SLOWEST(TIMES_508A_##op)
+#elif defined(NKCS11_CHIP_PROFILE_608A)
+#define ATECC508A_FIXED_VARIANT ATECC508A_VARIANT_608A
+#define PROFILE_TIMES(op) TYPICAL_AND_SLOWEST(TIMES_608A_##op)
+#elif defined(NKCS11_CHIP_PROFILE_608B_TNG)
+#define ATECC508A_FIXED_VARIANT ATECC508A_VARIANT_608B
+#define PROFILE_TIMES(op) TYPICAL_AND_SLOWEST(TIMES_608B_##op)
+#endif
+
+// Otherwise, the opcode table is what's used until the chip has been
+// identified. It takes the "typical" time from the datasheet and the "max" time
+// from the longest I see on the 508A/608A in atca_execution.c or the datasheet.
+// Once the chip is identified, the times for that variant are used instead.
 
 struct atecc508a_opcode_info {
     uint8_t opcode;  // Opcode
@@ -65,6 +125,13 @@ struct atecc508a_opcode_info {
     int max_us;      // Max processing time
 };
 
+#ifdef ATECC508A_FIXED_VARIANT
+static const struct atecc508a_opcode_info op_genkey =     {0x40, 64, PROFILE_TIMES(GENKEY)};
+static const struct atecc508a_opcode_info op_nonce =      {0x16,  1, PROFILE_TIMES(NONCE)};
+static const struct atecc508a_opcode_info op_read4 =      {0x02,  4, PROFILE_TIMES(READ)};
+static const struct atecc508a_opcode_info op_read32 =     {0x02, 32, PROFILE_TIMES(READ)};
+static const struct atecc508a_opcode_info op_sign =       {0x41, 64, PROFILE_TIMES(SIGN)};
+#else
 //static const struct atecc508a_opcode_info op_checkmac =   {0x28,  1,  5000,  40000};
 //static const struct atecc508a_opcode_info op_derive_key = {0x1c,  1,  2000,  50000};
 //static const struct atecc508a_opcode_info op_ecdh =       {0x43,  1, 38000, 531000};
@@ -74,11 +141,52 @@ static const struct atecc508a_opcode_info op_read4 =      {0x02,  4,   100,   50
 static const struct atecc508a_opcode_info op_read32 =     {0x02, 32,   100,   5000};
 static const struct atecc508a_opcode_info op_sign =       {0x41, 64, 42000, 665000};
 
+// Per-variant execution times. See clock_divider() for which max time is used.
+struct atecc508a_profile {
+    enum atecc508a_variant variant;
+    struct {
+        uint8_t opcode;
+        int typical_us;
+        int m0_max_us;
+        int m1_max_us;
+        int m2_max_us;
+    } ops[4];
+};
+
+static const struct atecc508a_profile profiles[] = {
+    {
+        ATECC508A_VARIANT_508A, {
+            {0x40, TIMES_508A_GENKEY},
+            {0x16, TIMES_508A_NONCE},
+            {0x02, TIMES_508A_READ},
+            {0x41, TIMES_508A_SIGN}
+        }
+    },
+    {
+        ATECC508A_VARIANT_608A, {
+            {0x40, TIMES_608A_GENKEY},
+            {0x16, TIMES_608A_NONCE},
+            {0x02, TIMES_608A_READ},
+            {0x41, TIMES_608A_SIGN}
+        }
+    },
+    {
+        ATECC508A_VARIANT_608B, {
+            {0x40, TIMES_608B_GENKEY},
+            {0x16, TIMES_608B_NONCE},
+            {0x02, TIMES_608B_READ},
+            {0x41, TIMES_608B_SIGN}
+        }
+    }
+};
+#define NUM_PROFILES (sizeof(profiles) / sizeof(profiles[0]))
+#endif
+
 static int microsleep(int microseconds)
 {
     struct timespec ts;
-    ts.tv_sec = 0;
-    ts.tv_nsec = microseconds * 1000;
+    ts.tv_sec = microseconds / 1000000;
+    ts.tv_nsec = (microseconds % 1000000) * 1000;
     int rc;
 
     while ((rc = nanosleep(&ts, &ts)) < 0 && errno == EINTR);
@@ -86,174 +194,909 @@ static int microsleep(int microseconds)
     return rc;
 }
 
-static int i2c_read(int fd, uint8_t addr, uint8_t *to_read, size_t to_read_len)
+static uint64_t monotonic_us(void)
 {
-    struct i2c_rdwr_ioctl_data data;
-    struct i2c_msg msg;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
 
-    msg.addr = addr;
-    msg.flags = I2C_M_RD;
-    msg.len = (uint16_t) to_read_len;
-    msg.buf = to_read;
-    data.msgs = &msg;
-    data.nmsgs = 1;
+// Transports can supply their own clock (e.g., a simulator's virtual clock)
+static void dev_sleep(struct atecc508a *dev, int microseconds)
+{
+    if (dev->transport->sleep_us)
+        dev->transport->sleep_us(dev, microseconds);
+    else
+        microsleep(microseconds);
+}
 
-    return ioctl(fd, I2C_RDWR, &data);
+static uint64_t dev_now(struct atecc508a *dev)
+{
+    if (dev->transport->now_us)
+        return dev->transport->now_us(dev);
+    else
+        return monotonic_us();
 }
 
-static int i2c_write(int fd, uint8_t addr, const uint8_t *to_write, uint16_t to_write_len)
+// Run messages back-to-back. Transports that can't do it in one bus
+// transaction get them one at a time.
+static int dev_transfer(struct atecc508a *dev, const struct atecc508a_msg *msgs, int count)
 {
-    struct i2c_rdwr_ioctl_data data;
-    struct i2c_msg msg;
+    if (dev->transport->transfer)
+        return dev->transport->transfer(dev, msgs, count);
+
+    for (int i = 0; i < count; i++) {
+        const struct atecc508a_msg *m = &msgs[i];
+        int rc;
+        if (m->flags & ATECC508A_MSG_WAKE)
+            rc = dev->transport->wake(dev);
+        else if (m->flags & ATECC508A_MSG_READ)
+            rc = dev->transport->read(dev, m->addr, m->buf, m->len);
+        else
+            rc = dev->transport->write(dev, m->addr, m->buf, m->len);
+        if (rc < 0)
+            return -1;
+    }
+    return 0;
+}
 
-    msg.addr = addr;
-    msg.flags = 0;
-    msg.len = (uint16_t) to_write_len;
-    msg.buf = (uint8_t *) to_write;
-    data.msgs = &msg;
-    data.nmsgs = 1;
+static const uint8_t wake_signature[4] = {0x04, 0x11, 0x33, 0x43};
 
-    return ioctl(fd, I2C_RDWR, &data);
+static struct atecc508a_timing *timing_for(struct atecc508a *dev, uint8_t opcode)
+{
+    for (int i = 0; i < ATECC508A_TIMING_OPCODES; i++) {
+        struct atecc508a_timing *t = &dev->timing[i];
+        if (t->opcode == opcode)
+            return t;
+
+        if (t->opcode == 0) {
+            t->opcode = opcode;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static int op_typical_us(struct atecc508a *dev, const struct atecc508a_opcode_info *op)
+{
+#ifdef ATECC508A_FIXED_VARIANT
+    (void) dev;
+    return op->typical_us;
+#else
+    struct atecc508a_timing *t = timing_for(dev, op->opcode);
+    return t && t->max_us ? t->typical_us : op->typical_us;
+#endif
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
 }
 
-static int i2c_poll_read(int fd, uint8_t addr, uint8_t *to_read, size_t to_read_len, int min_us, int max_us)
+static void timing_update(struct atecc508a_timing *t, int elapsed_us, int naks, int poll_interval_us)
 {
-    int amount_slept = min_us;
-    int poll_interval = 1000;
+    // If the first read worked, the command finished some time before it.
+    // Record a slightly earlier time so that the schedule creeps down until
+    // reads start getting NAK'd. Otherwise, the completion time is known to
+    // within one poll interval.
+    int sample;
+    if (naks == 0)
+        sample = elapsed_us - elapsed_us / 8;
+    else
+        sample = elapsed_us - poll_interval_us / 2;
+
+    t->samples[t->count % ATECC508A_TIMING_SAMPLES] = sample;
+    t->count++;
+    t->naks += naks;
+
+    int n = t->count < ATECC508A_TIMING_SAMPLES ? (int) t->count : ATECC508A_TIMING_SAMPLES;
+    int sorted[ATECC508A_TIMING_SAMPLES];
+    memcpy(sorted, t->samples, n * sizeof(int));
+    qsort(sorted, n, sizeof(int), compare_int);
+
+    int first = sorted[n * ATECC508A_POLL_PERCENTILE / 100];
+    int spread = sorted[n * 90 / 100] - first;
+
+    // Poll fast when the completion times are tightly clustered
+    int interval = spread / 4;
+    if (interval < ATECC508A_MIN_POLL_INTERVAL_US)
+        interval = ATECC508A_MIN_POLL_INTERVAL_US;
+    else if (interval > ATECC508A_POLL_INTERVAL_US)
+        interval = ATECC508A_POLL_INTERVAL_US;
+
+    t->first_poll_us = first > 0 ? first : 0;
+    t->poll_interval_us = interval;
+}
+
+// When to try the first read and how often to retry after that
+static struct atecc508a_timing *poll_plan(struct atecc508a *dev, const struct atecc508a_opcode_info *op,
+                                          int *first_poll_us, int *poll_interval_us, int *max_us)
+{
+    struct atecc508a_timing *t = timing_for(dev, op->opcode);
+    *first_poll_us = op->typical_us;
+    *max_us = op->max_us;
+    *poll_interval_us = ATECC508A_POLL_INTERVAL_US;
+
+#ifndef ATECC508A_FIXED_VARIANT
+    if (t && t->max_us) {
+        *first_poll_us = t->typical_us;
+        *max_us = t->max_us;
+    }
+#endif
+    if (t && t->count >= ATECC508A_TIMING_WARMUP) {
+        *first_poll_us = t->first_poll_us;
+        *poll_interval_us = t->poll_interval_us;
+    }
+    return t;
+}
+
+static int i2c_poll_read(struct atecc508a *dev, const struct atecc508a_opcode_info *op, uint8_t *to_read, size_t to_read_len)
+{
+    int first_poll_us;
+    int poll_interval_us;
+    int max_us;
+    struct atecc508a_timing *t = poll_plan(dev, op, &first_poll_us, &poll_interval_us, &max_us);
+    int naks = 0;
     int rc;
 
-    microsleep(min_us);
+    uint64_t start = dev_now(dev);
+    dev_sleep(dev, first_poll_us);
 
-    do {
-        rc = i2c_read(fd, addr, to_read, to_read_len);
+    for (;;) {
+        rc = dev->transport->read(dev, dev->addr, to_read, (uint16_t) to_read_len);
         if (rc >= 0)
             break;
 
-        microsleep(poll_interval);
-        amount_slept += poll_interval;
-    } while (amount_slept <= max_us);
+        naks++;
+        if (dev_now(dev) - start > (uint64_t) max_us)
+            return rc;
+
+        dev_sleep(dev, poll_interval_us);
+    }
+
+    if (t)
+        timing_update(t, (int) (dev_now(dev) - start), naks, poll_interval_us);
+
     return rc;
 }
 
-// See Atmel CryptoAuthentication Data Zone CRC Calculation application note
-static void atecc508a_crc(uint8_t *data)
+static enum atecc508a_recovery status_recovery(uint8_t status)
 {
-    const uint16_t polynom = 0x8005;
-    uint16_t crc_register = 0;
+    switch (status) {
+    case ATECC508A_STATUS_SUCCESS:
+        return ATECC508A_RECOVER_NONE;
+
+    case ATECC508A_STATUS_ECC_FAULT:
+    case ATECC508A_STATUS_HEALTH_TEST_ERROR:
+    case ATECC508A_STATUS_AFTER_WAKE:
+    case ATECC508A_STATUS_CRC_ERROR:
+        // The command wasn't received or the result was bad, so run it again
+        return ATECC508A_RECOVER_RESEND;
+
+    case ATECC508A_STATUS_WATCHDOG:
+        // Restart the watchdog first by going through idle
+        return ATECC508A_RECOVER_REIDLE;
+
+    case ATECC508A_STATUS_MISCOMPARE:
+    case ATECC508A_STATUS_PARSE_ERROR:
+    case ATECC508A_STATUS_SELFTEST_ERROR:
+    case ATECC508A_STATUS_EXECUTION_ERROR:
+    default:
+        return ATECC508A_RECOVER_FAIL;
+    }
+}
 
-    size_t length = data[0] - 2;
+// Read the rest of a response whose count byte is in dev->response[0]
+static enum atecc508a_recovery receive_rest(struct atecc508a *dev, const struct atecc508a_opcode_info *op)
+{
+    uint8_t *response = dev->response;
+    uint8_t expected = (uint8_t) (op->length + 3);
+    uint8_t count = response[0];
+    dev->last_status = ATECC508A_STATUS_BAD_RESPONSE;
+    if ((count != 4 && count != expected) ||
+        dev->transport->read(dev, dev->addr, &response[1], count - 1) < 0 ||
+        !atecc508a_crc_ok(response, count))
+        return ATECC508A_RECOVER_REREAD;
+
+    if (count == expected && (count != 4 || response[1] == ATECC508A_STATUS_SUCCESS)) {
+        dev->last_status = ATECC508A_STATUS_SUCCESS;
+        return ATECC508A_RECOVER_NONE;
+    }
 
-    for (size_t counter = 0; counter < length; counter++)
-    {
-        for (uint8_t shift_register = 0x01; shift_register > 0x00; shift_register <<= 1)
-        {
-            uint8_t data_bit = (data[counter] & shift_register) ? 1 : 0;
-            uint8_t crc_bit = crc_register >> 15;
-            crc_register <<= 1;
-            if (data_bit != crc_bit)
-                crc_register ^= polynom;
+    dev->last_status = response[1];
+    enum atecc508a_recovery recovery = status_recovery(response[1]);
+
+    // A status packet of 0 when data was expected shouldn't happen
+    return recovery == ATECC508A_RECOVER_NONE ? ATECC508A_RECOVER_RESEND : recovery;
+}
+
+static enum atecc508a_recovery atecc508a_receive(struct atecc508a *dev, const struct atecc508a_opcode_info *op, int poll)
+{
+    uint8_t *response = dev->response;
+
+    // Read the count byte first so that 4-byte status packets don't cost a
+    // full-length read
+    if (poll) {
+        if (i2c_poll_read(dev, op, response, 1) < 0) {
+            dev->last_status = ATECC508A_STATUS_NO_RESPONSE;
+            return ATECC508A_RECOVER_REWAKE;
         }
+    } else if (dev->transport->read(dev, dev->addr, response, 1) < 0) {
+        return ATECC508A_RECOVER_RESEND;
     }
 
-    uint8_t *crc_le = &data[length];
-    crc_le[0] = (uint8_t)(crc_register & 0x00FF);
-    crc_le[1] = (uint8_t)(crc_register >> 8);
+    return receive_rest(dev, op);
 }
 
-static int atecc508a_request(int fd, uint8_t addr, const struct atecc508a_opcode_info *op, uint8_t *msg, uint8_t *response)
+// Send the wake token (see atecc508a_rewake()), but leave the wait to the caller
+static void send_wake(struct atecc508a *dev, uint8_t word_address)
 {
-    atecc508a_crc(&msg[1]);
-
-    // Calculate and append the CRC and send
-    if (i2c_write(fd, addr, msg, msg[1] + 1) < 0) {
-        ERROR("Error from i2c_write for opcode 0x%02x", msg[2]);
-        return -1;
+    struct atecc508a_msg msgs[2];
+    int count = 0;
+
+    if (word_address) {
+        msgs[count].addr = dev->addr;
+        msgs[count].flags = 0;
+        msgs[count].len = 1;
+        msgs[count].buf = &word_address;
+        count++;
     }
+    msgs[count].addr = 0;
+    msgs[count].flags = ATECC508A_MSG_WAKE;
+    msgs[count].len = 0;
+    msgs[count].buf = NULL;
+    count++;
+
+    // Nothing ACKs the wake token, so the result doesn't say anything useful
+    dev_transfer(dev, msgs, count);
+
+    // Don't update wake_time_us until the wakeup is confirmed. If it didn't
+    // work, atecc508a_wakeup() needs the old one for the watchdog wait.
+    dev->awake = 1;
+    dev->pending_wake_us = dev_now(dev) + ATECC508A_WAKE_DELAY_US;
+}
 
-    if (i2c_poll_read(fd, addr, response, op->length + 3, op->typical_us, op->max_us) < 0) {
-        ERROR("Error for i2c_read for opcode 0x%02x. Waited %d us", msg[2], op->max_us);
-        return -1;
+/**
+ * Send the wake token without waiting to check the result
+ *
+ * The sleep or idle word address that has to go first is sent in the same
+ * transfer as the wake token and the check for the wake response is folded
+ * into the next command's transfer by send_command(). If the chip was already
+ * asleep, the sleep or idle write NAKs and the wake token doesn't go out.
+ * That's caught by the check and handled by doing a full wakeup.
+ *
+ * @param dev the device
+ * @param word_address ATECC508A_WORD_SLEEP, ATECC508A_WORD_IDLE or 0 for none
+ */
+static void atecc508a_rewake(struct atecc508a *dev, uint8_t word_address)
+{
+    send_wake(dev, word_address);
+    dev_sleep(dev, ATECC508A_WAKE_DELAY_US);
+}
+
+// Write the command in dev->command. Returns 1 if a wake token was pending
+// and the chip turned out not to be awake, so nothing was sent.
+static int write_command(struct atecc508a *dev, uint16_t len)
+{
+    if (dev->pending_wake_us) {
+        // Read the wake response and write the command in one transfer
+        uint8_t check[4];
+        struct atecc508a_msg msgs[2] = {
+            { dev->addr, ATECC508A_MSG_READ, sizeof(check), check },
+            { dev->addr, 0, len, dev->command }
+        };
+
+        uint64_t wake_time_us = dev->pending_wake_us;
+        dev->pending_wake_us = 0;
+        if (dev_transfer(dev, msgs, 2) == 0) {
+            if (memcmp(check, wake_signature, sizeof(check)) == 0) {
+                dev->wake_time_us = wake_time_us;
+            } else {
+                // It was already awake so the watchdog could fire sooner
+                // than expected. Assume the worst.
+                INFO("ATECC508A was already awake");
+                dev->wake_time_us = 0;
+            }
+            return 0;
+        }
+        return 1;
     }
 
-    // Check length
-    if (response[0] != op->length + 3) {
-        ERROR("Response error for opcode 0x%02x: %02x %02x %02x %02x", msg[2], response[0], response[1], response[2], response[3]);
+    return dev->transport->write(dev, dev->addr, dev->command, len);
+}
+
+static int send_command(struct atecc508a *dev, uint16_t len)
+{
+    int rc = write_command(dev, len);
+    if (rc <= 0)
+        return rc;
+
+    // The chip didn't wake up, so go through the full wakeup
+    if (atecc508a_wakeup(dev) < 0)
         return -1;
+
+    return dev->transport->write(dev, dev->addr, dev->command, len);
+}
+
+/**
+ * Send a command and receive its response
+ *
+ * Errors are handled here with the cheapest recovery that will work. If the
+ * response was garbled, it's read again. If the chip didn't get the command
+ * or reported a recoverable error, the command is sent again. If the
+ * watchdog is about to expire, the chip is sent through idle. If the chip
+ * stops responding, it's woken up again.
+ *
+ * The command is framed once into dev->command and resent from there. The
+ * response is left in dev->response.
+ *
+ * @param dev the device
+ * @param op the opcode info
+ * @param param1 the command's first parameter
+ * @param param2 the command's second parameter
+ * @param data data to send with the command or NULL
+ * @param data_len the length of data
+ * @return 0 on success; dev->last_status has the status on failure
+ */
+static int atecc508a_request(struct atecc508a *dev, const struct atecc508a_opcode_info *op,
+                             uint8_t param1, uint16_t param2, const uint8_t *data, size_t data_len)
+{
+    uint16_t len = (uint16_t) atecc508a_encode_command(dev->command, op->opcode, param1, param2, data, data_len);
+
+    enum atecc508a_recovery recovery = ATECC508A_RECOVER_NONE;
+    for (int attempt = 0; attempt < ATECC508A_MAX_ATTEMPTS; attempt++) {
+        switch (recovery) {
+        case ATECC508A_RECOVER_REREAD: {
+            // Reset the I/O buffer address and read the response again. If
+            // that doesn't work, give up on it and send the command again.
+            uint8_t reset = ATECC508A_WORD_RESET;
+            if (dev->transport->write(dev, dev->addr, &reset, 1) < 0)
+                recovery = ATECC508A_RECOVER_RESEND;
+            else
+                recovery = atecc508a_receive(dev, op, 0);
+
+            if (recovery == ATECC508A_RECOVER_REREAD)
+                recovery = ATECC508A_RECOVER_RESEND;
+            goto check;
+        }
+
+        case ATECC508A_RECOVER_REIDLE:
+            atecc508a_rewake(dev, ATECC508A_WORD_IDLE);
+            break;
+
+        case ATECC508A_RECOVER_REWAKE:
+            atecc508a_rewake(dev, ATECC508A_WORD_SLEEP);
+            break;
+
+        case ATECC508A_RECOVER_NONE:
+            break;
+
+        default:
+            // Sign uses up TempKey and a sleep clears it, so sending it
+            // again can't work. The caller has to start over from the Nonce.
+            if (op == &op_sign)
+                goto fail;
+            break;
+        }
+
+        if (send_command(dev, len) < 0) {
+            // Asleep or in a bad state
+            dev->last_status = ATECC508A_STATUS_NO_RESPONSE;
+            recovery = ATECC508A_RECOVER_REWAKE;
+            continue;
+        }
+
+        recovery = atecc508a_receive(dev, op, 1);
+
+check:
+        if (recovery == ATECC508A_RECOVER_NONE)
+            return 0;
+        if (recovery == ATECC508A_RECOVER_FAIL)
+            break;
+
+        INFO("Retrying opcode 0x%02x after status 0x%02x", op->opcode, dev->last_status);
     }
 
-    // Check the CRC
-    uint8_t got_crc[2];
-    got_crc[0] = response[op->length + 1];
-    got_crc[1] = response[op->length + 2];
-    atecc508a_crc(response);
-    if (got_crc[0] != response[op->length + 1] || got_crc[1] != response[op->length + 2]) {
-        ERROR("CRC error for opcode 0x%02x", msg[2]);
-        return -1;
+fail:
+    ERROR("Opcode 0x%02x failed with status 0x%02x", op->opcode, dev->last_status);
+    return -1;
+}
+
+static const struct atecc508a_transport *transports[] = {
+    &atecc508a_i2c_transport,
+#ifdef NKCS11_SIMULATOR
+    &atecc508a_sim_transport,
+#endif
+    NULL
+};
+
+/**
+ * Look up a transport by name
+ *
+ * @param name the transport's name or NULL for the default
+ * @return the transport or NULL if not found
+ */
+const struct atecc508a_transport *atecc508a_find_transport(const char *name)
+{
+    if (name == NULL || *name == '\0')
+        return transports[0];
+
+    for (const struct atecc508a_transport **t = transports; *t; t++) {
+        if (strcmp((*t)->name, name) == 0)
+            return *t;
     }
+    return NULL;
+}
+
+// Get a turn on the chip if there's an arbiter and this device doesn't
+// already have one. Returns 0 when it's this device's turn.
+static int arbitrate(struct atecc508a *dev, int blocking)
+{
+    if (dev->arbiter == NULL || dev->arbitrated)
+        return 0;
 
+    int rc = dev->arbiter->acquire(dev->arbiter_context, blocking);
+    if (rc < 0 || rc == ATECC508A_ARBITER_WAIT)
+        return rc;
+
+    dev->arbitrated = 1;
+    if (rc > 0) {
+        // Another process could have left the chip awake, idle or asleep.
+        // Saying that it's awake with no time left before the watchdog makes
+        // the next wakeup start with a word address that works for all three.
+        dev->awake = 1;
+        dev->wake_time_us = 0;
+        dev->pending_wake_us = 0;
+    }
     return 0;
 }
 
-int atecc508a_open(const char *filename)
+static void end_arbitration(struct atecc508a *dev)
 {
-    return open(filename, O_RDWR);
+    if (dev->arbitrated) {
+        dev->arbitrated = 0;
+        dev->arbiter->release(dev->arbiter_context);
+    }
 }
 
-void atecc508a_close(int fd)
+int atecc508a_open(struct atecc508a *dev, const struct atecc508a_transport *transport, const char *filename, uint8_t addr)
 {
-    close(fd);
+    memset(dev, 0, sizeof(*dev));
+    dev->transport = transport;
+    dev->fd = -1;
+    dev->addr = addr;
+    dev->keep_awake_us = ATECC508A_KEEP_AWAKE_DEFAULT_US;
+    dev->watchdog_us = ATECC508A_WATCHDOG_US;
+    dev->watchdog_max_us = ATECC508A_WATCHDOG_MAX_US;
+#ifdef ATECC508A_FIXED_VARIANT
+    dev->variant = ATECC508A_FIXED_VARIANT;
+#endif
+    return transport->open(dev, filename);
 }
 
-int atecc508a_wakeup(int fd, uint8_t addr)
+void atecc508a_close(struct atecc508a *dev)
 {
-    for (int i = 0; i < 2; i++) {
-        // See ATECC508A 6.1 for the wakeup sequence.
-        //
-        // Write to address 0 to pull SDA down for the wakeup interval (60 uS).
-        // Since only 8-bits get through, the I2C speed needs to be < 133 KHz for
-        // this to work.
-        uint8_t zero = 0;
-        i2c_write(fd, 0, &zero, 1);
-
-        // Wait for the device to wake up for real
-        microsleep(ATECC508A_WAKE_DELAY_US);
-
-        // Check that it's awake by reading its signature
-        uint8_t buffer[4];
-        if (i2c_read(fd, addr, buffer, sizeof(buffer)) < 0) {
-            ERROR("Can't wakeup ATECC508A");
-            return -1;
-        }
+    if (dev->awake && arbitrate(dev, 1) >= 0) {
+        atecc508a_sleep(dev);
+        end_arbitration(dev);
+    }
+
+    // Even if another process has it, there's nothing more to put to sleep
+    dev->awake = 0;
+    dev->transport->close(dev);
+}
 
-        if (buffer[0] == 0x04 &&
-            buffer[1] == 0x11 &&
-            buffer[2] == 0x33 &&
-            buffer[3] == 0x43) {
-            // Success
+/**
+ * Return what's been learned about an opcode's completion time
+ *
+ * @param dev the device opened by atecc508a_open
+ * @param opcode the ATECC opcode
+ * @param timing where to copy the timing information
+ * @return 0 on success; -1 if the opcode hasn't been used
+ */
+int atecc508a_get_timing(const struct atecc508a *dev, uint8_t opcode, struct atecc508a_timing *timing)
+{
+    for (int i = 0; i < ATECC508A_TIMING_OPCODES; i++) {
+        if (dev->timing[i].opcode == opcode) {
+            *timing = dev->timing[i];
             return 0;
         }
+    }
+    return -1;
+}
+
+/**
+ * Start with what was learned about an opcode's completion time before
+ *
+ * This is for timing saved with atecc508a_get_timing() in an earlier run so
+ * that polling doesn't have to warm up again. Only the learned parts are
+ * used. The execution times still come from the chip variant.
+ *
+ * @param dev the device opened by atecc508a_open
+ * @param timing what atecc508a_get_timing() returned
+ */
+void atecc508a_set_timing(struct atecc508a *dev, const struct atecc508a_timing *timing)
+{
+    if (timing->opcode == 0)
+        return;
+
+    struct atecc508a_timing *t = timing_for(dev, timing->opcode);
+    if (t == NULL)
+        return;
+
+    t->count = timing->count;
+    t->naks = timing->naks;
+    t->first_poll_us = timing->first_poll_us;
+    t->poll_interval_us = timing->poll_interval_us;
+    memcpy(t->samples, timing->samples, sizeof(t->samples));
+}
+
+/**
+ * Set how long to leave the chip awake after a command
+ *
+ * Leaving the chip awake lets the next command skip the wakeup sequence. The
+ * chip's watchdog limits how long this can go on, so the chip is put in idle
+ * mode and woken up again when a command might not finish before it fires. If
+ * nothing uses the chip for keep_awake_us, the next command starts from a
+ * fresh sleep/wakeup cycle.
+ *
+ * The caller has to put the chip to sleep when keep_awake_us runs out by
+ * calling atecc508a_sleep_if_idle(). Otherwise it stays awake until the next
+ * command or until its watchdog fires, which is about 1.3 seconds after the
+ * wakeup or about 10 seconds if ChipMode selects the long watchdog.
+ *
+ * @param dev the device opened by atecc508a_open
+ * @param keep_awake_us how long to keep the chip awake or 0 to put it to sleep after every command
+ */
+void atecc508a_set_keep_awake(struct atecc508a *dev, int keep_awake_us)
+{
+    dev->keep_awake_us = keep_awake_us > 0 ? keep_awake_us : 0;
+}
+
+/**
+ * Take turns on the chip with other processes
+ *
+ * The arbiter is held from when a command sequence starts until the chip is
+ * put to sleep or left awake at the end of it. If another process had the
+ * chip in between, the next sequence doesn't assume anything about the
+ * state that it was left in.
+ *
+ * @param dev the device opened by atecc508a_open
+ * @param arbiter the callbacks or NULL for none
+ * @param context passed to the callbacks
+ */
+void atecc508a_set_arbiter(struct atecc508a *dev, const struct atecc508a_arbiter *arbiter, void *context)
+{
+    dev->arbiter = arbiter;
+    dev->arbiter_context = context;
+}
+
+/**
+ * Keep the chip awake between commands until atecc508a_release_awake()
+ *
+ * This is for callers that know more commands are coming soon. It overrides
+ * keep_awake_us, but not the watchdog. Calls nest.
+ *
+ * @param dev the device opened by atecc508a_open
+ */
+void atecc508a_hold_awake(struct atecc508a *dev)
+{
+    dev->hold_awake++;
+}
+
+/**
+ * Undo atecc508a_hold_awake()
+ *
+ * If this was the last hold and the chip would normally be put to sleep
+ * after every command, it's put to sleep now.
+ *
+ * @param dev the device opened by atecc508a_open
+ */
+void atecc508a_release_awake(struct atecc508a *dev)
+{
+    if (dev->hold_awake > 0)
+        dev->hold_awake--;
+
+    if (dev->hold_awake == 0 && dev->keep_awake_us == 0 && dev->awake && arbitrate(dev, 1) == 0) {
+        atecc508a_sleep(dev);
+        end_arbitration(dev);
+    }
+}
+
+/**
+ * Put the chip to sleep if nothing has used it for keep_awake_us
+ *
+ * Call this when the time returned by the last call runs out. Commands that
+ * leave the chip awake don't set a timer themselves. If there's a hold on
+ * the chip, atecc508a_release_awake() is the next time to check. If another
+ * process has the chip, it's up to that process to put it to sleep.
+ *
+ * @param dev the device opened by atecc508a_open
+ * @return 0 if there's nothing left to do or microseconds until the next check
+ */
+int atecc508a_sleep_if_idle(struct atecc508a *dev)
+{
+    if (!dev->awake || dev->hold_awake > 0)
+        return 0;
+
+    uint64_t idle_us = dev_now(dev) - dev->last_use_us;
+    if (idle_us < (uint64_t) dev->keep_awake_us)
+        return dev->keep_awake_us - (int) idle_us;
+
+    if (arbitrate(dev, 0) != 0)
+        return 0;
+
+    atecc508a_sleep(dev);
+    end_arbitration(dev);
+    return 0;
+}
+
+static int try_wakeup(struct atecc508a *dev)
+{
+    // See ATECC508A 6.1 for the wakeup sequence.
+    dev->transport->wake(dev);
+
+    // Wait for the device to wake up for real
+    dev_sleep(dev, ATECC508A_WAKE_DELAY_US);
+
+    // Check that it's awake by reading its signature
+    uint8_t buffer[4];
+    if (dev->transport->read(dev, dev->addr, buffer, sizeof(buffer)) < 0) {
+        ERROR("Can't wakeup ATECC508A");
+        return -1;
+    }
 
-        ERROR("Unexpected ATECC508A wakeup response: %02x%02x%02x%02x", buffer[0], buffer[1], buffer[2], buffer[3]);
+    if (memcmp(buffer, wake_signature, sizeof(buffer)) == 0) {
+        // Success
+        dev->awake = 1;
+        dev->wake_time_us = dev_now(dev);
+        return 0;
+    }
+
+    ERROR("Unexpected ATECC508A wakeup response: %02x%02x%02x%02x", buffer[0], buffer[1], buffer[2], buffer[3]);
+    return -1;
+}
+
+int atecc508a_wakeup(struct atecc508a *dev)
+{
+    for (int i = 0; i < 2; i++) {
+        if (try_wakeup(dev) == 0)
+            return 0;
 
         // Maybe the device is already awake due to an error. Try sleeping it
         // and possibly trying again
-        atecc508a_sleep(fd, addr);
-        microsleep(ATECC508A_WAKE_DELAY_US);
+        atecc508a_sleep(dev);
+        dev_sleep(dev, ATECC508A_WAKE_DELAY_US);
     }
+
+    // A chip that's stuck in a command won't respond until its watchdog puts
+    // it to sleep. If it was woken up recently, wait that out and try once more.
+    uint64_t watchdog_expiry = dev->wake_time_us + (uint64_t) dev->watchdog_max_us;
+    uint64_t now = dev_now(dev);
+    if (dev->wake_time_us != 0 && now < watchdog_expiry) {
+        INFO("Waiting %d us for the watchdog", (int) (watchdog_expiry - now));
+        dev_sleep(dev, (int) (watchdog_expiry - now));
+        if (try_wakeup(dev) == 0)
+            return 0;
+    }
+
     ERROR("No ATECC508A or it's in a really bad state");
     return -1;
 }
 
-int atecc508a_sleep(int fd, uint8_t addr)
+int atecc508a_sleep(struct atecc508a *dev)
 {
     // See ATECC508A 6.2 for the sleep sequence.
-    uint8_t sleep = 0x01;
-    if (i2c_write(fd, addr, &sleep, 1) < 0)
+    uint8_t sleep = ATECC508A_WORD_SLEEP;
+    dev->awake = 0;
+    dev->pending_wake_us = 0;
+    if (dev->transport->write(dev, dev->addr, &sleep, 1) < 0)
+        return -1;
+
+    return 0;
+}
+
+int atecc508a_idle(struct atecc508a *dev)
+{
+    // See ATECC508A 6.2. Idle is like sleep except that TempKey and the RNG
+    // state survive. It also resets the watchdog.
+    uint8_t idle = ATECC508A_WORD_IDLE;
+    dev->awake = 0;
+    dev->pending_wake_us = 0;
+    if (dev->transport->write(dev, dev->addr, &idle, 1) < 0)
+        return -1;
+
+    return 0;
+}
+
+#ifndef ATECC508A_FIXED_VARIANT
+// Return 0, 1 or 2 for the M0, M1 or M2 clock divider
+static int clock_divider(uint8_t chip_mode)
+{
+    // See the ATECC608A datasheet, Table 2-8, and atca_execution.c. M0 is
+    // the fastest. The other values are reserved, so assume the slowest.
+    switch (ATECC508A_CHIP_MODE_CLOCK_DIVIDER(chip_mode)) {
+    case 0x00:
+        return 0;
+    case 0x05:
+        return 1;
+    case 0x0d:
+    default:
+        return 2;
+    }
+}
+
+static void apply_profile(struct atecc508a *dev, enum atecc508a_variant variant, uint8_t chip_mode)
+{
+    dev->variant = variant;
+    dev->chip_mode = chip_mode;
+
+    for (size_t i = 0; i < NUM_PROFILES; i++) {
+        const struct atecc508a_profile *profile = &profiles[i];
+        if (profile->variant != variant)
+            continue;
+
+        int divider = clock_divider(chip_mode);
+        for (size_t j = 0; j < sizeof(profile->ops) / sizeof(profile->ops[0]); j++) {
+            struct atecc508a_timing *t = timing_for(dev, profile->ops[j].opcode);
+            if (t == NULL)
+                continue;
+
+            const int max_us[3] = {profile->ops[j].m0_max_us, profile->ops[j].m1_max_us, profile->ops[j].m2_max_us};
+            t->typical_us = (int) ((int64_t) profile->ops[j].typical_us * max_us[divider] / max_us[0]);
+            t->max_us = max_us[divider];
+        }
+
+        if (chip_mode & ATECC508A_CHIP_MODE_LONG_WATCHDOG) {
+            dev->watchdog_us = ATECC508A_LONG_WATCHDOG_US;
+            dev->watchdog_max_us = ATECC508A_LONG_WATCHDOG_MAX_US;
+        }
+        return;
+    }
+}
+
+// Use the first 32 bytes of the config zone
+static void identify_from_config(struct atecc508a *dev, const uint8_t *config)
+{
+    // The RevNum field is bytes 4-7. Byte 6 is 0x50 for the 508A and 0x60
+    // for the 608. Byte 7 is the silicon revision and the 608B starts at 3.
+    // ChipMode is byte 19.
+    enum atecc508a_variant variant;
+    if (config[6] == 0x50)
+        variant = ATECC508A_VARIANT_508A;
+    else if (config[6] == 0x60)
+        variant = config[7] >= 0x03 ? ATECC508A_VARIANT_608B : ATECC508A_VARIANT_608A;
+    else
+        variant = ATECC508A_VARIANT_UNKNOWN;
+
+    apply_profile(dev, variant, config[19]);
+    INFO("Found %s (revision %02x%02x%02x%02x, ChipMode 0x%02x)",
+         atecc508a_variant_name(variant), config[4], config[5], config[6], config[7], config[19]);
+}
+
+static void identify_nowake(struct atecc508a *dev)
+{
+    uint8_t config[32];
+    if (atecc508a_read_zone_nowake(dev, ATECC508A_ZONE_CONFIG, 0, 0, 0, config, 32) == 0)
+        identify_from_config(dev, config);
+}
+#endif
+
+/**
+ * Return a printable name for a chip variant
+ *
+ * @param variant the variant
+ * @return the name
+ */
+const char *atecc508a_variant_name(enum atecc508a_variant variant)
+{
+    switch (variant) {
+    case ATECC508A_VARIANT_508A:
+        return "ATECC508A";
+    case ATECC508A_VARIANT_608A:
+        return "ATECC608A";
+    case ATECC508A_VARIANT_608B:
+        return "ATECC608B";
+    case ATECC508A_VARIANT_UNIDENTIFIED:
+        return "unidentified";
+    case ATECC508A_VARIANT_UNKNOWN:
+    default:
+        return "unknown";
+    }
+}
+
+// Return what to send before the wake token for atecc508a_begin() (0 for
+// nothing) or -1 if the chip is ready to go
+static int begin_word_address(struct atecc508a *dev, int budget_us)
+{
+    if (!dev->awake)
+        return 0;
+
+    uint64_t now = dev_now(dev);
+    if (dev->hold_awake == 0 && now - dev->last_use_us > (uint64_t) dev->keep_awake_us) {
+        // Stale. The watchdog probably put it to sleep, but make sure.
+        return ATECC508A_WORD_SLEEP;
+    } else if (now + (uint64_t) budget_us > dev->wake_time_us + (uint64_t) dev->watchdog_us) {
+        // Not enough time left before the watchdog fires
+        return ATECC508A_WORD_IDLE;
+    } else {
         return -1;
+    }
+}
+
+/**
+ * Get the chip ready for a command sequence that's expected to take budget_us
+ *
+ * @param dev the device
+ * @param budget_us the typical time for the commands that will be run
+ * @return 0 on success
+ */
+static int atecc508a_begin(struct atecc508a *dev, int budget_us)
+{
+    if (arbitrate(dev, 1) < 0)
+        return -1;
+
+    int word_address = begin_word_address(dev, budget_us);
+    if (word_address < 0)
+        return 0;
+
+    atecc508a_rewake(dev, (uint8_t) word_address);
+
+#ifndef ATECC508A_FIXED_VARIANT
+    // Identify the chip the first time it's used. If this fails, the generic
+    // timings are used and it's tried again on the next wakeup.
+    if (dev->variant == ATECC508A_VARIANT_UNIDENTIFIED)
+        identify_nowake(dev);
+#endif
 
     return 0;
 }
 
+/**
+ * Get the chip ready for the next command in a sequence that's already running
+ *
+ * The chip was just used, so unlike atecc508a_begin(), this doesn't check
+ * whether keep_awake_us ran out. It only sends the chip through idle if the
+ * watchdog would fire before budget_us is up.
+ */
+static int atecc508a_continue(struct atecc508a *dev, int budget_us)
+{
+    if (!dev->awake)
+        return atecc508a_begin(dev, budget_us);
+
+    if (dev_now(dev) + (uint64_t) budget_us > dev->wake_time_us + (uint64_t) dev->watchdog_us)
+        atecc508a_rewake(dev, ATECC508A_WORD_IDLE);
+
+    return 0;
+}
+
+static void atecc508a_end(struct atecc508a *dev)
+{
+    dev->last_use_us = dev_now(dev);
+    if ((dev->keep_awake_us == 0 && dev->hold_awake == 0) || !dev->awake)
+        atecc508a_sleep(dev);
+    end_arbitration(dev);
+}
+
+static int atecc508a_retry_sequence(struct atecc508a *dev)
+{
+    switch (dev->last_status) {
+    case ATECC508A_STATUS_MISCOMPARE:
+    case ATECC508A_STATUS_PARSE_ERROR:
+    case ATECC508A_STATUS_SELFTEST_ERROR:
+        // Trying again won't help
+        return -1;
+
+    default:
+        // The chip lost its state or wasn't in the state that was expected.
+        // For example, TempKey could have been cleared by the watchdog or
+        // someone else could have used the chip. Start over from scratch.
+        INFO("Retrying after a fresh wakeup");
+        atecc508a_sleep(dev);
+        return atecc508a_wakeup(dev);
+    }
+}
+
 static int atecc508a_get_addr(uint8_t zone, uint16_t slot, uint8_t block, uint8_t offset, uint16_t *addr)
 {
     switch (zone) {
@@ -274,7 +1117,7 @@ static int atecc508a_get_addr(uint8_t zone, uint16_t slot, uint8_t block, uint8_
 /**
  * Read data out of a zone
  *
- * @param fd the fd opened by atecc508a_open
+ * @param dev the device opened by atecc508a_open
  * @param zone ATECC508A_ZONE_CONFIG, ATECC508A_ZONE_OTP, or ATECC508A_ZONE_DATA
  * @param slot the slot if this is a data zone
  * @param block which block
@@ -283,7 +1126,7 @@ static int atecc508a_get_addr(uint8_t zone, uint16_t slot, uint8_t block, uint8_
  * @param len how much to read (4 or 32 bytes)
  * @return 0 on success
  */
-int atecc508a_read_zone_nowake(int fd, uint8_t i2c_addr, uint8_t zone, uint16_t slot, uint8_t block, uint8_t offset, uint8_t *data, uint8_t len)
+int atecc508a_read_zone_nowake(struct atecc508a *dev, uint8_t zone, uint16_t slot, uint8_t block, uint8_t offset, uint8_t *data, uint8_t len)
 {
     uint16_t addr;
 
@@ -308,151 +1151,483 @@ int atecc508a_read_zone_nowake(int fd, uint8_t i2c_addr, uint8_t zone, uint16_t
         return -1;
     }
 
-    uint8_t msg[8];
-    msg[0] = 3;    // "word address"
-    msg[1] = 7;    // 7 byte message
-    msg[2] = 0x02; // Read opcode
-    msg[3] = zone_flag | zone;
-    msg[4] = addr & 0xff;
-    msg[5] = addr >> 8;
-
-    uint8_t response[32 + 3];
-    if (atecc508a_request(fd, i2c_addr, op, msg, response) < 0)
+    if (atecc508a_request(dev, op, zone_flag | zone, addr, NULL, 0) < 0)
         return -1;
 
     // Copy the data (bytes after the count field)
-    memcpy(data, &response[1], len);
+    memcpy(data, &dev->response[1], len);
 
     return 0;
 }
 
 /**
- * Read the ATECC508A's serial number
+ * Identify the chip variant so that its execution times can be used
  *
- * @param fd the fd opened by atecc508a_open
- * @param serial_number a 9-byte buffer for the serial number
+ * This happens automatically the first time the chip is used, so calling
+ * this is only needed to find out the variant before then. The result is
+ * in dev->variant and dev->chip_mode.
+ *
+ * @param dev the device opened by atecc508a_open
  * @return 0 on success
  */
-int atecc508a_read_serial(int fd, uint8_t addr, uint8_t *serial_number)
+int atecc508a_identify(struct atecc508a *dev)
 {
-    int rc = 0;
-    if (atecc508a_wakeup(fd, addr) < 0)
+    if (dev->variant != ATECC508A_VARIANT_UNIDENTIFIED)
+        return 0;
+
+    if (atecc508a_begin(dev, op_read32.typical_us) < 0)
         return -1;
 
+    atecc508a_end(dev);
+    return dev->variant == ATECC508A_VARIANT_UNIDENTIFIED ? -1 : 0;
+}
+
+/**
+ * Use a chip identification that's already known
+ *
+ * This is for when another process has already identified the chip. It
+ * saves reading the config zone when the chip is first used.
+ *
+ * @param dev the device opened by atecc508a_open
+ * @param variant the chip variant
+ * @param chip_mode the ChipMode byte from the config zone
+ */
+void atecc508a_set_identity(struct atecc508a *dev, enum atecc508a_variant variant, uint8_t chip_mode)
+{
+#ifdef ATECC508A_FIXED_VARIANT
+    (void) dev;
+    (void) variant;
+    (void) chip_mode;
+#else
+    if (dev->variant == ATECC508A_VARIANT_UNIDENTIFIED && variant != ATECC508A_VARIANT_UNIDENTIFIED)
+        apply_profile(dev, variant, chip_mode);
+#endif
+}
+
+static int read_serial_nowake(struct atecc508a *dev, uint8_t *serial_number)
+{
     // Read the config -> try 2 times just in case there's a hiccup on the I2C bus
     uint8_t buffer[32];
-    if (atecc508a_read_zone_nowake(fd, addr, ATECC508A_ZONE_CONFIG, 0, 0, 0, buffer, 32) < 0 &&
-        atecc508a_read_zone_nowake(fd, addr, ATECC508A_ZONE_CONFIG, 0, 0, 0, buffer, 32) < 0) {
-        rc = -1;
-        goto cleanup;
-    }
+    if (atecc508a_read_zone_nowake(dev, ATECC508A_ZONE_CONFIG, 0, 0, 0, buffer, 32) < 0 &&
+        atecc508a_read_zone_nowake(dev, ATECC508A_ZONE_CONFIG, 0, 0, 0, buffer, 32) < 0)
+        return -1;
 
     // Copy out the serial number (see datasheet for offsets)
     memcpy(&serial_number[0], &buffer[0], 4);
     memcpy(&serial_number[4], &buffer[8], 5);
+    return 0;
+}
+
+/**
+ * Read the ATECC508A's serial number
+ *
+ * @param dev the device opened by atecc508a_open
+ * @param serial_number a 9-byte buffer for the serial number
+ * @return 0 on success
+ */
+int atecc508a_read_serial(struct atecc508a *dev, uint8_t *serial_number)
+{
+    if (atecc508a_begin(dev, op_typical_us(dev, &op_read32)) < 0)
+        return -1;
+
+    int rc = read_serial_nowake(dev, serial_number);
+    if (rc < 0 && atecc508a_retry_sequence(dev) == 0)
+        rc = read_serial_nowake(dev, serial_number);
 
-cleanup:
-    atecc508a_sleep(fd, addr);
+    atecc508a_end(dev);
     return rc;
 }
 
+static int derive_public_key_nowake(struct atecc508a *dev, uint8_t slot, uint8_t *key)
+{
+    // Send a GenKey command to derive the public key from a previously stored private key.
+    // Mode 0 with KeyID = slot. The 3 bytes of data are only used by other modes.
+    static const uint8_t other_info[3] = {0, 0, 0};
+    if (atecc508a_request(dev, &op_genkey, 0, slot, other_info, sizeof(other_info)) < 0)
+        return -1;
+
+    // Copy the data (bytes after the count field)
+    memcpy(key, &dev->response[1], 64);
+    return 0;
+}
+
 /**
  * Derive a public key from the private key that's stored in the specified slot.
  *
- * @param fd the fd opened by atecc508a_open
+ * @param dev the device opened by atecc508a_open
  * @param slot which slot
  * @param key a 64-byte buffer for the key
  * @return 0 on success
  */
-int atecc508a_derive_public_key(int fd, uint8_t addr, uint8_t slot, uint8_t *key)
+int atecc508a_derive_public_key(struct atecc508a *dev, uint8_t slot, uint8_t *key)
 {
-    // Send a GenKey command to derive the public key from a previously stored private key
-    uint8_t msg[11];
-    int rc = 0;
-
-    if (atecc508a_wakeup(fd, addr) < 0)
+    if (atecc508a_begin(dev, op_typical_us(dev, &op_genkey)) < 0)
         return -1;
 
-    msg[0] = 3;    // "word address"
-    msg[1] = 10;   // 10 byte message
-    msg[2] = op_genkey.opcode;
-    msg[3] = 0;    // Mode
-    msg[4] = slot;
-    msg[5] = 0;
-    msg[6] = 0;
-    msg[7] = 0;
-    msg[8] = 0;
+    int rc = derive_public_key_nowake(dev, slot, key);
+    if (rc < 0 && atecc508a_retry_sequence(dev) == 0)
+        rc = derive_public_key_nowake(dev, slot, key);
+
+    atecc508a_end(dev);
+    return rc;
+}
+
+static int sign_nowake(struct atecc508a *dev, uint8_t slot, const uint8_t *data, uint8_t *signature)
+{
+    // Send a Nonce command to load the data into TempKey. Mode 0x03 writes
+    // NumIn (the 32 bytes of data) to TempKey.
+    if (atecc508a_request(dev, &op_nonce, 0x03, 0, data, 32) < 0)
+        return -1;
 
-    uint8_t response[64 + 3];
-    if (atecc508a_request(fd, addr, &op_genkey, msg, response) < 0) {
-        rc = -1;
-        goto cleanup;
+    const uint8_t *response = dev->response;
+    if (response[1] != 0) {
+        INFO("Unexpected Nonce response %02x %02x %02x %02x", response[0], response[1], response[2], response[3]);
+        return -1;
     }
 
+    // Sign the value in TempKey. Mode 0x80 says that the data is in TempKey.
+    if (atecc508a_request(dev, &op_sign, 0x80, slot, NULL, 0) < 0)
+        return -1;
+
     // Copy the data (bytes after the count field)
-    memcpy(key, &response[1], 64);
+    memcpy(signature, &response[1], 64);
+    return 0;
+}
 
-cleanup:
-    atecc508a_sleep(fd, addr);
+// A resent Sign can't recover TempKey once a fault has cleared it, so start
+// over from the Nonce as many times as a single command would be tried.
+static int sign_with_retries(struct atecc508a *dev, uint8_t slot, const uint8_t *data, uint8_t *signature)
+{
+    int rc = sign_nowake(dev, slot, data, signature);
+    for (int attempt = 1; rc < 0 && attempt < ATECC508A_MAX_ATTEMPTS; attempt++) {
+        if (atecc508a_retry_sequence(dev) < 0)
+            break;
+        rc = sign_nowake(dev, slot, data, signature);
+    }
     return rc;
 }
 
 /**
  * Sign a 32-byte buffer using the private key stored in the specified slot.
  *
- * @param fd the fd openned by atecc508a_open
- * @param addr which i2c address
+ * @param dev the device opened by atecc508a_open
  * @param slot which slot
  * @param data a 32-byte input buffer to sign
  * @param signature a 64-byte buffer for the signature
  * @return 0 on success
  */
-int atecc508a_sign(int fd, uint8_t addr, uint8_t slot, const uint8_t *data, uint8_t *signature)
+int atecc508a_sign(struct atecc508a *dev, uint8_t slot, const uint8_t *data, uint8_t *signature)
 {
-    // Send a Nonce command to load the data into TempKey
-    uint8_t msg[40];
-    int rc = 0;
-
-    if (atecc508a_wakeup(fd, addr) < 0)
+    if (atecc508a_begin(dev, op_typical_us(dev, &op_nonce) + op_typical_us(dev, &op_sign)) < 0)
         return -1;
 
-    msg[0] = 3;    // "word address"
-    msg[1] = 39;   // Length
-    msg[2] = op_nonce.opcode;
-    msg[3] = 0x3;  // Mode - Write NumIn to TempKey
-    msg[4] = 0;    // Zero LSB
-    msg[5] = 0;    // Zero MSB
-    memcpy(&msg[6], data, 32); // NumIn
+    int rc = sign_with_retries(dev, slot, data, signature);
+
+    atecc508a_end(dev);
+    return rc;
+}
 
-    uint8_t response[64 + 3];
-    if (atecc508a_request(fd, addr, &op_nonce, msg, response) < 0) {
-        rc = -1;
-        goto cleanup;
+/**
+ * Sign several 32-byte buffers in one wake cycle
+ *
+ * This is like calling atecc508a_sign() on each buffer except that the chip
+ * is only woken up before the first one and put to sleep (or left awake)
+ * after the last one. A failure doesn't stop the rest from being signed.
+ *
+ * @param dev the device opened by atecc508a_open
+ * @param slot which slot
+ * @param count how many buffers to sign
+ * @param data pointers to the 32-byte input buffers
+ * @param signatures pointers to the 64-byte signature buffers
+ * @param results set to 0 or -1 for each buffer
+ * @param done called as soon as each result is in or NULL
+ * @param context passed to done
+ * @return the number of buffers that couldn't be signed
+ */
+int atecc508a_sign_group(struct atecc508a *dev, uint8_t slot, size_t count,
+                         const uint8_t *const *data, uint8_t *const *signatures, int *results,
+                         void (*done)(void *context, size_t index), void *context)
+{
+    int budget_us = op_typical_us(dev, &op_nonce) + op_typical_us(dev, &op_sign);
+    int failures = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        int rc = i == 0 ? atecc508a_begin(dev, budget_us) : atecc508a_continue(dev, budget_us);
+        if (rc == 0)
+            rc = sign_with_retries(dev, slot, data[i], signatures[i]);
+
+        results[i] = rc;
+        if (rc < 0)
+            failures++;
+        if (done)
+            done(context, i);
     }
 
-    if (response[1] != 0) {
-        INFO("Unexpected Nonce response %02x %02x %02x %02x", response[0], response[1], response[2], response[3]);
-        rc = -1;
-        goto cleanup;
+    atecc508a_end(dev);
+    return failures;
+}
+
+/**
+ * Set up a signature that's run without blocking
+ *
+ * This is atecc508a_sign() turned inside out for callers that drive many
+ * devices from one thread. Nothing is sent until the first call to
+ * atecc508a_sign_step(). Keep calling it at the times that it asks for
+ * until it returns 0 or -1. The device can't be used for anything else in
+ * the meantime.
+ *
+ * @param dev the device opened by atecc508a_open
+ * @param op the state of the signature
+ * @param slot which slot
+ * @param data a 32-byte input buffer to sign. It's copied.
+ * @param signature a 64-byte buffer for the signature
+ */
+void atecc508a_sign_start(struct atecc508a *dev, struct atecc508a_sign_op *op, uint8_t slot,
+                          const uint8_t *data, uint8_t *signature)
+{
+    (void) dev;
+    memset(op, 0, sizeof(*op));
+    op->state = ATECC508A_SIGN_BEGIN;
+    op->slot = slot;
+    memcpy(op->data, data, sizeof(op->data));
+    op->signature = signature;
+}
+
+// Come back in wait_us
+static int sign_wait(struct atecc508a *dev, struct atecc508a_sign_op *op, int wait_us)
+{
+    op->resume_us = dev_now(dev) + (uint64_t) wait_us;
+    return wait_us > 0 ? wait_us : 1;
+}
+
+static int sign_fail(struct atecc508a *dev, struct atecc508a_sign_op *op)
+{
+    ERROR("Sign failed with status 0x%02x", dev->last_status);
+    atecc508a_end(dev);
+    op->state = ATECC508A_SIGN_FAILED;
+    return -1;
+}
+
+// Start over from a fresh wakeup. It's the one recovery that works for
+// anything, so there's no need to keep the blocking path's finer-grained ones
+// here.
+static int sign_retry(struct atecc508a *dev, struct atecc508a_sign_op *op)
+{
+    switch (dev->last_status) {
+    case ATECC508A_STATUS_MISCOMPARE:
+    case ATECC508A_STATUS_PARSE_ERROR:
+    case ATECC508A_STATUS_SELFTEST_ERROR:
+        // Trying again won't help
+        return sign_fail(dev, op);
+
+    default:
+        break;
     }
 
-    // Sign the value in TempKey
-    msg[0] = 3;     // "word address"
-    msg[1] = 7;     // Length
-    msg[2] = op_sign.opcode;
-    msg[3] = 0x80;  // Mode - the data to be signed is in TempKey
-    msg[4] = slot;  // KeyID LSB
-    msg[5] = 0;     // KeyID MSB
+    if (++op->attempts >= ATECC508A_MAX_ATTEMPTS)
+        return sign_fail(dev, op);
+
+    INFO("Retrying opcode 0x%02x after status 0x%02x", op->op ? op->op->opcode : 0, dev->last_status);
+    send_wake(dev, ATECC508A_WORD_SLEEP);
+    op->state = ATECC508A_SIGN_SEND_NONCE;
+    return sign_wait(dev, op, ATECC508A_WAKE_DELAY_US);
+}
 
-    if (atecc508a_request(fd, addr, &op_sign, msg, response) < 0) {
-        rc = -1;
-        goto cleanup;
+// The command went out, so wait for it to finish
+static int sign_sent(struct atecc508a *dev, struct atecc508a_sign_op *op)
+{
+    int first_poll_us;
+    poll_plan(dev, op->op, &first_poll_us, &op->poll_interval_us, &op->max_us);
+    op->start_us = dev_now(dev);
+    op->state = ATECC508A_SIGN_POLL;
+    return sign_wait(dev, op, first_poll_us);
+}
+
+// atecc508a_wakeup() a step at a time
+static int sign_wake(struct atecc508a *dev, struct atecc508a_sign_op *op)
+{
+    dev->transport->wake(dev);
+    op->state = ATECC508A_SIGN_CHECK_WAKE;
+    return sign_wait(dev, op, ATECC508A_WAKE_DELAY_US);
+}
+
+static int sign_check_wake(struct atecc508a *dev, struct atecc508a_sign_op *op)
+{
+    uint8_t buffer[4];
+    if (dev->transport->read(dev, dev->addr, buffer, sizeof(buffer)) == 0 &&
+        memcmp(buffer, wake_signature, sizeof(buffer)) == 0) {
+        dev->awake = 1;
+        dev->wake_time_us = dev_now(dev);
+        if (dev->transport->write(dev, dev->addr, dev->command, op->command_len) < 0) {
+            dev->last_status = ATECC508A_STATUS_NO_RESPONSE;
+            return sign_retry(dev, op);
+        }
+        return sign_sent(dev, op);
     }
 
-    // Copy the data (bytes after the count field)
-    memcpy(signature, &response[1], 64);
+    // Maybe it's already awake due to an error, so put it to sleep and try
+    // again. If it's stuck in a command, wait out the watchdog first.
+    atecc508a_sleep(dev);
+    op->state = ATECC508A_SIGN_WAKE;
+    if (++op->wakeups < 2)
+        return sign_wait(dev, op, ATECC508A_WAKE_DELAY_US);
+
+    uint64_t watchdog_expiry = dev->wake_time_us + (uint64_t) dev->watchdog_max_us;
+    uint64_t now = dev_now(dev);
+    if (op->wakeups == 2 && dev->wake_time_us != 0 && now + ATECC508A_WAKE_DELAY_US < watchdog_expiry) {
+        INFO("Waiting %d us for the watchdog", (int) (watchdog_expiry - now));
+        return sign_wait(dev, op, (int) (watchdog_expiry - now));
+    }
 
-cleanup:
-    atecc508a_sleep(fd, addr);
-    return rc;
+    ERROR("No ATECC508A or it's in a really bad state");
+    dev->last_status = ATECC508A_STATUS_NO_RESPONSE;
+    return sign_retry(dev, op);
+}
+
+static int sign_send(struct atecc508a *dev, struct atecc508a_sign_op *op,
+                     const struct atecc508a_opcode_info *info, uint16_t len)
+{
+    op->op = info;
+    op->command_len = len;
+    op->naks = 0;
+
+    int rc = write_command(dev, len);
+    if (rc > 0) {
+        // The chip didn't wake up, so go through the full wakeup
+        op->wakeups = 0;
+        return sign_wake(dev, op);
+    }
+    if (rc < 0) {
+        dev->last_status = ATECC508A_STATUS_NO_RESPONSE;
+        return sign_retry(dev, op);
+    }
+    return sign_sent(dev, op);
+}
+
+static int sign_send_nonce(struct atecc508a *dev, struct atecc508a_sign_op *op)
+{
+    // Mode 0x03 writes the 32 bytes of data to TempKey
+    uint16_t len = (uint16_t) atecc508a_encode_command(dev->command, op_nonce.opcode, 0x03, 0, op->data, 32);
+    return sign_send(dev, op, &op_nonce, len);
+}
+
+// Read the first block of the config zone like identify_nowake()
+static int sign_identify(struct atecc508a *dev, struct atecc508a_sign_op *op)
+{
+    uint16_t len = (uint16_t) atecc508a_encode_command(dev->command, op_read32.opcode, 0x80 | ATECC508A_ZONE_CONFIG, 0, NULL, 0);
+    return sign_send(dev, op, &op_read32, len);
+}
+
+static int sign_poll(struct atecc508a *dev, struct atecc508a_sign_op *op)
+{
+    if (dev->transport->read(dev, dev->addr, dev->response, 1) < 0) {
+        op->naks++;
+        if (dev_now(dev) - op->start_us > (uint64_t) op->max_us) {
+            dev->last_status = ATECC508A_STATUS_NO_RESPONSE;
+            return sign_retry(dev, op);
+        }
+        return sign_wait(dev, op, op->poll_interval_us);
+    }
+
+    struct atecc508a_timing *t = timing_for(dev, op->op->opcode);
+    if (t)
+        timing_update(t, (int) (dev_now(dev) - op->start_us), op->naks, op->poll_interval_us);
+
+    if (receive_rest(dev, op->op) != ATECC508A_RECOVER_NONE)
+        return sign_retry(dev, op);
+
+    const uint8_t *response = dev->response;
+    if (op->op == &op_read32) {
+#ifndef ATECC508A_FIXED_VARIANT
+        identify_from_config(dev, &response[1]);
+#endif
+        return sign_send_nonce(dev, op);
+    }
+
+    if (op->op == &op_nonce) {
+        if (response[1] != 0) {
+            INFO("Unexpected Nonce response %02x %02x %02x %02x", response[0], response[1], response[2], response[3]);
+            return sign_retry(dev, op);
+        }
+
+        // Sign the value in TempKey. Mode 0x80 says that the data is in TempKey.
+        uint16_t len = (uint16_t) atecc508a_encode_command(dev->command, op_sign.opcode, 0x80, op->slot, NULL, 0);
+        return sign_send(dev, op, &op_sign, len);
+    }
+
+    memcpy(op->signature, &response[1], 64);
+    atecc508a_end(dev);
+    op->state = ATECC508A_SIGN_DONE;
+    return 0;
+}
+
+static int sign_begin(struct atecc508a *dev, struct atecc508a_sign_op *op)
+{
+    // Waiting on another process would hold up everything else that's
+    // running a step at a time, so check back instead.
+    int rc = arbitrate(dev, 0);
+    if (rc == ATECC508A_ARBITER_WAIT)
+        return sign_wait(dev, op, ATECC508A_ARBITER_POLL_US);
+    if (rc < 0) {
+        op->state = ATECC508A_SIGN_FAILED;
+        return -1;
+    }
+
+    // Identify the chip the first time it's used like atecc508a_begin() does
+    op->state = dev->variant == ATECC508A_VARIANT_UNIDENTIFIED ? ATECC508A_SIGN_IDENTIFY : ATECC508A_SIGN_SEND_NONCE;
+
+    int budget_us = op_typical_us(dev, &op_nonce) + op_typical_us(dev, &op_sign);
+    int word_address = begin_word_address(dev, budget_us);
+    if (word_address >= 0) {
+        send_wake(dev, (uint8_t) word_address);
+        return sign_wait(dev, op, ATECC508A_WAKE_DELAY_US);
+    }
+
+    return op->state == ATECC508A_SIGN_IDENTIFY ? sign_identify(dev, op) : sign_send_nonce(dev, op);
+}
+
+/**
+ * Run the next step of a signature
+ *
+ * Each step does a little I/O without waiting for the chip. Where
+ * atecc508a_sign() would sleep, this returns how long to wait instead.
+ *
+ * @param dev the device opened by atecc508a_open
+ * @param op the state from atecc508a_sign_start()
+ * @return microseconds to wait before the next call, 0 when the signature is done, or -1 on failure
+ */
+int atecc508a_sign_step(struct atecc508a *dev, struct atecc508a_sign_op *op)
+{
+    // A transport with its own clock (e.g., a simulator's virtual clock)
+    // doesn't see the time that the caller waited, so catch it up.
+    uint64_t now = dev_now(dev);
+    if (op->resume_us > now)
+        dev_sleep(dev, (int) (op->resume_us - now));
+
+    switch (op->state) {
+    case ATECC508A_SIGN_BEGIN:
+        return sign_begin(dev, op);
+
+    case ATECC508A_SIGN_IDENTIFY:
+        return sign_identify(dev, op);
+
+    case ATECC508A_SIGN_SEND_NONCE:
+        return sign_send_nonce(dev, op);
+
+    case ATECC508A_SIGN_WAKE:
+        return sign_wake(dev, op);
+
+    case ATECC508A_SIGN_CHECK_WAKE:
+        return sign_check_wake(dev, op);
+
+    case ATECC508A_SIGN_POLL:
+        return sign_poll(dev, op);
+
+    case ATECC508A_SIGN_DONE:
+        return 0;
+
+    case ATECC508A_SIGN_FAILED:
+    default:
+        return -1;
+    }
 }
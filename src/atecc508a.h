@@ -33,19 +33,231 @@
 #ifndef ATECC508A_H
 #define ATECC508A_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define ATECC508A_ZONE_CONFIG 0
 #define ATECC508A_ZONE_OTP    1
 #define ATECC508A_ZONE_DATA   2
 
-int atecc508a_open(const char *filename);
-void atecc508a_close(int fd);
-int atecc508a_wakeup(int fd, uint8_t addr);
-int atecc508a_sleep(int fd, uint8_t addr);
-int atecc508a_read_serial(int fd, uint8_t addr, uint8_t *serial_number);
-int atecc508a_derive_public_key(int fd, uint8_t addr, uint8_t slot, uint8_t *key);
-int atecc508a_sign(int fd, uint8_t addr, uint8_t slot, const uint8_t *data, uint8_t *signature);
-int atecc508a_read_zone_nowake(int fd, uint8_t addr, uint8_t zone, uint16_t slot, uint8_t block, uint8_t offset, uint8_t *data, uint8_t len);
+// Word addresses (ATECC508A 6.2)
+#define ATECC508A_WORD_RESET    0x00
+#define ATECC508A_WORD_SLEEP    0x01
+#define ATECC508A_WORD_IDLE     0x02
+#define ATECC508A_WORD_COMMAND  0x03
+
+// Command frames are the word address, count, opcode, param1, param2 (2
+// bytes), data and CRC (2 bytes). Responses are the count, data and CRC.
+#define ATECC508A_MAX_COMMAND_DATA 32
+#define ATECC508A_MAX_COMMAND      (ATECC508A_MAX_COMMAND_DATA + 8)
+#define ATECC508A_MAX_RESPONSE     (64 + 3)
+
+// Status codes from 4-byte responses. See ATECC508A datasheet Table 9-3.
+#define ATECC508A_STATUS_SUCCESS           0x00
+#define ATECC508A_STATUS_MISCOMPARE        0x01
+#define ATECC508A_STATUS_PARSE_ERROR       0x03
+#define ATECC508A_STATUS_ECC_FAULT         0x05
+#define ATECC508A_STATUS_SELFTEST_ERROR    0x07
+#define ATECC508A_STATUS_HEALTH_TEST_ERROR 0x08
+#define ATECC508A_STATUS_EXECUTION_ERROR   0x0f
+#define ATECC508A_STATUS_AFTER_WAKE        0x11
+#define ATECC508A_STATUS_WATCHDOG          0xee
+#define ATECC508A_STATUS_CRC_ERROR         0xff
+
+// Not from the chip. These record why a command failed on the host side.
+#define ATECC508A_STATUS_NO_RESPONSE       0xf0
+#define ATECC508A_STATUS_BAD_RESPONSE      0xf1
+
+enum atecc508a_recovery {
+    ATECC508A_RECOVER_NONE,
+    ATECC508A_RECOVER_REREAD,
+    ATECC508A_RECOVER_RESEND,
+    ATECC508A_RECOVER_REIDLE,
+    ATECC508A_RECOVER_REWAKE,
+    ATECC508A_RECOVER_FAIL
+};
+
+// Default time to leave the chip awake after a command. Signatures tend to
+// come in bursts, and this is long enough for most of a burst to share one
+// wakeup. See atecc508a_set_keep_awake().
+#define ATECC508A_KEEP_AWAKE_DEFAULT_US 50000
+
+// Completion times are learned per opcode. See atecc508a_get_timing().
+#define ATECC508A_TIMING_OPCODES 8
+#define ATECC508A_TIMING_SAMPLES 32
+
+struct atecc508a_timing {
+    uint8_t opcode;        // 0 if unused
+    int typical_us;        // Typical time for the chip variant or 0 if not known
+    int max_us;            // Max time for the chip variant or 0 if not known
+    uint32_t count;        // Number of completed commands
+    uint32_t naks;         // Number of reads that were NAK'd since the command wasn't done
+    int first_poll_us;     // When to try the first read (learned)
+    int poll_interval_us;  // How often to retry the read after that (learned)
+    int samples[ATECC508A_TIMING_SAMPLES]; // Ring buffer of completion times
+};
+
+struct atecc508a;
+
+enum atecc508a_variant {
+    ATECC508A_VARIANT_UNIDENTIFIED = 0, // Not checked yet
+    ATECC508A_VARIANT_UNKNOWN,          // Checked, but not recognized
+    ATECC508A_VARIANT_508A,
+    ATECC508A_VARIANT_608A,
+    ATECC508A_VARIANT_608B
+};
+
+// One message in a multi-message transfer. Wake messages send the wake token
+// and ignore addr, len and buf.
+#define ATECC508A_MSG_READ  0x01
+#define ATECC508A_MSG_WAKE  0x02
+#define ATECC508A_MAX_MSGS  4
+
+struct atecc508a_msg {
+    uint8_t addr;
+    uint8_t flags;
+    uint16_t len;
+    uint8_t *buf;
+};
+
+// Transports move bytes between the driver and the chip. The i2c transport is
+// the default. Others are for testing and benchmarking without hardware.
+struct atecc508a_transport {
+    const char *name;
+    int (*open)(struct atecc508a *dev, const char *filename);
+    void (*close)(struct atecc508a *dev);
+    int (*write)(struct atecc508a *dev, uint8_t addr, const uint8_t *data, uint16_t len);
+    int (*read)(struct atecc508a *dev, uint8_t addr, uint8_t *data, uint16_t len);
+    int (*wake)(struct atecc508a *dev);
+
+    // Optional. Runs the messages back-to-back in one bus transaction and
+    // stops at the first one that fails. Messages are sent one at a time
+    // if this is NULL.
+    int (*transfer)(struct atecc508a *dev, const struct atecc508a_msg *msgs, int count);
+
+    // Optional. The real clock is used if these are NULL.
+    uint64_t (*now_us)(struct atecc508a *dev);
+    void (*sleep_us)(struct atecc508a *dev, int microseconds);
+};
+
+extern const struct atecc508a_transport atecc508a_i2c_transport;
+#ifdef NKCS11_SIMULATOR
+extern const struct atecc508a_transport atecc508a_sim_transport;
+#endif
+
+// Keeps other processes off the chip from atecc508a_begin() to
+// atecc508a_end() so that their commands don't land in the middle of ours.
+#define ATECC508A_ARBITER_WAIT 2
+
+struct atecc508a_arbiter {
+    // Wait for a turn on the chip. If blocking is 0, return
+    // ATECC508A_ARBITER_WAIT instead of waiting. Otherwise, return 1 if
+    // someone else used the chip since this device's last turn, 0 if not or
+    // -1 on error.
+    int (*acquire)(void *context, int blocking);
+    void (*release)(void *context);
+};
+
+struct atecc508a {
+    const struct atecc508a_transport *transport;
+    void *transport_data;
+    int fd;
+    uint8_t addr;
+
+    struct atecc508a_timing timing[ATECC508A_TIMING_OPCODES];
+
+    // Wake state tracking so that back-to-back commands can share one wakeup
+    int awake;
+    uint64_t wake_time_us;
+    uint64_t last_use_us;
+    int keep_awake_us;
+    uint64_t pending_wake_us; // Wake token sent, but not confirmed yet
+    int hold_awake;           // Keep awake regardless of keep_awake_us while > 0
+
+    // Chip identification from the config zone. This determines the
+    // execution times and watchdog duration.
+    enum atecc508a_variant variant;
+    uint8_t chip_mode;
+    int watchdog_us;
+    int watchdog_max_us;
+
+    // Status of the last command for error reporting and recovery
+    uint8_t last_status;
+
+    // Reused for every command. Responses are left in place so callers can
+    // copy the data straight out of them.
+    uint8_t command[ATECC508A_MAX_COMMAND];
+    uint8_t response[ATECC508A_MAX_RESPONSE];
+
+    // See atecc508a_set_arbiter()
+    const struct atecc508a_arbiter *arbiter;
+    void *arbiter_context;
+    int arbitrated; // Has a turn now
+};
+
+struct atecc508a_opcode_info;
+
+// A signature that's run a step at a time. See atecc508a_sign_start().
+enum atecc508a_sign_state {
+    ATECC508A_SIGN_BEGIN,
+    ATECC508A_SIGN_IDENTIFY,
+    ATECC508A_SIGN_SEND_NONCE,
+    ATECC508A_SIGN_WAKE,
+    ATECC508A_SIGN_CHECK_WAKE,
+    ATECC508A_SIGN_POLL,
+    ATECC508A_SIGN_DONE,
+    ATECC508A_SIGN_FAILED
+};
+
+struct atecc508a_sign_op {
+    enum atecc508a_sign_state state;
+    uint8_t slot;
+    uint8_t data[32];
+    uint8_t *signature;
+    int attempts;
+
+    // The command that's running
+    const struct atecc508a_opcode_info *op;
+    uint16_t command_len;
+    int wakeups; // Failed wakeups before it
+    uint64_t start_us;
+    uint64_t resume_us; // When the next step is due
+    int max_us;
+    int poll_interval_us;
+    int naks;
+};
+
+uint16_t atecc508a_crc16(const uint8_t *data, size_t length);
+void atecc508a_append_crc(uint8_t *packet, size_t count);
+int atecc508a_crc_ok(const uint8_t *packet, size_t count);
+size_t atecc508a_encode_command(uint8_t *frame, uint8_t opcode, uint8_t param1, uint16_t param2,
+                                const uint8_t *data, size_t data_len);
+
+const struct atecc508a_transport *atecc508a_find_transport(const char *name);
+int atecc508a_open(struct atecc508a *dev, const struct atecc508a_transport *transport, const char *filename, uint8_t addr);
+void atecc508a_close(struct atecc508a *dev);
+void atecc508a_set_keep_awake(struct atecc508a *dev, int keep_awake_us);
+void atecc508a_set_arbiter(struct atecc508a *dev, const struct atecc508a_arbiter *arbiter, void *context);
+void atecc508a_hold_awake(struct atecc508a *dev);
+void atecc508a_release_awake(struct atecc508a *dev);
+int atecc508a_sleep_if_idle(struct atecc508a *dev);
+int atecc508a_identify(struct atecc508a *dev);
+void atecc508a_set_identity(struct atecc508a *dev, enum atecc508a_variant variant, uint8_t chip_mode);
+const char *atecc508a_variant_name(enum atecc508a_variant variant);
+int atecc508a_get_timing(const struct atecc508a *dev, uint8_t opcode, struct atecc508a_timing *timing);
+void atecc508a_set_timing(struct atecc508a *dev, const struct atecc508a_timing *timing);
+int atecc508a_wakeup(struct atecc508a *dev);
+int atecc508a_sleep(struct atecc508a *dev);
+int atecc508a_idle(struct atecc508a *dev);
+int atecc508a_read_serial(struct atecc508a *dev, uint8_t *serial_number);
+int atecc508a_derive_public_key(struct atecc508a *dev, uint8_t slot, uint8_t *key);
+int atecc508a_sign(struct atecc508a *dev, uint8_t slot, const uint8_t *data, uint8_t *signature);
+int atecc508a_sign_group(struct atecc508a *dev, uint8_t slot, size_t count,
+                         const uint8_t *const *data, uint8_t *const *signatures, int *results,
+                         void (*done)(void *context, size_t index), void *context);
+void atecc508a_sign_start(struct atecc508a *dev, struct atecc508a_sign_op *op, uint8_t slot,
+                          const uint8_t *data, uint8_t *signature);
+int atecc508a_sign_step(struct atecc508a *dev, struct atecc508a_sign_op *op);
+int atecc508a_read_zone_nowake(struct atecc508a *dev, uint8_t zone, uint16_t slot, uint8_t block, uint8_t offset, uint8_t *data, uint8_t len);
 
 #endif // ATECC508A_H
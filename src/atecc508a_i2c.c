@@ -0,0 +1,136 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "atecc508a.h"
+
+// Transport for talking to the ATECC through Linux's i2c-dev interface
+
+static int i2c_open(struct atecc508a *dev, const char *filename)
+{
+    dev->fd = open(filename, O_RDWR);
+    return dev->fd < 0 ? -1 : 0;
+}
+
+static void i2c_close(struct atecc508a *dev)
+{
+    close(dev->fd);
+    dev->fd = -1;
+}
+
+static int i2c_read(struct atecc508a *dev, uint8_t addr, uint8_t *to_read, uint16_t to_read_len)
+{
+    struct i2c_rdwr_ioctl_data data;
+    struct i2c_msg msg;
+
+    msg.addr = addr;
+    msg.flags = I2C_M_RD;
+    msg.len = to_read_len;
+    msg.buf = to_read;
+    data.msgs = &msg;
+    data.nmsgs = 1;
+
+    return ioctl(dev->fd, I2C_RDWR, &data);
+}
+
+static int i2c_write(struct atecc508a *dev, uint8_t addr, const uint8_t *to_write, uint16_t to_write_len)
+{
+    struct i2c_rdwr_ioctl_data data;
+    struct i2c_msg msg;
+
+    msg.addr = addr;
+    msg.flags = 0;
+    msg.len = to_write_len;
+    msg.buf = (uint8_t *) to_write;
+    data.msgs = &msg;
+    data.nmsgs = 1;
+
+    return ioctl(dev->fd, I2C_RDWR, &data);
+}
+
+static int i2c_wake(struct atecc508a *dev)
+{
+    // Write to address 0 to pull SDA down for the wakeup interval (60 uS).
+    // Since only 8-bits get through, the I2C speed needs to be < 133 KHz for
+    // this to work. Nothing will ACK this, so ignore the error.
+    uint8_t zero = 0;
+    i2c_write(dev, 0, &zero, 1);
+    return 0;
+}
+
+static int i2c_transfer(struct atecc508a *dev, const struct atecc508a_msg *msgs, int count)
+{
+    struct i2c_rdwr_ioctl_data data;
+    struct i2c_msg i2c_msgs[ATECC508A_MAX_MSGS];
+    uint8_t zero = 0;
+
+    if (count > ATECC508A_MAX_MSGS)
+        return -1;
+
+    // i2c-dev runs all of the messages in one ioctl with repeated starts
+    // between them and aborts on the first NAK.
+    for (int i = 0; i < count; i++) {
+        if (msgs[i].flags & ATECC508A_MSG_WAKE) {
+            i2c_msgs[i].addr = 0;
+            i2c_msgs[i].flags = 0;
+            i2c_msgs[i].len = 1;
+            i2c_msgs[i].buf = &zero;
+        } else {
+            i2c_msgs[i].addr = msgs[i].addr;
+            i2c_msgs[i].flags = (msgs[i].flags & ATECC508A_MSG_READ) ? I2C_M_RD : 0;
+            i2c_msgs[i].len = msgs[i].len;
+            i2c_msgs[i].buf = msgs[i].buf;
+        }
+    }
+    data.msgs = i2c_msgs;
+    data.nmsgs = count;
+
+    return ioctl(dev->fd, I2C_RDWR, &data) < 0 ? -1 : 0;
+}
+
+const struct atecc508a_transport atecc508a_i2c_transport = {
+    .name = "i2c",
+    .open = i2c_open,
+    .close = i2c_close,
+    .write = i2c_write,
+    .read = i2c_read,
+    .wake = i2c_wake,
+    .transfer = i2c_transfer
+};
@@ -0,0 +1,728 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// Simulated ATECC508A/608A for testing and benchmarking without hardware
+//
+// This speaks the same framing as the real chip (word address, count,
+// opcode, parameters, CRC) and implements enough of Read, GenKey, Nonce and
+// Sign to run the PKCS #11 module. Keys are real P-256 keys derived from the
+// bus and address so that every process sees the same simulated chips.
+//
+// Environment variables:
+//
+// NERVES_KEY_SIM_BUSES   number of simulated I2C buses (default 1)
+// NERVES_KEY_SIM_CHIP    508a, 608a or 608b (default 608a)
+// NERVES_KEY_SIM_CHIP_MODE  ChipMode config byte (default 0). The 608's clock
+//                        divider and the long watchdog bit are simulated.
+// NERVES_KEY_SIM_LOT     mixed into each chip's serial number and key
+//                        (default 0). Changing it is like swapping the chips.
+// NERVES_KEY_SIM_TIMING  typical, max, fixed:<us>, or random:<percent> (default typical)
+// NERVES_KEY_SIM_CLOCK   real or virtual (default real)
+// NERVES_KEY_SIM_REPORT  set to 1 to print transfer counts on close
+// NERVES_KEY_SIM_FAULTS  comma-separated list of <fault>=<probability> (see below)
+//
+// Faults are for exercising the error paths. Each one is injected at random
+// with the specified probability:
+//
+// nak     NAK a write or read
+// crc     corrupt the response's CRC
+// short   return a truncated response
+// status  return an execution error status instead of the result
+// stall   take much longer than the maximum execution time
+// reset   lose power (go to sleep) in the middle of a command
+
+#ifdef NKCS11_SIMULATOR
+
+#define OPENSSL_API_COMPAT 0x10100000L
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+#include <openssl/sha.h>
+
+#include "atecc508a.h"
+#include "log.h"
+
+#define SIM_WAKE_DELAY_US 800
+#define SIM_WATCHDOG_US 1300000
+#define SIM_LONG_WATCHDOG_US 10000000
+
+enum sim_state {
+    SIM_SLEEP,
+    SIM_IDLE,
+    SIM_ACTIVE
+};
+
+enum sim_timing {
+    SIM_TIMING_TYPICAL,
+    SIM_TIMING_MAX,
+    SIM_TIMING_FIXED,
+    SIM_TIMING_RANDOM
+};
+
+// Execution times in microseconds
+struct sim_times {
+    int read_us;
+    int nonce_us;
+    int genkey_us;
+    int sign_us;
+};
+
+// The typical times are for the fastest clock divider (M0). The max times are
+// the datasheet's for each clock divider (M0, M1 and M2) and the typical
+// times are scaled by the same amount. Only the 608 has a clock divider.
+struct sim_chip_info {
+    const char *name;
+    uint8_t revision[4];
+    struct sim_times typical;
+    struct sim_times max[3];
+};
+
+static const struct sim_chip_info sim_chips[] = {
+    {
+        "508a", {0x00, 0x00, 0x50, 0x00}, {400, 150, 52000, 48000},
+        {{1000, 7000, 115000, 50000}, {1000, 7000, 115000, 50000}, {1000, 7000, 115000, 50000}}
+    },
+    {
+        "608a", {0x00, 0x00, 0x60, 0x02}, {400, 150, 45000, 41000},
+        {{5000, 20000, 115000, 115000}, {5000, 20000, 215000, 220000}, {5000, 29000, 653000, 665000}}
+    },
+    {
+        "608b", {0x00, 0x00, 0x60, 0x03}, {400, 150, 36000, 32000},
+        {{5000, 20000, 115000, 115000}, {5000, 20000, 215000, 220000}, {5000, 29000, 653000, 665000}}
+    },
+    {NULL, {0}, {0, 0, 0, 0}, {{0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}}}
+};
+
+#define SIM_STALL_US 2000000
+
+enum sim_fault {
+    SIM_FAULT_NAK,
+    SIM_FAULT_CRC,
+    SIM_FAULT_SHORT,
+    SIM_FAULT_STATUS,
+    SIM_FAULT_STALL,
+    SIM_FAULT_RESET,
+    SIM_FAULT_COUNT
+};
+
+static const char *sim_fault_names[SIM_FAULT_COUNT] = {
+    "nak", "crc", "short", "status", "stall", "reset"
+};
+
+struct sim_stats {
+    unsigned long transfers;
+    unsigned long writes;
+    unsigned long reads;
+    unsigned long naks;
+    unsigned long wakes;
+    unsigned long commands;
+    unsigned long faults;
+    uint64_t awake_us; // Time spent out of sleep
+};
+
+struct sim_device {
+    const struct sim_chip_info *chip;
+    uint8_t config[128];
+    EC_KEY *key;
+
+    int clock_divider; // 0, 1 or 2 for M0, M1 or M2
+    int watchdog_us;
+
+    enum sim_state state;
+    uint64_t wake_time_us;
+    uint64_t awake_since_us; // Last wakeup from sleep
+    uint64_t busy_until_us;
+
+    uint8_t tempkey[32];
+    int tempkey_valid;
+
+    uint8_t out[70];
+    size_t out_len;
+    size_t out_pos;
+
+    enum sim_timing timing;
+    int timing_param;
+    unsigned int seed;
+
+    int virtual_clock;
+    uint64_t now_us;
+    uint64_t open_time_us;
+
+    double fault_rate[SIM_FAULT_COUNT];
+    uint64_t reset_at_us;
+
+    int report;
+    struct sim_stats stats;
+};
+
+static int sim_env_int(const char *name, int default_value)
+{
+    const char *value = getenv(name);
+    return value ? (int) strtol(value, NULL, 0) : default_value;
+}
+
+static uint64_t real_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static uint64_t sim_now(struct atecc508a *dev)
+{
+    struct sim_device *sim = dev->transport_data;
+    return sim->virtual_clock ? sim->now_us : real_now_us();
+}
+
+static void sim_sleep(struct atecc508a *dev, int microseconds)
+{
+    struct sim_device *sim = dev->transport_data;
+    if (sim->virtual_clock) {
+        sim->now_us += (uint64_t) microseconds;
+    } else {
+        struct timespec ts;
+        ts.tv_sec = microseconds / 1000000;
+        ts.tv_nsec = (microseconds % 1000000) * 1000;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+    }
+}
+
+static int sim_parse_bus(const char *filename)
+{
+    const char *prefix = "/dev/i2c-";
+    size_t prefix_len = strlen(prefix);
+    if (strncmp(filename, prefix, prefix_len) != 0)
+        return -1;
+
+    char *end;
+    long bus = strtol(filename + prefix_len, &end, 10);
+    if (*end != '\0' || bus < 0)
+        return -1;
+    return (int) bus;
+}
+
+static EC_KEY *sim_make_key(const uint8_t *seed, size_t seed_len)
+{
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(seed, seed_len, digest);
+
+    EC_KEY *key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    const EC_GROUP *group = EC_KEY_get0_group(key);
+    BIGNUM *priv = BN_bin2bn(digest, sizeof(digest), NULL);
+    BN_CTX *ctx = BN_CTX_new();
+    EC_POINT *pub = EC_POINT_new(group);
+
+    // Good enough for a simulator. The chance of hitting 0 or >= n is negligible.
+    EC_POINT_mul(group, pub, priv, NULL, NULL, ctx);
+    EC_KEY_set_private_key(key, priv);
+    EC_KEY_set_public_key(key, pub);
+
+    EC_POINT_free(pub);
+    BN_CTX_free(ctx);
+    BN_free(priv);
+    return key;
+}
+
+static void sim_init_config(struct sim_device *sim, const uint8_t *id, uint8_t addr)
+{
+    // See the ATECC508A datasheet, Table 2-4, for the layout
+    memset(sim->config, 0, sizeof(sim->config));
+    sim->config[0] = 0x01;
+    sim->config[1] = 0x23;
+    sim->config[2] = id[0];
+    sim->config[3] = id[1];
+    memcpy(&sim->config[4], sim->chip->revision, 4);
+    memcpy(&sim->config[8], &id[2], 4);
+    sim->config[12] = 0xee;
+    sim->config[14] = 0x01; // I2C_Enable
+    sim->config[16] = (uint8_t) (addr << 1);
+    sim->config[19] = (uint8_t) sim_env_int("NERVES_KEY_SIM_CHIP_MODE", 0); // ChipMode
+
+    // Only the 608 has a clock divider. It's bits 3-7 of ChipMode and the
+    // reserved values are treated like the slowest one.
+    sim->clock_divider = 0;
+    if (sim->chip->revision[2] == 0x60) {
+        switch (sim->config[19] >> 3) {
+        case 0x00:
+            break;
+        case 0x05:
+            sim->clock_divider = 1;
+            break;
+        default:
+            sim->clock_divider = 2;
+            break;
+        }
+    }
+    sim->watchdog_us = (sim->config[19] & 0x04) ? SIM_LONG_WATCHDOG_US : SIM_WATCHDOG_US;
+}
+
+static void sim_parse_faults(struct sim_device *sim, const char *faults)
+{
+    char *copy = strdup(faults);
+    char *saveptr;
+    for (char *item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        char *equals = strchr(item, '=');
+        if (equals == NULL)
+            continue;
+
+        *equals = '\0';
+        for (int i = 0; i < SIM_FAULT_COUNT; i++) {
+            if (strcmp(item, sim_fault_names[i]) == 0)
+                sim->fault_rate[i] = atof(equals + 1);
+        }
+    }
+    free(copy);
+}
+
+static int sim_fault(struct sim_device *sim, enum sim_fault fault)
+{
+    if (sim->fault_rate[fault] <= 0.0 ||
+        rand_r(&sim->seed) >= sim->fault_rate[fault] * ((double) RAND_MAX + 1.0))
+        return 0;
+
+    sim->stats.faults++;
+    return 1;
+}
+
+static int sim_open(struct atecc508a *dev, const char *filename)
+{
+    int bus = sim_parse_bus(filename);
+    if (bus < 0 || bus >= sim_env_int("NERVES_KEY_SIM_BUSES", 1))
+        return -1;
+
+    struct sim_device *sim = calloc(1, sizeof(struct sim_device));
+    if (sim == NULL)
+        return -1;
+
+    const char *chip_name = getenv("NERVES_KEY_SIM_CHIP");
+    sim->chip = &sim_chips[1];
+    for (const struct sim_chip_info *c = sim_chips; chip_name && c->name; c++) {
+        if (strcmp(c->name, chip_name) == 0)
+            sim->chip = c;
+    }
+
+    const char *timing = getenv("NERVES_KEY_SIM_TIMING");
+    if (timing && strcmp(timing, "max") == 0) {
+        sim->timing = SIM_TIMING_MAX;
+    } else if (timing && strncmp(timing, "fixed:", 6) == 0) {
+        sim->timing = SIM_TIMING_FIXED;
+        sim->timing_param = atoi(timing + 6);
+    } else if (timing && strncmp(timing, "random:", 7) == 0) {
+        sim->timing = SIM_TIMING_RANDOM;
+        sim->timing_param = atoi(timing + 7);
+    } else {
+        sim->timing = SIM_TIMING_TYPICAL;
+    }
+
+    const char *clock = getenv("NERVES_KEY_SIM_CLOCK");
+    sim->virtual_clock = clock && strcmp(clock, "virtual") == 0;
+    sim->report = sim_env_int("NERVES_KEY_SIM_REPORT", 0);
+
+    const char *faults = getenv("NERVES_KEY_SIM_FAULTS");
+    if (faults)
+        sim_parse_faults(sim, faults);
+    sim->open_time_us = sim->virtual_clock ? 0 : real_now_us();
+
+    uint8_t seed[40];
+    int lot = sim_env_int("NERVES_KEY_SIM_LOT", 0);
+    int seed_len = lot ? snprintf((char *) seed, sizeof(seed), "nerves_key_sim:%d:%02x:%d", bus, dev->addr, lot)
+                       : snprintf((char *) seed, sizeof(seed), "nerves_key_sim:%d:%02x", bus, dev->addr);
+    uint8_t id[SHA256_DIGEST_LENGTH];
+    SHA256(seed, (size_t) seed_len, id);
+
+    sim->key = sim_make_key(seed, (size_t) seed_len);
+    sim->seed = (unsigned int) (id[0] | (id[1] << 8) | (id[2] << 16));
+    sim_init_config(sim, &id[4], dev->addr);
+
+    dev->transport_data = sim;
+    return 0;
+}
+
+static void sim_fall_asleep(struct sim_device *sim, uint64_t when)
+{
+    if (sim->state != SIM_SLEEP)
+        sim->stats.awake_us += when - sim->awake_since_us;
+    sim->state = SIM_SLEEP;
+    sim->tempkey_valid = 0;
+}
+
+static void sim_check_watchdog(struct sim_device *sim, uint64_t now)
+{
+    if (sim->state != SIM_ACTIVE)
+        return;
+
+    uint64_t fires_at = sim->wake_time_us + (uint64_t) sim->watchdog_us;
+    if (sim->reset_at_us && sim->reset_at_us < fires_at)
+        fires_at = sim->reset_at_us;
+    if (now >= fires_at) {
+        sim_fall_asleep(sim, fires_at);
+        sim->reset_at_us = 0;
+    }
+}
+
+static void sim_close(struct atecc508a *dev)
+{
+    struct sim_device *sim = dev->transport_data;
+    if (sim->report) {
+        uint64_t now = sim_now(dev);
+        sim_check_watchdog(sim, now);
+        sim_fall_asleep(sim, now);
+        fprintf(stderr, "%s: sim 0x%02x: %lu transfers, %lu writes, %lu reads, %lu NAKs, %lu wakes, %lu commands, %lu faults in %llu us (%llu us awake)\r\n",
+                PROGNAME, dev->addr, sim->stats.transfers, sim->stats.writes, sim->stats.reads, sim->stats.naks,
+                sim->stats.wakes, sim->stats.commands, sim->stats.faults,
+                (unsigned long long) (now - sim->open_time_us), (unsigned long long) sim->stats.awake_us);
+    }
+    EC_KEY_free(sim->key);
+    free(sim);
+    dev->transport_data = NULL;
+}
+
+static int sim_op_time(const struct sim_times *times, uint8_t opcode)
+{
+    switch (opcode) {
+    case 0x02:
+        return times->read_us;
+    case 0x16:
+        return times->nonce_us;
+    case 0x40:
+        return times->genkey_us;
+    case 0x41:
+    default:
+        return times->sign_us;
+    }
+}
+
+static int sim_exec_time(struct sim_device *sim, uint8_t opcode)
+{
+    int max_us = sim_op_time(&sim->chip->max[sim->clock_divider], opcode);
+    int typical_us = (int) ((int64_t) sim_op_time(&sim->chip->typical, opcode) * max_us /
+                           sim_op_time(&sim->chip->max[0], opcode));
+
+    switch (sim->timing) {
+    case SIM_TIMING_MAX:
+        return max_us;
+
+    case SIM_TIMING_FIXED:
+        return sim->timing_param;
+
+    case SIM_TIMING_RANDOM: {
+        // Normally distributed around the typical time using Box-Muller
+        double u1 = (rand_r(&sim->seed) + 1.0) / (RAND_MAX + 2.0);
+        double u2 = (rand_r(&sim->seed) + 1.0) / (RAND_MAX + 2.0);
+        double z = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+        int t = (int) (typical_us * (1.0 + z * sim->timing_param / 100.0));
+        return t > 0 ? t : 0;
+    }
+
+    case SIM_TIMING_TYPICAL:
+    default:
+        return typical_us;
+    }
+}
+
+static void sim_respond(struct sim_device *sim, const uint8_t *data, size_t len)
+{
+    sim->out[0] = (uint8_t) (len + 3);
+    memcpy(&sim->out[1], data, len);
+    atecc508a_append_crc(sim->out, len + 3);
+    sim->out_len = len + 3;
+    sim->out_pos = 0;
+
+    if (sim_fault(sim, SIM_FAULT_CRC))
+        sim->out[len + 1] ^= 0x5a;
+
+    if (len > 1 && sim_fault(sim, SIM_FAULT_SHORT)) {
+        sim->out[0] = (uint8_t) (len / 2 + 3);
+        sim->out_len = len / 2 + 3;
+    }
+}
+
+static void sim_respond_status(struct sim_device *sim, uint8_t status)
+{
+    sim_respond(sim, &status, 1);
+}
+
+static int sim_public_key(struct sim_device *sim, uint8_t *key)
+{
+    uint8_t point[65];
+    if (EC_POINT_point2oct(EC_KEY_get0_group(sim->key), EC_KEY_get0_public_key(sim->key),
+                           POINT_CONVERSION_UNCOMPRESSED, point, sizeof(point), NULL) != sizeof(point))
+        return -1;
+
+    memcpy(key, &point[1], 64);
+    return 0;
+}
+
+static int sim_sign(struct sim_device *sim, uint8_t *signature)
+{
+    ECDSA_SIG *sig = ECDSA_do_sign(sim->tempkey, sizeof(sim->tempkey), sim->key);
+    if (sig == NULL)
+        return -1;
+
+    const BIGNUM *r;
+    const BIGNUM *s;
+    ECDSA_SIG_get0(sig, &r, &s);
+    BN_bn2binpad(r, signature, 32);
+    BN_bn2binpad(s, signature + 32, 32);
+    ECDSA_SIG_free(sig);
+    return 0;
+}
+
+static void sim_execute(struct sim_device *sim, const uint8_t *cmd, uint64_t now)
+{
+    uint8_t opcode = cmd[1];
+    uint8_t param1 = cmd[2];
+    uint16_t param2 = (uint16_t) (cmd[3] | (cmd[4] << 8));
+    uint8_t result[64];
+
+    switch (opcode) {
+    case 0x02: // Read
+    case 0x16: // Nonce
+    case 0x40: // GenKey
+    case 0x41: // Sign
+        break;
+    default:
+        sim_respond_status(sim, ATECC508A_STATUS_PARSE_ERROR);
+        return;
+    }
+
+    if (sim_fault(sim, SIM_FAULT_STATUS)) {
+        sim_respond_status(sim, ATECC508A_STATUS_EXECUTION_ERROR);
+        return;
+    }
+
+    int exec_us = sim_exec_time(sim, opcode);
+    if (now + (uint64_t) exec_us > sim->wake_time_us + (uint64_t) sim->watchdog_us) {
+        sim_respond_status(sim, ATECC508A_STATUS_WATCHDOG);
+        return;
+    }
+
+    if (sim_fault(sim, SIM_FAULT_STALL))
+        exec_us = SIM_STALL_US;
+    if (sim_fault(sim, SIM_FAULT_RESET))
+        sim->reset_at_us = now + (uint64_t) exec_us / 2;
+
+    sim->busy_until_us = now + (uint64_t) exec_us;
+    sim->stats.commands++;
+
+    switch (opcode) {
+    case 0x02: {
+        size_t len = (param1 & 0x80) ? 32 : 4;
+        size_t offset = (size_t) param2 * 4;
+        if ((param1 & 0x03) != 0 || offset + len > sizeof(sim->config)) {
+            // Only the config zone is simulated
+            sim_respond_status(sim, ATECC508A_STATUS_EXECUTION_ERROR);
+            return;
+        }
+        sim_respond(sim, &sim->config[offset], len);
+        break;
+    }
+
+    case 0x16:
+        if (param1 != 0x03 || cmd[0] != 39) {
+            sim_respond_status(sim, ATECC508A_STATUS_PARSE_ERROR);
+            return;
+        }
+        memcpy(sim->tempkey, &cmd[5], 32);
+        sim->tempkey_valid = 1;
+        sim_respond_status(sim, ATECC508A_STATUS_SUCCESS);
+        break;
+
+    case 0x40:
+        if (param1 != 0 || param2 != 0 || sim_public_key(sim, result) < 0) {
+            sim_respond_status(sim, ATECC508A_STATUS_EXECUTION_ERROR);
+            return;
+        }
+        sim_respond(sim, result, 64);
+        break;
+
+    case 0x41:
+        if (param1 != 0x80 || param2 != 0 || !sim->tempkey_valid || sim_sign(sim, result) < 0) {
+            sim_respond_status(sim, ATECC508A_STATUS_EXECUTION_ERROR);
+            return;
+        }
+        sim->tempkey_valid = 0;
+        sim_respond(sim, result, 64);
+        break;
+    }
+}
+
+static int sim_write_msg(struct atecc508a *dev, uint8_t addr, const uint8_t *data, uint16_t len)
+{
+    struct sim_device *sim = dev->transport_data;
+    uint64_t now = sim_now(dev);
+
+    sim->stats.writes++;
+    sim_check_watchdog(sim, now);
+    if (addr != dev->addr || sim->state != SIM_ACTIVE || now < sim->busy_until_us || len == 0 ||
+        sim_fault(sim, SIM_FAULT_NAK)) {
+        sim->stats.naks++;
+        return -1;
+    }
+
+    switch (data[0]) {
+    case ATECC508A_WORD_RESET: // Reset the output buffer
+        sim->out_pos = 0;
+        break;
+
+    case ATECC508A_WORD_SLEEP:
+        sim_fall_asleep(sim, now);
+        break;
+
+    case ATECC508A_WORD_IDLE:
+        sim->state = SIM_IDLE;
+        break;
+
+    case ATECC508A_WORD_COMMAND: {
+        const uint8_t *cmd = &data[1];
+        if (len < 8 || cmd[0] != len - 1) {
+            sim_respond_status(sim, ATECC508A_STATUS_PARSE_ERROR);
+            break;
+        }
+
+        if (!atecc508a_crc_ok(cmd, cmd[0])) {
+            sim_respond_status(sim, ATECC508A_STATUS_CRC_ERROR);
+            break;
+        }
+        sim_execute(sim, cmd, now);
+        break;
+    }
+
+    default:
+        sim->stats.naks++;
+        return -1;
+    }
+    return 0;
+}
+
+static int sim_read_msg(struct atecc508a *dev, uint8_t addr, uint8_t *data, uint16_t len)
+{
+    struct sim_device *sim = dev->transport_data;
+    uint64_t now = sim_now(dev);
+
+    sim->stats.reads++;
+    sim_check_watchdog(sim, now);
+    if (addr != dev->addr || sim->state != SIM_ACTIVE || now < sim->busy_until_us ||
+        sim_fault(sim, SIM_FAULT_NAK)) {
+        sim->stats.naks++;
+        return -1;
+    }
+
+    for (uint16_t i = 0; i < len; i++)
+        data[i] = sim->out_pos < sim->out_len ? sim->out[sim->out_pos++] : 0xff;
+
+    return 0;
+}
+
+static int sim_wake_msg(struct atecc508a *dev)
+{
+    struct sim_device *sim = dev->transport_data;
+    uint64_t now = sim_now(dev);
+
+    sim->stats.writes++;
+    sim->stats.wakes++;
+    sim_check_watchdog(sim, now);
+    if (sim->state != SIM_ACTIVE) {
+        if (sim->state == SIM_SLEEP)
+            sim->awake_since_us = now;
+        sim->state = SIM_ACTIVE;
+        sim->wake_time_us = now;
+        sim->busy_until_us = now + SIM_WAKE_DELAY_US;
+        uint8_t after_wake = ATECC508A_STATUS_AFTER_WAKE;
+        sim_respond(sim, &after_wake, 1);
+    }
+    return 0;
+}
+
+// Each of these counts as one bus transaction like an I2C_RDWR ioctl would
+static int sim_write(struct atecc508a *dev, uint8_t addr, const uint8_t *data, uint16_t len)
+{
+    struct sim_device *sim = dev->transport_data;
+    sim->stats.transfers++;
+    return sim_write_msg(dev, addr, data, len);
+}
+
+static int sim_read(struct atecc508a *dev, uint8_t addr, uint8_t *data, uint16_t len)
+{
+    struct sim_device *sim = dev->transport_data;
+    sim->stats.transfers++;
+    return sim_read_msg(dev, addr, data, len);
+}
+
+static int sim_wake(struct atecc508a *dev)
+{
+    struct sim_device *sim = dev->transport_data;
+    sim->stats.transfers++;
+    return sim_wake_msg(dev);
+}
+
+static int sim_transfer(struct atecc508a *dev, const struct atecc508a_msg *msgs, int count)
+{
+    struct sim_device *sim = dev->transport_data;
+    sim->stats.transfers++;
+
+    for (int i = 0; i < count; i++) {
+        const struct atecc508a_msg *m = &msgs[i];
+        int rc;
+        if (m->flags & ATECC508A_MSG_WAKE)
+            rc = sim_wake_msg(dev);
+        else if (m->flags & ATECC508A_MSG_READ)
+            rc = sim_read_msg(dev, m->addr, m->buf, m->len);
+        else
+            rc = sim_write_msg(dev, m->addr, m->buf, m->len);
+        if (rc < 0)
+            return -1;
+    }
+    return 0;
+}
+
+const struct atecc508a_transport atecc508a_sim_transport = {
+    .name = "sim",
+    .open = sim_open,
+    .close = sim_close,
+    .write = sim_write,
+    .read = sim_read,
+    .wake = sim_wake,
+    .transfer = sim_transfer,
+    .now_us = sim_now,
+    .sleep_us = sim_sleep
+};
+
+#endif // NKCS11_SIMULATOR
@@ -0,0 +1,123 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "nerves_key_agent_client.h"
+#include "log.h"
+
+/**
+ * Connect to nerves_key_agent
+ *
+ * @param path the agent's socket
+ * @return a file descriptor for the connection or -1 on error
+ */
+int nerves_key_agent_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        ERROR("Agent socket path is too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        ERROR("Can't connect to the agent at %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Send a request to the agent
+ *
+ * @param fd the connection from nerves_key_agent_connect
+ * @param request the request. The version is filled in.
+ * @return 0 on success; -1 if the connection is broken
+ */
+int nerves_key_agent_send(int fd, struct nerves_key_agent_request *request)
+{
+    request->version = NKCS11_AGENT_VERSION;
+
+    ssize_t sent;
+    do {
+        sent = send(fd, request, sizeof(*request), MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    return sent == (ssize_t) sizeof(*request) ? 0 : -1;
+}
+
+/**
+ * Receive the reply to the last request
+ *
+ * @param fd the connection from nerves_key_agent_connect
+ * @param reply where to put the reply
+ * @param blocking 0 to return right away if the reply isn't there yet
+ * @return 0 on success; NKCS11_AGENT_WAIT if not blocking and there's no
+ *         reply yet; -1 if the connection is broken
+ */
+int nerves_key_agent_receive(int fd, struct nerves_key_agent_reply *reply, int blocking)
+{
+    ssize_t received;
+    do {
+        received = recv(fd, reply, sizeof(*reply), blocking ? 0 : MSG_DONTWAIT);
+    } while (received < 0 && errno == EINTR);
+
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return NKCS11_AGENT_WAIT;
+    if (received != (ssize_t) sizeof(*reply)) {
+        ERROR("Lost the connection to the agent");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send a request to the agent and wait for the reply
+ *
+ * @return 0 on success; -1 if the connection is broken
+ */
+int nerves_key_agent_call(int fd, struct nerves_key_agent_request *request, struct nerves_key_agent_reply *reply)
+{
+    if (nerves_key_agent_send(fd, request) < 0)
+        return -1;
+    return nerves_key_agent_receive(fd, reply, 1);
+}
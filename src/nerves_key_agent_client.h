@@ -0,0 +1,90 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef NERVES_KEY_AGENT_CLIENT_H
+#define NERVES_KEY_AGENT_CLIENT_H
+
+#include <stdint.h>
+
+// Talking to nerves_key_agent
+//
+// The agent owns the ATECCs and signs for every process that uses the
+// library with NERVES_KEY_AGENT_SOCKET set. Requests and replies go over a
+// Unix SOCK_SEQPACKET socket, one message each, so neither side needs to
+// frame them. A connection has at most one request outstanding. Both sides
+// are built from the same tree, so the messages are plain structs.
+
+#define NKCS11_AGENT_VERSION     1
+#define NKCS11_AGENT_MAX_DIGESTS 16
+
+#define NKCS11_AGENT_LIST 1 // Which slots have a chip
+#define NKCS11_AGENT_INFO 2 // Serial number and public key for a slot
+#define NKCS11_AGENT_SIGN 3 // Sign up to NKCS11_AGENT_MAX_DIGESTS digests
+
+#define NKCS11_AGENT_WAIT 1 // No reply yet
+
+struct nerves_key_agent_request {
+    uint8_t version;
+    uint8_t op;
+    uint8_t slot;
+    uint8_t unused;
+    uint32_t session_flags; // CKF_NKCS11_PRIORITY_* for scheduling signatures
+    uint32_t deadline_ms;   // 0 if none
+    uint32_t count;
+    uint8_t digests[NKCS11_AGENT_MAX_DIGESTS][32];
+};
+
+struct nerves_key_agent_info {
+    uint8_t serial_number[9];
+    uint8_t has_public_key;
+    uint8_t public_key[65];
+    char chip_name[16];
+};
+
+struct nerves_key_agent_reply {
+    uint32_t rv; // CK_RV for the request as a whole
+    uint32_t count;
+    union {
+        uint32_t slots; // Bit for each slot that has a chip
+        struct nerves_key_agent_info info;
+        struct {
+            uint32_t results[NKCS11_AGENT_MAX_DIGESTS]; // CK_RV for each digest
+            uint8_t signatures[NKCS11_AGENT_MAX_DIGESTS][64];
+        } sign;
+    };
+};
+
+int nerves_key_agent_connect(const char *path);
+int nerves_key_agent_send(int fd, struct nerves_key_agent_request *request);
+int nerves_key_agent_receive(int fd, struct nerves_key_agent_reply *reply, int blocking);
+int nerves_key_agent_call(int fd, struct nerves_key_agent_request *request, struct nerves_key_agent_reply *reply);
+
+#endif // NERVES_KEY_AGENT_CLIENT_H
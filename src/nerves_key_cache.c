@@ -0,0 +1,250 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nerves_key_cache.h"
+#include "log.h"
+
+#define CACHE_MAGIC   0x314b434eU // "NKC1"
+#define CACHE_VERSION 1
+
+// The record size changes if the timing layout does, so a file from a
+// different build gets started over rather than misread.
+struct cache_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t record_count;
+    uint32_t reserved;
+};
+
+struct cache_file {
+    struct cache_header header;
+    struct nerves_key_cache_record records[NKCS11_CACHE_RECORDS];
+};
+
+// Threads share one mapping. Other processes can have the same file mapped,
+// so changes are made under an exclusive flock() and reads under a shared one.
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_file *cache;
+static int cache_fd = -1;
+static char *cache_path;
+
+static uint16_t record_crc(const struct nerves_key_cache_record *record)
+{
+    return atecc508a_crc16((const uint8_t *) record, offsetof(struct nerves_key_cache_record, crc));
+}
+
+// Records start out zeroed and the sequence numbers start at 1
+static int record_valid(const struct nerves_key_cache_record *record)
+{
+    return record->sequence != 0 && record->crc == record_crc(record);
+}
+
+// Call with cache_mutex held and the file locked. The chip's own record
+// comes first, then an unused one and then the one saved longest ago.
+static struct nerves_key_cache_record *record_for(const uint8_t *serial_number)
+{
+    struct nerves_key_cache_record *unused = NULL;
+    struct nerves_key_cache_record *oldest = NULL;
+    for (int i = 0; i < NKCS11_CACHE_RECORDS; i++) {
+        struct nerves_key_cache_record *r = &cache->records[i];
+        if (!record_valid(r)) {
+            if (unused == NULL)
+                unused = r;
+        } else if (memcmp(r->serial_number, serial_number, sizeof(r->serial_number)) == 0) {
+            return r;
+        } else if (oldest == NULL || r->sequence < oldest->sequence) {
+            oldest = r;
+        }
+    }
+    return unused ? unused : oldest;
+}
+
+static int header_valid(const struct cache_header *header)
+{
+    return header->magic == CACHE_MAGIC &&
+           header->version == CACHE_VERSION &&
+           header->record_size == sizeof(struct nerves_key_cache_record) &&
+           header->record_count == NKCS11_CACHE_RECORDS;
+}
+
+static void close_locked(void)
+{
+    if (cache)
+        munmap(cache, sizeof(struct cache_file));
+    if (cache_fd >= 0)
+        close(cache_fd);
+    free(cache_path);
+
+    cache = NULL;
+    cache_fd = -1;
+    cache_path = NULL;
+}
+
+static int open_locked(const char *path)
+{
+    cache_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (cache_fd < 0) {
+        ERROR("Can't open cache file %s", path);
+        return -1;
+    }
+
+    flock(cache_fd, LOCK_EX);
+    struct stat st;
+    int fresh = fstat(cache_fd, &st) < 0 || st.st_size != (off_t) sizeof(struct cache_file);
+    if (fresh && ftruncate(cache_fd, sizeof(struct cache_file)) < 0) {
+        ERROR("Can't size cache file %s", path);
+        flock(cache_fd, LOCK_UN);
+        return -1;
+    }
+
+    void *map = mmap(NULL, sizeof(struct cache_file), PROT_READ | PROT_WRITE, MAP_SHARED, cache_fd, 0);
+    if (map == MAP_FAILED) {
+        ERROR("Can't map cache file %s", path);
+        flock(cache_fd, LOCK_UN);
+        return -1;
+    }
+    cache = map;
+
+    if (fresh || !header_valid(&cache->header)) {
+        memset(cache, 0, sizeof(struct cache_file));
+        cache->header.magic = CACHE_MAGIC;
+        cache->header.version = CACHE_VERSION;
+        cache->header.record_size = sizeof(struct nerves_key_cache_record);
+        cache->header.record_count = NKCS11_CACHE_RECORDS;
+        msync(cache, sizeof(struct cache_file), MS_ASYNC);
+    }
+    flock(cache_fd, LOCK_UN);
+
+    cache_path = strdup(path);
+    return 0;
+}
+
+/**
+ * Start using a cache file
+ *
+ * The file is created if it doesn't exist. One that's from a different
+ * version or is the wrong size is cleared. Opening the file that's already
+ * open does nothing.
+ *
+ * @param path the file's path
+ * @return 0 on success
+ */
+int nerves_key_cache_open(const char *path)
+{
+    pthread_mutex_lock(&cache_mutex);
+    int rc = 0;
+    if (cache == NULL || cache_path == NULL || strcmp(path, cache_path) != 0) {
+        close_locked();
+        rc = open_locked(path);
+        if (rc < 0)
+            close_locked();
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return rc;
+}
+
+void nerves_key_cache_close(void)
+{
+    pthread_mutex_lock(&cache_mutex);
+    close_locked();
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * Find what was saved about a chip
+ *
+ * @param serial_number the chip's 9-byte serial number
+ * @param record where to copy the record
+ * @return 0 if found; -1 if not or if no cache file is open
+ */
+int nerves_key_cache_lookup(const uint8_t *serial_number, struct nerves_key_cache_record *record)
+{
+    int rc = -1;
+    pthread_mutex_lock(&cache_mutex);
+    if (cache) {
+        flock(cache_fd, LOCK_SH);
+        const struct nerves_key_cache_record *r = record_for(serial_number);
+        if (record_valid(r) && memcmp(r->serial_number, serial_number, sizeof(r->serial_number)) == 0) {
+            *record = *r;
+            rc = 0;
+        }
+        flock(cache_fd, LOCK_UN);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return rc;
+}
+
+/**
+ * Save what's known about a chip
+ *
+ * This replaces the chip's record if there is one. Otherwise, it goes in an
+ * unused record or the one that was saved longest ago.
+ *
+ * @param record what to save. The sequence number and CRC are filled in.
+ * @return 0 on success; -1 if no cache file is open
+ */
+int nerves_key_cache_save(struct nerves_key_cache_record *record)
+{
+    int rc = -1;
+    pthread_mutex_lock(&cache_mutex);
+    if (cache) {
+        flock(cache_fd, LOCK_EX);
+
+        uint32_t sequence = 0;
+        for (int i = 0; i < NKCS11_CACHE_RECORDS; i++) {
+            if (record_valid(&cache->records[i]) && cache->records[i].sequence > sequence)
+                sequence = cache->records[i].sequence;
+        }
+        struct nerves_key_cache_record *slot = record_for(record->serial_number);
+
+        record->sequence = sequence + 1;
+        record->crc = record_crc(record);
+        // The CRC covers padding too, so copy the bytes rather than the fields
+        memcpy(slot, record, sizeof(*slot));
+        msync(cache, sizeof(struct cache_file), MS_ASYNC);
+
+        flock(cache_fd, LOCK_UN);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return rc;
+}
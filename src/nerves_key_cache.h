@@ -0,0 +1,65 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef NERVES_KEY_CACHE_H
+#define NERVES_KEY_CACHE_H
+
+#include <stdint.h>
+
+#include "atecc508a.h"
+
+// What's known about a chip from earlier runs
+//
+// Reading the public key needs a GenKey and the poll timing takes a few
+// commands to learn. Both stay the same for a chip, so they're saved in a
+// file by serial number. The file is memory mapped and each record has a
+// CRC, so a record that was only partly written is ignored rather than used.
+
+#define NKCS11_CACHE_RECORDS 32
+
+struct nerves_key_cache_record {
+    uint8_t serial_number[9];
+    uint8_t variant;   // enum atecc508a_variant
+    uint8_t chip_mode;
+    uint8_t slot_id;   // The PKCS #11 slot it was last seen on
+    uint8_t has_public_key;
+    uint8_t public_key[65];
+    uint32_t sequence; // For replacing the least recently saved record
+    struct atecc508a_timing timing[ATECC508A_TIMING_OPCODES];
+    uint16_t crc;
+};
+
+int nerves_key_cache_open(const char *path);
+void nerves_key_cache_close(void);
+int nerves_key_cache_lookup(const uint8_t *serial_number, struct nerves_key_cache_record *record);
+int nerves_key_cache_save(struct nerves_key_cache_record *record);
+
+#endif // NERVES_KEY_CACHE_H
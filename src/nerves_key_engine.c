@@ -0,0 +1,288 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "nerves_key_engine.h"
+#include "log.h"
+
+#define ENGINE_MAX_EVENTS 16
+
+// The thread is started by the first submit and runs until
+// nerves_key_engine_stop(). Submitted jobs are handed over through a list and
+// the eventfd wakes the thread up to look at it.
+static pthread_mutex_t engine_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int engine_running;
+static int engine_stopping;
+static pthread_t engine_thread;
+static int epoll_fd = -1;
+static int event_fd = -1;
+static struct nerves_key_job *submitted; // Newest first
+static struct nerves_key_job *background_jobs; // Started and not finished
+
+static int arm_timer(struct nerves_key_job *job, int wait_us)
+{
+    if (job->timer_fd < 0) {
+        job->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (job->timer_fd < 0)
+            return -1;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = job;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, job->timer_fd, &ev) < 0) {
+            close(job->timer_fd);
+            job->timer_fd = -1;
+            return -1;
+        }
+    }
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = wait_us / 1000000;
+    its.it_value.tv_nsec = (wait_us % 1000000) * 1000;
+    return timerfd_settime(job->timer_fd, 0, &its, NULL);
+}
+
+static void close_timer(struct nerves_key_job *job)
+{
+    if (job->timer_fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, job->timer_fd, NULL);
+        close(job->timer_fd);
+        job->timer_fd = -1;
+    }
+}
+
+static void forget_background_job(struct nerves_key_job *job)
+{
+    for (struct nerves_key_job **p = &background_jobs; *p; p = &(*p)->next) {
+        if (*p == job) {
+            *p = job->next;
+            break;
+        }
+    }
+}
+
+// Return 1 if the job is done
+static int run_job(struct nerves_key_job *job)
+{
+    for (;;) {
+        int wait_us = job->step(job);
+        if (wait_us <= 0)
+            break;
+
+        if (arm_timer(job, wait_us) == 0)
+            return 0;
+
+        // Out of file descriptors. Waiting here holds up the other jobs,
+        // but it still works.
+        ERROR("Can't set a timer for a job: %s", strerror(errno));
+        struct timespec ts = {wait_us / 1000000, (wait_us % 1000000) * 1000};
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+    }
+
+    close_timer(job);
+    if (job->background)
+        forget_background_job(job);
+    job->finish(job);
+    return 1;
+}
+
+// Return 1 if a job that counts toward the active ones is done
+static int run_counted_job(struct nerves_key_job *job)
+{
+    int background = job->background; // The job can be reused after it's done
+    return run_job(job) && !background;
+}
+
+static void *engine_main(void *arg)
+{
+    (void) arg;
+    int active = 0;
+
+    for (;;) {
+        struct epoll_event events[ENGINE_MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, ENGINE_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ERROR("epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct nerves_key_job *job = events[i].data.ptr;
+            uint64_t value;
+            if (job == NULL) {
+                if (read(event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                    ERROR("eventfd read failed: %s", strerror(errno));
+            } else if (read(job->timer_fd, &value, sizeof(value)) == sizeof(value)) {
+                active -= run_counted_job(job);
+            }
+        }
+
+        pthread_mutex_lock(&engine_mutex);
+        struct nerves_key_job *jobs = submitted;
+        submitted = NULL;
+        int stopping = engine_stopping;
+        pthread_mutex_unlock(&engine_mutex);
+
+        // Start them in the order that they came in
+        struct nerves_key_job *oldest_first = NULL;
+        while (jobs) {
+            struct nerves_key_job *next = jobs->next;
+            jobs->next = oldest_first;
+            oldest_first = jobs;
+            jobs = next;
+        }
+        while (oldest_first) {
+            struct nerves_key_job *next = oldest_first->next;
+            if (oldest_first->background) {
+                oldest_first->next = background_jobs;
+                background_jobs = oldest_first;
+            } else {
+                active++;
+            }
+            active -= run_counted_job(oldest_first);
+            oldest_first = next;
+        }
+
+        if (stopping && active == 0)
+            break;
+    }
+
+    while (background_jobs) {
+        struct nerves_key_job *job = background_jobs;
+        background_jobs = job->next;
+        close_timer(job);
+        job->finish(job);
+    }
+    return NULL;
+}
+
+// Call with engine_mutex held
+static int start_engine(void)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || event_fd < 0)
+        goto fail;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev) < 0)
+        goto fail;
+
+    engine_stopping = 0;
+    if (pthread_create(&engine_thread, NULL, engine_main, NULL) != 0)
+        goto fail;
+
+    engine_running = 1;
+    return 0;
+
+fail:
+    ERROR("Can't start the engine: %s", strerror(errno));
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    if (event_fd >= 0)
+        close(event_fd);
+    epoll_fd = -1;
+    event_fd = -1;
+    return -1;
+}
+
+/**
+ * Run a job on the engine thread
+ *
+ * This is safe to call from any thread, including the engine's. The first
+ * step runs on the engine thread soon after.
+ *
+ * @param job the job. It has to stay around until its finish callback.
+ * @return 0 on success or -1 if the engine couldn't be started
+ */
+int nerves_key_engine_submit(struct nerves_key_job *job)
+{
+    job->timer_fd = -1;
+
+    pthread_mutex_lock(&engine_mutex);
+    if (!engine_running && start_engine() < 0) {
+        pthread_mutex_unlock(&engine_mutex);
+        return -1;
+    }
+    job->next = submitted;
+    submitted = job;
+    pthread_mutex_unlock(&engine_mutex);
+
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        ERROR("eventfd write failed: %s", strerror(errno));
+    return 0;
+}
+
+/**
+ * Stop the engine thread
+ *
+ * Jobs that are still running are finished first. Background jobs are
+ * finished without running their remaining steps. Don't submit new ones
+ * until this returns. The next submit starts the thread again.
+ */
+void nerves_key_engine_stop(void)
+{
+    pthread_mutex_lock(&engine_mutex);
+    if (!engine_running) {
+        pthread_mutex_unlock(&engine_mutex);
+        return;
+    }
+    engine_stopping = 1;
+    pthread_mutex_unlock(&engine_mutex);
+
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        ERROR("eventfd write failed: %s", strerror(errno));
+    pthread_join(engine_thread, NULL);
+
+    pthread_mutex_lock(&engine_mutex);
+    close(epoll_fd);
+    close(event_fd);
+    epoll_fd = -1;
+    event_fd = -1;
+    engine_running = 0;
+    pthread_mutex_unlock(&engine_mutex);
+}
@@ -0,0 +1,61 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef NERVES_KEY_ENGINE_H
+#define NERVES_KEY_ENGINE_H
+
+// Event loop for commands that don't block
+//
+// One thread runs every job. A job does a little I/O at a time and says how
+// long to wait before its next step, so one thread can keep several ATECCs
+// busy at once. Each waiting job has a timerfd in the engine's epoll set.
+
+struct nerves_key_job {
+    // Run the next step. Return microseconds to wait before the next one or
+    // <= 0 when the job is done.
+    int (*step)(struct nerves_key_job *job);
+
+    // Called after the last step. The engine doesn't touch the job after this.
+    void (*finish)(struct nerves_key_job *job);
+
+    // Set for housekeeping that nerves_key_engine_stop() shouldn't wait for.
+    // Stopping the engine calls finish without running the job's next step.
+    int background;
+
+    // Engine use only
+    int timer_fd;
+    struct nerves_key_job *next;
+};
+
+int nerves_key_engine_submit(struct nerves_key_job *job);
+void nerves_key_engine_stop(void);
+
+#endif // NERVES_KEY_ENGINE_H
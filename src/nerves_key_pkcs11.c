@@ -32,12 +32,19 @@
  *
  */
 
-#include "pkcs11.h"
+#include "nerves_key_pkcs11.h"
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include "atecc508a.h"
+#include "nerves_key_agent_client.h"
+#include "nerves_key_cache.h"
+#include "nerves_key_engine.h"
+#include "nerves_key_queue.h"
+#include "nerves_key_shm.h"
 #include "log.h"
 
 #define ATECC508A_DEFAULT_ADDR 0x60
@@ -50,7 +57,12 @@
 #define NKCS11_VERSION_MINOR 1
 #define NKCS11_VERSION_PATCH 0
 
-#define NKCS11_SESSION_MAGIC 0x4e727673
+/* Sessions come from a fixed-size slab. Handles are the slab index + 1 in the
+   low bits and the slot's generation count above them so that stale handles
+   are caught when the slot is reused. */
+#define NKCS11_MAX_SESSIONS 64
+#define SESSION_INDEX_BITS  8
+#define SESSION_INDEX_MASK  ((1 << SESSION_INDEX_BITS) - 1)
 
 /* The one ATECC key is exposed as two logical objects (private and public key).
    CKA_CLASS is derived from these handles so it is stable per object handle. */
@@ -79,7 +91,7 @@ static CK_TOKEN_INFO slot_token_info_template = {
     .model = "NervesKey",
     .serialNumber = "FIXME",
     .flags = CKF_WRITE_PROTECTED | CKF_TOKEN_INITIALIZED,
-    .ulMaxSessionCount = 4,
+    .ulMaxSessionCount = NKCS11_MAX_SESSIONS,
     .ulSessionCount = 0,
     .ulMaxRwSessionCount = 0,
     .ulRwSessionCount = 0,
@@ -95,763 +107,2383 @@ static CK_TOKEN_INFO slot_token_info_template = {
 };
 
 static CK_FUNCTION_LIST function_list;
+static CK_FUNCTION_LIST_3_0 function_list_3_0;
+static CK_NKCS11_FUNCTION_LIST vendor_function_list;
 
-struct nerves_key_session {
-    CK_SLOT_ID slot_id;
+/* What the metadata queries need to know about a device. A snapshot isn't
+   modified once it's published. Updates publish a new one so that readers
+   never need the device lock. Replaced snapshots are kept until the device
+   is closed since a reader could still be using one. */
+#define NKCS11_MAX_OBJECTS 2
+
+struct nerves_key_snapshot {
+    CK_BBOOL has_serial_number;
+    uint8_t serial_number[9];
+    enum atecc508a_variant variant;
+
+    CK_BBOOL has_public_key;
+    CK_BYTE public_key[65];
+
+    CK_ULONG object_count;
+    CK_OBJECT_HANDLE objects[NKCS11_MAX_OBJECTS];
+    CK_OBJECT_CLASS classes[NKCS11_MAX_OBJECTS];
+
+    struct nerves_key_snapshot *replaced;
+};
+
+/* C_Sign calls that are waiting for the same device. Whoever gets the device
+   next signs the ones in its priority class or higher in one wake cycle, in
+   the order that the queue would have run them and as many as fit in a
+   group. The others are let go as soon as their signature is done. A caller
+   that the queue turns away takes its request back out of the list. */
+#define NKCS11_MAX_SIGN_GROUP 8
+
+struct nerves_key_sign_request {
+    const CK_BYTE *data;
+    CK_BYTE *signature;
+    int priority;
+    uint64_t deadline_us; // 0 if none
+    uint64_t seq; // Arrival order for ties
+    CK_RV rv;
+    int done;
+    struct nerves_key_sign_request *next;
+};
+
+/* Puts a device's ATECC to sleep when its keep-awake time runs out. See
+   schedule_sleep(). */
+enum {
+    NKCS11_SLEEP_IDLE,      // Not submitted
+    NKCS11_SLEEP_SCHEDULED, // Waiting in the engine
+    NKCS11_SLEEP_FINISHING, // Done, but the engine hasn't called finish yet
+    NKCS11_SLEEP_AGAIN      // Like finishing, but the chip was used since
+};
 
+struct nerves_key_device;
+struct nerves_key_sleep_job {
+    struct nerves_key_job job;
+    struct nerves_key_device *device;
+    int state; // NKCS11_SLEEP_*
+};
+
+/* One per slot. Sessions on the same slot share the open device. Each slot
+   is a different bus and address, so the device lock keeps concurrent
+   callers from interleaving commands to one ATECC without holding up the
+   others. Commands wait in the queue first so that they run in priority
+   order. With NERVES_KEY_AGENT_SOCKET, the agent has the chip and this
+   process's commands go to it instead. They still wait in the queue here
+   so that each connection only has one request at a time. */
+struct nerves_key_device {
+    pthread_mutex_t mutex;
+    struct nerves_key_queue queue;
     CK_ULONG open_count;
-    CK_ULONG find_index;
 
-    int fd;
-    uint8_t addr;
+    struct atecc508a dev;
+    struct nerves_key_shm_turn turn; // Place in line with other processes
 
-    CK_BBOOL has_cached_public_key;
-    CK_BYTE cached_public_key[65];
+    CK_BBOOL use_agent;
+    int agent_fd; // -1 until connected
+
+    struct nerves_key_snapshot *snapshot; // See current_snapshot()
+    struct nerves_key_snapshot *detached; // See detach_device()
+
+    struct nerves_key_sleep_job sleep;
+
+    pthread_mutex_t pending_mutex;
+    struct nerves_key_sign_request *pending_signs; // Newest first
+    uint64_t sign_seq;
+    unsigned long sign_groups;
+    unsigned long grouped_signs;
+};
+
+struct nerves_key_session {
+    CK_SESSION_HANDLE handle; // 0 if not in use
+    CK_ULONG generation;
+    int next_free;
+
+    CK_SLOT_ID slot_id;
+    struct nerves_key_device *device;
+
+    CK_ULONG find_index;
 
     /* CKA_CLASS filter recorded by C_FindObjectsInit so C_FindObjects only
        emits the handle(s) matching the search. libp11 >= 0.4.12 locates each
        key by CKA_CLASS. */
     CK_BBOOL find_class_filtered;
     CK_OBJECT_CLASS find_class;
+
+    /* NKCS11_PRIORITY_* class from the C_OpenSession flags */
+    int priority;
+
+    /* Set by C_SignInit and cleared when C_Sign finishes */
+    CK_BBOOL sign_active;
+    CK_ULONG sign_deadline_ms;
+
+    /* Set by C_MessageSignInit and cleared by C_MessageSignFinal. The ATECC
+       is kept awake in between. A message that's signed in parts is
+       collected in message until the last part comes in. */
+    CK_BBOOL message_sign_active;
+    CK_ULONG message_deadline_ms;
+    CK_BBOOL message_part_active;
+    CK_ULONG message_part_deadline_ms;
+    CK_ULONG message_len;
+    CK_BYTE message[32];
+};
+
+/* Public keys outlive the devices that they were read from. Deriving one
+   takes a GenKey, which is the slowest part of opening a device, and the
+   key only changes if the chip is provisioned again. Entries are found by
+   slot (bus and address) and then checked against the serial number, so a
+   chip that's been swapped out gets its own key read. Each entry is only
+   used with its slot's device mutex held. This isn't cleared by
+   C_Finalize, so reloading the library's users doesn't cost a GenKey. */
+struct nerves_key_cached_key {
+    CK_BBOOL valid;
+    const struct atecc508a_transport *transport;
+    uint8_t serial_number[9];
+    CK_BYTE public_key[65];
 };
 
-static struct nerves_key_session session;
+static struct nerves_key_device devices[MAX_SLOT_ID + 1];
+static struct nerves_key_cached_key key_cache[MAX_SLOT_ID + 1];
+static struct nerves_key_session sessions[NKCS11_MAX_SESSIONS];
+static int free_session; // Head of the free list or -1 if all are in use
+
+/* The table mutex protects the session table and the device open counts.
+   It's never held while talking to an ATECC. Opening and closing a device
+   needs its mutex. Closing one also detaches it under the table mutex. Take
+   the device mutex first. Session lookups don't lock anything. */
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static CK_BBOOL initialized;
+static CK_BBOOL can_create_threads; // Unless C_Initialize said not to
 
 #define UNUSED(v) (void) v
 
-// See https://www.cryptsoft.com/pkcs11doc/
+static int env_int(const char *name, int default_value)
+{
+    const char *value = getenv(name);
+    if (value == NULL || *value == '\0')
+        return default_value;
 
-// https://www.cryptsoft.com/pkcs11doc/v220/pkcs11__all_8h.html
+    char *end;
+    long result = strtol(value, &end, 10);
+    if (*end != '\0' || result < 0 || result > 0x7fffffff / 1000) {
+        ERROR("Ignoring invalid %s=%s", name, value);
+        return default_value;
+    }
+    return (int) result;
+}
 
-/* General Purpose */
+static const struct atecc508a_transport *selected_transport(void)
+{
+    const char *name = getenv("NERVES_KEY_TRANSPORT");
+    const struct atecc508a_transport *transport = atecc508a_find_transport(name);
+    if (transport == NULL)
+        ERROR("Unknown transport '%s'", name);
 
-CK_DEFINE_FUNCTION(CK_RV, C_Initialize)(
-    CK_VOID_PTR pInitArgs
-)
+    return transport;
+}
+
+static CK_RV check_init_args(CK_C_INITIALIZE_ARGS_PTR args)
 {
-    ENTER();
-    UNUSED(pInitArgs);
+    can_create_threads = args == NULL_PTR || (args->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS) == 0;
+
+    // A NULL args means a single-threaded application. Pthread mutexes cost
+    // next to nothing when uncontended, so they're used anyway.
+    if (args == NULL_PTR)
+        return CKR_OK;
+
+    if (args->pReserved != NULL_PTR)
+        return CKR_ARGUMENTS_BAD;
+
+    int callbacks = (args->CreateMutex != NULL_PTR) + (args->DestroyMutex != NULL_PTR) +
+                    (args->LockMutex != NULL_PTR) + (args->UnlockMutex != NULL_PTR);
+    if (callbacks != 0 && callbacks != 4)
+        return CKR_ARGUMENTS_BAD;
 
-    memset(&session, 0, sizeof(session));
-    session.fd = -1;
+    // The queues, the async signer and the pending list wait on pthread
+    // condition variables, so the application's mutex callbacks can't
+    // replace the locks. PKCS #11 lets a library refuse them this way.
+    if (callbacks == 4 && (args->flags & CKF_OS_LOCKING_OK) == 0)
+        return CKR_CANT_LOCK;
 
     return CKR_OK;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_Finalize)(
-    CK_VOID_PTR pReserved
-)
+static void lock(pthread_mutex_t *mutex)
 {
-    ENTER();
-    UNUSED(pReserved);
-    return CKR_OK;
+    pthread_mutex_lock(mutex);
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GetInfo)(
-    CK_INFO_PTR pInfo
-)
+static void unlock(pthread_mutex_t *mutex)
 {
-    ENTER();
-    *pInfo = library_info;
-    return CKR_OK;
+    pthread_mutex_unlock(mutex);
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GetFunctionList)(
-    CK_FUNCTION_LIST_PTR_PTR ppFunctionList
-)
+/* The engine thread puts the chip to sleep so that no caller has to wait
+   around for that. It only tries the device mutex. If a caller has it, the
+   caller's going to leave the chip awake again anyway. */
+#define NKCS11_SLEEP_RETRY_US 10000
+
+static int sleep_step(struct nerves_key_job *job)
 {
-    ENTER();
+    struct nerves_key_sleep_job *sleep = (struct nerves_key_sleep_job *) job;
+    if (pthread_mutex_trylock(&sleep->device->mutex) != 0)
+        return NKCS11_SLEEP_RETRY_US;
 
-    if(ppFunctionList == NULL_PTR) {
-        INFO("GetFunctionList called with ppFunctionList = NULL");
-        return CKR_ARGUMENTS_BAD;
-    }
-    *ppFunctionList = &function_list;
-    return CKR_OK;
+    int wait_us = atecc508a_sleep_if_idle(&sleep->device->dev);
+    if (wait_us <= 0)
+        __atomic_store_n(&sleep->state, NKCS11_SLEEP_FINISHING, __ATOMIC_RELEASE);
+    unlock(&sleep->device->mutex);
+    return wait_us;
 }
 
-/* Slot and token management */
-
-CK_DEFINE_FUNCTION(CK_RV, C_GetSlotList)(
-    CK_BBOOL tokenPresent,
-    CK_SLOT_ID_PTR pSlotList,
-    CK_ULONG_PTR pulCount
-)
+static void sleep_finish(struct nerves_key_job *job)
 {
-    UNUSED(tokenPresent);
-
-    ENTER();
+    struct nerves_key_sleep_job *sleep = (struct nerves_key_sleep_job *) job;
+    int state = __atomic_load_n(&sleep->state, __ATOMIC_ACQUIRE);
+    while (state != NKCS11_SLEEP_AGAIN) {
+        if (__atomic_compare_exchange_n(&sleep->state, &state, NKCS11_SLEEP_IDLE, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return;
+    }
 
-    CK_ULONG count = 0;
-    CK_ULONG base_count;
-    CK_ULONG max_count = (pSlotList == NULL_PTR ? (MAX_SLOT_ID + 1) : *pulCount);
-    INFO("GetSlotList pSlotList=%p, max_count=%lu", pSlotList, max_count);
+    // The chip was left awake after the last step looked at it
+    __atomic_store_n(&sleep->state, NKCS11_SLEEP_SCHEDULED, __ATOMIC_RELEASE);
+    if (nerves_key_engine_submit(job) < 0)
+        __atomic_store_n(&sleep->state, NKCS11_SLEEP_IDLE, __ATOMIC_RELEASE);
+}
 
-    for (CK_ULONG i = 0; i < DEVICE_INDEX_SPLIT; i++) {
-        char path[16];
-        sprintf(path, "/dev/i2c-%lu", i);
-        INFO("Checking %s", path);
-        int fd = atecc508a_open(path);
-        if (fd >= 0) {
-            INFO("Found %lu", i);
-            atecc508a_close(fd);
-            if (count >= max_count)
-                return CKR_BUFFER_TOO_SMALL;
+/* Call with the device mutex held after using the chip. If the chip was left
+   awake, this makes sure that it's put to sleep when keep-awake runs out.
+   If the application doesn't allow threads, that's left to the watchdog, so
+   keep-awake is off by default. */
+static void schedule_sleep(struct nerves_key_device *device)
+{
+    if (!can_create_threads || !device->dev.awake || device->dev.hold_awake > 0)
+        return;
 
-            if (pSlotList)
-                pSlotList[count] = i;
+    int state = __atomic_load_n(&device->sleep.state, __ATOMIC_ACQUIRE);
+    for (;;) {
+        if (state == NKCS11_SLEEP_SCHEDULED || state == NKCS11_SLEEP_AGAIN)
+            return;
 
-            count++;
-        }
+        int next = state == NKCS11_SLEEP_IDLE ? NKCS11_SLEEP_SCHEDULED : NKCS11_SLEEP_AGAIN;
+        if (__atomic_compare_exchange_n(&device->sleep.state, &state, next, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
     }
 
-    // Replicate entries to support the alternative Trust&Go address
-    base_count = count;
-    for (CK_ULONG i = 0; i < base_count; i++) {
-        if (count >= max_count)
-            return CKR_BUFFER_TOO_SMALL;
-
-        if (pSlotList)
-            pSlotList[count] = pSlotList[i] + DEVICE_INDEX_SPLIT;
+    if (state == NKCS11_SLEEP_IDLE && nerves_key_engine_submit(&device->sleep.job) < 0)
+        __atomic_store_n(&device->sleep.state, NKCS11_SLEEP_IDLE, __ATOMIC_RELEASE);
+}
 
-        count ++;
+static void init_sessions(void)
+{
+    memset(devices, 0, sizeof(devices));
+    for (int i = 0; i < MAX_SLOT_ID + 1; i++) {
+        devices[i].dev.fd = -1;
+        devices[i].agent_fd = -1;
+        nerves_key_queue_init(&devices[i].queue);
+        pthread_mutex_init(&devices[i].pending_mutex, NULL);
+        pthread_mutex_init(&devices[i].mutex, NULL);
+        devices[i].sleep.job.step = sleep_step;
+        devices[i].sleep.job.finish = sleep_finish;
+        devices[i].sleep.job.background = 1;
+        devices[i].sleep.device = &devices[i];
     }
 
-    *pulCount = count;
+    memset(sessions, 0, sizeof(sessions));
+    for (int i = 0; i < NKCS11_MAX_SESSIONS; i++)
+        sessions[i].next_free = i + 1 < NKCS11_MAX_SESSIONS ? i + 1 : -1;
+    free_session = 0;
+}
 
-#ifdef DEBUG
-    INFO("Final count is %lu", count);
-    if (pSlotList) {
-        for (CK_ULONG i = 0; i < count; i++) {
-            INFO("  found --> %lu", pSlotList[i]);
-        }
+static void free_sessions(void)
+{
+    for (int i = 0; i < MAX_SLOT_ID + 1; i++) {
+        pthread_mutex_destroy(&devices[i].mutex);
+        nerves_key_queue_destroy(&devices[i].queue);
+        pthread_mutex_destroy(&devices[i].pending_mutex);
     }
-#endif
-
-    return CKR_OK;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GetSlotInfo)(
-    CK_SLOT_ID slotID,
-    CK_SLOT_INFO_PTR pInfo
-)
+static struct nerves_key_session *lookup_session(CK_SESSION_HANDLE hSession)
 {
-    if (slotID > MAX_SLOT_ID)
-        return CKR_SLOT_ID_INVALID;
-    if (pInfo == NULL_PTR)
-        return CKR_ARGUMENTS_BAD;
+    CK_ULONG index = (hSession & SESSION_INDEX_MASK) - 1;
+    if (!initialized || index >= NKCS11_MAX_SESSIONS)
+        return NULL;
 
-    ENTER();
-    INFO("Get slot info for %lu", slotID);
-    *pInfo = slot_info_template;
-    sprintf((char*) pInfo->slotDescription, "NervesKey slotID %lu", slotID);
+    // The handle includes the generation, so this catches stale handles too
+    struct nerves_key_session *s = &sessions[index];
+    if (__atomic_load_n(&s->handle, __ATOMIC_ACQUIRE) != hSession)
+        return NULL;
 
-    return CKR_OK;
+    return s;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GetTokenInfo)(
-    CK_SLOT_ID slotID,
-    CK_TOKEN_INFO_PTR pInfo
-)
+static uint64_t deadline_from_ms(CK_ULONG deadline_ms)
 {
-    ENTER();
-    if (slotID > MAX_SLOT_ID)
-        return CKR_SLOT_ID_INVALID;
+    return deadline_ms ? nerves_key_now_us() + (uint64_t) deadline_ms * 1000 : 0;
+}
 
-    *pInfo = slot_token_info_template;
-    sprintf((char*) pInfo->label, "%lu", slotID);
+static CK_RV queue_result_rv(int result)
+{
+    switch (result) {
+    case NKCS11_QUEUE_SHED:
+        return CKR_FUNCTION_REJECTED;
+    case NKCS11_QUEUE_TIMED_OUT:
+        return CKR_NKCS11_QUEUE_TIMEOUT;
+    case NKCS11_QUEUE_NO_MEMORY:
+        return CKR_HOST_MEMORY;
+    default:
+        return CKR_OK;
+    }
+}
 
-    return CKR_OK;
+/* Wait for a turn on the session's device. Commands to the ATECC go between
+   this and device_leave(). Nothing needs to be left if this fails. */
+static CK_RV device_enter(struct nerves_key_session *s, CK_ULONG deadline_ms)
+{
+    CK_RV rv = queue_result_rv(nerves_key_queue_enter(&s->device->queue, s->priority, deadline_from_ms(deadline_ms)));
+    if (rv == CKR_OK)
+        lock(&s->device->mutex);
+    return rv;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_WaitForSlotEvent)(
-    CK_FLAGS flags,
-    CK_SLOT_ID_PTR pSlot,
-    CK_VOID_PTR pReserved
-)
+static void device_leave(struct nerves_key_session *s)
 {
-    UNUSED(flags);
-    UNUSED(pSlot);
-    UNUSED(pReserved);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    schedule_sleep(s->device);
+    unlock(&s->device->mutex);
+    nerves_key_queue_leave(&s->device->queue);
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GetMechanismList)(
-    CK_SLOT_ID slotID,
-    CK_MECHANISM_TYPE_PTR pMechanismList,
-    CK_ULONG_PTR pulCount
-)
+// The agent's socket if nerves_key_agent does the signing or NULL
+static const char *agent_socket(void)
 {
-    UNUSED(slotID);
-    UNUSED(pMechanismList);
-    UNUSED(pulCount);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    const char *path = getenv("NERVES_KEY_AGENT_SOCKET");
+    return path && *path ? path : NULL;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GetMechanismInfo)(
-    CK_SLOT_ID slotID,
-    CK_MECHANISM_TYPE type,
-    CK_MECHANISM_INFO_PTR pInfo
-)
+// Call with the device mutex held
+static void agent_disconnect(struct nerves_key_device *device)
 {
-    UNUSED(slotID);
-    UNUSED(type);
-    UNUSED(pInfo);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    if (device->agent_fd >= 0)
+        close(device->agent_fd);
+    device->agent_fd = -1;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_InitToken)(
-    CK_SLOT_ID slotID,
-    CK_UTF8CHAR_PTR pPin,
-    CK_ULONG ulPinLen,
-    CK_UTF8CHAR_PTR pLabel
-)
+/* Call with the device mutex held. This connects again if the agent was
+   restarted since the last call. */
+static int agent_connect(struct nerves_key_device *device)
 {
-    UNUSED(slotID);
-    UNUSED(pPin);
-    UNUSED(ulPinLen);
-    UNUSED(pLabel);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    const char *path = agent_socket();
+    if (device->agent_fd < 0 && path)
+        device->agent_fd = nerves_key_agent_connect(path);
+    return device->agent_fd;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_InitPIN)(
-    CK_SESSION_HANDLE hSession,
-    CK_UTF8CHAR_PTR pPin,
-    CK_ULONG ulPinLen
-)
+// Call with the device mutex held. Returns the agent's result.
+static CK_RV agent_call(struct nerves_key_device *device, struct nerves_key_agent_request *request,
+                        struct nerves_key_agent_reply *reply)
 {
-    UNUSED(hSession);
-    UNUSED(pPin);
-    UNUSED(ulPinLen);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    request->slot = (uint8_t) (device - devices);
+    if (agent_connect(device) < 0)
+        return CKR_DEVICE_ERROR;
+
+    if (nerves_key_agent_call(device->agent_fd, request, reply) < 0) {
+        agent_disconnect(device);
+        return CKR_DEVICE_ERROR;
+    }
+    return (CK_RV) reply->rv;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_SetPIN)(
-    CK_SESSION_HANDLE hSession,
-    CK_UTF8CHAR_PTR pOldPin,
-    CK_ULONG ulOldLen,
-    CK_UTF8CHAR_PTR pNewPin,
-    CK_ULONG ulNewLen
-)
+static CK_FLAGS priority_flags(int priority)
 {
-    UNUSED(hSession);
-    UNUSED(pOldPin);
-    UNUSED(ulOldLen);
-    UNUSED(pNewPin);
-    UNUSED(ulNewLen);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    switch (priority) {
+    case NKCS11_PRIORITY_INTERACTIVE:
+        return CKF_NKCS11_PRIORITY_INTERACTIVE;
+    case NKCS11_PRIORITY_BACKGROUND:
+        return CKF_NKCS11_PRIORITY_BACKGROUND;
+    default:
+        return 0;
+    }
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_OpenSession)(
-    CK_SLOT_ID slotID,
-    CK_FLAGS flags,
-    CK_VOID_PTR pApplication,
-    CK_NOTIFY Notify,
-    CK_SESSION_HANDLE_PTR phSession
-)
+static void agent_sign_request(struct nerves_key_agent_request *request, int priority, CK_ULONG deadline_ms,
+                               size_t count, const uint8_t **digests)
 {
-    ENTER();
-    if (slotID > MAX_SLOT_ID)
-        return CKR_SLOT_ID_INVALID;
-    if (phSession == NULL_PTR)
-        return CKR_ARGUMENTS_BAD;
-    if ((flags & CKF_SERIAL_SESSION) == 0)
-        return CKR_SESSION_PARALLEL_NOT_SUPPORTED;
+    memset(request, 0, sizeof(*request));
+    request->op = NKCS11_AGENT_SIGN;
+    request->session_flags = (uint32_t) priority_flags(priority);
+    request->deadline_ms = (uint32_t) deadline_ms;
+    request->count = (uint32_t) count;
+    for (size_t i = 0; i < count; i++)
+        memcpy(request->digests[i], digests[i], sizeof(request->digests[i]));
+}
 
-    if ((flags & CKF_RW_SESSION))
-        return CKR_TOKEN_WRITE_PROTECTED;
+// The result for one digest in an agent's reply to a sign request
+static CK_RV agent_sign_result(const struct nerves_key_agent_reply *reply, CK_RV rv, size_t count, size_t index,
+                               uint8_t *signature)
+{
+    if (rv == CKR_OK && reply->count != count)
+        rv = CKR_DEVICE_ERROR;
+    if (rv == CKR_OK)
+        rv = (CK_RV) reply->sign.results[index];
+    if (rv == CKR_OK)
+        memcpy(signature, reply->sign.signatures[index], 64);
+    return rv;
+}
 
-    // Unused
-    UNUSED(pApplication);
-    UNUSED(Notify);
+/* Call with the device mutex held. Have the agent sign up to
+   NKCS11_AGENT_MAX_DIGESTS digests. The agent can turn some of them away
+   and not others, so each gets its own result. */
+static void agent_sign(struct nerves_key_device *device, int priority, CK_ULONG deadline_ms, size_t count,
+                       const uint8_t **digests, uint8_t **signatures, CK_RV *results)
+{
+    struct nerves_key_agent_request request;
+    struct nerves_key_agent_reply reply;
+    agent_sign_request(&request, priority, deadline_ms, count, digests);
 
-    *phSession = NKCS11_SESSION_MAGIC;
+    CK_RV rv = agent_call(device, &request, &reply);
+    for (size_t i = 0; i < count; i++)
+        results[i] = agent_sign_result(&reply, rv, count, i, signatures[i]);
+}
 
-    if (session.open_count == 0) {
-        char i2c_path[16];
-        sprintf(i2c_path, "/dev/i2c-%lu", (slotID % DEVICE_INDEX_SPLIT));
+struct nerves_key_sign_group {
+    struct nerves_key_device *device;
+    struct nerves_key_sign_request *requests[NKCS11_MAX_SIGN_GROUP];
+    int results[NKCS11_MAX_SIGN_GROUP];
+};
 
-        if(slotID >= DEVICE_INDEX_SPLIT) {
-            session.addr = ATECC508A_TRUST_AND_GO_ADDR;
-        } else {
-            session.addr = ATECC508A_DEFAULT_ADDR;
-        }
+static void finish_sign_request(struct nerves_key_device *device, struct nerves_key_sign_request *request, CK_RV rv)
+{
+    request->rv = rv;
+    __atomic_store_n(&request->done, 1, __ATOMIC_RELEASE);
+    nerves_key_queue_notify(&device->queue);
+}
 
-        session.fd = atecc508a_open(i2c_path);
-        if (session.fd < 0) {
-            ERROR("Error opening I2C bus: %s", i2c_path);
-            return CKR_DEVICE_ERROR;
-        }
-        session.slot_id = slotID;
-    } else if (slotID != session.slot_id) {
-        ERROR("Trying to open slot %lu when slot %lu is already open!", slotID, session.slot_id);
-        return CKR_SLOT_ID_INVALID;
-    }
-    session.open_count++;
-    return CKR_OK;
+static void sign_request_done(void *context, size_t index)
+{
+    struct nerves_key_sign_group *group = context;
+    finish_sign_request(group->device, group->requests[index],
+                        group->results[index] < 0 ? CKR_DEVICE_ERROR : CKR_OK);
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_CloseSession)(
-    CK_SESSION_HANDLE hSession
-)
+static void push_sign_request(struct nerves_key_device *device, struct nerves_key_sign_request *request)
 {
-    ENTER();
+    pthread_mutex_lock(&device->pending_mutex);
+    request->seq = device->sign_seq++;
+    request->next = device->pending_signs;
+    device->pending_signs = request;
+    pthread_mutex_unlock(&device->pending_mutex);
+}
 
-    if (hSession != NKCS11_SESSION_MAGIC || session.open_count == 0)
-        return CKR_SLOT_ID_INVALID;
+// Return 1 if request a should be signed before b. This is the queue's order.
+static int signs_before(const struct nerves_key_sign_request *a, const struct nerves_key_sign_request *b)
+{
+    if (nerves_key_queue_goes_first(a->priority, a->deadline_us, b->priority, b->deadline_us))
+        return 1;
+    if (nerves_key_queue_goes_first(b->priority, b->deadline_us, a->priority, a->deadline_us))
+        return 0;
+    return a->seq < b->seq;
+}
+
+/* Take holder and up to max - 1 other requests off the pending list. Only
+   ones in holder's priority class or higher are taken, and of those the ones
+   that the queue would run first. Lower classes wait for their own turn so
+   that they don't hold up holder's class. The group comes back in signing
+   order with holder in its place. max must be at least 2. */
+static size_t take_sign_requests(struct nerves_key_device *device, struct nerves_key_sign_request *holder,
+                                 struct nerves_key_sign_request **requests, size_t max)
+{
+    size_t count = 0;
+
+    pthread_mutex_lock(&device->pending_mutex);
+    for (struct nerves_key_sign_request *r = device->pending_signs; r; r = r->next) {
+        if (r == holder || r->priority < holder->priority)
+            continue;
+        if (count == max - 1 && !signs_before(r, requests[count - 1]))
+            continue;
 
-    session.open_count--;
-    if (session.open_count == 0) {
-        atecc508a_close(session.fd);
-        session.fd = -1;
+        // Insert in order. When it's full, this bumps the last one.
+        size_t i = count < max - 1 ? count++ : count - 1;
+        while (i > 0 && signs_before(r, requests[i - 1])) {
+            requests[i] = requests[i - 1];
+            i--;
+        }
+        requests[i] = r;
     }
-    return CKR_OK;
+
+    // The next one to get the device picks up whatever wasn't taken
+    for (struct nerves_key_sign_request **r = &device->pending_signs; *r;) {
+        int taken = *r == holder;
+        for (size_t i = 0; i < count && !taken; i++)
+            taken = *r == requests[i];
+        if (taken)
+            *r = (*r)->next;
+        else
+            r = &(*r)->next;
+    }
+    pthread_mutex_unlock(&device->pending_mutex);
+
+    size_t i = count++;
+    while (i > 0 && signs_before(holder, requests[i - 1])) {
+        requests[i] = requests[i - 1];
+        i--;
+    }
+    requests[i] = holder;
+    return count;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_CloseAllSessions)(
-    CK_SLOT_ID slotID
-)
+/* Take a request back after the queue turned it away. Return 1 if it was
+   still on the list. Otherwise, whoever has the device is already signing it,
+   so wait for that. */
+static int withdraw_sign_request(struct nerves_key_device *device, struct nerves_key_sign_request *request)
 {
-    ENTER();
-    if (slotID != session.slot_id)
-        return CKR_SLOT_ID_INVALID;
+    int found = 0;
 
-    if (session.open_count > 0) {
-        atecc508a_close(session.fd);
-        session.open_count = 0;
-        session.fd = -1;
+    pthread_mutex_lock(&device->pending_mutex);
+    for (struct nerves_key_sign_request **r = &device->pending_signs; *r; r = &(*r)->next) {
+        if (*r == request) {
+            *r = request->next;
+            found = 1;
+            break;
+        }
     }
-    return CKR_OK;
+    pthread_mutex_unlock(&device->pending_mutex);
+
+    if (!found)
+        nerves_key_queue_wait_done(&device->queue, &request->done);
+    return found;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GetSessionInfo)(
-    CK_SESSION_HANDLE hSession,
-    CK_SESSION_INFO_PTR pInfo
-)
+/* Time left before the earliest deadline in a group or 0 if none of them
+   have one. The agent can only take one deadline for the group. */
+static CK_ULONG group_deadline_ms(struct nerves_key_sign_request **requests, size_t count)
 {
-    ENTER();
-    if (hSession != NKCS11_SESSION_MAGIC || session.open_count == 0)
-        return CKR_SESSION_HANDLE_INVALID;
-    if (pInfo == NULL_PTR)
-        return CKR_ARGUMENTS_BAD;
+    uint64_t earliest_us = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t deadline_us = requests[i]->deadline_us;
+        if (deadline_us && (earliest_us == 0 || deadline_us < earliest_us))
+            earliest_us = deadline_us;
+    }
+    if (earliest_us == 0)
+        return 0;
 
-    pInfo->slotID = session.slot_id;
-    pInfo->state = CKS_RO_PUBLIC_SESSION;
-    pInfo->flags = CKF_SERIAL_SESSION;
-    pInfo->ulDeviceError = 0;
-    return CKR_OK;
+    // One that's already passed still has to go as a deadline, not as none
+    uint64_t now_us = nerves_key_now_us();
+    return earliest_us > now_us ? (CK_ULONG) ((earliest_us - now_us + 999) / 1000) : 1;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GetOperationState)(
-    CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pOperationState,
-    CK_ULONG_PTR pulOperationStateLen
-)
+/* Sign a 32-byte digest along with any other C_Sign calls that are waiting
+   for the same device. Requests that come in while the device is busy pile
+   up, so a burst of them only costs one wakeup. */
+static CK_RV sign_grouped(struct nerves_key_session *s, CK_ULONG deadline_ms, const CK_BYTE *data, CK_BYTE *signature)
 {
-    UNUSED(hSession);
-    UNUSED(pOperationState);
-    UNUSED(pulOperationStateLen);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    struct nerves_key_device *device = s->device;
+    uint64_t deadline_us = deadline_from_ms(deadline_ms);
+    struct nerves_key_sign_request request = {data, signature, s->priority, deadline_us, 0, CKR_DEVICE_ERROR, 0, NULL};
+
+    push_sign_request(device, &request);
+    int result = nerves_key_queue_enter_unless(&device->queue, s->priority, deadline_us, &request.done);
+    if (result != NKCS11_QUEUE_GRANTED) {
+        if (result != NKCS11_QUEUE_DONE && withdraw_sign_request(device, &request)) {
+            nerves_key_queue_count_turned_away(&device->queue, s->priority, result);
+            return queue_result_rv(result);
+        }
+        return request.rv;
+    }
+
+    lock(&device->mutex);
+    if (!__atomic_load_n(&request.done, __ATOMIC_ACQUIRE)) {
+        // Take what's waiting in this caller's class or higher. Each request
+        // gets to go as soon as its signature is done.
+        struct nerves_key_sign_group group;
+        size_t count = take_sign_requests(device, &request, group.requests, NKCS11_MAX_SIGN_GROUP);
+        group.device = device;
+
+        const uint8_t *digests[NKCS11_MAX_SIGN_GROUP];
+        uint8_t *signatures[NKCS11_MAX_SIGN_GROUP];
+        for (size_t i = 0; i < count; i++) {
+            digests[i] = group.requests[i]->data;
+            signatures[i] = group.requests[i]->signature;
+        }
+
+        if (device->use_agent) {
+            // The agent groups these with what other processes send it
+            CK_RV results[NKCS11_MAX_SIGN_GROUP];
+            agent_sign(device, s->priority, group_deadline_ms(group.requests, count), count, digests, signatures,
+                       results);
+            for (size_t i = 0; i < count; i++)
+                finish_sign_request(device, group.requests[i], results[i]);
+        } else {
+            atecc508a_sign_group(&device->dev, 0, count, digests, signatures, group.results,
+                                 sign_request_done, &group);
+        }
+        device->sign_groups++;
+        device->grouped_signs += count;
+    }
+
+    device_leave(s);
+    return request.rv;
+}
+
+/* A C_NKCS11_SignAsync request. It waits in the device's queue like any
+   other caller. Once it has the device, the engine thread runs it a step at a
+   time with the device mutex held. */
+struct nerves_key_async_sign {
+    struct nerves_key_job job;
+    struct nerves_key_device *device;
+    CK_SESSION_HANDLE session;
+    int priority;
+    CK_ULONG deadline_ms;
+    CK_BBOOL granted;
+    CK_BBOOL locked;
+    CK_BBOOL forwarded; // Sent to the agent
+    CK_RV rv;
+    struct atecc508a_sign_op op;
+    CK_NKCS11_ASYNC_SIGN_PTR async;
+};
+
+/* C_Finalize waits for the requests that haven't finished. This needs a
+   condition variable, so it uses pthreads rather than the application's
+   mutex callbacks. */
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_idle = PTHREAD_COND_INITIALIZER;
+static unsigned long async_outstanding;
+
+/* With the agent, the first step sends the request and the ones after that
+   check for the reply. The engine thread doesn't wait on the socket, so
+   requests for other devices keep going in the meantime. */
+#define NKCS11_AGENT_POLL_US 1000
+
+static int agent_sign_step(struct nerves_key_async_sign *request)
+{
+    struct nerves_key_device *device = request->device;
+    struct nerves_key_agent_reply reply;
+    int rc;
+
+    if (!request->forwarded) {
+        struct nerves_key_agent_request agent_request;
+        const uint8_t *digest = request->op.data;
+        agent_sign_request(&agent_request, request->priority, request->deadline_ms, 1, &digest);
+        agent_request.slot = (uint8_t) (device - devices);
+
+        rc = agent_connect(device) < 0 ? -1 : nerves_key_agent_send(device->agent_fd, &agent_request);
+        if (rc == 0) {
+            request->forwarded = CK_TRUE;
+            return NKCS11_AGENT_POLL_US;
+        }
+    } else {
+        rc = nerves_key_agent_receive(device->agent_fd, &reply, 0);
+        if (rc == NKCS11_AGENT_WAIT)
+            return NKCS11_AGENT_POLL_US;
+        if (rc == 0)
+            request->rv = agent_sign_result(&reply, (CK_RV) reply.rv, 1, 0, request->op.signature);
+    }
+
+    if (rc < 0) {
+        agent_disconnect(device);
+        request->rv = CKR_DEVICE_ERROR;
+    }
+    return 0;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_SetOperationState)(
-    CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pOperationState,
-    CK_ULONG ulOperationStateLen,
-    CK_OBJECT_HANDLE hEncryptionKey,
-    CK_OBJECT_HANDLE hAuthenticationKey
-)
+static int async_sign_step(struct nerves_key_job *job)
 {
-    UNUSED(hSession);
-    UNUSED(pOperationState);
-    UNUSED(ulOperationStateLen);
-    UNUSED(hEncryptionKey);
-    UNUSED(hAuthenticationKey);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    struct nerves_key_async_sign *request = (struct nerves_key_async_sign *) job;
+
+    if (!request->locked) {
+        lock(&request->device->mutex);
+        request->locked = CK_TRUE;
+
+        // The session could have been closed while this was in line
+        if (lookup_session(request->session) == NULL) {
+            request->rv = CKR_SESSION_CLOSED;
+            return 0;
+        }
+    }
+
+    if (request->device->use_agent)
+        return agent_sign_step(request);
+
+    int rc = atecc508a_sign_step(&request->device->dev, &request->op);
+    if (rc < 0)
+        request->rv = CKR_DEVICE_ERROR;
+    return rc;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_Login)(
-    CK_SESSION_HANDLE hSession,
-    CK_USER_TYPE userType,
-    CK_UTF8CHAR_PTR pPin,
-    CK_ULONG ulPinLen
-)
+static void async_sign_finish(struct nerves_key_job *job)
 {
-    UNUSED(hSession);
-    UNUSED(userType);
-    UNUSED(pPin);
-    UNUSED(ulPinLen);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    struct nerves_key_async_sign *request = (struct nerves_key_async_sign *) job;
+    CK_NKCS11_ASYNC_SIGN_PTR async = request->async;
+
+    if (request->locked) {
+        schedule_sleep(request->device);
+        unlock(&request->device->mutex);
+    }
+    if (request->granted)
+        nerves_key_queue_leave(&request->device->queue);
+
+    async->rv = request->rv;
+    if (async->Callback)
+        async->Callback(async->pContext, request->rv);
+    if (async->eventFd >= 0) {
+        uint64_t one = 1;
+        if (write(async->eventFd, &one, sizeof(one)) < 0)
+            ERROR("Can't signal the eventfd for C_NKCS11_SignAsync");
+    }
+    free(request);
+
+    pthread_mutex_lock(&async_mutex);
+    if (--async_outstanding == 0)
+        pthread_cond_broadcast(&async_idle);
+    pthread_mutex_unlock(&async_mutex);
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_Logout)(
-    CK_SESSION_HANDLE hSession
-)
+// Called when the request gets the device or waited too long for it
+static void async_sign_granted(void *context, int result)
 {
-    UNUSED(hSession);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    struct nerves_key_async_sign *request = context;
+    if (result != NKCS11_QUEUE_GRANTED) {
+        request->rv = queue_result_rv(result);
+        async_sign_finish(&request->job);
+        return;
+    }
+
+    request->granted = CK_TRUE;
+    if (nerves_key_engine_submit(&request->job) < 0) {
+        request->rv = CKR_FUNCTION_FAILED;
+        async_sign_finish(&request->job);
+    }
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_CreateObject)(
-    CK_SESSION_HANDLE hSession,
-    CK_ATTRIBUTE_PTR pTemplate,
-    CK_ULONG ulCount,
-    CK_OBJECT_HANDLE_PTR phObject
-)
+static void wait_for_async_signs(void)
 {
-    UNUSED(hSession);
-    UNUSED(pTemplate);
-    UNUSED(ulCount);
-    UNUSED(phObject);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    pthread_mutex_lock(&async_mutex);
+    while (async_outstanding > 0)
+        pthread_cond_wait(&async_idle, &async_mutex);
+    pthread_mutex_unlock(&async_mutex);
+
+    nerves_key_engine_stop();
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_CopyObject)(
-    CK_SESSION_HANDLE hSession,
-    CK_OBJECT_HANDLE hObject,
-    CK_ATTRIBUTE_PTR pTemplate,
-    CK_ULONG ulCount,
-    CK_OBJECT_HANDLE_PTR phNewObject
-)
+static CK_SESSION_HANDLE session_handle(const struct nerves_key_session *s)
 {
-    UNUSED(hSession);
-    UNUSED(hObject);
-    UNUSED(pTemplate);
-    UNUSED(ulCount);
-    UNUSED(phNewObject);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    return (s->generation << SESSION_INDEX_BITS) | (CK_ULONG) (s - sessions + 1);
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_DestroyObject)(
-    CK_SESSION_HANDLE hSession,
-    CK_OBJECT_HANDLE hObject
-)
+static const struct nerves_key_snapshot *current_snapshot(const struct nerves_key_device *device)
 {
-    UNUSED(hSession);
-    UNUSED(hObject);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    return __atomic_load_n(&device->snapshot, __ATOMIC_ACQUIRE);
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GetObjectSize)(
-    CK_SESSION_HANDLE hSession,
-    CK_OBJECT_HANDLE hObject,
-    CK_ULONG_PTR pulSize
-)
+static struct nerves_key_snapshot *copy_snapshot(const struct nerves_key_snapshot *from)
 {
-    UNUSED(hSession);
-    UNUSED(hObject);
-    UNUSED(pulSize);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    struct nerves_key_snapshot *snapshot = malloc(sizeof(struct nerves_key_snapshot));
+    if (snapshot == NULL)
+        return NULL;
+
+    if (from) {
+        *snapshot = *from;
+    } else {
+        // The one ATECC key is exposed as a private and a public key object
+        memset(snapshot, 0, sizeof(*snapshot));
+        snapshot->object_count = 2;
+        snapshot->objects[0] = OBJECT_HANDLE_PRIVATE_KEY;
+        snapshot->classes[0] = CKO_PRIVATE_KEY;
+        snapshot->objects[1] = OBJECT_HANDLE_PUBLIC_KEY;
+        snapshot->classes[1] = CKO_PUBLIC_KEY;
+    }
+    snapshot->replaced = NULL;
+    return snapshot;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GetAttributeValue)(
-    CK_SESSION_HANDLE hSession,
-    CK_OBJECT_HANDLE hObject,
-    CK_ATTRIBUTE_PTR pTemplate,
-    CK_ULONG ulCount
-)
+// Call with the device mutex held
+static void publish_snapshot(struct nerves_key_device *device, struct nerves_key_snapshot *snapshot)
 {
-    ENTER();
-    if (hSession != NKCS11_SESSION_MAGIC || session.open_count == 0)
-        return CKR_SESSION_HANDLE_INVALID;
+    snapshot->replaced = device->snapshot;
+    __atomic_store_n(&device->snapshot, snapshot, __ATOMIC_RELEASE);
+}
 
-    if (pTemplate == NULL_PTR || ulCount == 0)
-        return CKR_ARGUMENTS_BAD;
+static enum atecc508a_variant variant_named(const char *name)
+{
+    for (int variant = ATECC508A_VARIANT_508A; variant <= ATECC508A_VARIANT_608B; variant++) {
+        if (strcmp(name, atecc508a_variant_name((enum atecc508a_variant) variant)) == 0)
+            return (enum atecc508a_variant) variant;
+    }
+    return ATECC508A_VARIANT_UNKNOWN;
+}
 
-    CK_RV rv_final = CKR_OK;
-    for (CK_ULONG i = 0; i < ulCount; i++) {
-        CK_RV rv;
+/* Call with the device mutex held. Ask the agent for what the metadata
+   queries need to know about its chip. */
+static CK_RV agent_read_info(struct nerves_key_device *device, struct nerves_key_snapshot *snapshot)
+{
+    struct nerves_key_agent_request request;
+    struct nerves_key_agent_reply reply;
+    memset(&request, 0, sizeof(request));
+    request.op = NKCS11_AGENT_INFO;
 
-        INFO("C_GetAttributeValue object %lu, attribute %lu", hObject, pTemplate[i].type);
-        switch (pTemplate[i].type) {
-        case CKA_KEY_TYPE:
-            // Type of key.
-            if (pTemplate[i].pValue == NULL_PTR) {
-                pTemplate[i].ulValueLen = sizeof(CK_ULONG);
-                rv = CKR_OK;
-            } else if (pTemplate[i].ulValueLen >= sizeof(CK_ULONG)) {
-                pTemplate[i].ulValueLen = sizeof(CK_ULONG);
-                *((CK_ULONG *) pTemplate[i].pValue) = CKK_ECDSA;
-                rv = CKR_OK;
-            } else {
-                pTemplate[i].ulValueLen = (CK_ULONG) -1;
-                rv = CKR_BUFFER_TOO_SMALL;
-            }
-            break;
+    CK_RV rv = agent_call(device, &request, &reply);
+    if (rv != CKR_OK)
+        return rv;
 
-        case CKA_LABEL:
-            INFO("LABEL");
-            // Description of the object. PKCS#11 labels are NOT NUL-terminated,
-            // so report the exact byte length and copy without the terminator.
-        {
-            char label[16];
-            int label_len = snprintf(label, sizeof(label), "%lu", session.slot_id);
-            if (pTemplate[i].pValue == NULL_PTR) {
-                pTemplate[i].ulValueLen = (CK_ULONG) label_len;
-                rv = CKR_OK;
-            } else if (pTemplate[i].ulValueLen >= (CK_ULONG) label_len) {
-                pTemplate[i].ulValueLen = (CK_ULONG) label_len;
-                memcpy(pTemplate[i].pValue, label, (size_t) label_len);
-                rv = CKR_OK;
-            } else {
-                pTemplate[i].ulValueLen = (CK_ULONG) -1;
-                rv = CKR_BUFFER_TOO_SMALL;
-            }
-            break;
-        }
+    memcpy(snapshot->serial_number, reply.info.serial_number, sizeof(snapshot->serial_number));
+    snapshot->has_serial_number = CK_TRUE;
+    if (reply.info.has_public_key) {
+        memcpy(snapshot->public_key, reply.info.public_key, sizeof(snapshot->public_key));
+        snapshot->has_public_key = CK_TRUE;
+    }
+    reply.info.chip_name[sizeof(reply.info.chip_name) - 1] = '\0';
+    snapshot->variant = variant_named(reply.info.chip_name);
+    return CKR_OK;
+}
 
-        case CKA_ID:
-            INFO("ID");
-            // Key identifier for public/private key pair (default empty).
-            if (pTemplate[i].pValue == NULL_PTR) {
-                pTemplate[i].ulValueLen = 1;
-                rv = CKR_OK;
-            } else if (pTemplate[i].ulValueLen >= 1) {
-                pTemplate[i].ulValueLen = 1;
-                // NOTE: This cannot possibly be the intended use, but it currently
-                //       makes the URL nice.
-                *((CK_BYTE *) pTemplate[i].pValue) = '0' + (CK_BYTE) session.slot_id;
-                rv = CKR_OK;
-            } else {
-                pTemplate[i].ulValueLen = (CK_ULONG) -1;
-                rv = CKR_BUFFER_TOO_SMALL;
-            }
-            break;
+// Call with the device mutex held
+static int read_public_key(struct nerves_key_device *device, struct nerves_key_snapshot *snapshot)
+{
+    if (device->use_agent)
+        return agent_read_info(device, snapshot) == CKR_OK && snapshot->has_public_key ? 0 : -1;
 
-        case CKA_EC_PARAMS:
-            // DER-encoding of an ANSI X9.62 Parameters value.
-        {
-            // OID 1.2.840.10045.3.1.7 (prime256v1). Use a byte array (NOT a
-            // string literal) so the length is exactly 10, with no trailing NUL.
-            static const CK_BYTE prime256v1[] = {
-                0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07
-            };
-            const unsigned long params_len = sizeof(prime256v1);
-            if (pTemplate[i].pValue == NULL_PTR) {
-                pTemplate[i].ulValueLen = params_len;
-                rv = CKR_OK;
-            } else if (pTemplate[i].ulValueLen >= params_len) {
-                pTemplate[i].ulValueLen = params_len;
-                memcpy(pTemplate[i].pValue, prime256v1, params_len);
-                rv = CKR_OK;
-            } else {
-                pTemplate[i].ulValueLen = (CK_ULONG) -1;
-                rv = CKR_BUFFER_TOO_SMALL;
-            }
-            break;
-        }
-        case CKA_EC_POINT:
-            // PKCS#11 requires the ECPoint as a DER-encoded ASN.1 OCTET STRING
-            // wrapping the raw uncompressed point (0x04 || X || Y). Emit:
-            //   04 41 <65-byte point>   (tag, length=0x41=65, point)
+    struct nerves_key_cached_key *cached = &key_cache[device - devices];
+    CK_BBOOL same_chip = snapshot->has_serial_number &&
+                         cached->transport == device->dev.transport &&
+                         memcmp(cached->serial_number, snapshot->serial_number, sizeof(cached->serial_number)) == 0;
+    if (cached->valid && same_chip) {
+        memcpy(snapshot->public_key, cached->public_key, sizeof(snapshot->public_key));
+        snapshot->has_public_key = CK_TRUE;
+        return 0;
+    }
+
+    snapshot->public_key[0] = 0x04; // uncompressed point prefix
+    if (atecc508a_derive_public_key(&device->dev, 0, &snapshot->public_key[1]) < 0) {
+        INFO("Error getting public key!");
+        return -1;
+    }
+    snapshot->has_public_key = CK_TRUE;
+
+    // Without a serial number, there'd be no way to tell if it's the same chip next time
+    cached->valid = snapshot->has_serial_number;
+    if (cached->valid) {
+        cached->transport = device->dev.transport;
+        memcpy(cached->serial_number, snapshot->serial_number, sizeof(cached->serial_number));
+        memcpy(cached->public_key, snapshot->public_key, sizeof(cached->public_key));
+    }
+    return 0;
+}
+
+/* Call with the device mutex held. If NERVES_KEY_CACHE_FILE has what was
+   learned about this chip last time, use it. Returns 0 if it was there. */
+static int restore_saved_state(struct nerves_key_device *device, struct nerves_key_snapshot *snapshot)
+{
+    struct nerves_key_cache_record record;
+    if (!snapshot->has_serial_number ||
+        nerves_key_cache_lookup(snapshot->serial_number, &record) < 0 ||
+        record.variant != (uint8_t) device->dev.variant)
+        return -1;
+
+    for (int i = 0; i < ATECC508A_TIMING_OPCODES; i++)
+        atecc508a_set_timing(&device->dev, &record.timing[i]);
+
+    if (record.has_public_key) {
+        memcpy(snapshot->public_key, record.public_key, sizeof(snapshot->public_key));
+        snapshot->has_public_key = CK_TRUE;
+    }
+    return 0;
+}
+
+// Call with the device mutex held
+static void save_state(struct nerves_key_device *device, const struct nerves_key_snapshot *snapshot)
+{
+    if (!snapshot->has_serial_number)
+        return;
+
+    struct nerves_key_cache_record record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.serial_number, snapshot->serial_number, sizeof(record.serial_number));
+    record.variant = (uint8_t) device->dev.variant;
+    record.chip_mode = device->dev.chip_mode;
+    record.slot_id = (uint8_t) (device - devices);
+    record.has_public_key = snapshot->has_public_key;
+    memcpy(record.public_key, snapshot->public_key, sizeof(record.public_key));
+    memcpy(record.timing, device->dev.timing, sizeof(record.timing));
+    nerves_key_cache_save(&record);
+}
+
+/* Call with the device mutex held after reading the serial number. If another
+   process already read this slot's chip and NERVES_KEY_SHM is set, use what
+   it found instead of reading the public key. Returns 0 if there was
+   something. */
+static int restore_shared_state(struct nerves_key_device *device, struct nerves_key_snapshot *snapshot)
+{
+    unsigned int slot = (unsigned int) (device - devices);
+    struct nerves_key_shared_device shared;
+    if (!snapshot->has_serial_number || nerves_key_shm_get(slot, device->dev.transport->name, &shared) < 0)
+        return -1;
+
+    // Entries are by slot, so the chip could have been swapped since
+    if (memcmp(shared.serial_number, snapshot->serial_number, sizeof(shared.serial_number)) != 0) {
+        INFO("Dropping the shared entry for slot %u. It's for a different chip.", slot);
+        nerves_key_shm_drop(slot, shared.serial_number);
+        return -1;
+    }
+
+    memcpy(snapshot->public_key, shared.public_key, sizeof(snapshot->public_key));
+    snapshot->has_public_key = CK_TRUE;
+    atecc508a_set_identity(&device->dev, (enum atecc508a_variant) shared.variant, shared.chip_mode);
+    return 0;
+}
+
+// Call with the device mutex held
+static void share_state(struct nerves_key_device *device, const struct nerves_key_snapshot *snapshot)
+{
+    // Other processes only read the serial number, so only share complete
+    // entries. The agent shares what it reads for itself.
+    if (device->use_agent || !snapshot->has_serial_number || !snapshot->has_public_key)
+        return;
+
+    struct nerves_key_shared_device shared;
+    memset(&shared, 0, sizeof(shared));
+    snprintf(shared.transport, sizeof(shared.transport), "%s", device->dev.transport->name);
+    memcpy(shared.serial_number, snapshot->serial_number, sizeof(shared.serial_number));
+    shared.variant = (uint8_t) device->dev.variant;
+    shared.chip_mode = device->dev.chip_mode;
+    shared.has_public_key = 1;
+    memcpy(shared.public_key, snapshot->public_key, sizeof(shared.public_key));
+    nerves_key_shm_put((unsigned int) (device - devices), &shared);
+}
+
+/* With NERVES_KEY_SHM, processes take turns on each chip through the shared
+   memory segment so that their commands don't get mixed up. */
+static int shm_acquire(void *context, int blocking)
+{
+    struct nerves_key_device *device = context;
+    int rc = nerves_key_shm_acquire((unsigned int) (device - devices), blocking, &device->turn);
+    return rc == NKCS11_SHM_WAIT ? ATECC508A_ARBITER_WAIT : rc;
+}
+
+static void shm_release(void *context)
+{
+    struct nerves_key_device *device = context;
+    nerves_key_shm_release((unsigned int) (device - devices), &device->turn);
+}
+
+static const struct atecc508a_arbiter shm_arbiter = {
+    .acquire = shm_acquire,
+    .release = shm_release
+};
+
+// Returns 0 if the NERVES_KEY_SHM segment is open
+static int open_shm(void)
+{
+    const char *shm_name = getenv("NERVES_KEY_SHM");
+    if (shm_name == NULL || *shm_name == '\0')
+        return -1;
+
+    return nerves_key_shm_open(shm_name);
+}
+
+// Call with the device mutex held
+static CK_RV open_agent_device(struct nerves_key_device *device)
+{
+    struct nerves_key_snapshot *snapshot = copy_snapshot(NULL);
+    if (snapshot == NULL)
+        return CKR_HOST_MEMORY;
+
+    device->use_agent = CK_TRUE;
+    CK_RV rv = agent_read_info(device, snapshot);
+    if (rv != CKR_OK) {
+        agent_disconnect(device);
+        device->use_agent = CK_FALSE;
+        free(snapshot);
+        return rv;
+    }
+
+    publish_snapshot(device, snapshot);
+    return CKR_OK;
+}
+
+/* Call with the device mutex held. This reads everything that the metadata
+   queries need up front so that they don't have to wait on the ATECC. */
+static CK_RV open_device(CK_SLOT_ID slotID)
+{
+    struct nerves_key_device *device = &devices[slotID];
+    nerves_key_queue_set_limits(&device->queue, (unsigned long) env_int("NERVES_KEY_QUEUE_LIMIT", 0),
+                                (uint64_t) env_int("NERVES_KEY_QUEUE_MAX_WAIT_MS", 0) * 1000);
+    if (agent_socket())
+        return open_agent_device(device);
+
+    char i2c_path[16];
+    uint8_t addr;
+    sprintf(i2c_path, "/dev/i2c-%lu", (slotID % DEVICE_INDEX_SPLIT));
+
+    if(slotID >= DEVICE_INDEX_SPLIT) {
+        addr = ATECC508A_TRUST_AND_GO_ADDR;
+    } else {
+        addr = ATECC508A_DEFAULT_ADDR;
+    }
+
+    const struct atecc508a_transport *transport = selected_transport();
+    if (transport == NULL)
+        return CKR_DEVICE_ERROR;
+
+    if (atecc508a_open(&device->dev, transport, i2c_path, addr) < 0) {
+        ERROR("Error opening I2C bus: %s", i2c_path);
+        return CKR_DEVICE_ERROR;
+    }
+    // Without the engine thread, nothing would put the chip to sleep
+    int keep_awake_ms = can_create_threads ? ATECC508A_KEEP_AWAKE_DEFAULT_US / 1000 : 0;
+    atecc508a_set_keep_awake(&device->dev, env_int("NERVES_KEY_KEEP_AWAKE_MS", keep_awake_ms) * 1000);
+
+    struct nerves_key_snapshot *snapshot = copy_snapshot(NULL);
+    if (snapshot == NULL) {
+        atecc508a_close(&device->dev);
+        return CKR_HOST_MEMORY;
+    }
+
+    const char *cache_file = getenv("NERVES_KEY_CACHE_FILE");
+    if (cache_file && *cache_file)
+        nerves_key_cache_open(cache_file);
+    if (open_shm() == 0) {
+        memset(&device->turn, 0, sizeof(device->turn));
+        atecc508a_set_arbiter(&device->dev, &shm_arbiter, device);
+    }
+
+    // If these fail, the session still opens. The public key is tried again
+    // when it's asked for.
+    if (atecc508a_read_serial(&device->dev, snapshot->serial_number) == 0)
+        snapshot->has_serial_number = CK_TRUE;
+
+    if (restore_shared_state(device, snapshot) == 0) {
+        // Only the learned timing is needed from the cache file
+        restore_saved_state(device, snapshot);
+    } else {
+        if (restore_saved_state(device, snapshot) < 0) {
+            read_public_key(device, snapshot);
+            save_state(device, snapshot);
+        }
+        share_state(device, snapshot);
+    }
+    snapshot->variant = device->dev.variant;
+
+    publish_snapshot(device, snapshot);
+    return CKR_OK;
+}
+
+/* Call with the device mutex and the table mutex held once the last session
+   is gone. This only hides the snapshot from C_GetSlotInfo and friends. The
+   slow part is close_device(), which runs after the table mutex is released. */
+static void detach_device(struct nerves_key_device *device)
+{
+    device->detached = device->snapshot;
+    __atomic_store_n(&device->snapshot, NULL, __ATOMIC_RELEASE);
+}
+
+// Call with the device mutex held and after detach_device()
+static void close_device(struct nerves_key_device *device)
+{
+    if (device->use_agent) {
+        agent_disconnect(device);
+        device->use_agent = CK_FALSE;
+    } else {
+        // Keep what was learned about the poll timing for next time
+        if (device->detached)
+            save_state(device, device->detached);
+        atecc508a_close(&device->dev);
+    }
+
+    if (env_int("NERVES_KEY_QUEUE_REPORT", 0)) {
+        char name[16];
+        sprintf(name, "slot %d", (int) (device - devices));
+        nerves_key_queue_report(&device->queue, name);
+        if (device->sign_groups)
+            fprintf(stderr, "%s: %s: %lu signatures in %lu wake cycles\r\n",
+                    PROGNAME, name, device->grouped_signs, device->sign_groups);
+
+        struct nerves_key_bus_stats bus;
+        if (device->dev.arbiter && nerves_key_shm_get_bus_stats((unsigned int) (device - devices), &bus) == 0 &&
+            bus.turns)
+            fprintf(stderr, "%s: %s: %llu turns for all processes, %llu waited (mean %llu us, max %llu us), %llu handoffs, %llu takeovers\r\n",
+                    PROGNAME, name, (unsigned long long) bus.turns, (unsigned long long) bus.contended,
+                    (unsigned long long) (bus.contended ? bus.total_wait_us / bus.contended : 0),
+                    (unsigned long long) bus.max_wait_us, (unsigned long long) bus.handoffs,
+                    (unsigned long long) bus.takeovers);
+    }
+
+    struct nerves_key_snapshot *snapshot = device->detached;
+    device->detached = NULL;
+    while (snapshot) {
+        struct nerves_key_snapshot *replaced = snapshot->replaced;
+        free(snapshot);
+        snapshot = replaced;
+    }
+}
+
+// Call with the device mutex held
+static void end_message_sign(struct nerves_key_session *s)
+{
+    if (s->message_sign_active) {
+        atecc508a_release_awake(&s->device->dev);
+        schedule_sleep(s->device);
+    }
+
+    s->message_sign_active = CK_FALSE;
+    s->message_part_active = CK_FALSE;
+}
+
+/* Call with the device mutex held. Returns true if this was the device's last
+   session. The caller then calls close_device(). */
+static CK_BBOOL close_session(struct nerves_key_session *s)
+{
+    struct nerves_key_device *device = s->device;
+
+    end_message_sign(s);
+
+    lock(&table_mutex);
+    device->open_count--;
+    CK_BBOOL last = device->open_count == 0;
+    if (last)
+        detach_device(device);
+
+    // Bump the generation so that the old handle stops working
+    __atomic_store_n(&s->handle, 0, __ATOMIC_RELEASE);
+    s->generation++;
+    s->next_free = free_session;
+    free_session = (int) (s - sessions);
+    unlock(&table_mutex);
+
+    return last;
+}
+
+// Close every session on a slot
+static void close_slot(CK_SLOT_ID slotID)
+{
+    struct nerves_key_device *device = &devices[slotID];
+    lock(&device->mutex);
+
+    // No sessions can be opened on the slot while its mutex is held
+    int on_slot[NKCS11_MAX_SESSIONS];
+    int count = 0;
+    lock(&table_mutex);
+    for (int i = 0; i < NKCS11_MAX_SESSIONS; i++) {
+        if (sessions[i].handle && sessions[i].slot_id == slotID)
+            on_slot[count++] = i;
+    }
+    unlock(&table_mutex);
+
+    CK_BBOOL last = CK_FALSE;
+    for (int i = 0; i < count; i++)
+        last = close_session(&sessions[on_slot[i]]);
+    if (last)
+        close_device(device);
+    unlock(&device->mutex);
+}
+
+// See https://www.cryptsoft.com/pkcs11doc/
+
+// https://www.cryptsoft.com/pkcs11doc/v220/pkcs11__all_8h.html
+
+/* General Purpose */
+
+CK_DEFINE_FUNCTION(CK_RV, C_Initialize)(
+    CK_VOID_PTR pInitArgs
+)
+{
+    ENTER();
+
+    if (initialized)
+        return CKR_CRYPTOKI_ALREADY_INITIALIZED;
+
+    CK_RV rv = check_init_args((CK_C_INITIALIZE_ARGS_PTR) pInitArgs);
+    if (rv != CKR_OK)
+        return rv;
+
+    init_sessions();
+    initialized = CK_TRUE;
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_Finalize)(
+    CK_VOID_PTR pReserved
+)
+{
+    ENTER();
+    if (pReserved != NULL_PTR)
+        return CKR_ARGUMENTS_BAD;
+    if (!initialized)
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    wait_for_async_signs();
+    for (CK_SLOT_ID i = 0; i <= MAX_SLOT_ID; i++)
+        close_slot(i);
+    initialized = CK_FALSE;
+
+    free_sessions();
+    nerves_key_cache_close();
+    nerves_key_shm_close();
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetInfo)(
+    CK_INFO_PTR pInfo
+)
+{
+    ENTER();
+    *pInfo = library_info;
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetFunctionList)(
+    CK_FUNCTION_LIST_PTR_PTR ppFunctionList
+)
+{
+    ENTER();
+
+    if(ppFunctionList == NULL_PTR) {
+        INFO("GetFunctionList called with ppFunctionList = NULL");
+        return CKR_ARGUMENTS_BAD;
+    }
+    *ppFunctionList = &function_list;
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_NKCS11_GetFunctionList)(
+    CK_NKCS11_FUNCTION_LIST_PTR_PTR ppFunctionList
+)
+{
+    ENTER();
+
+    if (ppFunctionList == NULL_PTR)
+        return CKR_ARGUMENTS_BAD;
+
+    *ppFunctionList = &vendor_function_list;
+    return CKR_OK;
+}
+
+/* Slot and token management */
+
+static int bus_present(const struct atecc508a_transport *transport, CK_ULONG bus)
+{
+    char path[16];
+    sprintf(path, "/dev/i2c-%lu", bus);
+    INFO("Checking %s", path);
+
+    struct atecc508a dev;
+    if (atecc508a_open(&dev, transport, path, ATECC508A_DEFAULT_ADDR) < 0)
+        return 0;
+
+    INFO("Found %lu", bus);
+    atecc508a_close(&dev);
+    return 1;
+}
+
+/* Return a bit for each bus with an ATECC. With NERVES_KEY_AGENT_SOCKET,
+   the agent has the buses, so it's asked instead. */
+static uint32_t present_buses(const struct atecc508a_transport *transport)
+{
+    uint32_t buses = 0;
+    const char *path = agent_socket();
+    if (path) {
+        struct nerves_key_agent_request request;
+        struct nerves_key_agent_reply reply;
+        memset(&request, 0, sizeof(request));
+        request.op = NKCS11_AGENT_LIST;
+
+        int fd = nerves_key_agent_connect(path);
+        if (fd < 0)
+            return 0;
+        if (nerves_key_agent_call(fd, &request, &reply) == 0 && reply.rv == CKR_OK)
+            buses = (reply.slots | reply.slots >> DEVICE_INDEX_SPLIT) & ((1U << DEVICE_INDEX_SPLIT) - 1);
+        close(fd);
+        return buses;
+    }
+
+    for (CK_ULONG bus = 0; bus < DEVICE_INDEX_SPLIT; bus++) {
+        if (bus_present(transport, bus))
+            buses |= 1U << bus;
+    }
+    return buses;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetSlotList)(
+    CK_BBOOL tokenPresent,
+    CK_SLOT_ID_PTR pSlotList,
+    CK_ULONG_PTR pulCount
+)
+{
+    UNUSED(tokenPresent);
+
+    ENTER();
+
+    CK_ULONG count = 0;
+    CK_ULONG base_count;
+    CK_ULONG max_count = (pSlotList == NULL_PTR ? (MAX_SLOT_ID + 1) : *pulCount);
+    INFO("GetSlotList pSlotList=%p, max_count=%lu", pSlotList, max_count);
+
+    const struct atecc508a_transport *transport = selected_transport();
+    if (transport == NULL)
+        return CKR_GENERAL_ERROR;
+
+    uint32_t buses = present_buses(transport);
+    for (CK_ULONG i = 0; i < DEVICE_INDEX_SPLIT; i++) {
+        if (buses & (1U << i)) {
+            if (count >= max_count)
+                return CKR_BUFFER_TOO_SMALL;
+
+            if (pSlotList)
+                pSlotList[count] = i;
+
+            count++;
+        }
+    }
+
+    // Replicate entries to support the alternative Trust&Go address
+    base_count = count;
+    for (CK_ULONG i = 0; i < base_count; i++) {
+        if (count >= max_count)
+            return CKR_BUFFER_TOO_SMALL;
+
+        if (pSlotList)
+            pSlotList[count] = pSlotList[i] + DEVICE_INDEX_SPLIT;
+
+        count ++;
+    }
+
+    *pulCount = count;
+
+#ifdef DEBUG
+    INFO("Final count is %lu", count);
+    if (pSlotList) {
+        for (CK_ULONG i = 0; i < count; i++) {
+            INFO("  found --> %lu", pSlotList[i]);
+        }
+    }
+#endif
+
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetSlotInfo)(
+    CK_SLOT_ID slotID,
+    CK_SLOT_INFO_PTR pInfo
+)
+{
+    if (slotID > MAX_SLOT_ID)
+        return CKR_SLOT_ID_INVALID;
+    if (pInfo == NULL_PTR)
+        return CKR_ARGUMENTS_BAD;
+
+    ENTER();
+    INFO("Get slot info for %lu", slotID);
+    *pInfo = slot_info_template;
+
+    enum atecc508a_variant variant = ATECC508A_VARIANT_UNIDENTIFIED;
+    if (initialized) {
+        lock(&table_mutex);
+        const struct nerves_key_snapshot *snapshot = current_snapshot(&devices[slotID]);
+        if (snapshot)
+            variant = snapshot->variant;
+        unlock(&table_mutex);
+    }
+
+    if (variant == ATECC508A_VARIANT_UNIDENTIFIED)
+        sprintf((char*) pInfo->slotDescription, "NervesKey slotID %lu", slotID);
+    else
+        sprintf((char*) pInfo->slotDescription, "NervesKey slotID %lu (%s)", slotID, atecc508a_variant_name(variant));
+
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetTokenInfo)(
+    CK_SLOT_ID slotID,
+    CK_TOKEN_INFO_PTR pInfo
+)
+{
+    ENTER();
+    if (slotID > MAX_SLOT_ID)
+        return CKR_SLOT_ID_INVALID;
+
+    *pInfo = slot_token_info_template;
+    sprintf((char*) pInfo->label, "%lu", slotID);
+    if (initialized) {
+        // The table mutex keeps the device from being closed while the
+        // snapshot is in use. It's never held for long.
+        lock(&table_mutex);
+        pInfo->ulSessionCount = devices[slotID].open_count;
+        const struct nerves_key_snapshot *snapshot = current_snapshot(&devices[slotID]);
+        if (snapshot && snapshot->has_serial_number) {
+            // The field is 16 characters, so skip the first byte. It's always 0x01.
+            char serial[17];
+            for (int i = 0; i < 8; i++)
+                sprintf(&serial[i * 2], "%02X", snapshot->serial_number[i + 1]);
+            memset(pInfo->serialNumber, ' ', sizeof(pInfo->serialNumber));
+            memcpy(pInfo->serialNumber, serial, 16);
+        }
+        unlock(&table_mutex);
+    }
+
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_WaitForSlotEvent)(
+    CK_FLAGS flags,
+    CK_SLOT_ID_PTR pSlot,
+    CK_VOID_PTR pReserved
+)
+{
+    UNUSED(flags);
+    UNUSED(pSlot);
+    UNUSED(pReserved);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetMechanismList)(
+    CK_SLOT_ID slotID,
+    CK_MECHANISM_TYPE_PTR pMechanismList,
+    CK_ULONG_PTR pulCount
+)
+{
+    UNUSED(slotID);
+    UNUSED(pMechanismList);
+    UNUSED(pulCount);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetMechanismInfo)(
+    CK_SLOT_ID slotID,
+    CK_MECHANISM_TYPE type,
+    CK_MECHANISM_INFO_PTR pInfo
+)
+{
+    UNUSED(slotID);
+    UNUSED(type);
+    UNUSED(pInfo);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_InitToken)(
+    CK_SLOT_ID slotID,
+    CK_UTF8CHAR_PTR pPin,
+    CK_ULONG ulPinLen,
+    CK_UTF8CHAR_PTR pLabel
+)
+{
+    UNUSED(slotID);
+    UNUSED(pPin);
+    UNUSED(ulPinLen);
+    UNUSED(pLabel);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_InitPIN)(
+    CK_SESSION_HANDLE hSession,
+    CK_UTF8CHAR_PTR pPin,
+    CK_ULONG ulPinLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pPin);
+    UNUSED(ulPinLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_SetPIN)(
+    CK_SESSION_HANDLE hSession,
+    CK_UTF8CHAR_PTR pOldPin,
+    CK_ULONG ulOldLen,
+    CK_UTF8CHAR_PTR pNewPin,
+    CK_ULONG ulNewLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pOldPin);
+    UNUSED(ulOldLen);
+    UNUSED(pNewPin);
+    UNUSED(ulNewLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_OpenSession)(
+    CK_SLOT_ID slotID,
+    CK_FLAGS flags,
+    CK_VOID_PTR pApplication,
+    CK_NOTIFY Notify,
+    CK_SESSION_HANDLE_PTR phSession
+)
+{
+    ENTER();
+    if (slotID > MAX_SLOT_ID)
+        return CKR_SLOT_ID_INVALID;
+    if (phSession == NULL_PTR)
+        return CKR_ARGUMENTS_BAD;
+    if ((flags & CKF_SERIAL_SESSION) == 0)
+        return CKR_SESSION_PARALLEL_NOT_SUPPORTED;
+
+    if ((flags & CKF_RW_SESSION))
+        return CKR_TOKEN_WRITE_PROTECTED;
+
+    // Unused
+    UNUSED(pApplication);
+    UNUSED(Notify);
+
+    if (!initialized)
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    // The device mutex is held while opening the device so that other
+    // sessions on it wait until it's ready.
+    struct nerves_key_device *device = &devices[slotID];
+    lock(&device->mutex);
+    if (device->open_count == 0) {
+        CK_RV rv = open_device(slotID);
+        if (rv != CKR_OK) {
+            unlock(&device->mutex);
+            return rv;
+        }
+    }
+
+    lock(&table_mutex);
+    if (free_session < 0) {
+        CK_BBOOL unused = device->open_count == 0;
+        if (unused)
+            detach_device(device);
+        unlock(&table_mutex);
+        if (unused)
+            close_device(device);
+        unlock(&device->mutex);
+        return CKR_SESSION_COUNT;
+    }
+
+    struct nerves_key_session *s = &sessions[free_session];
+    free_session = s->next_free;
+
+    s->slot_id = slotID;
+    s->device = device;
+    s->find_index = 0;
+    s->find_class_filtered = CK_FALSE;
+    s->sign_active = CK_FALSE;
+    s->message_sign_active = CK_FALSE;
+    s->message_part_active = CK_FALSE;
+    if (flags & CKF_NKCS11_PRIORITY_INTERACTIVE)
+        s->priority = NKCS11_PRIORITY_INTERACTIVE;
+    else if (flags & CKF_NKCS11_PRIORITY_BACKGROUND)
+        s->priority = NKCS11_PRIORITY_BACKGROUND;
+    else
+        s->priority = NKCS11_PRIORITY_NORMAL;
+    device->open_count++;
+    __atomic_store_n(&s->handle, session_handle(s), __ATOMIC_RELEASE);
+
+    *phSession = s->handle;
+    unlock(&table_mutex);
+    schedule_sleep(device);
+    unlock(&device->mutex);
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_CloseSession)(
+    CK_SESSION_HANDLE hSession
+)
+{
+    ENTER();
+
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+
+    struct nerves_key_device *device = s->device;
+    lock(&device->mutex);
+    lock(&table_mutex);
+    // Another thread could have closed it since the lookup
+    CK_BBOOL still_open = s->handle == hSession;
+    unlock(&table_mutex);
+    if (still_open && close_session(s))
+        close_device(device);
+    unlock(&device->mutex);
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_CloseAllSessions)(
+    CK_SLOT_ID slotID
+)
+{
+    ENTER();
+    if (!initialized)
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    if (slotID > MAX_SLOT_ID)
+        return CKR_SLOT_ID_INVALID;
+
+    close_slot(slotID);
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetSessionInfo)(
+    CK_SESSION_HANDLE hSession,
+    CK_SESSION_INFO_PTR pInfo
+)
+{
+    ENTER();
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (pInfo == NULL_PTR)
+        return CKR_ARGUMENTS_BAD;
+
+    pInfo->slotID = s->slot_id;
+    pInfo->state = CKS_RO_PUBLIC_SESSION;
+    pInfo->flags = CKF_SERIAL_SESSION;
+    pInfo->ulDeviceError = 0;
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetOperationState)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pOperationState,
+    CK_ULONG_PTR pulOperationStateLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pOperationState);
+    UNUSED(pulOperationStateLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_SetOperationState)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pOperationState,
+    CK_ULONG ulOperationStateLen,
+    CK_OBJECT_HANDLE hEncryptionKey,
+    CK_OBJECT_HANDLE hAuthenticationKey
+)
+{
+    UNUSED(hSession);
+    UNUSED(pOperationState);
+    UNUSED(ulOperationStateLen);
+    UNUSED(hEncryptionKey);
+    UNUSED(hAuthenticationKey);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_Login)(
+    CK_SESSION_HANDLE hSession,
+    CK_USER_TYPE userType,
+    CK_UTF8CHAR_PTR pPin,
+    CK_ULONG ulPinLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(userType);
+    UNUSED(pPin);
+    UNUSED(ulPinLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_Logout)(
+    CK_SESSION_HANDLE hSession
+)
+{
+    UNUSED(hSession);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_CreateObject)(
+    CK_SESSION_HANDLE hSession,
+    CK_ATTRIBUTE_PTR pTemplate,
+    CK_ULONG ulCount,
+    CK_OBJECT_HANDLE_PTR phObject
+)
+{
+    UNUSED(hSession);
+    UNUSED(pTemplate);
+    UNUSED(ulCount);
+    UNUSED(phObject);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_CopyObject)(
+    CK_SESSION_HANDLE hSession,
+    CK_OBJECT_HANDLE hObject,
+    CK_ATTRIBUTE_PTR pTemplate,
+    CK_ULONG ulCount,
+    CK_OBJECT_HANDLE_PTR phNewObject
+)
+{
+    UNUSED(hSession);
+    UNUSED(hObject);
+    UNUSED(pTemplate);
+    UNUSED(ulCount);
+    UNUSED(phNewObject);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_DestroyObject)(
+    CK_SESSION_HANDLE hSession,
+    CK_OBJECT_HANDLE hObject
+)
+{
+    UNUSED(hSession);
+    UNUSED(hObject);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetObjectSize)(
+    CK_SESSION_HANDLE hSession,
+    CK_OBJECT_HANDLE hObject,
+    CK_ULONG_PTR pulSize
+)
+{
+    UNUSED(hSession);
+    UNUSED(hObject);
+    UNUSED(pulSize);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetAttributeValue)(
+    CK_SESSION_HANDLE hSession,
+    CK_OBJECT_HANDLE hObject,
+    CK_ATTRIBUTE_PTR pTemplate,
+    CK_ULONG ulCount
+)
+{
+    ENTER();
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+
+    if (pTemplate == NULL_PTR || ulCount == 0)
+        return CKR_ARGUMENTS_BAD;
+
+    CK_RV rv_final = CKR_OK;
+    for (CK_ULONG i = 0; i < ulCount; i++) {
+        CK_RV rv;
+
+        INFO("C_GetAttributeValue object %lu, attribute %lu", hObject, pTemplate[i].type);
+        switch (pTemplate[i].type) {
+        case CKA_KEY_TYPE:
+            // Type of key.
+            if (pTemplate[i].pValue == NULL_PTR) {
+                pTemplate[i].ulValueLen = sizeof(CK_ULONG);
+                rv = CKR_OK;
+            } else if (pTemplate[i].ulValueLen >= sizeof(CK_ULONG)) {
+                pTemplate[i].ulValueLen = sizeof(CK_ULONG);
+                *((CK_ULONG *) pTemplate[i].pValue) = CKK_ECDSA;
+                rv = CKR_OK;
+            } else {
+                pTemplate[i].ulValueLen = (CK_ULONG) -1;
+                rv = CKR_BUFFER_TOO_SMALL;
+            }
+            break;
+
+        case CKA_LABEL:
+            INFO("LABEL");
+            // Description of the object. PKCS#11 labels are NOT NUL-terminated,
+            // so report the exact byte length and copy without the terminator.
+        {
+            char label[16];
+            int label_len = snprintf(label, sizeof(label), "%lu", s->slot_id);
+            if (pTemplate[i].pValue == NULL_PTR) {
+                pTemplate[i].ulValueLen = (CK_ULONG) label_len;
+                rv = CKR_OK;
+            } else if (pTemplate[i].ulValueLen >= (CK_ULONG) label_len) {
+                pTemplate[i].ulValueLen = (CK_ULONG) label_len;
+                memcpy(pTemplate[i].pValue, label, (size_t) label_len);
+                rv = CKR_OK;
+            } else {
+                pTemplate[i].ulValueLen = (CK_ULONG) -1;
+                rv = CKR_BUFFER_TOO_SMALL;
+            }
+            break;
+        }
+
+        case CKA_ID:
+            INFO("ID");
+            // Key identifier for public/private key pair (default empty).
+            if (pTemplate[i].pValue == NULL_PTR) {
+                pTemplate[i].ulValueLen = 1;
+                rv = CKR_OK;
+            } else if (pTemplate[i].ulValueLen >= 1) {
+                pTemplate[i].ulValueLen = 1;
+                // NOTE: This cannot possibly be the intended use, but it currently
+                //       makes the URL nice.
+                *((CK_BYTE *) pTemplate[i].pValue) = '0' + (CK_BYTE) s->slot_id;
+                rv = CKR_OK;
+            } else {
+                pTemplate[i].ulValueLen = (CK_ULONG) -1;
+                rv = CKR_BUFFER_TOO_SMALL;
+            }
+            break;
+
+        case CKA_EC_PARAMS:
+            // DER-encoding of an ANSI X9.62 Parameters value.
+        {
+            // OID 1.2.840.10045.3.1.7 (prime256v1). Use a byte array (NOT a
+            // string literal) so the length is exactly 10, with no trailing NUL.
+            static const CK_BYTE prime256v1[] = {
+                0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07
+            };
+            const unsigned long params_len = sizeof(prime256v1);
+            if (pTemplate[i].pValue == NULL_PTR) {
+                pTemplate[i].ulValueLen = params_len;
+                rv = CKR_OK;
+            } else if (pTemplate[i].ulValueLen >= params_len) {
+                pTemplate[i].ulValueLen = params_len;
+                memcpy(pTemplate[i].pValue, prime256v1, params_len);
+                rv = CKR_OK;
+            } else {
+                pTemplate[i].ulValueLen = (CK_ULONG) -1;
+                rv = CKR_BUFFER_TOO_SMALL;
+            }
+            break;
+        }
+        case CKA_EC_POINT:
+            // PKCS#11 requires the ECPoint as a DER-encoded ASN.1 OCTET STRING
+            // wrapping the raw uncompressed point (0x04 || X || Y). Emit:
+            //   04 41 <65-byte point>   (tag, length=0x41=65, point)
             // Returning the bare 65-byte point corrupts libp11 >= 0.4.12.
         {
-            const unsigned long point_len = sizeof(session.cached_public_key); // 65
-            const unsigned long der_len = point_len + 2;                       // 67
+            struct nerves_key_device *device = s->device;
+            const struct nerves_key_snapshot *snapshot = current_snapshot(device);
+            const unsigned long point_len = sizeof(snapshot->public_key); // 65
+            const unsigned long der_len = point_len + 2;                       // 67
+
+            if (pTemplate[i].pValue == NULL_PTR) {
+                pTemplate[i].ulValueLen = der_len;
+                rv = CKR_OK;
+            } else if (pTemplate[i].ulValueLen >= der_len) {
+                rv = CKR_OK;
+                if (!snapshot->has_public_key && (rv = device_enter(s, 0)) == CKR_OK) {
+                    // It couldn't be read when the device was opened. Try again.
+                    snapshot = current_snapshot(device);
+                    if (!snapshot->has_public_key) {
+                        struct nerves_key_snapshot *updated = copy_snapshot(snapshot);
+                        if (updated == NULL) {
+                            rv = CKR_HOST_MEMORY;
+                        } else if (read_public_key(device, updated) < 0) {
+                            free(updated);
+                            rv = CKR_DEVICE_ERROR;
+                        } else {
+                            publish_snapshot(device, updated);
+                            share_state(device, updated);
+                            snapshot = updated;
+                        }
+                    }
+                    device_leave(s);
+                }
+                if (rv == CKR_OK) {
+                    CK_BYTE *out = (CK_BYTE *) pTemplate[i].pValue;
+                    out[0] = 0x04;                 // ASN.1 OCTET STRING tag
+                    out[1] = (CK_BYTE) point_len;  // length (0x41 == 65)
+                    memcpy(out + 2, snapshot->public_key, point_len);
+                    pTemplate[i].ulValueLen = der_len;
+                } else {
+                    pTemplate[i].ulValueLen = (CK_ULONG) -1;
+                }
+            } else {
+                pTemplate[i].ulValueLen = (CK_ULONG) -1;
+                rv = CKR_BUFFER_TOO_SMALL;
+            }
+            break;
+        }
+
+        case CKA_ALWAYS_AUTHENTICATE:
+            // 	If CK_TRUE, the user has to supply the PIN for each use (sign or decrypt) with the key.
+            if (pTemplate[i].pValue == NULL_PTR) {
+                pTemplate[i].ulValueLen = sizeof(CK_BBOOL);
+                rv = CKR_OK;
+            } else if (pTemplate[i].ulValueLen >=  sizeof(CK_BBOOL)) {
+                pTemplate[i].ulValueLen =  sizeof(CK_BBOOL);
+                *((CK_BBOOL *) pTemplate[i].pValue) = CK_FALSE;
+                rv = CKR_OK;
+            } else {
+                pTemplate[i].ulValueLen = (CK_ULONG) -1;
+                rv = CKR_BUFFER_TOO_SMALL;
+            }
+            break;
+
+        case CKA_SIGN:
+            // 	CK_TRUE if key supports signatures where the signature is an appendix to the data.
+            if (pTemplate[i].pValue == NULL_PTR) {
+                pTemplate[i].ulValueLen = sizeof(CK_BBOOL);
+                rv = CKR_OK;
+            } else if (pTemplate[i].ulValueLen >=  sizeof(CK_BBOOL)) {
+                pTemplate[i].ulValueLen =  sizeof(CK_BBOOL);
+                *((CK_BBOOL *) pTemplate[i].pValue) = CK_TRUE;
+                rv = CKR_OK;
+            } else {
+                pTemplate[i].ulValueLen = (CK_ULONG) -1;
+                rv = CKR_BUFFER_TOO_SMALL;
+            }
+            break;
+
+        case CKA_CLASS:
+            // Class is a stable property of the handle: the private and public
+            // key are distinct handles over the one ATECC key.
+        {
+            CK_OBJECT_CLASS klass =
+                (hObject == OBJECT_HANDLE_PUBLIC_KEY) ? CKO_PUBLIC_KEY : CKO_PRIVATE_KEY;
+            if (pTemplate[i].pValue == NULL_PTR) {
+                pTemplate[i].ulValueLen = sizeof(CK_OBJECT_CLASS);
+                rv = CKR_OK;
+            } else if (pTemplate[i].ulValueLen >= sizeof(CK_OBJECT_CLASS)) {
+                pTemplate[i].ulValueLen = sizeof(CK_OBJECT_CLASS);
+                *((CK_OBJECT_CLASS *) pTemplate[i].pValue) = klass;
+                rv = CKR_OK;
+            } else {
+                pTemplate[i].ulValueLen = (CK_ULONG) -1;
+                rv = CKR_BUFFER_TOO_SMALL;
+            }
+            break;
+        }
+
+        default:
+            pTemplate[i].ulValueLen = (CK_ULONG) -1;
+            rv = CKR_ATTRIBUTE_TYPE_INVALID;
+            break;
+        }
+        if (rv != CKR_OK) {
+            INFO("Unable to get attribute 0x%lx of object %lu", pTemplate[i].type, hObject);
+            rv_final = rv;
+        }
+    }
+    return rv_final;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_SetAttributeValue)(
+    CK_SESSION_HANDLE hSession,
+    CK_OBJECT_HANDLE hObject,
+    CK_ATTRIBUTE_PTR pTemplate,
+    CK_ULONG ulCount
+)
+{
+    UNUSED(hObject);
+    ENTER();
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+
+    if (pTemplate == NULL_PTR || ulCount == 0)
+        return CKR_ARGUMENTS_BAD;
+
+    CK_RV rv_final = CKR_OK;
+    for (CK_ULONG i = 0; i < ulCount; i++) {
+        CK_RV rv = CKR_ATTRIBUTE_TYPE_INVALID;
+
+        // TODO: this function has some complex cases for return value. Make sure to check them.
+        if (rv != CKR_OK) {
+            INFO("Unable to set attribute 0x%lx of object %lu", pTemplate[i].type, hObject);
+            rv_final = rv;
+        }
+    }
+    return rv_final;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_FindObjectsInit)(
+    CK_SESSION_HANDLE hSession,
+    CK_ATTRIBUTE_PTR pTemplate,
+    CK_ULONG ulCount
+)
+{
+    ENTER();
+
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+
+    /* Record the CKA_CLASS filter (if any) so C_FindObjects returns only the
+       matching key handle(s). A NULL template with ulCount > 0 is invalid. */
+    if (pTemplate == NULL_PTR && ulCount > 0)
+        return CKR_ARGUMENTS_BAD;
+
+    s->find_class_filtered = CK_FALSE;
+    for (CK_ULONG i = 0; i < ulCount; i++) {
+        if (pTemplate[i].type == CKA_CLASS &&
+            pTemplate[i].pValue != NULL_PTR &&
+            pTemplate[i].ulValueLen >= sizeof(CK_OBJECT_CLASS)) {
+            s->find_class_filtered = CK_TRUE;
+            s->find_class = *((CK_OBJECT_CLASS *) pTemplate[i].pValue);
+        }
+    }
+
+    s->find_index = 0;
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_FindObjects)(
+    CK_SESSION_HANDLE hSession,
+    CK_OBJECT_HANDLE_PTR phObject,
+    CK_ULONG ulMaxObjectCount,
+    CK_ULONG_PTR pulObjectCount
+)
+{
+    ENTER();
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+
+    const struct nerves_key_snapshot *snapshot = current_snapshot(s->device);
+    CK_ULONG count = 0;
+    while (s->find_index < snapshot->object_count && count < ulMaxObjectCount) {
+        CK_ULONG idx = s->find_index++;
+        if (!s->find_class_filtered || s->find_class == snapshot->classes[idx])
+            phObject[count++] = snapshot->objects[idx];
+    }
+    *pulObjectCount = count;
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_FindObjectsFinal)(
+    CK_SESSION_HANDLE hSession
+)
+{
+    ENTER();
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_EncryptInit)(
+    CK_SESSION_HANDLE hSession,
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey
+)
+{
+    UNUSED(hSession);
+    UNUSED(pMechanism);
+    UNUSED(hKey);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_Encrypt)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen,
+    CK_BYTE_PTR pEncryptedData,
+    CK_ULONG_PTR pulEncryptedDataLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pData);
+    UNUSED(ulDataLen);
+    UNUSED(pEncryptedData);
+    UNUSED(pulEncryptedDataLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_EncryptUpdate)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pPart,
+    CK_ULONG ulPartLen,
+    CK_BYTE_PTR pEncryptedPart,
+    CK_ULONG_PTR pulEncryptedPartLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pPart);
+    UNUSED(ulPartLen);
+    UNUSED(pEncryptedPart);
+    UNUSED(pulEncryptedPartLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_EncryptFinal)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pLastEncryptedPart,
+    CK_ULONG_PTR pulLastEncryptedPartLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pLastEncryptedPart);
+    UNUSED(pulLastEncryptedPartLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_DecryptInit)(
+    CK_SESSION_HANDLE hSession,
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey
+)
+{
+    UNUSED(hSession);
+    UNUSED(pMechanism);
+    UNUSED(hKey);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_Decrypt)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pEncryptedData,
+    CK_ULONG ulEncryptedDataLen,
+    CK_BYTE_PTR pData,
+    CK_ULONG_PTR pulDataLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pEncryptedData);
+    UNUSED(ulEncryptedDataLen);
+    UNUSED(pData);
+    UNUSED(pulDataLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_DecryptUpdate)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pEncryptedPart,
+    CK_ULONG ulEncryptedPartLen,
+    CK_BYTE_PTR pPart,
+    CK_ULONG_PTR pulPartLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pEncryptedPart);
+    UNUSED(ulEncryptedPartLen);
+    UNUSED(pPart);
+    UNUSED(pulPartLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
 
-            if (pTemplate[i].pValue == NULL_PTR) {
-                pTemplate[i].ulValueLen = der_len;
-                rv = CKR_OK;
-            } else if (pTemplate[i].ulValueLen >= der_len) {
-                rv = CKR_OK;
-                if (!session.has_cached_public_key) {
-                    session.cached_public_key[0] = 0x04; // uncompressed point prefix
-                    if (atecc508a_derive_public_key(session.fd, session.addr, 0,
-                                                    &session.cached_public_key[1]) < 0) {
-                        INFO("Error getting public key!");
-                        rv = CKR_DEVICE_ERROR;
-                    } else {
-                        session.has_cached_public_key = CK_TRUE;
-                    }
-                }
-                if (rv == CKR_OK) {
-                    CK_BYTE *out = (CK_BYTE *) pTemplate[i].pValue;
-                    out[0] = 0x04;                 // ASN.1 OCTET STRING tag
-                    out[1] = (CK_BYTE) point_len;  // length (0x41 == 65)
-                    memcpy(out + 2, session.cached_public_key, point_len);
-                    pTemplate[i].ulValueLen = der_len;
-                } else {
-                    pTemplate[i].ulValueLen = (CK_ULONG) -1;
-                }
-            } else {
-                pTemplate[i].ulValueLen = (CK_ULONG) -1;
-                rv = CKR_BUFFER_TOO_SMALL;
-            }
-            break;
-        }
+CK_DEFINE_FUNCTION(CK_RV, C_DecryptFinal)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pLastPart,
+    CK_ULONG_PTR pulLastPartLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pLastPart);
+    UNUSED(pulLastPartLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
 
-        case CKA_ALWAYS_AUTHENTICATE:
-            // 	If CK_TRUE, the user has to supply the PIN for each use (sign or decrypt) with the key.
-            if (pTemplate[i].pValue == NULL_PTR) {
-                pTemplate[i].ulValueLen = sizeof(CK_BBOOL);
-                rv = CKR_OK;
-            } else if (pTemplate[i].ulValueLen >=  sizeof(CK_BBOOL)) {
-                pTemplate[i].ulValueLen =  sizeof(CK_BBOOL);
-                *((CK_BBOOL *) pTemplate[i].pValue) = CK_FALSE;
-                rv = CKR_OK;
-            } else {
-                pTemplate[i].ulValueLen = (CK_ULONG) -1;
-                rv = CKR_BUFFER_TOO_SMALL;
-            }
-            break;
+CK_DEFINE_FUNCTION(CK_RV, C_DigestInit)(
+    CK_SESSION_HANDLE hSession,
+    CK_MECHANISM_PTR pMechanism
+)
+{
+    UNUSED(hSession);
+    UNUSED(pMechanism);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
 
-        case CKA_SIGN:
-            // 	CK_TRUE if key supports signatures where the signature is an appendix to the data.
-            if (pTemplate[i].pValue == NULL_PTR) {
-                pTemplate[i].ulValueLen = sizeof(CK_BBOOL);
-                rv = CKR_OK;
-            } else if (pTemplate[i].ulValueLen >=  sizeof(CK_BBOOL)) {
-                pTemplate[i].ulValueLen =  sizeof(CK_BBOOL);
-                *((CK_BBOOL *) pTemplate[i].pValue) = CK_TRUE;
-                rv = CKR_OK;
-            } else {
-                pTemplate[i].ulValueLen = (CK_ULONG) -1;
-                rv = CKR_BUFFER_TOO_SMALL;
-            }
-            break;
+CK_DEFINE_FUNCTION(CK_RV, C_Digest)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen,
+    CK_BYTE_PTR pDigest,
+    CK_ULONG_PTR pulDigestLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pData);
+    UNUSED(ulDataLen);
+    UNUSED(pDigest);
+    UNUSED(pulDigestLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
 
-        case CKA_CLASS:
-            // Class is a stable property of the handle: the private and public
-            // key are distinct handles over the one ATECC key.
-        {
-            CK_OBJECT_CLASS klass =
-                (hObject == OBJECT_HANDLE_PUBLIC_KEY) ? CKO_PUBLIC_KEY : CKO_PRIVATE_KEY;
-            if (pTemplate[i].pValue == NULL_PTR) {
-                pTemplate[i].ulValueLen = sizeof(CK_OBJECT_CLASS);
-                rv = CKR_OK;
-            } else if (pTemplate[i].ulValueLen >= sizeof(CK_OBJECT_CLASS)) {
-                pTemplate[i].ulValueLen = sizeof(CK_OBJECT_CLASS);
-                *((CK_OBJECT_CLASS *) pTemplate[i].pValue) = klass;
-                rv = CKR_OK;
-            } else {
-                pTemplate[i].ulValueLen = (CK_ULONG) -1;
-                rv = CKR_BUFFER_TOO_SMALL;
-            }
-            break;
-        }
+CK_DEFINE_FUNCTION(CK_RV, C_DigestUpdate)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pPart,
+    CK_ULONG ulPartLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pPart);
+    UNUSED(ulPartLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
 
-        default:
-            pTemplate[i].ulValueLen = (CK_ULONG) -1;
-            rv = CKR_ATTRIBUTE_TYPE_INVALID;
-            break;
-        }
-        if (rv != CKR_OK) {
-            INFO("Unable to get attribute 0x%lx of object %lu", pTemplate[i].type, hObject);
-            rv_final = rv;
+CK_DEFINE_FUNCTION(CK_RV, C_DigestKey)(
+    CK_SESSION_HANDLE hSession,
+    CK_OBJECT_HANDLE hKey
+)
+{
+    UNUSED(hSession);
+    UNUSED(hKey);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_DigestFinal)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pDigest,
+    CK_ULONG_PTR pulDigestLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pDigest);
+    UNUSED(pulDigestLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+static CK_RV check_sign_mechanism(CK_MECHANISM_PTR pMechanism, CK_ULONG *deadline_ms)
+{
+    switch (pMechanism->mechanism) {
+    case CKM_ECDSA:
+        // The parameter is optional and only used for scheduling
+        if (pMechanism->pParameter != NULL_PTR) {
+            if (pMechanism->ulParameterLen != sizeof(CK_NKCS11_SIGN_PARAMS))
+                return CKR_MECHANISM_PARAM_INVALID;
+            *deadline_ms = ((CK_NKCS11_SIGN_PARAMS *) pMechanism->pParameter)->ulDeadlineMs;
+        } else {
+            *deadline_ms = 0;
         }
+        return CKR_OK;
+
+    default:
+        return CKR_MECHANISM_INVALID;
     }
-    return rv_final;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_SetAttributeValue)(
+CK_DEFINE_FUNCTION(CK_RV, C_SignInit)(
     CK_SESSION_HANDLE hSession,
-    CK_OBJECT_HANDLE hObject,
-    CK_ATTRIBUTE_PTR pTemplate,
-    CK_ULONG ulCount
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey
 )
 {
-    UNUSED(hObject);
+    UNUSED(hKey);
     ENTER();
-    if (hSession != NKCS11_SESSION_MAGIC || session.open_count == 0)
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
         return CKR_SESSION_HANDLE_INVALID;
-
-    if (pTemplate == NULL_PTR || ulCount == 0)
+    if (pMechanism == NULL_PTR)
         return CKR_ARGUMENTS_BAD;
 
-    CK_RV rv_final = CKR_OK;
-    for (CK_ULONG i = 0; i < ulCount; i++) {
-        CK_RV rv = CKR_ATTRIBUTE_TYPE_INVALID;
+    if (s->sign_active)
+        return CKR_OPERATION_ACTIVE;
 
-        // TODO: this function has some complex cases for return value. Make sure to check them.
-        if (rv != CKR_OK) {
-            INFO("Unable to set attribute 0x%lx of object %lu", pTemplate[i].type, hObject);
-            rv_final = rv;
-        }
-    }
-    return rv_final;
+    CK_RV rv = check_sign_mechanism(pMechanism, &s->sign_deadline_ms);
+    if (rv == CKR_OK)
+        s->sign_active = CK_TRUE;
+    return rv;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_FindObjectsInit)(
+CK_DEFINE_FUNCTION(CK_RV, C_Sign)(
     CK_SESSION_HANDLE hSession,
-    CK_ATTRIBUTE_PTR pTemplate,
-    CK_ULONG ulCount
+    CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen,
+    CK_BYTE_PTR pSignature,
+    CK_ULONG_PTR pulSignatureLen
 )
 {
     ENTER();
-
-    if (hSession != NKCS11_SESSION_MAGIC || session.open_count == 0)
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
         return CKR_SESSION_HANDLE_INVALID;
+    if (!s->sign_active)
+        return CKR_OPERATION_NOT_INITIALIZED;
+    if (pulSignatureLen == NULL_PTR) {
+        s->sign_active = CK_FALSE;
+        return CKR_ARGUMENTS_BAD;
+    }
 
-    /* Record the CKA_CLASS filter (if any) so C_FindObjects returns only the
-       matching key handle(s). A NULL template with ulCount > 0 is invalid. */
-    if (pTemplate == NULL_PTR && ulCount > 0)
+    // Asking for the signature length doesn't end the operation
+    if (pSignature == NULL_PTR) {
+        *pulSignatureLen = 64;
+        return CKR_BUFFER_TOO_SMALL;
+    } else if (*pulSignatureLen < 64) {
+        *pulSignatureLen = 64;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    s->sign_active = CK_FALSE;
+    if (pData == NULL_PTR)
         return CKR_ARGUMENTS_BAD;
 
-    session.find_class_filtered = CK_FALSE;
-    for (CK_ULONG i = 0; i < ulCount; i++) {
-        if (pTemplate[i].type == CKA_CLASS &&
-            pTemplate[i].pValue != NULL_PTR &&
-            pTemplate[i].ulValueLen >= sizeof(CK_OBJECT_CLASS)) {
-            session.find_class_filtered = CK_TRUE;
-            session.find_class = *((CK_OBJECT_CLASS *) pTemplate[i].pValue);
-        }
+    if (ulDataLen != 32) {
+        INFO("C_Sign called with unsupported data length: %lu", ulDataLen);
+        return CKR_ARGUMENTS_BAD;
     }
 
-    session.find_index = 0;
+    CK_RV rv = sign_grouped(s, s->sign_deadline_ms, pData, pSignature);
+    if (rv != CKR_OK) {
+        INFO("Error signing data!");
+        return rv;
+    }
+    *pulSignatureLen = 64;
     return CKR_OK;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_FindObjects)(
+CK_DEFINE_FUNCTION(CK_RV, C_SignUpdate)(
     CK_SESSION_HANDLE hSession,
-    CK_OBJECT_HANDLE_PTR phObject,
-    CK_ULONG ulMaxObjectCount,
-    CK_ULONG_PTR pulObjectCount
+    CK_BYTE_PTR pPart,
+    CK_ULONG ulPartLen
 )
 {
-    ENTER();
-    if (hSession != NKCS11_SESSION_MAGIC || session.open_count == 0)
-        return CKR_SESSION_HANDLE_INVALID;
+    UNUSED(hSession);
+    UNUSED(pPart);
+    UNUSED(ulPartLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
 
-    static const CK_OBJECT_CLASS classes[2] = { CKO_PRIVATE_KEY, CKO_PUBLIC_KEY };
-    static const CK_OBJECT_HANDLE handles[2] = {
-        OBJECT_HANDLE_PRIVATE_KEY, OBJECT_HANDLE_PUBLIC_KEY
-    };
+CK_DEFINE_FUNCTION(CK_RV, C_SignFinal)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pSignature,
+    CK_ULONG_PTR pulSignatureLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pSignature);
+    UNUSED(pulSignatureLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
 
-    CK_ULONG count = 0;
-    while (session.find_index < 2 && count < ulMaxObjectCount) {
-        CK_ULONG idx = session.find_index++;
-        if (!session.find_class_filtered || session.find_class == classes[idx])
-            phObject[count++] = handles[idx];
-    }
-    *pulObjectCount = count;
-    return CKR_OK;
+CK_DEFINE_FUNCTION(CK_RV, C_SignRecoverInit)(
+    CK_SESSION_HANDLE hSession,
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey
+)
+{
+    UNUSED(hSession);
+    UNUSED(hKey);
+    UNUSED(pMechanism);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_FindObjectsFinal)(
-    CK_SESSION_HANDLE hSession
+CK_DEFINE_FUNCTION(CK_RV, C_SignRecover)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen,
+    CK_BYTE_PTR pSignature,
+    CK_ULONG_PTR pulSignatureLen
 )
 {
-    ENTER();
-    if (hSession != NKCS11_SESSION_MAGIC || session.open_count == 0)
-        return CKR_SESSION_HANDLE_INVALID;
-    return CKR_OK;
+    UNUSED(hSession);
+    UNUSED(pData);
+    UNUSED(ulDataLen);
+    UNUSED(pSignature);
+    UNUSED(pulSignatureLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_EncryptInit)(
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyInit)(
     CK_SESSION_HANDLE hSession,
     CK_MECHANISM_PTR pMechanism,
     CK_OBJECT_HANDLE hKey
@@ -864,54 +2496,50 @@ CK_DEFINE_FUNCTION(CK_RV, C_EncryptInit)(
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_Encrypt)(
+CK_DEFINE_FUNCTION(CK_RV, C_Verify)(
     CK_SESSION_HANDLE hSession,
     CK_BYTE_PTR pData,
     CK_ULONG ulDataLen,
-    CK_BYTE_PTR pEncryptedData,
-    CK_ULONG_PTR pulEncryptedDataLen
+    CK_BYTE_PTR pSignature,
+    CK_ULONG ulSignatureLen
 )
 {
     UNUSED(hSession);
     UNUSED(pData);
     UNUSED(ulDataLen);
-    UNUSED(pEncryptedData);
-    UNUSED(pulEncryptedDataLen);
+    UNUSED(pSignature);
+    UNUSED(ulSignatureLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_EncryptUpdate)(
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyUpdate)(
     CK_SESSION_HANDLE hSession,
     CK_BYTE_PTR pPart,
-    CK_ULONG ulPartLen,
-    CK_BYTE_PTR pEncryptedPart,
-    CK_ULONG_PTR pulEncryptedPartLen
+    CK_ULONG ulPartLen
 )
 {
     UNUSED(hSession);
     UNUSED(pPart);
     UNUSED(ulPartLen);
-    UNUSED(pEncryptedPart);
-    UNUSED(pulEncryptedPartLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_EncryptFinal)(
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyFinal)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pLastEncryptedPart,
-    CK_ULONG_PTR pulLastEncryptedPartLen
+    CK_BYTE_PTR pSignature,
+    CK_ULONG ulSignatureLen
 )
 {
     UNUSED(hSession);
-    UNUSED(pLastEncryptedPart);
-    UNUSED(pulLastEncryptedPartLen);
+    UNUSED(pSignature);
+    UNUSED(ulSignatureLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_DecryptInit)(
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyRecoverInit)(
     CK_SESSION_HANDLE hSession,
     CK_MECHANISM_PTR pMechanism,
     CK_OBJECT_HANDLE hKey
@@ -924,24 +2552,41 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptInit)(
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_Decrypt)(
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyRecover)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pEncryptedData,
-    CK_ULONG ulEncryptedDataLen,
+    CK_BYTE_PTR pSignature,
+    CK_ULONG ulSignatureLen,
     CK_BYTE_PTR pData,
     CK_ULONG_PTR pulDataLen
 )
 {
     UNUSED(hSession);
-    UNUSED(pEncryptedData);
-    UNUSED(ulEncryptedDataLen);
+    UNUSED(pSignature);
+    UNUSED(ulSignatureLen);
     UNUSED(pData);
     UNUSED(pulDataLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_DecryptUpdate)(
+CK_DEFINE_FUNCTION(CK_RV, C_DigestEncryptUpdate)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pPart,
+    CK_ULONG ulPartLen,
+    CK_BYTE_PTR pEncryptedPart,
+    CK_ULONG_PTR pulEncryptedPartLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pPart);
+    UNUSED(ulPartLen);
+    UNUSED(pEncryptedPart);
+    UNUSED(pulEncryptedPartLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_DecryptDigestUpdate)(
     CK_SESSION_HANDLE hSession,
     CK_BYTE_PTR pEncryptedPart,
     CK_ULONG ulEncryptedPartLen,
@@ -949,512 +2594,1063 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptUpdate)(
     CK_ULONG_PTR pulPartLen
 )
 {
-    UNUSED(hSession);
+    UNUSED(pPart);
     UNUSED(pEncryptedPart);
     UNUSED(ulEncryptedPartLen);
-    UNUSED(pPart);
     UNUSED(pulPartLen);
+    UNUSED(hSession);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_DecryptFinal)(
+CK_DEFINE_FUNCTION(CK_RV, C_SignEncryptUpdate)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pLastPart,
-    CK_ULONG_PTR pulLastPartLen
+    CK_BYTE_PTR pPart,
+    CK_ULONG ulPartLen,
+    CK_BYTE_PTR pEncryptedPart,
+    CK_ULONG_PTR pulEncryptedPartLen
 )
 {
     UNUSED(hSession);
-    UNUSED(pLastPart);
-    UNUSED(pulLastPartLen);
+    UNUSED(pPart);
+    UNUSED(ulPartLen);
+    UNUSED(pEncryptedPart);
+    UNUSED(pulEncryptedPartLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_DigestInit)(
+CK_DEFINE_FUNCTION(CK_RV, C_DecryptVerifyUpdate)(
     CK_SESSION_HANDLE hSession,
-    CK_MECHANISM_PTR pMechanism
+    CK_BYTE_PTR pEncryptedPart,
+    CK_ULONG ulEncryptedPartLen,
+    CK_BYTE_PTR pPart,
+    CK_ULONG_PTR pulPartLen
 )
 {
     UNUSED(hSession);
-    UNUSED(pMechanism);
+    UNUSED(pPart);
+    UNUSED(pEncryptedPart);
+    UNUSED(ulEncryptedPartLen);
+    UNUSED(pulPartLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_Digest)(
+CK_DEFINE_FUNCTION(CK_RV, C_GenerateKey)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pData,
-    CK_ULONG ulDataLen,
-    CK_BYTE_PTR pDigest,
-    CK_ULONG_PTR pulDigestLen
+    CK_MECHANISM_PTR pMechanism,
+    CK_ATTRIBUTE_PTR pTemplate,
+    CK_ULONG ulCount,
+    CK_OBJECT_HANDLE_PTR phKey
 )
 {
     UNUSED(hSession);
-    UNUSED(pData);
-    UNUSED(ulDataLen);
-    UNUSED(pDigest);
-    UNUSED(pulDigestLen);
+    UNUSED(pMechanism);
+    UNUSED(pTemplate);
+    UNUSED(ulCount);
+    UNUSED(phKey);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_DigestUpdate)(
+CK_DEFINE_FUNCTION(CK_RV, C_GenerateKeyPair)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pPart,
-    CK_ULONG ulPartLen
+    CK_MECHANISM_PTR pMechanism,
+    CK_ATTRIBUTE_PTR pPublicKeyTemplate,
+    CK_ULONG ulPublicKeyAttributeCount,
+    CK_ATTRIBUTE_PTR pPrivateKeyTemplate,
+    CK_ULONG ulPrivateKeyAttributeCount,
+    CK_OBJECT_HANDLE_PTR phPublicKey,
+    CK_OBJECT_HANDLE_PTR phPrivateKey
 )
 {
     UNUSED(hSession);
-    UNUSED(pPart);
-    UNUSED(ulPartLen);
+    UNUSED(pMechanism);
+    UNUSED(pPublicKeyTemplate);
+    UNUSED(ulPublicKeyAttributeCount);
+    UNUSED(pPrivateKeyTemplate);
+    UNUSED(ulPrivateKeyAttributeCount);
+    UNUSED(phPublicKey);
+    UNUSED(phPrivateKey);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_DigestKey)(
+CK_DEFINE_FUNCTION(CK_RV, C_WrapKey)(
     CK_SESSION_HANDLE hSession,
-    CK_OBJECT_HANDLE hKey
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hWrappingKey,
+    CK_OBJECT_HANDLE hKey,
+    CK_BYTE_PTR pWrappedKey,
+    CK_ULONG_PTR pulWrappedKeyLen
 )
 {
     UNUSED(hSession);
+    UNUSED(pMechanism);
+    UNUSED(hWrappingKey);
     UNUSED(hKey);
+    UNUSED(pWrappedKey);
+    UNUSED(pulWrappedKeyLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_DigestFinal)(
+CK_DEFINE_FUNCTION(CK_RV, C_UnwrapKey)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pDigest,
-    CK_ULONG_PTR pulDigestLen
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hUnwrappingKey,
+    CK_BYTE_PTR pWrappedKey,
+    CK_ULONG ulWrappedKeyLen,
+    CK_ATTRIBUTE_PTR pTemplate,
+    CK_ULONG ulAttributeCount,
+    CK_OBJECT_HANDLE_PTR phKey
 )
 {
     UNUSED(hSession);
-    UNUSED(pDigest);
-    UNUSED(pulDigestLen);
+    UNUSED(pMechanism);
+    UNUSED(hUnwrappingKey);
+    UNUSED(pWrappedKey);
+    UNUSED(ulWrappedKeyLen);
+    UNUSED(pTemplate);
+    UNUSED(ulAttributeCount);
+    UNUSED(phKey);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_SignInit)(
+CK_DEFINE_FUNCTION(CK_RV, C_DeriveKey)(
     CK_SESSION_HANDLE hSession,
     CK_MECHANISM_PTR pMechanism,
-    CK_OBJECT_HANDLE hKey
+    CK_OBJECT_HANDLE hBaseKey,
+    CK_ATTRIBUTE_PTR pTemplate,
+    CK_ULONG ulAttributeCount,
+    CK_OBJECT_HANDLE_PTR phKey
 )
 {
-    UNUSED(hKey);
-    ENTER();
-    if (hSession != NKCS11_SESSION_MAGIC || session.open_count == 0)
-        return CKR_SESSION_HANDLE_INVALID;
-    if (pMechanism == NULL_PTR)
-        return CKR_ARGUMENTS_BAD;
+    UNUSED(hSession);
+    UNUSED(pMechanism);
+    UNUSED(hBaseKey);
+    UNUSED(pTemplate);
+    UNUSED(ulAttributeCount);
+    UNUSED(phKey);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+/* Random number generation functions */
+
+CK_DEFINE_FUNCTION(CK_RV, C_SeedRandom)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pSeed,
+    CK_ULONG ulSeedLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pSeed);
+    UNUSED(ulSeedLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GenerateRandom)(
+    CK_SESSION_HANDLE hSession,
+    CK_BYTE_PTR pRandomData,
+    CK_ULONG ulRandomLen
+)
+{
+    UNUSED(hSession);
+    UNUSED(pRandomData);
+    UNUSED(ulRandomLen);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetFunctionStatus)(
+    CK_SESSION_HANDLE hSession
+)
+{
+    UNUSED(hSession);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_CancelFunction)(
+    CK_SESSION_HANDLE hSession
+)
+{
+    UNUSED(hSession);
+    UNIMPLEMENTED();
+    return CKR_FUNCTION_FAILED;
+}
 
-    CK_RV rv;
-    switch (pMechanism->mechanism) {
-    case CKM_ECDSA:
-        rv = CKR_OK;
-        break;
+/* PKCS #11 3.0 */
 
-    default:
-        rv = CKR_MECHANISM_INVALID;
-        break;
-    }
-    return rv;
-}
+/* C_GetInterface returns the first match, so the 3.0 list is the default */
+static CK_INTERFACE interfaces[] = {
+    { (CK_UTF8CHAR_PTR) "PKCS 11", &function_list_3_0, 0 },
+    { (CK_UTF8CHAR_PTR) "PKCS 11", &function_list, 0 },
+    { (CK_UTF8CHAR_PTR) "Vendor NervesKey", &vendor_function_list, 0 }
+};
+#define NUM_INTERFACES (sizeof(interfaces) / sizeof(interfaces[0]))
 
-CK_DEFINE_FUNCTION(CK_RV, C_Sign)(
-    CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pData,
-    CK_ULONG ulDataLen,
-    CK_BYTE_PTR pSignature,
-    CK_ULONG_PTR pulSignatureLen
+CK_DEFINE_FUNCTION(CK_RV, C_GetInterfaceList)(
+    CK_INTERFACE_PTR pInterfacesList,
+    CK_ULONG_PTR pulCount
 )
 {
     ENTER();
-    if (hSession != NKCS11_SESSION_MAGIC || session.open_count == 0)
-        return CKR_SESSION_HANDLE_INVALID;
-    if (pulSignatureLen == NULL_PTR)
+    if (pulCount == NULL_PTR)
         return CKR_ARGUMENTS_BAD;
 
-    if (pSignature == NULL_PTR) {
-        *pulSignatureLen = 64;
-        return CKR_BUFFER_TOO_SMALL;
-    } else if (*pulSignatureLen < 64) {
-        *pulSignatureLen = 64;
+    if (pInterfacesList == NULL_PTR) {
+        *pulCount = NUM_INTERFACES;
+        return CKR_OK;
+    }
+    if (*pulCount < NUM_INTERFACES) {
+        *pulCount = NUM_INTERFACES;
         return CKR_BUFFER_TOO_SMALL;
     }
 
-    if (pData == NULL_PTR)
-        return CKR_ARGUMENTS_BAD;
+    memcpy(pInterfacesList, interfaces, sizeof(interfaces));
+    *pulCount = NUM_INTERFACES;
+    return CKR_OK;
+}
 
-    if (ulDataLen != 32) {
-        INFO("C_Sign called with unsupported data length: %lu", ulDataLen);
+CK_DEFINE_FUNCTION(CK_RV, C_GetInterface)(
+    CK_UTF8CHAR_PTR pInterfaceName,
+    CK_VERSION_PTR pVersion,
+    CK_INTERFACE_PTR_PTR ppInterface,
+    CK_FLAGS flags
+)
+{
+    ENTER();
+    if (ppInterface == NULL_PTR)
         return CKR_ARGUMENTS_BAD;
-    }
 
-    if (atecc508a_sign(session.fd, session.addr, 0, pData, pSignature) < 0) {
-        INFO("Error signing data!");
-        return CKR_DEVICE_ERROR;
+    for (size_t i = 0; i < NUM_INTERFACES; i++) {
+        CK_INTERFACE *interface = &interfaces[i];
+
+        // Every function list starts with its version
+        const CK_VERSION *version = interface->pFunctionList;
+        if ((pInterfaceName == NULL_PTR || strcmp((const char *) pInterfaceName, (const char *) interface->pInterfaceName) == 0) &&
+            (pVersion == NULL_PTR || (pVersion->major == version->major && pVersion->minor == version->minor)) &&
+            (flags & interface->flags) == flags) {
+            *ppInterface = interface;
+            return CKR_OK;
+        }
     }
-    *pulSignatureLen = 64;
-    return CKR_OK;
+    return CKR_ARGUMENTS_BAD;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_SignUpdate)(
+CK_DEFINE_FUNCTION(CK_RV, C_LoginUser)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pPart,
-    CK_ULONG ulPartLen
+    CK_USER_TYPE userType,
+    CK_UTF8CHAR_PTR pPin,
+    CK_ULONG ulPinLen,
+    CK_UTF8CHAR_PTR pUsername,
+    CK_ULONG ulUsernameLen
 )
 {
     UNUSED(hSession);
-    UNUSED(pPart);
-    UNUSED(ulPartLen);
+    UNUSED(userType);
+    UNUSED(pPin);
+    UNUSED(ulPinLen);
+    UNUSED(pUsername);
+    UNUSED(ulUsernameLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_SignFinal)(
+CK_DEFINE_FUNCTION(CK_RV, C_SessionCancel)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pSignature,
-    CK_ULONG_PTR pulSignatureLen
+    CK_FLAGS flags
 )
 {
-    UNUSED(hSession);
-    UNUSED(pSignature);
-    UNUSED(pulSignatureLen);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    ENTER();
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+
+    if (flags & CKF_SIGN)
+        s->sign_active = CK_FALSE;
+    if (flags & CKF_MESSAGE_SIGN) {
+        lock(&s->device->mutex);
+        end_message_sign(s);
+        unlock(&s->device->mutex);
+    }
+    return CKR_OK;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_SignRecoverInit)(
+CK_DEFINE_FUNCTION(CK_RV, C_MessageEncryptInit)(
     CK_SESSION_HANDLE hSession,
     CK_MECHANISM_PTR pMechanism,
     CK_OBJECT_HANDLE hKey
 )
 {
     UNUSED(hSession);
-    UNUSED(hKey);
     UNUSED(pMechanism);
+    UNUSED(hKey);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_SignRecover)(
+CK_DEFINE_FUNCTION(CK_RV, C_EncryptMessage)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pData,
-    CK_ULONG ulDataLen,
-    CK_BYTE_PTR pSignature,
-    CK_ULONG_PTR pulSignatureLen
+    CK_VOID_PTR pParameter,
+    CK_ULONG ulParameterLen,
+    CK_BYTE_PTR pAssociatedData,
+    CK_ULONG ulAssociatedDataLen,
+    CK_BYTE_PTR pPlaintext,
+    CK_ULONG ulPlaintextLen,
+    CK_BYTE_PTR pCiphertext,
+    CK_ULONG_PTR pulCiphertextLen
 )
 {
     UNUSED(hSession);
-    UNUSED(pData);
-    UNUSED(ulDataLen);
-    UNUSED(pSignature);
-    UNUSED(pulSignatureLen);
+    UNUSED(pParameter);
+    UNUSED(ulParameterLen);
+    UNUSED(pAssociatedData);
+    UNUSED(ulAssociatedDataLen);
+    UNUSED(pPlaintext);
+    UNUSED(ulPlaintextLen);
+    UNUSED(pCiphertext);
+    UNUSED(pulCiphertextLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_VerifyInit)(
+CK_DEFINE_FUNCTION(CK_RV, C_EncryptMessageBegin)(
     CK_SESSION_HANDLE hSession,
-    CK_MECHANISM_PTR pMechanism,
-    CK_OBJECT_HANDLE hKey
+    CK_VOID_PTR pParameter,
+    CK_ULONG ulParameterLen,
+    CK_BYTE_PTR pAssociatedData,
+    CK_ULONG ulAssociatedDataLen
 )
 {
     UNUSED(hSession);
-    UNUSED(pMechanism);
-    UNUSED(hKey);
+    UNUSED(pParameter);
+    UNUSED(ulParameterLen);
+    UNUSED(pAssociatedData);
+    UNUSED(ulAssociatedDataLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_Verify)(
+CK_DEFINE_FUNCTION(CK_RV, C_EncryptMessageNext)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pData,
-    CK_ULONG ulDataLen,
-    CK_BYTE_PTR pSignature,
-    CK_ULONG ulSignatureLen
+    CK_VOID_PTR pParameter,
+    CK_ULONG ulParameterLen,
+    CK_BYTE_PTR pPlaintextPart,
+    CK_ULONG ulPlaintextPartLen,
+    CK_BYTE_PTR pCiphertextPart,
+    CK_ULONG_PTR pulCiphertextPartLen,
+    CK_FLAGS flags
 )
 {
     UNUSED(hSession);
-    UNUSED(pData);
-    UNUSED(ulDataLen);
-    UNUSED(pSignature);
-    UNUSED(ulSignatureLen);
+    UNUSED(pParameter);
+    UNUSED(ulParameterLen);
+    UNUSED(pPlaintextPart);
+    UNUSED(ulPlaintextPartLen);
+    UNUSED(pCiphertextPart);
+    UNUSED(pulCiphertextPartLen);
+    UNUSED(flags);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_VerifyUpdate)(
-    CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pPart,
-    CK_ULONG ulPartLen
+CK_DEFINE_FUNCTION(CK_RV, C_MessageEncryptFinal)(
+    CK_SESSION_HANDLE hSession
 )
 {
     UNUSED(hSession);
-    UNUSED(pPart);
-    UNUSED(ulPartLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_VerifyFinal)(
+CK_DEFINE_FUNCTION(CK_RV, C_MessageDecryptInit)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pSignature,
-    CK_ULONG ulSignatureLen
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey
 )
 {
     UNUSED(hSession);
-    UNUSED(pSignature);
-    UNUSED(ulSignatureLen);
+    UNUSED(pMechanism);
+    UNUSED(hKey);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_VerifyRecoverInit)(
+CK_DEFINE_FUNCTION(CK_RV, C_DecryptMessage)(
     CK_SESSION_HANDLE hSession,
-    CK_MECHANISM_PTR pMechanism,
-    CK_OBJECT_HANDLE hKey
+    CK_VOID_PTR pParameter,
+    CK_ULONG ulParameterLen,
+    CK_BYTE_PTR pAssociatedData,
+    CK_ULONG ulAssociatedDataLen,
+    CK_BYTE_PTR pCiphertext,
+    CK_ULONG ulCiphertextLen,
+    CK_BYTE_PTR pPlaintext,
+    CK_ULONG_PTR pulPlaintextLen
 )
 {
     UNUSED(hSession);
-    UNUSED(pMechanism);
-    UNUSED(hKey);
+    UNUSED(pParameter);
+    UNUSED(ulParameterLen);
+    UNUSED(pAssociatedData);
+    UNUSED(ulAssociatedDataLen);
+    UNUSED(pCiphertext);
+    UNUSED(ulCiphertextLen);
+    UNUSED(pPlaintext);
+    UNUSED(pulPlaintextLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_VerifyRecover)(
+CK_DEFINE_FUNCTION(CK_RV, C_DecryptMessageBegin)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pSignature,
-    CK_ULONG ulSignatureLen,
-    CK_BYTE_PTR pData,
-    CK_ULONG_PTR pulDataLen
+    CK_VOID_PTR pParameter,
+    CK_ULONG ulParameterLen,
+    CK_BYTE_PTR pAssociatedData,
+    CK_ULONG ulAssociatedDataLen
 )
 {
     UNUSED(hSession);
-    UNUSED(pSignature);
-    UNUSED(ulSignatureLen);
-    UNUSED(pData);
-    UNUSED(pulDataLen);
+    UNUSED(pParameter);
+    UNUSED(ulParameterLen);
+    UNUSED(pAssociatedData);
+    UNUSED(ulAssociatedDataLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_DigestEncryptUpdate)(
+CK_DEFINE_FUNCTION(CK_RV, C_DecryptMessageNext)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pPart,
-    CK_ULONG ulPartLen,
-    CK_BYTE_PTR pEncryptedPart,
-    CK_ULONG_PTR pulEncryptedPartLen
+    CK_VOID_PTR pParameter,
+    CK_ULONG ulParameterLen,
+    CK_BYTE_PTR pCiphertextPart,
+    CK_ULONG ulCiphertextPartLen,
+    CK_BYTE_PTR pPlaintextPart,
+    CK_ULONG_PTR pulPlaintextPartLen,
+    CK_FLAGS flags
 )
 {
     UNUSED(hSession);
-    UNUSED(pPart);
-    UNUSED(ulPartLen);
-    UNUSED(pEncryptedPart);
-    UNUSED(pulEncryptedPartLen);
+    UNUSED(pParameter);
+    UNUSED(ulParameterLen);
+    UNUSED(pCiphertextPart);
+    UNUSED(ulCiphertextPartLen);
+    UNUSED(pPlaintextPart);
+    UNUSED(pulPlaintextPartLen);
+    UNUSED(flags);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_DecryptDigestUpdate)(
-    CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pEncryptedPart,
-    CK_ULONG ulEncryptedPartLen,
-    CK_BYTE_PTR pPart,
-    CK_ULONG_PTR pulPartLen
+CK_DEFINE_FUNCTION(CK_RV, C_MessageDecryptFinal)(
+    CK_SESSION_HANDLE hSession
 )
 {
-    UNUSED(pPart);
-    UNUSED(pEncryptedPart);
-    UNUSED(ulEncryptedPartLen);
-    UNUSED(pulPartLen);
     UNUSED(hSession);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_SignEncryptUpdate)(
+/* Message signing keeps the ATECC awake from C_MessageSignInit until
+   C_MessageSignFinal so that the mechanism check and the wakeup happen once
+   for all of the messages. The per-message parameter can be NULL or a
+   CK_NKCS11_SIGN_PARAMS to give that message its own deadline. */
+static CK_RV message_deadline(const struct nerves_key_session *s, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen,
+                              CK_ULONG *deadline_ms)
+{
+    if (pParameter == NULL_PTR) {
+        *deadline_ms = s->message_deadline_ms;
+        return CKR_OK;
+    }
+    if (ulParameterLen != sizeof(CK_NKCS11_SIGN_PARAMS))
+        return CKR_ARGUMENTS_BAD;
+
+    *deadline_ms = ((CK_NKCS11_SIGN_PARAMS *) pParameter)->ulDeadlineMs;
+    return CKR_OK;
+}
+
+static CK_RV sign_message(struct nerves_key_session *s, CK_ULONG deadline_ms, const CK_BYTE *data, CK_ULONG data_len,
+                          CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+    if (pSignature == NULL_PTR) {
+        *pulSignatureLen = 64;
+        return CKR_OK;
+    } else if (*pulSignatureLen < 64) {
+        *pulSignatureLen = 64;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    if (data_len != 32) {
+        INFO("Message signing called with unsupported data length: %lu", data_len);
+        return CKR_DATA_LEN_RANGE;
+    }
+
+    CK_RV rv = sign_grouped(s, deadline_ms, data, pSignature);
+    if (rv != CKR_OK) {
+        INFO("Error signing data!");
+        return rv;
+    }
+    *pulSignatureLen = 64;
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_MessageSignInit)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pPart,
-    CK_ULONG ulPartLen,
-    CK_BYTE_PTR pEncryptedPart,
-    CK_ULONG_PTR pulEncryptedPartLen
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey
 )
 {
-    UNUSED(hSession);
-    UNUSED(pPart);
-    UNUSED(ulPartLen);
-    UNUSED(pEncryptedPart);
-    UNUSED(pulEncryptedPartLen);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    UNUSED(hKey);
+    ENTER();
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (pMechanism == NULL_PTR)
+        return CKR_ARGUMENTS_BAD;
+    if (s->message_sign_active)
+        return CKR_OPERATION_ACTIVE;
+
+    CK_RV rv = check_sign_mechanism(pMechanism, &s->message_deadline_ms);
+    if (rv != CKR_OK)
+        return rv;
+
+    lock(&s->device->mutex);
+    atecc508a_hold_awake(&s->device->dev);
+    s->message_sign_active = CK_TRUE;
+    s->message_part_active = CK_FALSE;
+    unlock(&s->device->mutex);
+    return CKR_OK;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_DecryptVerifyUpdate)(
+CK_DEFINE_FUNCTION(CK_RV, C_SignMessage)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pEncryptedPart,
-    CK_ULONG ulEncryptedPartLen,
-    CK_BYTE_PTR pPart,
-    CK_ULONG_PTR pulPartLen
+    CK_VOID_PTR pParameter,
+    CK_ULONG ulParameterLen,
+    CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen,
+    CK_BYTE_PTR pSignature,
+    CK_ULONG_PTR pulSignatureLen
 )
 {
-    UNUSED(hSession);
-    UNUSED(pPart);
-    UNUSED(pEncryptedPart);
-    UNUSED(ulEncryptedPartLen);
-    UNUSED(pulPartLen);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    ENTER();
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (!s->message_sign_active)
+        return CKR_OPERATION_NOT_INITIALIZED;
+    if (s->message_part_active)
+        return CKR_OPERATION_ACTIVE;
+    if (pData == NULL_PTR || pulSignatureLen == NULL_PTR)
+        return CKR_ARGUMENTS_BAD;
+
+    CK_ULONG deadline_ms;
+    CK_RV rv = message_deadline(s, pParameter, ulParameterLen, &deadline_ms);
+    if (rv != CKR_OK)
+        return rv;
+
+    return sign_message(s, deadline_ms, pData, ulDataLen, pSignature, pulSignatureLen);
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GenerateKey)(
+CK_DEFINE_FUNCTION(CK_RV, C_SignMessageBegin)(
     CK_SESSION_HANDLE hSession,
-    CK_MECHANISM_PTR pMechanism,
-    CK_ATTRIBUTE_PTR pTemplate,
-    CK_ULONG ulCount,
-    CK_OBJECT_HANDLE_PTR phKey
+    CK_VOID_PTR pParameter,
+    CK_ULONG ulParameterLen
 )
 {
-    UNUSED(hSession);
-    UNUSED(pMechanism);
-    UNUSED(pTemplate);
-    UNUSED(ulCount);
-    UNUSED(phKey);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    ENTER();
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (!s->message_sign_active)
+        return CKR_OPERATION_NOT_INITIALIZED;
+    if (s->message_part_active)
+        return CKR_OPERATION_ACTIVE;
+
+    CK_RV rv = message_deadline(s, pParameter, ulParameterLen, &s->message_part_deadline_ms);
+    if (rv != CKR_OK)
+        return rv;
+
+    s->message_len = 0;
+    s->message_part_active = CK_TRUE;
+    return CKR_OK;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GenerateKeyPair)(
+CK_DEFINE_FUNCTION(CK_RV, C_SignMessageNext)(
     CK_SESSION_HANDLE hSession,
-    CK_MECHANISM_PTR pMechanism,
-    CK_ATTRIBUTE_PTR pPublicKeyTemplate,
-    CK_ULONG ulPublicKeyAttributeCount,
-    CK_ATTRIBUTE_PTR pPrivateKeyTemplate,
-    CK_ULONG ulPrivateKeyAttributeCount,
-    CK_OBJECT_HANDLE_PTR phPublicKey,
-    CK_OBJECT_HANDLE_PTR phPrivateKey
+    CK_VOID_PTR pParameter,
+    CK_ULONG ulParameterLen,
+    CK_BYTE_PTR pDataPart,
+    CK_ULONG ulDataPartLen,
+    CK_BYTE_PTR pSignature,
+    CK_ULONG_PTR pulSignatureLen
 )
 {
-    UNUSED(hSession);
-    UNUSED(pMechanism);
-    UNUSED(pPublicKeyTemplate);
-    UNUSED(ulPublicKeyAttributeCount);
-    UNUSED(pPrivateKeyTemplate);
-    UNUSED(ulPrivateKeyAttributeCount);
-    UNUSED(phPublicKey);
-    UNUSED(phPrivateKey);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    UNUSED(pParameter);
+    UNUSED(ulParameterLen);
+    ENTER();
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (!s->message_part_active)
+        return CKR_OPERATION_NOT_INITIALIZED;
+    if (pDataPart == NULL_PTR && ulDataPartLen > 0)
+        return CKR_ARGUMENTS_BAD;
+
+    // The ATECC signs a 32-byte digest, so that's all a message can hold
+    if (ulDataPartLen > sizeof(s->message) - s->message_len) {
+        s->message_part_active = CK_FALSE;
+        return CKR_DATA_LEN_RANGE;
+    }
+    memcpy(&s->message[s->message_len], pDataPart, ulDataPartLen);
+    s->message_len += ulDataPartLen;
+
+    // No signature length means that more parts are coming
+    if (pulSignatureLen == NULL_PTR)
+        return CKR_OK;
+
+    CK_RV rv = sign_message(s, s->message_part_deadline_ms, s->message, s->message_len, pSignature, pulSignatureLen);
+
+    // Asking for the signature length doesn't end the message
+    if (pSignature == NULL_PTR || rv == CKR_BUFFER_TOO_SMALL)
+        s->message_len -= ulDataPartLen;
+    else
+        s->message_part_active = CK_FALSE;
+    return rv;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_MessageSignFinal)(
+    CK_SESSION_HANDLE hSession
+)
+{
+    ENTER();
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (!s->message_sign_active)
+        return CKR_OPERATION_NOT_INITIALIZED;
+
+    lock(&s->device->mutex);
+    end_message_sign(s);
+    unlock(&s->device->mutex);
+    return CKR_OK;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_WrapKey)(
+CK_DEFINE_FUNCTION(CK_RV, C_MessageVerifyInit)(
     CK_SESSION_HANDLE hSession,
     CK_MECHANISM_PTR pMechanism,
-    CK_OBJECT_HANDLE hWrappingKey,
-    CK_OBJECT_HANDLE hKey,
-    CK_BYTE_PTR pWrappedKey,
-    CK_ULONG_PTR pulWrappedKeyLen
+    CK_OBJECT_HANDLE hKey
 )
 {
     UNUSED(hSession);
     UNUSED(pMechanism);
-    UNUSED(hWrappingKey);
     UNUSED(hKey);
-    UNUSED(pWrappedKey);
-    UNUSED(pulWrappedKeyLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_UnwrapKey)(
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyMessage)(
     CK_SESSION_HANDLE hSession,
-    CK_MECHANISM_PTR pMechanism,
-    CK_OBJECT_HANDLE hUnwrappingKey,
-    CK_BYTE_PTR pWrappedKey,
-    CK_ULONG ulWrappedKeyLen,
-    CK_ATTRIBUTE_PTR pTemplate,
-    CK_ULONG ulAttributeCount,
-    CK_OBJECT_HANDLE_PTR phKey
+    CK_VOID_PTR pParameter,
+    CK_ULONG ulParameterLen,
+    CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen,
+    CK_BYTE_PTR pSignature,
+    CK_ULONG ulSignatureLen
 )
 {
     UNUSED(hSession);
-    UNUSED(pMechanism);
-    UNUSED(hUnwrappingKey);
-    UNUSED(pWrappedKey);
-    UNUSED(ulWrappedKeyLen);
-    UNUSED(pTemplate);
-    UNUSED(ulAttributeCount);
-    UNUSED(phKey);
+    UNUSED(pParameter);
+    UNUSED(ulParameterLen);
+    UNUSED(pData);
+    UNUSED(ulDataLen);
+    UNUSED(pSignature);
+    UNUSED(ulSignatureLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_DeriveKey)(
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyMessageBegin)(
     CK_SESSION_HANDLE hSession,
-    CK_MECHANISM_PTR pMechanism,
-    CK_OBJECT_HANDLE hBaseKey,
-    CK_ATTRIBUTE_PTR pTemplate,
-    CK_ULONG ulAttributeCount,
-    CK_OBJECT_HANDLE_PTR phKey
+    CK_VOID_PTR pParameter,
+    CK_ULONG ulParameterLen
 )
 {
     UNUSED(hSession);
-    UNUSED(pMechanism);
-    UNUSED(hBaseKey);
-    UNUSED(pTemplate);
-    UNUSED(ulAttributeCount);
-    UNUSED(phKey);
+    UNUSED(pParameter);
+    UNUSED(ulParameterLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-/* Random number generation functions */
-
-CK_DEFINE_FUNCTION(CK_RV, C_SeedRandom)(
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyMessageNext)(
     CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pSeed,
-    CK_ULONG ulSeedLen
+    CK_VOID_PTR pParameter,
+    CK_ULONG ulParameterLen,
+    CK_BYTE_PTR pDataPart,
+    CK_ULONG ulDataPartLen,
+    CK_BYTE_PTR pSignature,
+    CK_ULONG ulSignatureLen
 )
 {
     UNUSED(hSession);
-    UNUSED(pSeed);
-    UNUSED(ulSeedLen);
+    UNUSED(pParameter);
+    UNUSED(ulParameterLen);
+    UNUSED(pDataPart);
+    UNUSED(ulDataPartLen);
+    UNUSED(pSignature);
+    UNUSED(ulSignatureLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GenerateRandom)(
-    CK_SESSION_HANDLE hSession,
-    CK_BYTE_PTR pRandomData,
-    CK_ULONG ulRandomLen
+CK_DEFINE_FUNCTION(CK_RV, C_MessageVerifyFinal)(
+    CK_SESSION_HANDLE hSession
 )
 {
     UNUSED(hSession);
-    UNUSED(pRandomData);
-    UNUSED(ulRandomLen);
     UNIMPLEMENTED();
     return CKR_FUNCTION_FAILED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_GetFunctionStatus)(
-    CK_SESSION_HANDLE hSession
+/* Vendor extensions. See nerves_key_pkcs11.h. */
+
+/* Batches are signed this many at a time so that other callers can get to
+   the device in between. This has to fit in one request to the agent. */
+#define NKCS11_BATCH_CHUNK NKCS11_AGENT_MAX_DIGESTS
+
+// Give every digest that's left the same result when a batch can't go on
+static CK_RV fail_batch(CK_RV rv, CK_ULONG count, CK_RV *results)
+{
+    if (results) {
+        for (CK_ULONG i = 0; i < count; i++)
+            results[i] = rv;
+    }
+    return rv;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_NKCS11_SignBatch)(
+    CK_SESSION_HANDLE hSession,
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey,
+    CK_BYTE_PTR pDigests,
+    CK_ULONG ulCount,
+    CK_BYTE_PTR pSignatures,
+    CK_RV *pResults
 )
 {
-    UNUSED(hSession);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    UNUSED(hKey);
+    ENTER();
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return fail_batch(CKR_SESSION_HANDLE_INVALID, ulCount, pResults);
+    if (pMechanism == NULL_PTR ||
+        (ulCount > 0 && (pDigests == NULL_PTR || pSignatures == NULL_PTR || pResults == NULL_PTR)))
+        return fail_batch(CKR_ARGUMENTS_BAD, ulCount, pResults);
+
+    CK_ULONG deadline_ms;
+    CK_RV rv = check_sign_mechanism(pMechanism, &deadline_ms);
+    if (rv != CKR_OK)
+        return fail_batch(rv, ulCount, pResults);
+
+    // The chip stays awake from the first chunk to the last like it does
+    // for C_MessageSignInit. Other callers can still go in between.
+    struct nerves_key_device *device = s->device;
+    CK_BBOOL holding = CK_FALSE;
+    for (CK_ULONG start = 0; start < ulCount; start += NKCS11_BATCH_CHUNK) {
+        size_t count = ulCount - start < NKCS11_BATCH_CHUNK ? ulCount - start : NKCS11_BATCH_CHUNK;
+        const uint8_t *digests[NKCS11_BATCH_CHUNK];
+        uint8_t *signatures[NKCS11_BATCH_CHUNK];
+        for (size_t i = 0; i < count; i++) {
+            digests[i] = &pDigests[(start + i) * 32];
+            signatures[i] = &pSignatures[(start + i) * 64];
+        }
+
+        CK_RV enter_rv = device_enter(s, deadline_ms);
+        if (enter_rv != CKR_OK) {
+            if (holding) {
+                lock(&device->mutex);
+                atecc508a_release_awake(&device->dev);
+                schedule_sleep(device);
+                unlock(&device->mutex);
+            }
+
+            // The device is overloaded, so don't get in line for the rest either
+            return fail_batch(enter_rv, ulCount - start, &pResults[start]);
+        }
+        if (device->use_agent) {
+            agent_sign(device, s->priority, deadline_ms, count, digests, signatures, &pResults[start]);
+        } else {
+            CK_BBOOL last = start + count >= ulCount;
+            if (!holding && !last) {
+                atecc508a_hold_awake(&device->dev);
+                holding = CK_TRUE;
+            }
+
+            int results[NKCS11_BATCH_CHUNK];
+            atecc508a_sign_group(&device->dev, 0, count, digests, signatures, results, NULL, NULL);
+            for (size_t i = 0; i < count; i++)
+                pResults[start + i] = results[i] < 0 ? CKR_DEVICE_ERROR : CKR_OK;
+
+            if (holding && last) {
+                atecc508a_release_awake(&device->dev);
+                holding = CK_FALSE;
+            }
+        }
+        device->sign_groups++;
+        device->grouped_signs += count;
+        device_leave(s);
+
+        for (size_t i = 0; i < count; i++) {
+            if (pResults[start + i] != CKR_OK)
+                rv = pResults[start + i];
+        }
+    }
+    return rv;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_CancelFunction)(
-    CK_SESSION_HANDLE hSession
+/* C_NKCS11_ScanSlots gives every slot its own worker thread so that slow
+   or missing chips don't hold up the others */
+struct nerves_key_scan {
+    CK_SLOT_ID slot_id;
+    CK_RV rv;
+    CK_NKCS11_SLOT_SCAN result;
+    pthread_t thread;
+    CK_BBOOL started;
+};
+
+static CK_RV scan_slot(CK_SLOT_ID slotID, CK_NKCS11_SLOT_SCAN_PTR result)
+{
+    struct nerves_key_device *device = &devices[slotID];
+
+    // Open slots already have everything in their snapshot. Others are
+    // opened just long enough to read it.
+    lock(&device->mutex);
+    lock(&table_mutex);
+    CK_BBOOL was_open = device->open_count > 0;
+    unlock(&table_mutex);
+
+    CK_RV rv = was_open ? CKR_OK : open_device(slotID);
+    if (rv == CKR_OK) {
+        const struct nerves_key_snapshot *snapshot = current_snapshot(device);
+        if (snapshot->has_serial_number) {
+            memset(result, 0, sizeof(*result));
+            result->slotID = slotID;
+            memcpy(result->serialNumber, snapshot->serial_number, sizeof(result->serialNumber));
+            result->hasPublicKey = snapshot->has_public_key;
+            memcpy(result->publicKey, snapshot->public_key, sizeof(result->publicKey));
+            snprintf(result->chipName, sizeof(result->chipName), "%s", atecc508a_variant_name(snapshot->variant));
+        } else {
+            rv = CKR_TOKEN_NOT_PRESENT;
+        }
+
+        if (!was_open) {
+            lock(&table_mutex);
+            detach_device(device);
+            unlock(&table_mutex);
+            close_device(device);
+        }
+    }
+    unlock(&device->mutex);
+    return rv;
+}
+
+static void *scan_worker(void *arg)
+{
+    struct nerves_key_scan *scan = arg;
+    scan->rv = scan_slot(scan->slot_id, &scan->result);
+    return NULL;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_NKCS11_ScanSlots)(
+    CK_NKCS11_SLOT_SCAN_PTR pScans,
+    CK_ULONG_PTR pulCount
 )
 {
-    UNUSED(hSession);
-    UNIMPLEMENTED();
-    return CKR_FUNCTION_FAILED;
+    ENTER();
+    if (!initialized)
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    if (pulCount == NULL_PTR)
+        return CKR_ARGUMENTS_BAD;
+
+    const struct atecc508a_transport *transport = selected_transport();
+    if (transport == NULL)
+        return CKR_GENERAL_ERROR;
+
+    // Both addresses are tried on every bus that's there
+    struct nerves_key_scan scans[MAX_SLOT_ID + 1];
+    for (CK_SLOT_ID i = 0; i <= MAX_SLOT_ID; i++) {
+        scans[i].slot_id = i;
+        scans[i].rv = CKR_TOKEN_NOT_PRESENT;
+        scans[i].started = CK_FALSE;
+    }
+    uint32_t buses = present_buses(transport);
+    for (CK_ULONG bus = 0; bus < DEVICE_INDEX_SPLIT; bus++) {
+        if ((buses & (1U << bus)) == 0)
+            continue;
+
+        for (CK_SLOT_ID i = bus; i <= MAX_SLOT_ID; i += DEVICE_INDEX_SPLIT) {
+            scans[i].started = can_create_threads &&
+                               pthread_create(&scans[i].thread, NULL, scan_worker, &scans[i]) == 0;
+            if (!scans[i].started)
+                scan_worker(&scans[i]);
+        }
+    }
+    for (CK_SLOT_ID i = 0; i <= MAX_SLOT_ID; i++) {
+        if (scans[i].started)
+            pthread_join(scans[i].thread, NULL);
+    }
+
+    CK_ULONG count = 0;
+    CK_RV rv = CKR_OK;
+    for (CK_SLOT_ID i = 0; i <= MAX_SLOT_ID; i++) {
+        if (scans[i].rv != CKR_OK)
+            continue;
+
+        if (pScans) {
+            if (count < *pulCount)
+                pScans[count] = scans[i].result;
+            else
+                rv = CKR_BUFFER_TOO_SMALL;
+        }
+        count++;
+    }
+    *pulCount = count;
+    return rv;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_NKCS11_GetQueueStats)(
+    CK_SLOT_ID slotID,
+    CK_NKCS11_QUEUE_STATS_PTR pStats
+)
+{
+    ENTER();
+    if (!initialized)
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    if (slotID > MAX_SLOT_ID)
+        return CKR_SLOT_ID_INVALID;
+    if (pStats == NULL_PTR)
+        return CKR_ARGUMENTS_BAD;
+
+    struct nerves_key_queue_stats stats[NKCS11_PRIORITY_CLASSES];
+    nerves_key_queue_get_stats(&devices[slotID].queue, stats);
+
+    unsigned long requests = 0;
+    uint64_t total_wait_us = 0;
+    memset(pStats, 0, sizeof(*pStats));
+    for (int i = 0; i < NKCS11_PRIORITY_CLASSES; i++) {
+        requests += stats[i].requests;
+        pStats->ulShed += stats[i].shed;
+        pStats->ulTimedOut += stats[i].timed_out;
+        pStats->ulWaiting += stats[i].depth;
+        pStats->ulMaxWaiting += stats[i].max_depth;
+        pStats->ulDeadlineMisses += stats[i].deadline_misses;
+        total_wait_us += stats[i].total_wait_us;
+        if (stats[i].max_wait_us > pStats->ulMaxWaitUs)
+            pStats->ulMaxWaitUs = (CK_ULONG) stats[i].max_wait_us;
+    }
+    pStats->ulAccepted = requests - pStats->ulShed;
+
+    // Only requests that got the device add to the total wait
+    CK_ULONG started = pStats->ulAccepted - pStats->ulTimedOut - pStats->ulWaiting;
+    if (started)
+        pStats->ulMeanWaitUs = (CK_ULONG) (total_wait_us / started);
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_NKCS11_GetBusStats)(
+    CK_SLOT_ID slotID,
+    CK_NKCS11_BUS_STATS_PTR pStats
+)
+{
+    ENTER();
+    if (!initialized)
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    if (slotID > MAX_SLOT_ID)
+        return CKR_SLOT_ID_INVALID;
+    if (pStats == NULL_PTR)
+        return CKR_ARGUMENTS_BAD;
+
+    struct nerves_key_bus_stats stats;
+    if (open_shm() < 0 || nerves_key_shm_get_bus_stats((unsigned int) slotID, &stats) < 0)
+        return CKR_FUNCTION_NOT_SUPPORTED;
+
+    pStats->ulTurns = (CK_ULONG) stats.turns;
+    pStats->ulContended = (CK_ULONG) stats.contended;
+    pStats->ulHandoffs = (CK_ULONG) stats.handoffs;
+    pStats->ulTakeovers = (CK_ULONG) stats.takeovers;
+    pStats->ulMeanWaitUs = (CK_ULONG) (stats.contended ? stats.total_wait_us / stats.contended : 0);
+    pStats->ulMaxWaitUs = (CK_ULONG) stats.max_wait_us;
+    return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_NKCS11_SignAsync)(
+    CK_SESSION_HANDLE hSession,
+    CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey,
+    CK_BYTE_PTR pDigest,
+    CK_BYTE_PTR pSignature,
+    CK_NKCS11_ASYNC_SIGN_PTR pAsync
+)
+{
+    UNUSED(hKey);
+    ENTER();
+    struct nerves_key_session *s = lookup_session(hSession);
+    if (s == NULL)
+        return CKR_SESSION_HANDLE_INVALID;
+    if (pMechanism == NULL_PTR || pDigest == NULL_PTR || pSignature == NULL_PTR || pAsync == NULL_PTR)
+        return CKR_ARGUMENTS_BAD;
+
+    if (!can_create_threads)
+        return CKR_FUNCTION_NOT_SUPPORTED;
+
+    CK_ULONG deadline_ms;
+    CK_RV rv = check_sign_mechanism(pMechanism, &deadline_ms);
+    if (rv != CKR_OK)
+        return rv;
+
+    struct nerves_key_async_sign *request = calloc(1, sizeof(struct nerves_key_async_sign));
+    if (request == NULL)
+        return CKR_HOST_MEMORY;
+
+    request->job.step = async_sign_step;
+    request->job.finish = async_sign_finish;
+    request->device = s->device;
+    request->session = hSession;
+    request->priority = s->priority;
+    request->deadline_ms = deadline_ms;
+    request->rv = CKR_OK;
+    request->async = pAsync;
+    atecc508a_sign_start(&request->device->dev, &request->op, 0, pDigest, pSignature);
+
+    pthread_mutex_lock(&async_mutex);
+    async_outstanding++;
+    pthread_mutex_unlock(&async_mutex);
+
+    int result = nerves_key_queue_enter_async(&s->device->queue, s->priority, deadline_from_ms(deadline_ms),
+                                              async_sign_granted, request);
+    switch (result) {
+    case NKCS11_QUEUE_GRANTED:
+        async_sign_granted(request, result);
+        break;
+
+    case NKCS11_QUEUE_WAITING:
+        break;
+
+    default:
+        // Turned away. Nothing is reported through pAsync since it never started.
+        free(request);
+        pthread_mutex_lock(&async_mutex);
+        if (--async_outstanding == 0)
+            pthread_cond_broadcast(&async_idle);
+        pthread_mutex_unlock(&async_mutex);
+        return queue_result_rv(result);
+    }
+    return CKR_OK;
 }
 
 static CK_FUNCTION_LIST function_list = {
@@ -1528,3 +3724,108 @@ static CK_FUNCTION_LIST function_list = {
     C_CancelFunction,
     C_WaitForSlotEvent,
 };
+
+static CK_FUNCTION_LIST_3_0 function_list_3_0 = {
+    {3, 0},
+    C_Initialize,
+    C_Finalize,
+    C_GetInfo,
+    C_GetFunctionList,
+    C_GetSlotList,
+    C_GetSlotInfo,
+    C_GetTokenInfo,
+    C_GetMechanismList,
+    C_GetMechanismInfo,
+    C_InitToken,
+    C_InitPIN,
+    C_SetPIN,
+    C_OpenSession,
+    C_CloseSession,
+    C_CloseAllSessions,
+    C_GetSessionInfo,
+    C_GetOperationState,
+    C_SetOperationState,
+    C_Login,
+    C_Logout,
+    C_CreateObject,
+    C_CopyObject,
+    C_DestroyObject,
+    C_GetObjectSize,
+    C_GetAttributeValue,
+    C_SetAttributeValue,
+    C_FindObjectsInit,
+    C_FindObjects,
+    C_FindObjectsFinal,
+    C_EncryptInit,
+    C_Encrypt,
+    C_EncryptUpdate,
+    C_EncryptFinal,
+    C_DecryptInit,
+    C_Decrypt,
+    C_DecryptUpdate,
+    C_DecryptFinal,
+    C_DigestInit,
+    C_Digest,
+    C_DigestUpdate,
+    C_DigestKey,
+    C_DigestFinal,
+    C_SignInit,
+    C_Sign,
+    C_SignUpdate,
+    C_SignFinal,
+    C_SignRecoverInit,
+    C_SignRecover,
+    C_VerifyInit,
+    C_Verify,
+    C_VerifyUpdate,
+    C_VerifyFinal,
+    C_VerifyRecoverInit,
+    C_VerifyRecover,
+    C_DigestEncryptUpdate,
+    C_DecryptDigestUpdate,
+    C_SignEncryptUpdate,
+    C_DecryptVerifyUpdate,
+    C_GenerateKey,
+    C_GenerateKeyPair,
+    C_WrapKey,
+    C_UnwrapKey,
+    C_DeriveKey,
+    C_SeedRandom,
+    C_GenerateRandom,
+    C_GetFunctionStatus,
+    C_CancelFunction,
+    C_WaitForSlotEvent,
+    C_GetInterfaceList,
+    C_GetInterface,
+    C_LoginUser,
+    C_SessionCancel,
+    C_MessageEncryptInit,
+    C_EncryptMessage,
+    C_EncryptMessageBegin,
+    C_EncryptMessageNext,
+    C_MessageEncryptFinal,
+    C_MessageDecryptInit,
+    C_DecryptMessage,
+    C_DecryptMessageBegin,
+    C_DecryptMessageNext,
+    C_MessageDecryptFinal,
+    C_MessageSignInit,
+    C_SignMessage,
+    C_SignMessageBegin,
+    C_SignMessageNext,
+    C_MessageSignFinal,
+    C_MessageVerifyInit,
+    C_VerifyMessage,
+    C_VerifyMessageBegin,
+    C_VerifyMessageNext,
+    C_MessageVerifyFinal,
+};
+
+static CK_NKCS11_FUNCTION_LIST vendor_function_list = {
+    { NKCS11_FUNCTION_LIST_VERSION_MAJOR, NKCS11_FUNCTION_LIST_VERSION_MINOR },
+    C_NKCS11_SignBatch,
+    C_NKCS11_SignAsync,
+    C_NKCS11_ScanSlots,
+    C_NKCS11_GetQueueStats,
+    C_NKCS11_GetBusStats,
+};
@@ -0,0 +1,160 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// NervesKey vendor extensions to PKCS #11
+//
+// Applications that don't use these don't need this header.
+
+#ifndef NERVES_KEY_PKCS11_H
+#define NERVES_KEY_PKCS11_H
+
+#include "pkcs11.h"
+
+// C_OpenSession flags that set the session's priority class. When threads
+// share a NervesKey, interactive sessions (e.g., TLS handshakes) go ahead of
+// normal ones and background sessions go last. Sessions are normal by default.
+#define CKF_NKCS11_PRIORITY_BACKGROUND  0x00010000UL
+#define CKF_NKCS11_PRIORITY_INTERACTIVE 0x00020000UL
+
+// Optional parameter for CKM_ECDSA in C_SignInit. Signatures with deadlines
+// are run earliest deadline first within their priority class.
+typedef struct CK_NKCS11_SIGN_PARAMS {
+    CK_ULONG ulDeadlineMs; // How soon the C_Sign should start or 0 for no deadline
+} CK_NKCS11_SIGN_PARAMS;
+
+// Returned when a signature waited longer than NERVES_KEY_QUEUE_MAX_WAIT_MS
+// for its NervesKey. Requests that arrive when NERVES_KEY_QUEUE_LIMIT are
+// already waiting get CKR_FUNCTION_REJECTED right away instead.
+#define CKR_NKCS11_QUEUE_TIMEOUT (CKR_VENDOR_DEFINED | 0x4e4b0001UL)
+
+// Vendor functions that aren't in CK_FUNCTION_LIST. Get them by looking up
+// C_NKCS11_GetFunctionList the same way as C_GetFunctionList.
+//
+// C_NKCS11_SignBatch signs ulCount 32-byte digests from pDigests into
+// ulCount 64-byte signatures in pSignatures with far fewer wakeups than
+// calling C_Sign for each one. It takes the same mechanism and key as
+// C_SignInit, but doesn't need a C_SignInit first. pResults gets the result
+// for each digest, even when the batch fails before anything is signed. The
+// call returns CKR_OK if every digest was signed.
+//
+// C_NKCS11_SignAsync starts signing one 32-byte digest and returns without
+// waiting for it. The signature is written to the 64-byte pSignature and
+// the library's engine thread reports the result through pAsync. The digest
+// is copied, but pSignature and pAsync have to stay around until then.
+// Requests wait for the device in priority order like C_Sign. One thread can
+// keep every NervesKey busy this way. C_Finalize waits for requests that
+// haven't finished.
+//
+// C_NKCS11_ScanSlots reads the serial number, public key and chip type of
+// every NervesKey that answers. Each slot is checked on its own thread, so
+// this takes about as long as the slowest chip. It works like
+// C_GetSlotList: pass NULL for pScans to get the count, and
+// CKR_BUFFER_TOO_SMALL means that *pulCount has been set to the number
+// needed. Slots come back in order.
+//
+// C_NKCS11_GetQueueStats reports how many requests for a slot's NervesKey
+// were let in, turned away and timed out since C_Initialize, and how long
+// they waited. Counts cover all priority classes.
+//
+// C_NKCS11_GetBusStats reports how processes have been taking turns on a
+// slot's NervesKey. The counts are for every process that uses the same
+// NERVES_KEY_SHM segment. It returns CKR_FUNCTION_NOT_SUPPORTED if
+// NERVES_KEY_SHM isn't set.
+#define NKCS11_FUNCTION_LIST_VERSION_MAJOR 1
+#define NKCS11_FUNCTION_LIST_VERSION_MINOR 4
+
+typedef struct CK_NKCS11_ASYNC_SIGN {
+    int eventFd;                                    // eventfd to write 1 to when done or -1
+    void (*Callback)(CK_VOID_PTR pContext, CK_RV rv); // Called on the engine thread when done or NULL
+    CK_VOID_PTR pContext;                           // Passed to Callback
+    CK_RV rv;                                       // The result. Set before eventFd or Callback.
+} CK_NKCS11_ASYNC_SIGN;
+
+typedef CK_NKCS11_ASYNC_SIGN *CK_NKCS11_ASYNC_SIGN_PTR;
+
+typedef struct CK_NKCS11_SLOT_SCAN {
+    CK_SLOT_ID slotID;
+    CK_BYTE serialNumber[9];
+    CK_BBOOL hasPublicKey;
+    CK_BYTE publicKey[65]; // Uncompressed EC point (0x04, X, Y)
+    char chipName[16];     // For example, "ATECC608A"
+} CK_NKCS11_SLOT_SCAN;
+
+typedef CK_NKCS11_SLOT_SCAN *CK_NKCS11_SLOT_SCAN_PTR;
+
+typedef struct CK_NKCS11_QUEUE_STATS {
+    CK_ULONG ulAccepted;       // Requests that were let in to wait
+    CK_ULONG ulShed;           // Rejected because the queue was full
+    CK_ULONG ulTimedOut;       // Gave up after waiting too long
+    CK_ULONG ulWaiting;        // Waiting right now
+    CK_ULONG ulMaxWaiting;     // Most waiting at once in each class, added up
+    CK_ULONG ulDeadlineMisses; // Started after their C_SignInit deadline
+    CK_ULONG ulMeanWaitUs;     // For requests that got the device
+    CK_ULONG ulMaxWaitUs;
+} CK_NKCS11_QUEUE_STATS;
+
+typedef CK_NKCS11_QUEUE_STATS *CK_NKCS11_QUEUE_STATS_PTR;
+
+typedef struct CK_NKCS11_BUS_STATS {
+    CK_ULONG ulTurns;      // Command sequences run by all processes
+    CK_ULONG ulContended;  // Turns that had to wait for another process
+    CK_ULONG ulHandoffs;   // Turns after a different process had the chip
+    CK_ULONG ulTakeovers;  // Processes skipped because they died
+    CK_ULONG ulMeanWaitUs; // For the turns that waited
+    CK_ULONG ulMaxWaitUs;
+} CK_NKCS11_BUS_STATS;
+
+typedef CK_NKCS11_BUS_STATS *CK_NKCS11_BUS_STATS_PTR;
+
+typedef struct CK_NKCS11_FUNCTION_LIST {
+    CK_VERSION version;
+    CK_RV (*C_NKCS11_SignBatch)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey,
+                                CK_BYTE_PTR pDigests, CK_ULONG ulCount, CK_BYTE_PTR pSignatures, CK_RV *pResults);
+    CK_RV (*C_NKCS11_SignAsync)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey,
+                                CK_BYTE_PTR pDigest, CK_BYTE_PTR pSignature, CK_NKCS11_ASYNC_SIGN_PTR pAsync);
+    CK_RV (*C_NKCS11_ScanSlots)(CK_NKCS11_SLOT_SCAN_PTR pScans, CK_ULONG_PTR pulCount);
+    CK_RV (*C_NKCS11_GetQueueStats)(CK_SLOT_ID slotID, CK_NKCS11_QUEUE_STATS_PTR pStats);
+    CK_RV (*C_NKCS11_GetBusStats)(CK_SLOT_ID slotID, CK_NKCS11_BUS_STATS_PTR pStats);
+} CK_NKCS11_FUNCTION_LIST;
+
+typedef CK_NKCS11_FUNCTION_LIST *CK_NKCS11_FUNCTION_LIST_PTR;
+typedef CK_NKCS11_FUNCTION_LIST_PTR *CK_NKCS11_FUNCTION_LIST_PTR_PTR;
+
+CK_RV C_NKCS11_GetFunctionList(CK_NKCS11_FUNCTION_LIST_PTR_PTR ppFunctionList);
+CK_RV C_NKCS11_SignBatch(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey,
+                         CK_BYTE_PTR pDigests, CK_ULONG ulCount, CK_BYTE_PTR pSignatures, CK_RV *pResults);
+CK_RV C_NKCS11_SignAsync(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey,
+                         CK_BYTE_PTR pDigest, CK_BYTE_PTR pSignature, CK_NKCS11_ASYNC_SIGN_PTR pAsync);
+CK_RV C_NKCS11_ScanSlots(CK_NKCS11_SLOT_SCAN_PTR pScans, CK_ULONG_PTR pulCount);
+CK_RV C_NKCS11_GetQueueStats(CK_SLOT_ID slotID, CK_NKCS11_QUEUE_STATS_PTR pStats);
+CK_RV C_NKCS11_GetBusStats(CK_SLOT_ID slotID, CK_NKCS11_BUS_STATS_PTR pStats);
+
+#endif // NERVES_KEY_PKCS11_H
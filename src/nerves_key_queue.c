@@ -0,0 +1,524 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nerves_key_queue.h"
+#include "log.h"
+
+struct nerves_key_waiter {
+    int priority;
+    uint64_t deadline_us; // 0 if none
+    uint64_t seq;
+    uint64_t enqueue_us;
+    int granted;
+    int expired;          // Removed for waiting too long
+    const int *done;      // Stop waiting when this is set. NULL if not used.
+    pthread_cond_t cond;
+
+    // Called instead of signaling cond for callers that don't wait. See
+    // nerves_key_queue_enter_async().
+    void (*granted_fn)(void *context, int result);
+    void *context;
+
+    struct nerves_key_waiter *next;
+};
+
+static const char *class_names[NKCS11_PRIORITY_CLASSES] = {
+    "background", "normal", "interactive"
+};
+
+uint64_t nerves_key_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+void nerves_key_queue_init(struct nerves_key_queue *q)
+{
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->done_cond, NULL);
+}
+
+void nerves_key_queue_destroy(struct nerves_key_queue *q)
+{
+    pthread_cond_destroy(&q->done_cond);
+    pthread_mutex_destroy(&q->mutex);
+}
+
+/**
+ * Bound the queue
+ *
+ * @param q the device's queue
+ * @param max_waiting how many requests can wait at once or 0 for no limit
+ * @param max_wait_us how long a request can wait or 0 for no limit
+ */
+void nerves_key_queue_set_limits(struct nerves_key_queue *q, unsigned long max_waiting, uint64_t max_wait_us)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->max_waiting = max_waiting;
+    q->max_wait_us = max_wait_us;
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/* Return 1 if a request with priority a and deadline a should run before one
+   with priority b and deadline b. Return 0 if it goes after it or if they tie.
+   Ties go in the order that they came in. */
+int nerves_key_queue_goes_first(int a_priority, uint64_t a_deadline_us, int b_priority, uint64_t b_deadline_us)
+{
+    if (a_priority != b_priority)
+        return a_priority > b_priority;
+
+    if (a_deadline_us != b_deadline_us) {
+        if (a_deadline_us == 0)
+            return 0;
+        if (b_deadline_us == 0)
+            return 1;
+        return a_deadline_us < b_deadline_us;
+    }
+    return 0;
+}
+
+// Return 1 if a should run before b
+static int runs_before(const struct nerves_key_waiter *a, const struct nerves_key_waiter *b)
+{
+    if (nerves_key_queue_goes_first(a->priority, a->deadline_us, b->priority, b->deadline_us))
+        return 1;
+    if (nerves_key_queue_goes_first(b->priority, b->deadline_us, a->priority, a->deadline_us))
+        return 0;
+    return a->seq < b->seq;
+}
+
+// Call with q->mutex held
+static void record_start(struct nerves_key_queue *q, int priority, uint64_t deadline_us, uint64_t enqueue_us)
+{
+    struct nerves_key_queue_stats *stats = &q->stats[priority];
+    uint64_t now = nerves_key_now_us();
+    uint64_t wait_us = now - enqueue_us;
+
+    stats->total_wait_us += wait_us;
+    if (wait_us > stats->max_wait_us)
+        stats->max_wait_us = wait_us;
+    if (deadline_us && now > deadline_us)
+        stats->deadline_misses++;
+}
+
+// Call with q->mutex held. Callers with a done flag might be finished by
+// someone else anyway, so they count their own rejections with
+// nerves_key_queue_count_turned_away().
+static void count_turned_away(struct nerves_key_queue *q, int priority, const int *done, int result)
+{
+    if (done)
+        return;
+
+    if (result == NKCS11_QUEUE_SHED)
+        q->stats[priority].shed++;
+    else
+        q->stats[priority].timed_out++;
+}
+
+// Call with q->mutex held. Return 1 if the caller can have the device now
+// and NKCS11_QUEUE_SHED if the queue is full. 0 means that it has to wait.
+static int admit(struct nerves_key_queue *q, int priority, uint64_t deadline_us, uint64_t enqueue_us,
+                 const int *done)
+{
+    if (!q->busy) {
+        q->busy = 1;
+        record_start(q, priority, deadline_us, enqueue_us);
+        return NKCS11_QUEUE_GRANTED;
+    }
+
+    if (q->max_waiting && q->waiting_count >= q->max_waiting) {
+        count_turned_away(q, priority, done, NKCS11_QUEUE_SHED);
+        return NKCS11_QUEUE_SHED;
+    }
+    return 0;
+}
+
+// Call with q->mutex held
+static void add_waiter(struct nerves_key_queue *q, struct nerves_key_waiter *waiter)
+{
+    struct nerves_key_queue_stats *stats = &q->stats[waiter->priority];
+
+    waiter->seq = q->next_seq++;
+    waiter->next = q->waiting;
+    q->waiting = waiter;
+    q->waiting_count++;
+
+    stats->depth++;
+    if (stats->depth > stats->max_depth)
+        stats->max_depth = stats->depth;
+}
+
+// Call with q->mutex held
+static void remove_waiter(struct nerves_key_queue *q, struct nerves_key_waiter **link)
+{
+    struct nerves_key_waiter *waiter = *link;
+    *link = waiter->next;
+    q->waiting_count--;
+    q->stats[waiter->priority].depth--;
+}
+
+// Call with q->mutex held
+static struct nerves_key_waiter **find_waiter(struct nerves_key_queue *q, struct nerves_key_waiter *waiter)
+{
+    for (struct nerves_key_waiter **w = &q->waiting; *w; w = &(*w)->next) {
+        if (*w == waiter)
+            return w;
+    }
+    return NULL;
+}
+
+static struct timespec to_timespec(uint64_t us)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t) (us / 1000000);
+    ts.tv_nsec = (long) (us % 1000000) * 1000;
+    return ts;
+}
+
+/**
+ * Wait for a turn on the device
+ *
+ * @param q the device's queue
+ * @param priority one of the NKCS11_PRIORITY_* classes
+ * @param deadline_us when the request should start by (nerves_key_now_us() time) or 0 for none
+ * @return NKCS11_QUEUE_GRANTED, NKCS11_QUEUE_SHED or NKCS11_QUEUE_TIMED_OUT
+ */
+int nerves_key_queue_enter(struct nerves_key_queue *q, int priority, uint64_t deadline_us)
+{
+    return nerves_key_queue_enter_unless(q, priority, deadline_us, NULL);
+}
+
+/**
+ * Wait for a turn on the device unless someone else does the work first
+ *
+ * This is for requests that the current holder of the device can take care
+ * of. The holder sets *done and calls nerves_key_queue_notify() to let the
+ * caller go without waiting for the device. If done isn't NULL, rejections
+ * aren't counted until the caller confirms them with
+ * nerves_key_queue_count_turned_away().
+ *
+ * @param q the device's queue
+ * @param priority one of the NKCS11_PRIORITY_* classes
+ * @param deadline_us when the request should start by (nerves_key_now_us() time) or 0 for none
+ * @param done set when the request has been taken care of or NULL
+ * @return NKCS11_QUEUE_GRANTED if the caller has the device, NKCS11_QUEUE_DONE
+ *         if *done was set first, or NKCS11_QUEUE_SHED or NKCS11_QUEUE_TIMED_OUT
+ *         if the queue's limits turned it away
+ */
+int nerves_key_queue_enter_unless(struct nerves_key_queue *q, int priority, uint64_t deadline_us, const int *done)
+{
+    if (priority < 0 || priority >= NKCS11_PRIORITY_CLASSES)
+        priority = NKCS11_PRIORITY_NORMAL;
+
+    struct nerves_key_queue_stats *stats = &q->stats[priority];
+    uint64_t enqueue_us = nerves_key_now_us();
+
+    pthread_mutex_lock(&q->mutex);
+    stats->requests++;
+    if (done && __atomic_load_n(done, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&q->mutex);
+        return NKCS11_QUEUE_DONE;
+    }
+
+    int result = admit(q, priority, deadline_us, enqueue_us, done);
+    if (result != 0) {
+        pthread_mutex_unlock(&q->mutex);
+        return result;
+    }
+
+    struct nerves_key_waiter waiter;
+    waiter.priority = priority;
+    waiter.deadline_us = deadline_us;
+    waiter.enqueue_us = enqueue_us;
+    waiter.granted = 0;
+    waiter.expired = 0;
+    waiter.done = done;
+    waiter.granted_fn = NULL;
+
+    // The expiration time is on the same clock as nerves_key_now_us()
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&waiter.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    add_waiter(q, &waiter);
+
+    struct timespec expiration = to_timespec(enqueue_us + q->max_wait_us);
+    while (!waiter.granted && !waiter.expired && !(done && __atomic_load_n(done, __ATOMIC_ACQUIRE))) {
+        if (q->max_wait_us == 0) {
+            pthread_cond_wait(&waiter.cond, &q->mutex);
+        } else if (pthread_cond_timedwait(&waiter.cond, &q->mutex, &expiration) == ETIMEDOUT &&
+                   !waiter.granted && !waiter.expired) {
+            remove_waiter(q, find_waiter(q, &waiter));
+            count_turned_away(q, priority, done, NKCS11_QUEUE_TIMED_OUT);
+            waiter.expired = 1;
+        }
+    }
+
+    if (waiter.granted) {
+        result = NKCS11_QUEUE_GRANTED;
+    } else if (waiter.expired) {
+        result = NKCS11_QUEUE_TIMED_OUT;
+    } else {
+        // Done without needing the device, so give up the place in line
+        remove_waiter(q, find_waiter(q, &waiter));
+        record_start(q, priority, deadline_us, enqueue_us);
+        result = NKCS11_QUEUE_DONE;
+    }
+
+    pthread_mutex_unlock(&q->mutex);
+    pthread_cond_destroy(&waiter.cond);
+    return result;
+}
+
+/**
+ * Get in line for the device without waiting
+ *
+ * This is for callers that can't block. If the device is free, it's the
+ * caller's right away. Otherwise, granted is called with NKCS11_QUEUE_GRANTED
+ * when it's the caller's turn or NKCS11_QUEUE_TIMED_OUT if it waited too
+ * long. That happens on the thread that calls nerves_key_queue_leave(), so
+ * granted shouldn't do much more than hand off the work. Timeouts are
+ * noticed when the device changes hands, so they can be up to one command
+ * late.
+ *
+ * @param q the device's queue
+ * @param priority one of the NKCS11_PRIORITY_* classes
+ * @param deadline_us when the request should start by (nerves_key_now_us() time) or 0 for none
+ * @param granted called when the caller has the device
+ * @param context passed to granted
+ * @return NKCS11_QUEUE_GRANTED if the caller has the device now,
+ *         NKCS11_QUEUE_WAITING if granted will be called, NKCS11_QUEUE_SHED
+ *         or NKCS11_QUEUE_NO_MEMORY
+ */
+int nerves_key_queue_enter_async(struct nerves_key_queue *q, int priority, uint64_t deadline_us,
+                                 void (*granted)(void *context, int result), void *context)
+{
+    if (priority < 0 || priority >= NKCS11_PRIORITY_CLASSES)
+        priority = NKCS11_PRIORITY_NORMAL;
+
+    struct nerves_key_queue_stats *stats = &q->stats[priority];
+    uint64_t enqueue_us = nerves_key_now_us();
+
+    pthread_mutex_lock(&q->mutex);
+    stats->requests++;
+    int result = admit(q, priority, deadline_us, enqueue_us, NULL);
+    if (result != 0) {
+        pthread_mutex_unlock(&q->mutex);
+        return result;
+    }
+
+    // This outlives the call, so it can't be on the stack
+    struct nerves_key_waiter *waiter = malloc(sizeof(struct nerves_key_waiter));
+    if (waiter == NULL) {
+        pthread_mutex_unlock(&q->mutex);
+        return NKCS11_QUEUE_NO_MEMORY;
+    }
+
+    waiter->priority = priority;
+    waiter->deadline_us = deadline_us;
+    waiter->enqueue_us = enqueue_us;
+    waiter->granted = 0;
+    waiter->expired = 0;
+    waiter->done = NULL;
+    waiter->granted_fn = granted;
+    waiter->context = context;
+    add_waiter(q, waiter);
+
+    pthread_mutex_unlock(&q->mutex);
+    return NKCS11_QUEUE_WAITING;
+}
+
+/**
+ * Wake up waiters whose done flag was set
+ *
+ * Set the flag before calling this so that the wakeup isn't missed.
+ *
+ * @param q the device's queue
+ */
+void nerves_key_queue_notify(struct nerves_key_queue *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    for (struct nerves_key_waiter *w = q->waiting; w; w = w->next) {
+        if (w->done && __atomic_load_n(w->done, __ATOMIC_ACQUIRE))
+            pthread_cond_signal(&w->cond);
+    }
+    pthread_cond_broadcast(&q->done_cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/**
+ * Wait for *done without being in line
+ *
+ * This is for a caller that gave up its place, but whose request was already
+ * picked up by the holder of the device.
+ *
+ * @param q the device's queue
+ * @param done set by the holder before it calls nerves_key_queue_notify()
+ */
+void nerves_key_queue_wait_done(struct nerves_key_queue *q, const int *done)
+{
+    pthread_mutex_lock(&q->mutex);
+    while (!__atomic_load_n(done, __ATOMIC_ACQUIRE))
+        pthread_cond_wait(&q->done_cond, &q->mutex);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/**
+ * Give up the device and hand it to the next waiter
+ *
+ * @param q the device's queue
+ */
+void nerves_key_queue_leave(struct nerves_key_queue *q)
+{
+    struct nerves_key_waiter *async_next = NULL;
+    struct nerves_key_waiter *async_expired = NULL;
+
+    pthread_mutex_lock(&q->mutex);
+
+    // Let go of anything that has waited too long rather than start it late.
+    // Waiting threads time out on their own, but this gets them first if
+    // they're about to.
+    if (q->max_wait_us) {
+        uint64_t now = nerves_key_now_us();
+        struct nerves_key_waiter **w = &q->waiting;
+        while (*w) {
+            struct nerves_key_waiter *waiter = *w;
+            if (now - waiter->enqueue_us < q->max_wait_us) {
+                w = &waiter->next;
+                continue;
+            }
+
+            remove_waiter(q, w);
+            count_turned_away(q, waiter->priority, waiter->done, NKCS11_QUEUE_TIMED_OUT);
+            waiter->expired = 1;
+            if (waiter->granted_fn) {
+                waiter->next = async_expired;
+                async_expired = waiter;
+            } else {
+                pthread_cond_signal(&waiter->cond);
+            }
+        }
+    }
+
+    // The queue is short (one entry per waiting request), so a scan is fine
+    struct nerves_key_waiter **best = NULL;
+    for (struct nerves_key_waiter **w = &q->waiting; *w; w = &(*w)->next) {
+        if (best == NULL || runs_before(*w, *best))
+            best = w;
+    }
+
+    if (best == NULL) {
+        q->busy = 0;
+    } else {
+        struct nerves_key_waiter *next = *best;
+        remove_waiter(q, best);
+
+        record_start(q, next->priority, next->deadline_us, next->enqueue_us);
+        next->granted = 1;
+        if (next->granted_fn)
+            async_next = next;
+        else
+            pthread_cond_signal(&next->cond);
+    }
+
+    pthread_mutex_unlock(&q->mutex);
+
+    while (async_expired) {
+        struct nerves_key_waiter *next = async_expired->next;
+        async_expired->granted_fn(async_expired->context, NKCS11_QUEUE_TIMED_OUT);
+        free(async_expired);
+        async_expired = next;
+    }
+    if (async_next) {
+        async_next->granted_fn(async_next->context, NKCS11_QUEUE_GRANTED);
+        free(async_next);
+    }
+}
+
+/**
+ * Count a request that was shed or timed out
+ *
+ * This is for callers of nerves_key_queue_enter_unless() that really were
+ * turned away, since their request could have been done by someone else in
+ * the meantime.
+ *
+ * @param q the device's queue
+ * @param priority the class passed to nerves_key_queue_enter_unless()
+ * @param result NKCS11_QUEUE_SHED or NKCS11_QUEUE_TIMED_OUT
+ */
+void nerves_key_queue_count_turned_away(struct nerves_key_queue *q, int priority, int result)
+{
+    if (priority < 0 || priority >= NKCS11_PRIORITY_CLASSES)
+        priority = NKCS11_PRIORITY_NORMAL;
+
+    pthread_mutex_lock(&q->mutex);
+    count_turned_away(q, priority, NULL, result);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/**
+ * Copy the per-class statistics
+ *
+ * @param q the device's queue
+ * @param stats an array of NKCS11_PRIORITY_CLASSES entries
+ */
+void nerves_key_queue_get_stats(struct nerves_key_queue *q, struct nerves_key_queue_stats *stats)
+{
+    pthread_mutex_lock(&q->mutex);
+    memcpy(stats, q->stats, sizeof(q->stats));
+    pthread_mutex_unlock(&q->mutex);
+}
+
+void nerves_key_queue_report(struct nerves_key_queue *q, const char *name)
+{
+    struct nerves_key_queue_stats stats[NKCS11_PRIORITY_CLASSES];
+    nerves_key_queue_get_stats(q, stats);
+
+    for (int i = 0; i < NKCS11_PRIORITY_CLASSES; i++) {
+        if (stats[i].requests == 0)
+            continue;
+
+        fprintf(stderr, "%s: %s %s: %lu requests, max depth %lu, wait mean %llu us max %llu us, %lu missed deadlines, %lu shed, %lu timed out\r\n",
+                PROGNAME, name, class_names[i], stats[i].requests, stats[i].max_depth,
+                (unsigned long long) (stats[i].total_wait_us / stats[i].requests),
+                (unsigned long long) stats[i].max_wait_us, stats[i].deadline_misses,
+                stats[i].shed, stats[i].timed_out);
+    }
+}
@@ -0,0 +1,106 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef NERVES_KEY_QUEUE_H
+#define NERVES_KEY_QUEUE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// Dispatch queue for one ATECC
+//
+// Callers wait here for their turn on the device. Higher priority classes go
+// first. Within a class, requests with deadlines go earliest-deadline-first
+// and ahead of requests without one. Ties go in arrival order.
+//
+// When the device can't keep up, the queue can be bounded. Requests are
+// turned away when too many are waiting, and waiters give up after a maximum
+// wait. Either way, the caller finds out right away instead of holding on
+// for a signature that will be too late to use.
+
+#define NKCS11_PRIORITY_BACKGROUND  0
+#define NKCS11_PRIORITY_NORMAL      1
+#define NKCS11_PRIORITY_INTERACTIVE 2
+#define NKCS11_PRIORITY_CLASSES     3
+
+// Results from the nerves_key_queue_enter calls
+#define NKCS11_QUEUE_DONE       0  // Someone else took care of the request
+#define NKCS11_QUEUE_GRANTED    1  // The caller has the device
+#define NKCS11_QUEUE_WAITING    2  // In line. The granted callback will be called.
+#define NKCS11_QUEUE_SHED      -1  // Turned away since too many were waiting
+#define NKCS11_QUEUE_TIMED_OUT -2  // Waited longer than the limit
+#define NKCS11_QUEUE_NO_MEMORY -3
+
+struct nerves_key_queue_stats {
+    unsigned long requests;
+    unsigned long depth;           // Waiting right now
+    unsigned long max_depth;
+    unsigned long deadline_misses; // Started after their deadline
+    unsigned long shed;            // Turned away when the queue was full
+    unsigned long timed_out;       // Gave up after waiting max_wait_us
+    uint64_t total_wait_us;
+    uint64_t max_wait_us;
+};
+
+struct nerves_key_waiter;
+
+struct nerves_key_queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond; // See nerves_key_queue_wait_done()
+    int busy;
+    uint64_t next_seq;
+    struct nerves_key_waiter *waiting;
+
+    // Admission limits. 0 means no limit.
+    unsigned long waiting_count;
+    unsigned long max_waiting;
+    uint64_t max_wait_us;
+
+    struct nerves_key_queue_stats stats[NKCS11_PRIORITY_CLASSES];
+};
+
+uint64_t nerves_key_now_us(void);
+void nerves_key_queue_init(struct nerves_key_queue *q);
+void nerves_key_queue_destroy(struct nerves_key_queue *q);
+int nerves_key_queue_goes_first(int a_priority, uint64_t a_deadline_us, int b_priority, uint64_t b_deadline_us);
+void nerves_key_queue_set_limits(struct nerves_key_queue *q, unsigned long max_waiting, uint64_t max_wait_us);
+int nerves_key_queue_enter(struct nerves_key_queue *q, int priority, uint64_t deadline_us);
+int nerves_key_queue_enter_unless(struct nerves_key_queue *q, int priority, uint64_t deadline_us, const int *done);
+int nerves_key_queue_enter_async(struct nerves_key_queue *q, int priority, uint64_t deadline_us,
+                                 void (*granted)(void *context, int result), void *context);
+void nerves_key_queue_notify(struct nerves_key_queue *q);
+void nerves_key_queue_wait_done(struct nerves_key_queue *q, const int *done);
+void nerves_key_queue_leave(struct nerves_key_queue *q);
+void nerves_key_queue_count_turned_away(struct nerves_key_queue *q, int priority, int result);
+void nerves_key_queue_get_stats(struct nerves_key_queue *q, struct nerves_key_queue_stats *stats);
+void nerves_key_queue_report(struct nerves_key_queue *q, const char *name);
+
+#endif // NERVES_KEY_QUEUE_H
@@ -0,0 +1,420 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "nerves_key_shm.h"
+#include "log.h"
+
+#define SHM_MAGIC   0x314d534eU // "NSM1"
+#define SHM_VERSION 2
+
+// Processes in line for one chip at a time. More than this still works,
+// but one that dies while waiting might not be noticed.
+#define SHM_MAX_WAITERS 16
+
+// How often waiters check whether the process ahead of them is still alive
+#define SHM_LIVENESS_CHECK_NS 10000000
+
+// A ticket that's been taken, but has no process for this long belongs to
+// a process that died right after taking it
+#define SHM_STALLED_US 1000000
+
+struct shm_entry {
+    uint32_t valid;
+    struct nerves_key_shared_device device;
+};
+
+// A ticket lock. Waiters sleep on serving with a futex.
+struct shm_lane {
+    uint32_t next_ticket;
+    uint32_t serving;
+    int32_t pids[SHM_MAX_WAITERS]; // Who has each ticket, by ticket % SHM_MAX_WAITERS
+    int32_t last_pid;              // Who had the last turn
+    struct nerves_key_bus_stats stats;
+};
+
+// The mutex is robust so that a process that dies while holding it doesn't
+// lock everyone else out.
+struct shm_segment {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    pthread_mutex_t mutex;
+    struct shm_entry entries[NKCS11_SHM_SLOTS];
+    struct shm_lane lanes[NKCS11_SHM_SLOTS];
+};
+
+// Protects the mapping itself. Threads in this process share it.
+static pthread_mutex_t map_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct shm_segment *segment;
+static char *segment_name;
+
+static int lock_segment(void)
+{
+    int rc = pthread_mutex_lock(&segment->mutex);
+    if (rc == EOWNERDEAD) {
+        // Someone died partway through an update. There's no telling which
+        // entry it was, so everything gets read from the chips again.
+        for (int i = 0; i < NKCS11_SHM_SLOTS; i++)
+            segment->entries[i].valid = 0;
+        pthread_mutex_consistent(&segment->mutex);
+        rc = 0;
+    }
+    return rc;
+}
+
+static void init_segment(struct shm_segment *s)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&s->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    s->version = SHM_VERSION;
+    s->entry_size = sizeof(struct shm_entry);
+    s->magic = SHM_MAGIC;
+}
+
+static void close_locked(void)
+{
+    if (segment)
+        munmap(segment, sizeof(struct shm_segment));
+    free(segment_name);
+
+    segment = NULL;
+    segment_name = NULL;
+}
+
+static int open_locked(const char *name)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ERROR("Can't open shared memory %s", name);
+        return -1;
+    }
+
+    // The first process to get here sets the segment up. flock() keeps the
+    // others from using it before then.
+    flock(fd, LOCK_EX);
+    struct stat st;
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size == 0 && ftruncate(fd, sizeof(struct shm_segment)) < 0) ||
+        (st.st_size != 0 && st.st_size != (off_t) sizeof(struct shm_segment))) {
+        ERROR("Can't use shared memory %s. It may be from a different version.", name);
+        close(fd);
+        return -1;
+    }
+
+    struct shm_segment *s = mmap(NULL, sizeof(struct shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s != MAP_FAILED && s->magic == 0)
+        init_segment(s); // New or whoever made it died before setting it up
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (s == MAP_FAILED) {
+        ERROR("Can't map shared memory %s", name);
+        return -1;
+    }
+
+    if (s->magic != SHM_MAGIC || s->version != SHM_VERSION || s->entry_size != sizeof(struct shm_entry)) {
+        ERROR("Shared memory %s is from a different version", name);
+        munmap(s, sizeof(struct shm_segment));
+        return -1;
+    }
+
+    segment = s;
+    segment_name = strdup(name);
+    return 0;
+}
+
+/**
+ * Start sharing device information through a POSIX shared memory segment
+ *
+ * The segment is created if it doesn't exist. Opening the one that's
+ * already open does nothing.
+ *
+ * @param name the segment's name, like "/nerves_key"
+ * @return 0 on success
+ */
+int nerves_key_shm_open(const char *name)
+{
+    pthread_mutex_lock(&map_mutex);
+    int rc = 0;
+    if (segment == NULL || segment_name == NULL || strcmp(name, segment_name) != 0) {
+        close_locked();
+        rc = open_locked(name);
+    }
+    pthread_mutex_unlock(&map_mutex);
+    return rc;
+}
+
+void nerves_key_shm_close(void)
+{
+    pthread_mutex_lock(&map_mutex);
+    close_locked();
+    pthread_mutex_unlock(&map_mutex);
+}
+
+/**
+ * Get what another process found out about a slot's chip
+ *
+ * @param slot the PKCS #11 slot
+ * @param transport the name of the transport that this process uses
+ * @param device where to copy the information
+ * @return 0 if there was an entry; -1 if not or if the segment isn't open
+ */
+int nerves_key_shm_get(unsigned int slot, const char *transport, struct nerves_key_shared_device *device)
+{
+    int rc = -1;
+    pthread_mutex_lock(&map_mutex);
+    if (segment && slot < NKCS11_SHM_SLOTS && lock_segment() == 0) {
+        const struct shm_entry *entry = &segment->entries[slot];
+        if (entry->valid && strncmp(entry->device.transport, transport, sizeof(entry->device.transport)) == 0) {
+            *device = entry->device;
+            rc = 0;
+        }
+        pthread_mutex_unlock(&segment->mutex);
+    }
+    pthread_mutex_unlock(&map_mutex);
+    return rc;
+}
+
+/**
+ * Forget a slot's entry after finding a different chip there
+ *
+ * The entry is only dropped if it still has the old serial number. Another
+ * process could have replaced it already.
+ *
+ * @param slot the PKCS #11 slot
+ * @param serial_number the serial number in the entry that didn't match
+ */
+void nerves_key_shm_drop(unsigned int slot, const uint8_t *serial_number)
+{
+    pthread_mutex_lock(&map_mutex);
+    if (segment && slot < NKCS11_SHM_SLOTS && lock_segment() == 0) {
+        struct shm_entry *entry = &segment->entries[slot];
+        if (entry->valid && memcmp(entry->device.serial_number, serial_number, sizeof(entry->device.serial_number)) == 0)
+            entry->valid = 0;
+        pthread_mutex_unlock(&segment->mutex);
+    }
+    pthread_mutex_unlock(&map_mutex);
+}
+
+/**
+ * Share what's known about a slot's chip
+ *
+ * @param slot the PKCS #11 slot
+ * @param device the information to share
+ */
+void nerves_key_shm_put(unsigned int slot, const struct nerves_key_shared_device *device)
+{
+    pthread_mutex_lock(&map_mutex);
+    if (segment && slot < NKCS11_SHM_SLOTS && lock_segment() == 0) {
+        struct shm_entry *entry = &segment->entries[slot];
+        entry->device = *device;
+        entry->valid = 1;
+        pthread_mutex_unlock(&segment->mutex);
+    }
+    pthread_mutex_unlock(&map_mutex);
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+// The segment stays mapped until C_Finalize, so waiting doesn't need the map
+// mutex. This returns NULL if there's no segment.
+static struct shm_lane *lane_for(unsigned int slot)
+{
+    struct shm_lane *lane = NULL;
+    pthread_mutex_lock(&map_mutex);
+    if (segment && slot < NKCS11_SHM_SLOTS)
+        lane = &segment->lanes[slot];
+    pthread_mutex_unlock(&map_mutex);
+    return lane;
+}
+
+static void wake_waiters(struct shm_lane *lane)
+{
+    syscall(SYS_futex, &lane->serving, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Move past the ticket being served if whoever has it is gone
+static void skip_if_dead(struct shm_lane *lane, uint32_t serving, struct nerves_key_shm_turn *turn)
+{
+    int32_t pid = __atomic_load_n(&lane->pids[serving % SHM_MAX_WAITERS], __ATOMIC_ACQUIRE);
+    int dead;
+    if (pid == 0) {
+        // Normally the pid shows up right after the ticket is taken
+        uint64_t now = now_us();
+        if (turn->stalled_serving != serving || turn->stalled_since_us == 0) {
+            turn->stalled_serving = serving;
+            turn->stalled_since_us = now;
+        }
+        dead = now - turn->stalled_since_us >= SHM_STALLED_US;
+    } else {
+        dead = kill(pid, 0) < 0 && errno == ESRCH;
+    }
+
+    if (dead && __atomic_compare_exchange_n(&lane->serving, &serving, serving + 1, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        ERROR("Process %d died while using the ATECC. Skipping it.", (int) pid);
+        __atomic_compare_exchange_n(&lane->pids[serving % SHM_MAX_WAITERS], &pid, 0, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        __atomic_fetch_add(&lane->stats.takeovers, 1, __ATOMIC_RELAXED);
+        wake_waiters(lane);
+    }
+}
+
+/**
+ * Wait for a turn on a slot's chip
+ *
+ * If blocking is 0 and it's not this caller's turn yet, the caller keeps
+ * its place in line and should call again later with the same turn.
+ *
+ * @param slot the PKCS #11 slot
+ * @param blocking whether to wait
+ * @param turn this caller's place in line. Zero it before the first call.
+ * @return 1 if it's the caller's turn and another process had the chip
+ *         last, 0 if it's the caller's turn, NKCS11_SHM_WAIT or -1 if the
+ *         segment isn't open
+ */
+int nerves_key_shm_acquire(unsigned int slot, int blocking, struct nerves_key_shm_turn *turn)
+{
+    struct shm_lane *lane = lane_for(slot);
+    if (lane == NULL)
+        return -1;
+
+    int32_t pid = (int32_t) getpid();
+    for (;;) {
+        if (!turn->has_ticket) {
+            turn->ticket = __atomic_fetch_add(&lane->next_ticket, 1, __ATOMIC_ACQ_REL);
+            __atomic_store_n(&lane->pids[turn->ticket % SHM_MAX_WAITERS], pid, __ATOMIC_RELEASE);
+            turn->has_ticket = 1;
+            turn->enqueue_us = now_us();
+            turn->stalled_since_us = 0;
+        }
+
+        uint32_t serving = __atomic_load_n(&lane->serving, __ATOMIC_ACQUIRE);
+        if (serving == turn->ticket)
+            break;
+
+        if ((int32_t) (serving - turn->ticket) > 0) {
+            // Skipped for taking too long to show up. Get back in line.
+            turn->has_ticket = 0;
+            continue;
+        }
+
+        if (!blocking) {
+            skip_if_dead(lane, serving, turn);
+            return NKCS11_SHM_WAIT;
+        }
+
+        struct timespec timeout = {0, SHM_LIVENESS_CHECK_NS};
+        if (syscall(SYS_futex, &lane->serving, FUTEX_WAIT, serving, &timeout, NULL, 0) < 0 &&
+            errno == ETIMEDOUT)
+            skip_if_dead(lane, serving, turn);
+    }
+
+    // Only the process with the turn updates these
+    uint64_t wait_us = now_us() - turn->enqueue_us;
+    int handoff = lane->last_pid != pid;
+    lane->last_pid = pid;
+    lane->stats.turns++;
+    if (handoff)
+        lane->stats.handoffs++;
+    if (wait_us > 100) {
+        // Anything shorter is just the time to get here
+        lane->stats.contended++;
+        lane->stats.total_wait_us += wait_us;
+        if (wait_us > lane->stats.max_wait_us)
+            lane->stats.max_wait_us = wait_us;
+    }
+    return handoff;
+}
+
+/**
+ * Give up a turn from nerves_key_shm_acquire()
+ *
+ * @param slot the PKCS #11 slot
+ * @param turn the caller's turn
+ */
+void nerves_key_shm_release(unsigned int slot, struct nerves_key_shm_turn *turn)
+{
+    struct shm_lane *lane = lane_for(slot);
+    if (lane == NULL || !turn->has_ticket)
+        return;
+
+    int32_t pid = (int32_t) getpid();
+    __atomic_compare_exchange_n(&lane->pids[turn->ticket % SHM_MAX_WAITERS], &pid, 0, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    uint32_t ticket = turn->ticket;
+    __atomic_compare_exchange_n(&lane->serving, &ticket, turn->ticket + 1, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    turn->has_ticket = 0;
+    wake_waiters(lane);
+}
+
+/**
+ * Copy the arbitration totals for a slot
+ *
+ * @param slot the PKCS #11 slot
+ * @param stats where to copy them
+ * @return 0 on success; -1 if the segment isn't open
+ */
+int nerves_key_shm_get_bus_stats(unsigned int slot, struct nerves_key_bus_stats *stats)
+{
+    struct shm_lane *lane = lane_for(slot);
+    if (lane == NULL)
+        return -1;
+
+    *stats = lane->stats;
+    stats->takeovers = __atomic_load_n(&lane->stats.takeovers, __ATOMIC_RELAXED);
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef NERVES_KEY_SHM_H
+#define NERVES_KEY_SHM_H
+
+#include <stdint.h>
+
+// Device information shared between processes
+//
+// Every process that loads the library would otherwise read the same public
+// key from each chip. The first one to open a slot puts the chip's serial
+// number and public key in a POSIX shared memory segment and the others take
+// them from there. Entries are by PKCS #11 slot, so the others read the serial
+// number to check that it's still the same chip.
+
+#define NKCS11_SHM_SLOTS 32
+
+struct nerves_key_shared_device {
+    char transport[8];  // Entries from the simulator aren't used for I2C
+    uint8_t serial_number[9];
+    uint8_t variant;    // enum atecc508a_variant
+    uint8_t chip_mode;
+    uint8_t has_public_key;
+    uint8_t public_key[65];
+};
+
+// Processes also take turns on each slot's chip through the segment. Turns
+// are handed out first come, first served, like a ticket lock. A process
+// that dies while it has a turn or is in line is skipped.
+struct nerves_key_shm_turn {
+    int has_ticket;
+    uint32_t ticket;
+    uint64_t enqueue_us;
+    uint32_t stalled_serving; // For noticing a ticket that was never claimed
+    uint64_t stalled_since_us;
+};
+
+#define NKCS11_SHM_WAIT 2 // Not this process's turn yet
+
+// Totals for all processes since the segment was created
+struct nerves_key_bus_stats {
+    uint64_t turns;
+    uint64_t contended;   // Had to wait for another process
+    uint64_t handoffs;    // Another process had the chip last
+    uint64_t takeovers;   // Skipped a process that died
+    uint64_t total_wait_us;
+    uint64_t max_wait_us;
+};
+
+int nerves_key_shm_open(const char *name);
+void nerves_key_shm_close(void);
+int nerves_key_shm_get(unsigned int slot, const char *transport, struct nerves_key_shared_device *device);
+void nerves_key_shm_put(unsigned int slot, const struct nerves_key_shared_device *device);
+void nerves_key_shm_drop(unsigned int slot, const uint8_t *serial_number);
+int nerves_key_shm_acquire(unsigned int slot, int blocking, struct nerves_key_shm_turn *turn);
+void nerves_key_shm_release(unsigned int slot, struct nerves_key_shm_turn *turn);
+int nerves_key_shm_get_bus_stats(unsigned int slot, struct nerves_key_bus_stats *stats);
+
+#endif // NERVES_KEY_SHM_H
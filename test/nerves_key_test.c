@@ -0,0 +1,1347 @@
+/*
+ * SPDX-FileCopyrightText: 2026 NervesKey contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// Tests for the library against simulated ATECCs
+//
+// Run with "make test SIMULATOR=1". Each test runs in a process of its own
+// with its own environment, so settings like fault injection and queue
+// limits don't carry over. Every signature is checked against the public
+// key that the library reports for the simulated chip. What a test writes to
+// stderr, including the library's log, is only shown if it fails.
+
+#define OPENSSL_API_COMPAT 0x10100000L
+
+#include <ctype.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+
+#include "nerves_key_cache.h"
+#include "nerves_key_pkcs11.h"
+
+#define PRIVATE_KEY 1
+#define PUBLIC_KEY 2
+
+// CHIP_PROFILE builds don't detect the part, so there's nothing to identify,
+// and the simulator has to be the part that it was built for.
+#if defined(NKCS11_CHIP_PROFILE_508A)
+#define FIXED_CHIP_PROFILE "508a"
+#elif defined(NKCS11_CHIP_PROFILE_608A)
+#define FIXED_CHIP_PROFILE "608a"
+#elif defined(NKCS11_CHIP_PROFILE_608B_TNG)
+#define FIXED_CHIP_PROFILE "608b"
+#endif
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "  %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            return -1; \
+        } \
+    } while (0)
+
+static const char *library_path;
+static const char *agent_path;
+static FILE *log_file; // The test's stderr
+static CK_FUNCTION_LIST_PTR p11;
+static CK_NKCS11_FUNCTION_LIST_PTR nkcs11;
+
+static CK_MECHANISM ecdsa = {CKM_ECDSA, NULL_PTR, 0};
+
+static int load(void)
+{
+    void *library = dlopen(library_path, RTLD_NOW);
+    if (library == NULL) {
+        fprintf(stderr, "  %s\n", dlerror());
+        return -1;
+    }
+
+    CK_RV (*get_function_list)(CK_FUNCTION_LIST_PTR_PTR) = (CK_RV (*)(CK_FUNCTION_LIST_PTR_PTR)) dlsym(library, "C_GetFunctionList");
+    CK_RV (*get_vendor_function_list)(CK_NKCS11_FUNCTION_LIST_PTR_PTR) =
+        (CK_RV (*)(CK_NKCS11_FUNCTION_LIST_PTR_PTR)) dlsym(library, "C_NKCS11_GetFunctionList");
+    CHECK(get_function_list && get_vendor_function_list);
+    CHECK(get_function_list(&p11) == CKR_OK);
+    CHECK(get_vendor_function_list(&nkcs11) == CKR_OK);
+
+    CK_C_INITIALIZE_ARGS args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CKF_OS_LOCKING_OK;
+    CHECK(p11->C_Initialize(&args) == CKR_OK);
+    return 0;
+}
+
+static void make_digest(CK_BYTE *digest, int n)
+{
+    for (int i = 0; i < 32; i++)
+        digest[i] = (CK_BYTE) (n * 31 + i);
+}
+
+// The public key is a DER OCTET STRING around the uncompressed point
+static EC_KEY *public_key(CK_SESSION_HANDLE session)
+{
+    CK_BYTE point[67];
+    CK_ATTRIBUTE attribute = {CKA_EC_POINT, point, sizeof(point)};
+    if (p11->C_GetAttributeValue(session, PUBLIC_KEY, &attribute, 1) != CKR_OK ||
+        attribute.ulValueLen != sizeof(point) || point[0] != 0x04 || point[1] != 65)
+        return NULL;
+
+    EC_KEY *key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    const unsigned char *p = &point[2];
+    if (key && o2i_ECPublicKey(&key, &p, 65) == NULL) {
+        EC_KEY_free(key);
+        return NULL;
+    }
+    return key;
+}
+
+static int verifies(EC_KEY *key, const CK_BYTE *digest, const CK_BYTE *signature)
+{
+    ECDSA_SIG *sig = ECDSA_SIG_new();
+    ECDSA_SIG_set0(sig, BN_bin2bn(signature, 32, NULL), BN_bin2bn(&signature[32], 32, NULL));
+    int ok = ECDSA_do_verify(digest, 32, sig, key) == 1;
+    ECDSA_SIG_free(sig);
+    return ok;
+}
+
+static CK_RV sign(CK_SESSION_HANDLE session, const CK_BYTE *digest, CK_BYTE *signature)
+{
+    CK_ULONG len = 64;
+    CK_RV rv = p11->C_SignInit(session, &ecdsa, PRIVATE_KEY);
+    if (rv == CKR_OK)
+        rv = p11->C_Sign(session, (CK_BYTE_PTR) digest, 32, signature, &len);
+    return rv;
+}
+
+static int sign_and_verify(CK_SESSION_HANDLE session, EC_KEY *key, int count)
+{
+    for (int i = 0; i < count; i++) {
+        CK_BYTE digest[32];
+        CK_BYTE signature[64];
+        make_digest(digest, i);
+        CHECK(sign(session, digest, signature) == CKR_OK);
+        CHECK(verifies(key, digest, signature));
+    }
+    return 0;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static int test_sign(void)
+{
+    CK_SESSION_HANDLE session;
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+    CHECK(sign_and_verify(session, key, 4) == 0);
+
+    // A signature doesn't verify for another digest
+    CK_BYTE digest[32];
+    CK_BYTE signature[64];
+    make_digest(digest, 0);
+    CHECK(sign(session, digest, signature) == CKR_OK);
+    digest[0] ^= 1;
+    CHECK(!verifies(key, digest, signature));
+
+    EC_KEY_free(key);
+    CHECK(p11->C_CloseSession(session) == CKR_OK);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+// Add up the number that follows the label in each line that
+// NERVES_KEY_SIM_REPORT printed when the simulated chips were closed
+static unsigned long sim_report_total(const char *label)
+{
+    static char text[65536];
+    ssize_t len = pread(fileno(log_file), text, sizeof(text) - 1, 0);
+    if (len < 0)
+        return 0;
+    text[len] = '\0';
+
+    unsigned long total = 0;
+    for (const char *p = strstr(text, label); p; p = strstr(p + 1, label))
+        total += strtoul(p + strlen(label), NULL, 10);
+    return total;
+}
+
+static unsigned long injected_faults(void)
+{
+    return sim_report_total(" commands, ");
+}
+
+// Total time that the simulated chips were out of sleep
+static unsigned long awake_us(void)
+{
+    return sim_report_total(" us (");
+}
+
+static unsigned long commands(void)
+{
+    return sim_report_total(" wakes, ");
+}
+
+// NERVES_KEY_SIM_FAULTS injects the fault now and then. Every signature has
+// to come out right anyway.
+static int test_recovers(void)
+{
+    CK_SESSION_HANDLE session;
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+    CHECK(sign_and_verify(session, key, 16) == 0);
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    CHECK(injected_faults() > 0);
+    return 0;
+}
+
+// With the fault on every transfer, nothing can work. This makes sure that
+// the fault that test_recovers() gets through is really injected.
+static int test_fault_fails(void)
+{
+    CK_SESSION_HANDLE session;
+    CK_RV rv = p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session);
+    if (rv == CKR_OK) {
+        CK_BYTE digest[32];
+        CK_BYTE signature[64];
+        make_digest(digest, 0);
+        rv = sign(session, digest, signature);
+    }
+    CHECK(rv != CKR_OK);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+static int test_session_reuse(void)
+{
+    CK_SESSION_HANDLE first;
+    CK_SESSION_HANDLE second;
+    CK_BYTE digest[32];
+    CK_BYTE signature[64];
+    make_digest(digest, 0);
+
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &first) == CKR_OK);
+    CHECK(p11->C_CloseSession(first) == CKR_OK);
+
+    // The table entry is reused, but the old handle mustn't reach it
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &second) == CKR_OK);
+    CHECK(second != first);
+    CHECK(p11->C_SignInit(first, &ecdsa, PRIVATE_KEY) == CKR_SESSION_HANDLE_INVALID);
+    CHECK(p11->C_CloseSession(first) == CKR_SESSION_HANDLE_INVALID);
+
+    EC_KEY *key = public_key(second);
+    CHECK(key);
+    CHECK(sign(second, digest, signature) == CKR_OK);
+    CHECK(verifies(key, digest, signature));
+    EC_KEY_free(key);
+
+    CHECK(p11->C_CloseSession(second) == CKR_OK);
+    CHECK(p11->C_SignInit(second, &ecdsa, PRIVATE_KEY) == CKR_SESSION_HANDLE_INVALID);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+// Keep-awake can't leave the chip on until its watchdog fires. It has to go
+// to sleep soon after the last command.
+static int test_sleeps_when_idle(void)
+{
+    CK_SESSION_HANDLE session;
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+    for (int i = 0; i < 2; i++) {
+        CHECK(sign_and_verify(session, key, 1) == 0);
+        sleep_ms(400);
+    }
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+
+    // Staying awake until each next command would be over 800 ms
+    unsigned long awake = awake_us();
+    CHECK(awake > 0 && awake < 400000);
+    return 0;
+}
+
+#ifndef FIXED_CHIP_PROFILE
+// Number of times the simulated chips were woken up
+static unsigned long wakes(void)
+{
+    return sim_report_total(" NAKs, ");
+}
+
+// A batch that takes several chunks still only wakes the chip once, even
+// with keep-awake off. NERVES_KEY_SIM_CHIP_MODE turns on the long watchdog
+// so that it doesn't have to go through idle. CHIP_PROFILE builds don't read
+// ChipMode, so they'd wake it for that.
+static int test_batch_stays_awake(void)
+{
+    static CK_BYTE digests[48][32];
+    static CK_BYTE signatures[48][64];
+    CK_RV results[48];
+    CK_SESSION_HANDLE session;
+
+    // The key is remembered after the first time, so the second time around
+    // opening only takes a serial number read
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    unsigned long opening = wakes();
+
+    CHECK(p11->C_Initialize(NULL_PTR) == CKR_OK);
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    for (int i = 0; i < 48; i++)
+        make_digest(digests[i], i);
+    CHECK(nkcs11->C_NKCS11_SignBatch(session, &ecdsa, PRIVATE_KEY, &digests[0][0], 48, &signatures[0][0], results) == CKR_OK);
+    for (int i = 0; i < 48; i++)
+        CHECK(results[i] == CKR_OK && verifies(key, digests[i], signatures[i]));
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+
+    // One wakeup for the serial number and one for the batch
+    CHECK(wakes() - opening == 2);
+    return 0;
+}
+#endif
+
+static CK_RV app_create_mutex(CK_VOID_PTR_PTR mutex)
+{
+    *mutex = NULL_PTR;
+    return CKR_OK;
+}
+
+static CK_RV app_mutex(CK_VOID_PTR mutex)
+{
+    (void) mutex;
+    return CKR_OK;
+}
+
+// The library needs its own locks, so it turns away an application that
+// only offers mutex callbacks.
+static int test_mutex_callbacks(void)
+{
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+
+    CK_C_INITIALIZE_ARGS args;
+    memset(&args, 0, sizeof(args));
+    args.CreateMutex = app_create_mutex;
+    args.DestroyMutex = app_mutex;
+    args.LockMutex = app_mutex;
+    CHECK(p11->C_Initialize(&args) == CKR_ARGUMENTS_BAD);
+
+    args.UnlockMutex = app_mutex;
+    CHECK(p11->C_Initialize(&args) == CKR_CANT_LOCK);
+
+    args.flags = CKF_OS_LOCKING_OK;
+    CHECK(p11->C_Initialize(&args) == CKR_OK);
+
+    CK_SESSION_HANDLE session;
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+    CHECK(sign_and_verify(session, key, 1) == 0);
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+static int test_interfaces(void)
+{
+    void *library = dlopen(library_path, RTLD_NOW);
+    CHECK(library);
+    CK_C_GetInterfaceList get_interface_list = (CK_C_GetInterfaceList) dlsym(library, "C_GetInterfaceList");
+    CK_C_GetInterface get_interface = (CK_C_GetInterface) dlsym(library, "C_GetInterface");
+    CHECK(get_interface_list && get_interface);
+
+    CK_INTERFACE list[3];
+    CK_ULONG count = 0;
+    CHECK(get_interface_list(NULL_PTR, &count) == CKR_OK);
+    CHECK(count == 3);
+    count = 2;
+    CHECK(get_interface_list(list, &count) == CKR_BUFFER_TOO_SMALL);
+    CHECK(count == 3);
+    CHECK(get_interface_list(list, &count) == CKR_OK);
+    CHECK(count == 3);
+
+    // The 3.0 list comes first, so it's what an application gets by default
+    CK_INTERFACE_PTR interface;
+    CHECK(get_interface(NULL_PTR, NULL_PTR, &interface, 0) == CKR_OK);
+    CHECK(interface->pFunctionList == list[0].pFunctionList);
+    CK_VERSION *version = interface->pFunctionList;
+    CHECK(version->major == 3 && version->minor == 0);
+    CHECK(strcmp((const char *) interface->pInterfaceName, "PKCS 11") == 0);
+
+    CHECK(get_interface((CK_UTF8CHAR_PTR) "PKCS 11", &p11->version, &interface, 0) == CKR_OK);
+    CHECK(interface->pFunctionList == p11);
+    CHECK(get_interface((CK_UTF8CHAR_PTR) "Vendor NervesKey", NULL_PTR, &interface, 0) == CKR_OK);
+    CHECK(interface->pFunctionList == nkcs11);
+
+    CK_VERSION unknown = {9, 9};
+    CHECK(get_interface((CK_UTF8CHAR_PTR) "PKCS 11", &unknown, &interface, 0) == CKR_ARGUMENTS_BAD);
+    CHECK(get_interface((CK_UTF8CHAR_PTR) "Other", NULL_PTR, &interface, 0) == CKR_ARGUMENTS_BAD);
+    CHECK(get_interface(NULL_PTR, NULL_PTR, &interface, CKF_INTERFACE_FORK_SAFE) == CKR_ARGUMENTS_BAD);
+
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+static int message_sign(CK_FUNCTION_LIST_3_0_PTR p11_3, CK_SESSION_HANDLE session, EC_KEY *key)
+{
+    CK_BYTE digest[32];
+    CK_BYTE signature[64];
+    CK_ULONG len;
+    make_digest(digest, 0);
+
+    CHECK(p11_3->C_SignMessage(session, NULL_PTR, 0, digest, 32, signature, &len) == CKR_OPERATION_NOT_INITIALIZED);
+    CHECK(p11_3->C_MessageSignInit(session, &ecdsa, PRIVATE_KEY) == CKR_OK);
+    CHECK(p11_3->C_MessageSignInit(session, &ecdsa, PRIVATE_KEY) == CKR_OPERATION_ACTIVE);
+
+    // Length queries don't use up the operation
+    len = 0;
+    CHECK(p11_3->C_SignMessage(session, NULL_PTR, 0, digest, 32, NULL_PTR, &len) == CKR_OK);
+    CHECK(len == 64);
+    len = 63;
+    CHECK(p11_3->C_SignMessage(session, NULL_PTR, 0, digest, 32, signature, &len) == CKR_BUFFER_TOO_SMALL);
+    CHECK(len == 64);
+    CHECK(p11_3->C_SignMessage(session, NULL_PTR, 0, digest, 32, signature, &len) == CKR_OK);
+    CHECK(len == 64 && verifies(key, digest, signature));
+
+    // Each message can have its own deadline
+    CK_NKCS11_SIGN_PARAMS params = {1000};
+    make_digest(digest, 1);
+    CHECK(p11_3->C_SignMessage(session, &params, sizeof(params) - 1, digest, 32, signature, &len) == CKR_ARGUMENTS_BAD);
+    CHECK(p11_3->C_SignMessage(session, &params, sizeof(params), digest, 32, signature, &len) == CKR_OK);
+    CHECK(verifies(key, digest, signature));
+
+    // A message in parts is only signed once the signature is asked for
+    make_digest(digest, 2);
+    CHECK(p11_3->C_SignMessageNext(session, NULL_PTR, 0, digest, 16, NULL_PTR, NULL_PTR) == CKR_OPERATION_NOT_INITIALIZED);
+    CHECK(p11_3->C_SignMessageBegin(session, NULL_PTR, 0) == CKR_OK);
+    CHECK(p11_3->C_SignMessageBegin(session, NULL_PTR, 0) == CKR_OPERATION_ACTIVE);
+    CHECK(p11_3->C_SignMessage(session, NULL_PTR, 0, digest, 32, signature, &len) == CKR_OPERATION_ACTIVE);
+    CHECK(p11_3->C_SignMessageNext(session, NULL_PTR, 0, digest, 16, NULL_PTR, NULL_PTR) == CKR_OK);
+    len = 0;
+    CHECK(p11_3->C_SignMessageNext(session, NULL_PTR, 0, &digest[16], 16, NULL_PTR, &len) == CKR_OK);
+    CHECK(len == 64);
+    len = 63;
+    CHECK(p11_3->C_SignMessageNext(session, NULL_PTR, 0, &digest[16], 16, signature, &len) == CKR_BUFFER_TOO_SMALL);
+    CHECK(p11_3->C_SignMessageNext(session, NULL_PTR, 0, &digest[16], 16, signature, &len) == CKR_OK);
+    CHECK(len == 64 && verifies(key, digest, signature));
+    CHECK(p11_3->C_SignMessageNext(session, NULL_PTR, 0, digest, 16, signature, &len) == CKR_OPERATION_NOT_INITIALIZED);
+
+    // Messages that aren't 32 bytes end the part, but not the operation
+    CHECK(p11_3->C_SignMessageBegin(session, NULL_PTR, 0) == CKR_OK);
+    CHECK(p11_3->C_SignMessageNext(session, NULL_PTR, 0, digest, 32, NULL_PTR, NULL_PTR) == CKR_OK);
+    CHECK(p11_3->C_SignMessageNext(session, NULL_PTR, 0, digest, 1, NULL_PTR, NULL_PTR) == CKR_DATA_LEN_RANGE);
+    CHECK(p11_3->C_SignMessageNext(session, NULL_PTR, 0, digest, 1, signature, &len) == CKR_OPERATION_NOT_INITIALIZED);
+    CHECK(p11_3->C_SignMessageBegin(session, NULL_PTR, 0) == CKR_OK);
+    CHECK(p11_3->C_SignMessageNext(session, NULL_PTR, 0, digest, 16, signature, &len) == CKR_DATA_LEN_RANGE);
+    CHECK(p11_3->C_SignMessage(session, NULL_PTR, 0, digest, 31, signature, &len) == CKR_DATA_LEN_RANGE);
+
+    CHECK(p11_3->C_MessageSignFinal(session) == CKR_OK);
+    CHECK(p11_3->C_MessageSignFinal(session) == CKR_OPERATION_NOT_INITIALIZED);
+    CHECK(p11_3->C_SignMessage(session, NULL_PTR, 0, digest, 32, signature, &len) == CKR_OPERATION_NOT_INITIALIZED);
+    return 0;
+}
+
+static int test_message_sign(void)
+{
+    void *library = dlopen(library_path, RTLD_NOW);
+    CHECK(library);
+    CK_C_GetInterface get_interface = (CK_C_GetInterface) dlsym(library, "C_GetInterface");
+    CHECK(get_interface);
+    CK_INTERFACE_PTR interface;
+    CHECK(get_interface((CK_UTF8CHAR_PTR) "PKCS 11", NULL_PTR, &interface, 0) == CKR_OK);
+
+    CK_SESSION_HANDLE session;
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+    CHECK(message_sign(interface->pFunctionList, session, key) == 0);
+
+    // C_Sign works as usual after C_MessageSignFinal
+    CHECK(sign_and_verify(session, key, 1) == 0);
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+#ifndef FIXED_CHIP_PROFILE
+// The slot description names the part that NERVES_KEY_SIM_CHIP picked once
+// the chip has been read
+static int test_identifies(void)
+{
+    char expected[32];
+    snprintf(expected, sizeof(expected), "(ATECC%s)", getenv("NERVES_KEY_SIM_CHIP"));
+    for (char *p = expected; *p; p++)
+        *p = (char) toupper((unsigned char) *p);
+
+    CK_SESSION_HANDLE session;
+    CK_SLOT_INFO info;
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    CHECK(p11->C_GetSlotInfo(0, &info) == CKR_OK);
+    CHECK(memmem(info.slotDescription, sizeof(info.slotDescription), expected, strlen(expected)) != NULL);
+
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+    CHECK(sign_and_verify(session, key, 2) == 0);
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+#endif
+
+static int same_point(EC_KEY *key, const CK_BYTE *point)
+{
+    unsigned char *encoded = NULL;
+    int len = i2o_ECPublicKey(key, &encoded);
+    int same = len == 65 && memcmp(encoded, point, 65) == 0;
+    OPENSSL_free(encoded);
+    return same;
+}
+
+// NERVES_KEY_SIM_BUSES=2 puts a chip at both addresses on buses 0 and 1.
+// Slot 0 is already open, so its session has to keep working.
+static int test_scan_slots(void)
+{
+    static const CK_SLOT_ID expected[] = {0, 1, 16, 17};
+    CK_NKCS11_SLOT_SCAN scans[4];
+    CK_SESSION_HANDLE session;
+
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+
+    CK_ULONG count = 0;
+    CHECK(nkcs11->C_NKCS11_ScanSlots(NULL_PTR, &count) == CKR_OK);
+    CHECK(count == 4);
+    count = 3;
+    CHECK(nkcs11->C_NKCS11_ScanSlots(scans, &count) == CKR_BUFFER_TOO_SMALL);
+    CHECK(count == 4);
+    CHECK(nkcs11->C_NKCS11_ScanSlots(scans, &count) == CKR_OK);
+    CHECK(count == 4);
+
+    for (int i = 0; i < 4; i++) {
+        CHECK(scans[i].slotID == expected[i]);
+        CHECK(scans[i].hasPublicKey);
+        CHECK(strncmp(scans[i].chipName, "ATECC", 5) == 0);
+        for (int j = 0; j < i; j++)
+            CHECK(memcmp(scans[i].serialNumber, scans[j].serialNumber, sizeof(scans[i].serialNumber)) != 0);
+
+        // What the scan found is what a session on the slot sees
+        CK_SESSION_HANDLE other;
+        CHECK(p11->C_OpenSession(scans[i].slotID, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &other) == CKR_OK);
+        EC_KEY *other_key = public_key(other);
+        CHECK(other_key);
+        CHECK(same_point(other_key, scans[i].publicKey));
+        EC_KEY_free(other_key);
+        CHECK(p11->C_CloseSession(other) == CKR_OK);
+    }
+
+    CHECK(sign_and_verify(session, key, 1) == 0);
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+
+    count = 4;
+    CHECK(nkcs11->C_NKCS11_ScanSlots(scans, &count) == CKR_CRYPTOKI_NOT_INITIALIZED);
+    return 0;
+}
+
+// NERVES_KEY_SIM_CHIP_MODE=0x68 selects the slowest clock divider and
+// NERVES_KEY_SIM_TIMING=max makes every command take as long as the datasheet
+// allows. Nothing may time out.
+static int test_slow_clock(void)
+{
+    CK_SESSION_HANDLE session;
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+    CHECK(sign_and_verify(session, key, 4) == 0);
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+/* Keeps the device busy for a while so that other callers have to wait.
+   Opening a session waits for the device too, so every session that's used
+   while the batch runs is opened before it starts. */
+struct busy_batch {
+    CK_SESSION_HANDLE session;
+    CK_BYTE digests[16][32];
+    CK_BYTE signatures[16][64];
+    CK_RV results[16];
+    CK_RV rv;
+    pthread_t thread;
+};
+
+static void *run_batch(void *arg)
+{
+    struct busy_batch *batch = arg;
+    batch->rv = nkcs11->C_NKCS11_SignBatch(batch->session, &ecdsa, PRIVATE_KEY, &batch->digests[0][0], 16,
+                                           &batch->signatures[0][0], batch->results);
+    return NULL;
+}
+
+static int start_batch(struct busy_batch *batch)
+{
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &batch->session) == CKR_OK);
+    for (int i = 0; i < 16; i++)
+        make_digest(batch->digests[i], 100 + i);
+    CHECK(pthread_create(&batch->thread, NULL, run_batch, batch) == 0);
+
+    // Give it time to get the device
+    sleep_ms(50);
+    return 0;
+}
+
+static int finish_batch(struct busy_batch *batch, EC_KEY *key)
+{
+    pthread_join(batch->thread, NULL);
+    CHECK(batch->rv == CKR_OK);
+    for (int i = 0; i < 16; i++)
+        CHECK(batch->results[i] == CKR_OK && verifies(key, batch->digests[i], batch->signatures[i]));
+    return 0;
+}
+
+struct signer {
+    CK_SESSION_HANDLE session;
+    CK_BYTE digest[32];
+    CK_BYTE signature[64];
+    CK_RV rv;
+    double finished;
+    pthread_t thread;
+};
+
+static void *run_signer(void *arg)
+{
+    struct signer *signer = arg;
+    signer->rv = sign(signer->session, signer->digest, signer->signature);
+    signer->finished = now_s();
+    return NULL;
+}
+
+static int open_signer(struct signer *signer, CK_FLAGS flags, int n)
+{
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION | flags, NULL_PTR, NULL_PTR, &signer->session) == CKR_OK);
+    make_digest(signer->digest, n);
+    return 0;
+}
+
+static int start_signer(struct signer *signer)
+{
+    CHECK(pthread_create(&signer->thread, NULL, run_signer, signer) == 0);
+    return 0;
+}
+
+// NERVES_KEY_QUEUE_LIMIT is 1, so with one caller waiting, the next is shed
+static int test_queue_shed(void)
+{
+    struct busy_batch batch;
+    struct signer waiter;
+    CK_SESSION_HANDLE session;
+    CK_BYTE digest[32];
+    CK_BYTE signature[64];
+
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+
+    CHECK(open_signer(&waiter, 0, 1) == 0);
+    CHECK(start_batch(&batch) == 0);
+    CHECK(start_signer(&waiter) == 0);
+    sleep_ms(50);
+
+    make_digest(digest, 2);
+    CHECK(sign(session, digest, signature) == CKR_FUNCTION_REJECTED);
+
+    CHECK(finish_batch(&batch, key) == 0);
+    pthread_join(waiter.thread, NULL);
+    CHECK(waiter.rv == CKR_OK);
+    CHECK(verifies(key, waiter.digest, waiter.signature));
+
+    CK_NKCS11_QUEUE_STATS stats;
+    CHECK(nkcs11->C_NKCS11_GetQueueStats(0, &stats) == CKR_OK);
+    CHECK(stats.ulShed == 1);
+    CHECK(stats.ulTimedOut == 0);
+
+    // Once the queue is clear, signing works again
+    CHECK(sign_and_verify(session, key, 1) == 0);
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+// NERVES_KEY_QUEUE_MAX_WAIT_MS is shorter than a batch takes
+static int test_queue_timeout(void)
+{
+    struct busy_batch batch;
+    CK_SESSION_HANDLE session;
+    CK_BYTE digest[32];
+    CK_BYTE signature[64];
+
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+
+    CHECK(start_batch(&batch) == 0);
+    make_digest(digest, 1);
+    CHECK(sign(session, digest, signature) == CKR_NKCS11_QUEUE_TIMEOUT);
+    CHECK(finish_batch(&batch, key) == 0);
+
+    CK_NKCS11_QUEUE_STATS stats;
+    CHECK(nkcs11->C_NKCS11_GetQueueStats(0, &stats) == CKR_OK);
+    CHECK(stats.ulTimedOut == 1);
+    CHECK(stats.ulShed == 0);
+
+    CHECK(sign_and_verify(session, key, 1) == 0);
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+// C_Sign calls that pile up behind a batch are signed in groups. Each caller
+// has to get the signature for its own digest, and the interactive caller
+// can't be held up by the background ones that were there first.
+static int test_grouped_sign(void)
+{
+    struct busy_batch batch;
+    struct signer background[6];
+    struct signer interactive;
+    CK_SESSION_HANDLE session;
+
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+
+    for (int i = 0; i < 6; i++)
+        CHECK(open_signer(&background[i], CKF_NKCS11_PRIORITY_BACKGROUND, i) == 0);
+    CHECK(open_signer(&interactive, CKF_NKCS11_PRIORITY_INTERACTIVE, 6) == 0);
+
+    CHECK(start_batch(&batch) == 0);
+    for (int i = 0; i < 6; i++)
+        CHECK(start_signer(&background[i]) == 0);
+    sleep_ms(50);
+    CHECK(start_signer(&interactive) == 0);
+
+    CHECK(finish_batch(&batch, key) == 0);
+    pthread_join(interactive.thread, NULL);
+    CHECK(interactive.rv == CKR_OK);
+    CHECK(verifies(key, interactive.digest, interactive.signature));
+    for (int i = 0; i < 6; i++) {
+        pthread_join(background[i].thread, NULL);
+        CHECK(background[i].rv == CKR_OK);
+        CHECK(verifies(key, background[i].digest, background[i].signature));
+        CHECK(interactive.finished < background[i].finished);
+    }
+
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+#define ASYNC_SIGNS 8
+
+static int callbacks;
+
+static void async_done(CK_VOID_PTR context, CK_RV rv)
+{
+    (void) context;
+    (void) rv;
+    __atomic_add_fetch(&callbacks, 1, __ATOMIC_SEQ_CST);
+}
+
+static int test_sign_async(void)
+{
+    static CK_BYTE digests[ASYNC_SIGNS][32];
+    static CK_BYTE signatures[ASYNC_SIGNS][64];
+    static CK_NKCS11_ASYNC_SIGN async[ASYNC_SIGNS];
+    CK_SESSION_HANDLE session;
+
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+
+    int event_fd = eventfd(0, EFD_CLOEXEC);
+    CHECK(event_fd >= 0);
+    for (int i = 0; i < ASYNC_SIGNS; i++) {
+        make_digest(digests[i], i);
+        async[i].eventFd = event_fd;
+        async[i].Callback = NULL;
+        async[i].pContext = NULL;
+        async[i].rv = CKR_GENERAL_ERROR;
+        CHECK(nkcs11->C_NKCS11_SignAsync(session, &ecdsa, PRIVATE_KEY, digests[i], signatures[i], &async[i]) == CKR_OK);
+    }
+
+    uint64_t done = 0;
+    while (done < ASYNC_SIGNS) {
+        uint64_t value;
+        ssize_t len = read(event_fd, &value, sizeof(value));
+        CHECK(len == sizeof(value) || (len < 0 && errno == EINTR));
+        if (len == sizeof(value))
+            done += value;
+    }
+    CHECK(done == ASYNC_SIGNS);
+    close(event_fd);
+
+    for (int i = 0; i < ASYNC_SIGNS; i++) {
+        CHECK(async[i].rv == CKR_OK);
+        CHECK(verifies(key, digests[i], signatures[i]));
+    }
+
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+// The engine thread recovers a step at a time like C_Sign does
+static int test_async_recovers(void)
+{
+    CHECK(test_sign_async() == 0);
+    CHECK(injected_faults() > 0);
+    return 0;
+}
+
+// C_Finalize right after starting the signatures has to wait for all of them
+static int test_finalize_drains(void)
+{
+    static CK_BYTE digests[ASYNC_SIGNS][32];
+    static CK_BYTE signatures[ASYNC_SIGNS][64];
+    static CK_NKCS11_ASYNC_SIGN async[ASYNC_SIGNS];
+    CK_SESSION_HANDLE session;
+
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+
+    for (int i = 0; i < ASYNC_SIGNS; i++) {
+        make_digest(digests[i], i);
+        async[i].eventFd = -1;
+        async[i].Callback = async_done;
+        async[i].pContext = NULL;
+        async[i].rv = CKR_GENERAL_ERROR;
+        CHECK(nkcs11->C_NKCS11_SignAsync(session, &ecdsa, PRIVATE_KEY, digests[i], signatures[i], &async[i]) == CKR_OK);
+    }
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+
+    CHECK(__atomic_load_n(&callbacks, __ATOMIC_SEQ_CST) == ASYNC_SIGNS);
+    for (int i = 0; i < ASYNC_SIGNS; i++) {
+        CHECK(async[i].rv == CKR_OK);
+        CHECK(verifies(key, digests[i], signatures[i]));
+    }
+    EC_KEY_free(key);
+    return 0;
+}
+
+static pid_t start_agent(const char *socket_path)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        setenv("NERVES_KEY_AGENT_SOCKET", socket_path, 1);
+        setenv("NERVES_KEY_AGENT_LIBRARY", library_path, 1);
+        execl(agent_path, agent_path, (char *) NULL);
+        _exit(127);
+    }
+
+    // Wait for it to listen
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    for (int i = 0; pid > 0 && i < 500; i++) {
+        int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        int rc = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+        close(fd);
+        if (rc == 0)
+            return pid;
+        sleep_ms(10);
+    }
+
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    return -1;
+}
+
+// The library runs as a thin client of nerves_key_agent. The client doesn't
+// have the simulator, so everything has to come from the agent.
+static int agent_client(void)
+{
+    CK_SESSION_HANDLE session;
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+    CHECK(sign_and_verify(session, key, 2) == 0);
+
+    CK_BYTE digests[20][32];
+    CK_BYTE signatures[20][64];
+    CK_RV results[20];
+    for (int i = 0; i < 20; i++)
+        make_digest(digests[i], i);
+    CHECK(nkcs11->C_NKCS11_SignBatch(session, &ecdsa, PRIVATE_KEY, &digests[0][0], 20, &signatures[0][0], results) == CKR_OK);
+    for (int i = 0; i < 20; i++)
+        CHECK(results[i] == CKR_OK && verifies(key, digests[i], signatures[i]));
+
+    // A batch that fails up front says so for every digest
+    CHECK(nkcs11->C_NKCS11_SignBatch(session + 1000, &ecdsa, PRIVATE_KEY, &digests[0][0], 3, &signatures[0][0], results) ==
+          CKR_SESSION_HANDLE_INVALID);
+    for (int i = 0; i < 3; i++)
+        CHECK(results[i] == CKR_SESSION_HANDLE_INVALID);
+
+    CK_NKCS11_ASYNC_SIGN async = {eventfd(0, EFD_CLOEXEC), NULL, NULL, CKR_GENERAL_ERROR};
+    uint64_t value;
+    CHECK(async.eventFd >= 0);
+    CHECK(nkcs11->C_NKCS11_SignAsync(session, &ecdsa, PRIVATE_KEY, digests[0], signatures[0], &async) == CKR_OK);
+    CHECK(read(async.eventFd, &value, sizeof(value)) == sizeof(value));
+    CHECK(async.rv == CKR_OK && verifies(key, digests[0], signatures[0]));
+    close(async.eventFd);
+
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+static int same_key(const EC_KEY *a, const EC_KEY *b)
+{
+    return EC_POINT_cmp(EC_KEY_get0_group(a), EC_KEY_get0_public_key(a), EC_KEY_get0_public_key(b), NULL) == 0;
+}
+
+// NERVES_KEY_SIM_LOT gives the slot a different chip. Its own public key
+// has to be read instead of the old chip's being used.
+static int test_swapped_chip(void)
+{
+    CK_SESSION_HANDLE session;
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *old_key = public_key(session);
+    CHECK(old_key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+
+    setenv("NERVES_KEY_SIM_LOT", "1", 1);
+    CHECK(p11->C_Initialize(NULL_PTR) == CKR_OK);
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+    CHECK(!same_key(key, old_key));
+    CHECK(sign_and_verify(session, key, 2) == 0);
+    EC_KEY_free(old_key);
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+// The public key is remembered after C_Finalize. Reading it again would take a
+// GenKey.
+static int test_key_kept(void)
+{
+    CK_SESSION_HANDLE session;
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *first_key = public_key(session);
+    CHECK(first_key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    unsigned long first = commands();
+
+    CHECK(p11->C_Initialize(NULL_PTR) == CKR_OK);
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+    CHECK(same_key(key, first_key));
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    CHECK(commands() - first < first);
+
+    // It's still the key that signs
+    CHECK(p11->C_Initialize(NULL_PTR) == CKR_OK);
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    CHECK(sign_and_verify(session, key, 2) == 0);
+    EC_KEY_free(first_key);
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+static int open_and_sign(void)
+{
+    CK_SESSION_HANDLE session;
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+    CHECK(sign_and_verify(session, key, 1) == 0);
+    EC_KEY_free(key);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+// Sign in a process of its own, so that only the cache file or shared memory
+// carries over. Returns how many commands the simulated chip ran.
+static long round_in_child(void)
+{
+    unsigned long before = commands();
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(load() == 0 && open_and_sign() == 0 ? 0 : 1);
+
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return (long) (commands() - before);
+}
+
+static int flip_byte(const char *path, off_t offset)
+{
+    FILE *file = fopen(path, "r+b");
+    CHECK(file);
+    CHECK(fseeko(file, offset, SEEK_SET) == 0);
+    int c = fgetc(file);
+    CHECK(c != EOF);
+    CHECK(fseeko(file, offset, SEEK_SET) == 0);
+    CHECK(fputc(c ^ 0x01, file) != EOF);
+    CHECK(fclose(file) == 0);
+    return 0;
+}
+
+static int cache_file(const char *path)
+{
+    long cold = round_in_child();
+    CHECK(cold > 0);
+    long warm = round_in_child();
+    CHECK(warm > 0 && warm < cold);
+
+    // The records come after the header. The chip's record is the first one.
+    FILE *file = fopen(path, "rb");
+    CHECK(file);
+    CHECK(fseeko(file, 0, SEEK_END) == 0);
+    off_t records = ftello(file) - NKCS11_CACHE_RECORDS * (off_t) sizeof(struct nerves_key_cache_record);
+    fclose(file);
+
+    // A record that fails its CRC is read from the chip again and rewritten
+    CHECK(flip_byte(path, records + (off_t) offsetof(struct nerves_key_cache_record, public_key) + 10) == 0);
+    CHECK(round_in_child() == cold);
+    CHECK(round_in_child() == warm);
+
+    // So is everything in a file from another version. It's right after the
+    // 4-byte magic number.
+    CHECK(flip_byte(path, 4) == 0);
+    CHECK(round_in_child() == cold);
+    CHECK(round_in_child() == warm);
+
+#ifndef FIXED_CHIP_PROFILE
+    // The timing in a record is for one part, so it isn't used for another
+    // one with the same serial number
+    setenv("NERVES_KEY_SIM_CHIP", "508a", 1);
+    CHECK(round_in_child() > warm);
+    CHECK(round_in_child() == warm);
+#endif
+    return 0;
+}
+
+// NERVES_KEY_CACHE_FILE saves the public key and timing for the next process
+static int test_cache_file(void)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/nerves_key_test.%d.cache", (int) getpid());
+    setenv("NERVES_KEY_CACHE_FILE", path, 1);
+
+    int rc = cache_file(path);
+    unlink(path);
+    return rc;
+}
+
+// NERVES_KEY_SHM entries are by slot. When a different chip shows up there,
+// its own public key has to be read instead of the old chip's being used.
+static int test_shm_swap(void)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/nerves_key_test.%d", (int) getpid());
+    setenv("NERVES_KEY_SHM", name, 1);
+
+    int rc = load() == 0 ? test_swapped_chip() : -1;
+    shm_unlink(name);
+    return rc;
+}
+
+// The first process to open the slot shares the public key through
+// NERVES_KEY_SHM. The next one only reads the serial number.
+static int shm_share(void)
+{
+    long first = round_in_child();
+    CHECK(first > 0);
+    long second = round_in_child();
+    CHECK(second > 0 && second < first);
+    return 0;
+}
+
+static int test_shm_share(void)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/nerves_key_test.%d", (int) getpid());
+    setenv("NERVES_KEY_SHM", name, 1);
+
+    int rc = shm_share();
+    shm_unlink(name);
+    return rc;
+}
+
+// The holder's first command stalls, so it has the chip's turn when it's
+// killed
+static int shm_takeover(void)
+{
+    pid_t holder = fork();
+    if (holder == 0) {
+        setenv("NERVES_KEY_SIM_FAULTS", "stall=1", 1);
+        CK_SESSION_HANDLE session;
+        _exit(load() == 0 && p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK ? 0 : 1);
+    }
+    CHECK(holder > 0);
+
+    CK_NKCS11_BUS_STATS stats;
+    int has_turn = 0;
+    CHECK(load() == 0);
+    for (int i = 0; i < 100 && !has_turn; i++) {
+        CHECK(nkcs11->C_NKCS11_GetBusStats(0, &stats) == CKR_OK);
+        has_turn = stats.ulTurns > 0;
+        if (!has_turn)
+            sleep_ms(10);
+    }
+    kill(holder, SIGKILL);
+    waitpid(holder, NULL, 0);
+    CHECK(has_turn);
+
+    CK_SESSION_HANDLE session;
+    CHECK(p11->C_OpenSession(0, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session) == CKR_OK);
+    EC_KEY *key = public_key(session);
+    CHECK(key);
+    CHECK(sign_and_verify(session, key, 1) == 0);
+    EC_KEY_free(key);
+
+    CHECK(nkcs11->C_NKCS11_GetBusStats(0, &stats) == CKR_OK);
+    CHECK(stats.ulTakeovers == 1);
+    CHECK(stats.ulContended >= 1);
+    CHECK(p11->C_Finalize(NULL_PTR) == CKR_OK);
+    return 0;
+}
+
+// A process that dies while it has the chip's turn is skipped, so the
+// others aren't locked out of the chip
+static int test_shm_takeover(void)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/nerves_key_test.%d", (int) getpid());
+    setenv("NERVES_KEY_SHM", name, 1);
+
+    int rc = shm_takeover();
+    shm_unlink(name);
+    return rc;
+}
+
+static int test_agent(void)
+{
+    char socket_path[64];
+    snprintf(socket_path, sizeof(socket_path), "/tmp/nerves_key_test.%d.sock", (int) getpid());
+
+    pid_t agent = start_agent(socket_path);
+    CHECK(agent > 0);
+
+    setenv("NERVES_KEY_AGENT_SOCKET", socket_path, 1);
+    unsetenv("NERVES_KEY_TRANSPORT");
+    int rc = load() == 0 ? agent_client() : -1;
+
+    kill(agent, SIGTERM);
+    waitpid(agent, NULL, 0);
+    unlink(socket_path);
+    return rc;
+}
+
+struct test {
+    const char *name;
+    int (*run)(void);
+    const char *env; // NAME=value pairs separated by spaces
+    int loads_library; // Sets up its own environment and calls load()
+};
+
+static const struct test tests[] = {
+    {"sign", test_sign, "", 0},
+    {"recovers from nak", test_recovers, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_REPORT=1 NERVES_KEY_SIM_FAULTS=nak=0.1", 0},
+    {"recovers from crc", test_recovers, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_REPORT=1 NERVES_KEY_SIM_FAULTS=crc=0.2", 0},
+    {"recovers from short", test_recovers, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_REPORT=1 NERVES_KEY_SIM_FAULTS=short=0.2", 0},
+    {"recovers from status", test_recovers, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_REPORT=1 NERVES_KEY_SIM_FAULTS=status=0.2", 0},
+    {"recovers from stall", test_recovers, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_REPORT=1 NERVES_KEY_SIM_FAULTS=stall=0.2", 0},
+    {"recovers from reset", test_recovers, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_REPORT=1 NERVES_KEY_SIM_FAULTS=reset=0.2", 0},
+    {"fails with nak always", test_fault_fails, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_FAULTS=nak=1", 0},
+    {"fails with crc always", test_fault_fails, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_FAULTS=crc=1", 0},
+    {"fails with short always", test_fault_fails, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_FAULTS=short=1", 0},
+    {"fails with status always", test_fault_fails, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_FAULTS=status=1", 0},
+    {"fails with stall always", test_fault_fails, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_FAULTS=stall=1", 0},
+    {"fails with reset always", test_fault_fails, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_FAULTS=reset=1", 0},
+#ifndef FIXED_CHIP_PROFILE
+    {"identifies 508a", test_identifies, "NERVES_KEY_SIM_CHIP=508a", 0},
+    {"identifies 608a", test_identifies, "NERVES_KEY_SIM_CHIP=608a", 0},
+    {"identifies 608b", test_identifies, "NERVES_KEY_SIM_CHIP=608b", 0},
+#endif
+    {"slowest clock divider", test_slow_clock, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_CHIP_MODE=0x68 NERVES_KEY_SIM_TIMING=max", 0},
+    {"session handle reuse", test_session_reuse, "", 0},
+    {"scan slots", test_scan_slots, "NERVES_KEY_SIM_BUSES=2", 0},
+    {"mutex callbacks", test_mutex_callbacks, "", 0},
+    {"interfaces", test_interfaces, "", 0},
+    {"message signing", test_message_sign, "", 0},
+#ifndef FIXED_CHIP_PROFILE
+    {"batch stays awake", test_batch_stays_awake,
+     "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_REPORT=1 NERVES_KEY_KEEP_AWAKE_MS=0 NERVES_KEY_SIM_CHIP_MODE=0x04", 0},
+#endif
+    {"sleeps when idle", test_sleeps_when_idle, "NERVES_KEY_SIM_REPORT=1 NERVES_KEY_KEEP_AWAKE_MS=20", 0},
+    {"queue sheds", test_queue_shed, "NERVES_KEY_QUEUE_LIMIT=1", 0},
+    {"queue times out", test_queue_timeout, "NERVES_KEY_QUEUE_MAX_WAIT_MS=20", 0},
+    {"grouped sign", test_grouped_sign, "", 0},
+    {"sign async", test_sign_async, "", 0},
+    {"sign async recovers from nak", test_async_recovers, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_REPORT=1 NERVES_KEY_SIM_FAULTS=nak=0.1", 0},
+    {"finalize drains async", test_finalize_drains, "", 0},
+    {"key kept across finalize", test_key_kept, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_REPORT=1", 0},
+    {"swapped chip", test_swapped_chip, "", 0},
+    {"cache file", test_cache_file, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_REPORT=1", 1},
+    {"shared entry", test_shm_share, "NERVES_KEY_SIM_CLOCK=virtual NERVES_KEY_SIM_REPORT=1", 1},
+    {"shared entry for a swapped chip", test_shm_swap, "", 1},
+    {"takeover from a dead process", test_shm_takeover, "", 1},
+    {"agent round trip", test_agent, "", 1},
+    {NULL, NULL, NULL, 0}
+};
+
+static void apply_env(const char *env)
+{
+    char *copy = strdup(env);
+    char *saveptr;
+    for (char *item = strtok_r(copy, " ", &saveptr); item; item = strtok_r(NULL, " ", &saveptr)) {
+        char *equals = strchr(item, '=');
+        if (equals) {
+            *equals = '\0';
+            setenv(item, equals + 1, 1);
+        }
+    }
+    free(copy);
+}
+
+static int run_test(const struct test *test)
+{
+    log_file = tmpfile();
+    if (log_file == NULL)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fileno(log_file), STDERR_FILENO);
+        apply_env(test->env);
+        if (!test->loads_library && load() < 0)
+            _exit(1);
+        _exit(test->run() == 0 ? 0 : 1);
+    }
+
+    int status;
+    int rc = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+    if (rc < 0) {
+        char buffer[4096];
+        size_t len;
+        rewind(log_file);
+        while ((len = fread(buffer, 1, sizeof(buffer), log_file)) > 0)
+            fwrite(buffer, 1, len, stderr);
+    }
+    fclose(log_file);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <path to nerves_key_pkcs11.so> <path to nerves_key_agent>\n", argv[0]);
+        return 1;
+    }
+    library_path = argv[1];
+    agent_path = argv[2];
+
+    // The fault tests run the simulator on a virtual clock so that stalls
+    // and retries don't take real time. The queue tests need the real one.
+    setenv("NERVES_KEY_TRANSPORT", "sim", 1);
+    unsetenv("NERVES_KEY_CACHE_FILE");
+    unsetenv("NERVES_KEY_SHM");
+    unsetenv("NERVES_KEY_AGENT_SOCKET");
+    unsetenv("NERVES_KEY_QUEUE_LIMIT");
+    unsetenv("NERVES_KEY_QUEUE_MAX_WAIT_MS");
+    unsetenv("NERVES_KEY_SIM_FAULTS");
+#ifdef FIXED_CHIP_PROFILE
+    setenv("NERVES_KEY_SIM_CHIP", FIXED_CHIP_PROFILE, 1);
+#else
+    unsetenv("NERVES_KEY_SIM_CHIP");
+#endif
+    unsetenv("NERVES_KEY_SIM_CHIP_MODE");
+    unsetenv("NERVES_KEY_SIM_TIMING");
+    unsetenv("NERVES_KEY_SIM_LOT");
+    unsetenv("NERVES_KEY_SIM_BUSES");
+
+    int failures = 0;
+    for (const struct test *test = tests; test->name; test++) {
+        double start = now_s();
+        int rc = run_test(test);
+        printf("%-4s %s (%.0f ms)\n", rc == 0 ? "ok" : "FAIL", test->name, (now_s() - start) * 1000);
+        if (rc != 0)
+            failures++;
+    }
+
+    if (failures) {
+        printf("%d of %d tests failed\n", failures, (int) (sizeof(tests) / sizeof(tests[0])) - 1);
+        return 1;
+    }
+    printf("All %d tests passed\n", (int) (sizeof(tests) / sizeof(tests[0])) - 1);
+    return 0;
+}